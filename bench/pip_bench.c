@@ -0,0 +1,351 @@
+/*
+ * FreeSWITCH Video Picture-in-Picture Module
+ * 合成内核基准测试
+ *
+ * 独立可执行程序，只链接FFmpeg。用合成帧分别测量
+ * 缩放(sws_scale)、叠加(overlay_yuv420p_frames)、样式叠加(overlay_yuv420p_frames_masked)、
+ * 字幕叠加(overlay_yuv420p_mask_color)、背景调色(pip_color_lut_apply)、
+ * 背景图层混合(pip_blend_layer_apply，四种模式)和编码(libx264)，
+ * 输出每个分辨率下的帧率和每像素耗时，便于跨版本追踪性能回退。
+ *
+ * 用法: pip_bench [-n 帧数] [-e 编码帧数] [-r 分辨率名] [-E]
+ *   -n  缩放/叠加阶段的迭代帧数（默认300）
+ *   -e  编码阶段的帧数（默认120）
+ *   -r  只测试指定分辨率（480p/720p/1080p/4k）
+ *   -E  跳过编码阶段
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "video_pip_kernels.h"
+
+typedef struct bench_resolution
+{
+    const char *name;
+    int width;
+    int height;
+} bench_resolution_t;
+
+static const bench_resolution_t resolutions[] = {
+    {"480p", 848, 480},
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+    {"4k", 3840, 2160},
+};
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 分配YUV420P帧并填充确定性的测试图案 */
+static AVFrame *alloc_pattern_frame(int width, int height, int seed)
+{
+    AVFrame *frame = av_frame_alloc();
+
+    if (!frame)
+    {
+        return NULL;
+    }
+
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 32) < 0)
+    {
+        av_frame_free(&frame);
+        return NULL;
+    }
+
+    for (int y = 0; y < height; y++)
+    {
+        uint8_t *row = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < width; x++)
+        {
+            row[x] = (uint8_t)((x + y + seed) & 0xff);
+        }
+    }
+    for (int y = 0; y < (height + 1) / 2; y++)
+    {
+        uint8_t *row_u = frame->data[1] + y * frame->linesize[1];
+        uint8_t *row_v = frame->data[2] + y * frame->linesize[2];
+        for (int x = 0; x < (width + 1) / 2; x++)
+        {
+            row_u[x] = (uint8_t)((x * 2 + seed) & 0xff);
+            row_v[x] = (uint8_t)((y * 2 + seed) & 0xff);
+        }
+    }
+
+    return frame;
+}
+
+/* 修改少量像素，避免编码器把连续帧当作完全静止画面 */
+static void perturb_frame(AVFrame *frame, int index)
+{
+    int row = index % frame->height;
+    memset(frame->data[0] + row * frame->linesize[0], (index * 7) & 0xff, frame->width);
+}
+
+static void report(const char *res, const char *stage, int frames, double seconds, long long pixels_per_frame)
+{
+    double fps = seconds > 0 ? frames / seconds : 0;
+    double ns_per_pixel = (frames > 0 && pixels_per_frame > 0) ? seconds * 1e9 / ((double)frames * pixels_per_frame) : 0;
+
+    printf("%-6s %-11s %6d帧 %10.1f fps %9.3f ns/pixel\n", res, stage, frames, fps, ns_per_pixel);
+}
+
+static int bench_scale_and_blend(const bench_resolution_t *res, int iterations)
+{
+    int pip_width = res->width / 4;
+    int pip_height = res->height / 4;
+    int pip_x = res->width - pip_width - 10;
+    int pip_y = 10;
+    AVFrame *main_frame = alloc_pattern_frame(res->width, res->height, 0);
+    AVFrame *remote_frame = alloc_pattern_frame(res->width, res->height, 64);
+    AVFrame *pip_frame = alloc_pattern_frame(pip_width, pip_height, 0);
+    AVFrame *output_frame = alloc_pattern_frame(res->width, res->height, 0);
+    struct SwsContext *sws_ctx = pip_scaler_create(res->width, res->height, pip_width, pip_height);
+    pip_style_t style = {3, {16, 128, 128}, 12, 2};
+    pip_alpha_mask_t mask = {0};
+    pip_alpha_mask_t text_mask = {0};
+    pip_color_adjust_t adjust = {0.05f, 1.2f, 1.1f};
+    pip_color_lut_t lut;
+    pip_blend_layer_t layer = {0};
+    int text_width = res->width / 2;
+    int text_height = res->height / 12;
+    uint8_t *coverage = malloc((size_t)text_width * text_height);
+    double start;
+    int ret = -1;
+
+    if (!main_frame || !remote_frame || !pip_frame || !output_frame || !sws_ctx || !coverage)
+    {
+        fprintf(stderr, "%s: 分配测试资源失败\n", res->name);
+        goto end;
+    }
+
+    /* 缩放阶段：与convert_and_overlay_frames相同的sws配置 */
+    start = now_seconds();
+    for (int i = 0; i < iterations; i++)
+    {
+        sws_scale(sws_ctx, (const uint8_t *const *)remote_frame->data, remote_frame->linesize, 0, remote_frame->height,
+                  pip_frame->data, pip_frame->linesize);
+    }
+    report(res->name, "scale", iterations, now_seconds() - start, (long long)pip_width * pip_height);
+
+    /* 叠加阶段：包含主视频到输出帧的整帧复制 */
+    start = now_seconds();
+    for (int i = 0; i < iterations; i++)
+    {
+        overlay_yuv420p_frames(main_frame, pip_frame, output_frame, pip_x, pip_y, 0.8f);
+    }
+    report(res->name, "blend", iterations, now_seconds() - start, (long long)res->width * res->height);
+
+    /* 样式叠加阶段：3像素边框+圆角+羽化，遮罩只在开始时生成一次 */
+    if (pip_alpha_mask_build(&mask, pip_width, pip_height, &style) < 0)
+    {
+        fprintf(stderr, "%s: 生成遮罩失败\n", res->name);
+        goto end;
+    }
+    start = now_seconds();
+    for (int i = 0; i < iterations; i++)
+    {
+        overlay_yuv420p_frames_masked(main_frame, pip_frame, output_frame, pip_x, pip_y, 0.8f, &mask);
+    }
+    report(res->name, "styled", iterations, now_seconds() - start, (long long)res->width * res->height);
+
+    /* 字幕阶段：半幅宽的文字遮罩（覆盖率按竖条纹模拟笔画），只混合遮罩所在的矩形，按遮罩像素数计 */
+    for (int i = 0; i < text_height; i++)
+    {
+        for (int j = 0; j < text_width; j++)
+        {
+            coverage[i * text_width + j] = (j % 12) < 4 ? 255 : ((j % 12) < 6 ? 128 : 0);
+        }
+    }
+    if (pip_alpha_mask_from_coverage(&text_mask, coverage, text_width, text_width, text_height, style.border_color) <
+        0)
+    {
+        fprintf(stderr, "%s: 生成字幕遮罩失败\n", res->name);
+        goto end;
+    }
+    start = now_seconds();
+    for (int i = 0; i < iterations; i++)
+    {
+        overlay_yuv420p_mask_color(output_frame, 10, res->height - text_height - 10, 1.0f, &text_mask);
+    }
+    report(res->name, "text", iterations, now_seconds() - start, (long long)text_width * text_height);
+
+    /* 背景调色阶段：整帧查表，查找表只生成一次 */
+    pip_color_lut_build(&lut, &adjust);
+    start = now_seconds();
+    for (int i = 0; i < iterations; i++)
+    {
+        pip_color_lut_apply(output_frame, main_frame, &lut);
+    }
+    report(res->name, "grade", iterations, now_seconds() - start, (long long)res->width * res->height);
+
+    /* 背景图层阶段：图层系数只在开始时计算一次，每帧整帧混合（与模块相同，写回同一帧） */
+    for (pip_blend_mode_t mode = PIP_BLEND_NORMAL; mode <= PIP_BLEND_SCREEN; mode++)
+    {
+        char stage[32];
+
+        if (pip_blend_layer_build(&layer, remote_frame, mode, 0.3f) < 0)
+        {
+            fprintf(stderr, "%s: 生成背景图层失败\n", res->name);
+            goto end;
+        }
+        snprintf(stage, sizeof(stage), "bg-%s", pip_blend_mode_name(mode));
+        start = now_seconds();
+        for (int i = 0; i < iterations; i++)
+        {
+            pip_blend_layer_apply(output_frame, output_frame, &layer);
+        }
+        report(res->name, stage, iterations, now_seconds() - start, (long long)res->width * res->height);
+    }
+
+    ret = 0;
+
+end:
+    pip_alpha_mask_free(&mask);
+    pip_alpha_mask_free(&text_mask);
+    pip_blend_layer_free(&layer);
+    free(coverage);
+    sws_freeContext(sws_ctx);
+    av_frame_free(&main_frame);
+    av_frame_free(&remote_frame);
+    av_frame_free(&pip_frame);
+    av_frame_free(&output_frame);
+    return ret;
+}
+
+static int bench_encode(const bench_resolution_t *res, int frames)
+{
+    AVCodec *encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+    AVCodecContext *codec_ctx = NULL;
+    AVFrame *frame = NULL;
+    AVPacket *packet = NULL;
+    long long bytes = 0;
+    double start;
+    int ret = -1;
+
+    if (!encoder)
+    {
+        fprintf(stderr, "未找到H264编码器，跳过编码阶段\n");
+        return 0;
+    }
+
+    codec_ctx = avcodec_alloc_context3(encoder);
+    frame = alloc_pattern_frame(res->width, res->height, 0);
+    packet = av_packet_alloc();
+    if (!codec_ctx || !frame || !packet)
+    {
+        fprintf(stderr, "%s: 分配编码资源失败\n", res->name);
+        goto end;
+    }
+
+    /* 与init_output_video_file相同的编码器设置 */
+    pip_encoder_configure(codec_ctx, res->width, res->height);
+    if (avcodec_open2(codec_ctx, encoder, NULL) < 0)
+    {
+        fprintf(stderr, "%s: 打开编码器失败\n", res->name);
+        goto end;
+    }
+
+    start = now_seconds();
+    for (int i = 0; i <= frames; i++)
+    {
+        /* 最后一轮发送NULL帧刷新编码器 */
+        if (i < frames)
+        {
+            perturb_frame(frame, i);
+            frame->pts = i;
+        }
+        if (avcodec_send_frame(codec_ctx, i < frames ? frame : NULL) < 0)
+        {
+            fprintf(stderr, "%s: 发送帧到编码器失败\n", res->name);
+            goto end;
+        }
+        while (avcodec_receive_packet(codec_ctx, packet) >= 0)
+        {
+            bytes += packet->size;
+            av_packet_unref(packet);
+        }
+    }
+    report(res->name, "encode", frames, now_seconds() - start, (long long)res->width * res->height);
+    printf("%-6s %-7s 平均 %.1f 字节/帧\n", res->name, "", frames > 0 ? (double)bytes / frames : 0.0);
+
+    ret = 0;
+
+end:
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&codec_ctx);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    const char *only = NULL;
+    int iterations = 300;
+    int encode_frames = 120;
+    int skip_encode = 0;
+    int opt;
+    int failed = 0;
+
+    while ((opt = getopt(argc, argv, "n:e:r:E")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'e':
+            encode_frames = atoi(optarg);
+            break;
+        case 'r':
+            only = optarg;
+            break;
+        case 'E':
+            skip_encode = 1;
+            break;
+        default:
+            fprintf(stderr, "用法: %s [-n 帧数] [-e 编码帧数] [-r 480p|720p|1080p|4k] [-E]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (iterations <= 0 || encode_frames <= 0)
+    {
+        fprintf(stderr, "帧数必须为正数\n");
+        return 2;
+    }
+
+    printf("PIP合成内核基准测试 (缩放/叠加 %d 帧, 编码 %d 帧)\n", iterations, encode_frames);
+    printf("%-6s %-11s %8s %14s %18s\n", "分辨率", "阶段", "帧数", "帧率", "每像素耗时");
+
+    for (size_t i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); i++)
+    {
+        const bench_resolution_t *res = &resolutions[i];
+
+        if (only && strcasecmp(only, res->name) != 0)
+        {
+            continue;
+        }
+
+        failed |= bench_scale_and_blend(res, iterations);
+        if (!skip_encode)
+        {
+            failed |= bench_encode(res, encode_frames);
+        }
+    }
+
+    return failed ? 1 : 0;
+}
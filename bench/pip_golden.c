@@ -0,0 +1,1063 @@
+/*
+ * FreeSWITCH Video Picture-in-Picture Module
+ * 缩放/叠加路径的确定性正确性校验
+ *
+ * 用固定的合成输入（以及可选的真实Y4M帧）覆盖多种几何：奇数坐标、
+ * 右/下边缘裁剪、完全越界，以及 0、0.5、1 三种透明度。
+ *   - 叠加用例（普通叠加和按样式遮罩叠加）：输出与工具内的标量参考实现
+ *     逐像素比较，并与 bench/golden/blend.sum 中存储的校验和比较（要求逐位一致）；
+ *   - 图层混合用例（normal、overlay、multiply、screen）：输出与工具内的标量参考实现逐像素比较、
+ *     与浮点的混合公式比较（允许舍入误差），并同样存储校验和；
+ *   - 缩放用例：sws输出依赖FFmpeg版本和CPU指令集，不存校验和，
+ *     而是与工具内的双线性参考实现比较PSNR。
+ * 以后替换成更快的内核时，用它确认结果逐位一致或在容差范围内。
+ *
+ * 用法: pip_golden [-g 校验和文件] [-u] [-i 真实帧.y4m] [-v]
+ *   -g  校验和文件（默认 bench/golden/blend.sum）
+ *   -u  重新生成校验和文件（确认参考输出变化是预期的之后再用）
+ *   -i  额外用Y4M文件第一帧作为主视频/远程视频做PSNR校验
+ *   -v  打印每个用例的详细结果
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "video_pip_kernels.h"
+
+#define GOLDEN_MAX_CASES 256
+#define SCALE_MIN_PSNR 30.0
+#define LAYER_MAX_FLOAT_DIFF 1
+
+typedef struct golden_entry
+{
+    char name[96];
+    unsigned long long checksum;
+} golden_entry_t;
+
+static golden_entry_t stored[GOLDEN_MAX_CASES];
+static int stored_count = 0;
+static golden_entry_t computed[GOLDEN_MAX_CASES];
+static int computed_count = 0;
+static int verbose = 0;
+
+/* ---------- 帧工具 ---------- */
+
+static AVFrame *alloc_frame(int width, int height)
+{
+    AVFrame *frame = av_frame_alloc();
+
+    if (!frame)
+    {
+        return NULL;
+    }
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 32) < 0)
+    {
+        av_frame_free(&frame);
+        return NULL;
+    }
+    return frame;
+}
+
+static int plane_width(const AVFrame *frame, int plane)
+{
+    return plane == 0 ? frame->width : (frame->width + 1) / 2;
+}
+
+static int plane_height(const AVFrame *frame, int plane)
+{
+    return plane == 0 ? frame->height : (frame->height + 1) / 2;
+}
+
+/* 确定性的测试图案：低频渐变叠加少量高频纹理，seed区分不同输入 */
+static void fill_pattern(AVFrame *frame, int seed)
+{
+    for (int p = 0; p < 3; p++)
+    {
+        for (int y = 0; y < plane_height(frame, p); y++)
+        {
+            uint8_t *row = frame->data[p] + y * frame->linesize[p];
+            for (int x = 0; x < plane_width(frame, p); x++)
+            {
+                int v = (x * 3 + y * 2) / (p ? 1 : 2) + seed * (p + 1) + (((x ^ y) & 8) ? 6 : 0);
+                row[x] = (uint8_t)(p == 0 ? 16 + v % 220 : 64 + v % 128);
+            }
+        }
+    }
+}
+
+/* 平滑的测试图案：缩放用例只衡量滤波精度，不放大不同实现在锐利边缘上的相位差异 */
+static void fill_smooth_pattern(AVFrame *frame, int seed)
+{
+    for (int p = 0; p < 3; p++)
+    {
+        double f = p ? 2.0 : 1.0;
+
+        for (int y = 0; y < plane_height(frame, p); y++)
+        {
+            uint8_t *row = frame->data[p] + y * frame->linesize[p];
+            for (int x = 0; x < plane_width(frame, p); x++)
+            {
+                double v = 60.0 * sin(x * f * 0.021 + seed) * cos(y * f * 0.017) + 25.0 * sin((x + y) * f * 0.043);
+                row[x] = (uint8_t)(128.0 + (p ? 0.5 : 1.0) * v);
+            }
+        }
+    }
+}
+
+/* 覆盖0-255全范围的测试图案：图层混合在两端和128附近的分支都要覆盖 */
+static void fill_full_range_pattern(AVFrame *frame, int seed)
+{
+    for (int p = 0; p < 3; p++)
+    {
+        for (int y = 0; y < plane_height(frame, p); y++)
+        {
+            uint8_t *row = frame->data[p] + y * frame->linesize[p];
+            for (int x = 0; x < plane_width(frame, p); x++)
+            {
+                row[x] = (uint8_t)(x * 7 + y * 13 + seed * (p + 1));
+            }
+        }
+    }
+}
+
+static void copy_frame(AVFrame *dst, const AVFrame *src)
+{
+    for (int p = 0; p < 3; p++)
+    {
+        for (int y = 0; y < plane_height(src, p); y++)
+        {
+            memcpy(dst->data[p] + y * dst->linesize[p], src->data[p] + y * src->linesize[p], plane_width(src, p));
+        }
+    }
+}
+
+/* FNV-1a 64位校验和，只覆盖可见区域，与缓冲区对齐方式无关 */
+static unsigned long long frame_checksum(const AVFrame *frame)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+
+    for (int p = 0; p < 3; p++)
+    {
+        for (int y = 0; y < plane_height(frame, p); y++)
+        {
+            const uint8_t *row = frame->data[p] + y * frame->linesize[p];
+            for (int x = 0; x < plane_width(frame, p); x++)
+            {
+                hash ^= row[x];
+                hash *= 0x100000001b3ULL;
+            }
+        }
+    }
+    return hash;
+}
+
+static int max_abs_diff(const AVFrame *a, const AVFrame *b)
+{
+    int max = 0;
+
+    for (int p = 0; p < 3; p++)
+    {
+        for (int y = 0; y < plane_height(a, p); y++)
+        {
+            const uint8_t *ra = a->data[p] + y * a->linesize[p];
+            const uint8_t *rb = b->data[p] + y * b->linesize[p];
+            for (int x = 0; x < plane_width(a, p); x++)
+            {
+                int d = abs(ra[x] - rb[x]);
+                if (d > max)
+                {
+                    max = d;
+                }
+            }
+        }
+    }
+    return max;
+}
+
+static double frame_psnr(const AVFrame *a, const AVFrame *b)
+{
+    double sse = 0;
+    long long count = 0;
+
+    for (int p = 0; p < 3; p++)
+    {
+        for (int y = 0; y < plane_height(a, p); y++)
+        {
+            const uint8_t *ra = a->data[p] + y * a->linesize[p];
+            const uint8_t *rb = b->data[p] + y * b->linesize[p];
+            for (int x = 0; x < plane_width(a, p); x++)
+            {
+                double d = ra[x] - rb[x];
+                sse += d * d;
+                count++;
+            }
+        }
+    }
+    if (sse == 0 || count == 0)
+    {
+        return 99.0;
+    }
+    return 10.0 * log10(255.0 * 255.0 * count / sse);
+}
+
+/* ---------- 参考实现 ---------- */
+
+/* 参考实现按几何逐样本推导，不沿用内核的行/列计数：
+ * 平面样本c覆盖亮度[c << shift, (c + 1) << shift)，与PIP的亮度范围[x, x + w)相交即被PIP覆盖；
+ * 取值用PIP中与该样本右/下半部分（亮度 (c << shift) + shift）对齐的样本，超出PIP平面时取最后一个 */
+static int reference_src_index(int c, int shift, int x, int pip_size)
+{
+    int last = ((pip_size + shift) >> shift) - 1;
+    int s = (((c << shift) + shift - x) >> shift);
+
+    return s < last ? s : last;
+}
+
+/* 叠加参考实现：输出总是先复制主视频，再混合PIP（裁剪到画面内）覆盖的每个样本 */
+static void reference_overlay(const AVFrame *main_frame, const AVFrame *pip, AVFrame *out, int x, int y, float opacity)
+{
+    int x_end = x + pip->width < main_frame->width ? x + pip->width : main_frame->width;
+    int y_end = y + pip->height < main_frame->height ? y + pip->height : main_frame->height;
+
+    copy_frame(out, main_frame);
+    if (x < 0 || y < 0 || x_end <= x || y_end <= y)
+        return;
+
+    for (int p = 0; p < 3; p++)
+    {
+        int shift = p ? 1 : 0;
+
+        for (int ci = y >> shift; ci <= (y_end - 1) >> shift; ci++)
+        {
+            const uint8_t *src = pip->data[p] + reference_src_index(ci, shift, y, pip->height) * pip->linesize[p];
+            uint8_t *dst = out->data[p] + ci * out->linesize[p];
+
+            for (int cj = x >> shift; cj <= (x_end - 1) >> shift; cj++)
+            {
+                uint8_t v = src[reference_src_index(cj, shift, x, pip->width)];
+                dst[cj] = (uint8_t)(dst[cj] * (1.0f - opacity) + v * opacity);
+            }
+        }
+    }
+}
+
+/* 遮罩叠加参考实现：覆盖范围与reference_overlay相同，逐样本按 overlay_yuv420p_frames_masked 的定点公式计算 */
+static void reference_overlay_masked(const AVFrame *main_frame, const AVFrame *pip, AVFrame *out, int x, int y,
+                                     float opacity, const pip_alpha_mask_t *mask)
+{
+    int x_end = x + pip->width < main_frame->width ? x + pip->width : main_frame->width;
+    int y_end = y + pip->height < main_frame->height ? y + pip->height : main_frame->height;
+    int op = (int)lrintf(opacity * 256.0f);
+
+    copy_frame(out, main_frame);
+    if (x < 0 || y < 0 || x_end <= x || y_end <= y)
+        return;
+
+    for (int p = 0; p < 3; p++)
+    {
+        int m = p ? 1 : 0;
+        int shift = p ? 1 : 0;
+
+        for (int ci = y >> shift; ci <= (y_end - 1) >> shift; ci++)
+        {
+            int si = reference_src_index(ci, shift, y, pip->height);
+            uint8_t *dst = out->data[p] + ci * out->linesize[p];
+
+            for (int cj = x >> shift; cj <= (x_end - 1) >> shift; cj++)
+            {
+                int sj = reference_src_index(cj, shift, x, pip->width);
+                int b = mask->border[m][si * mask->linesize[m] + sj];
+                int a = (mask->coverage[m][si * mask->linesize[m] + sj] * op) >> 8;
+                int s;
+
+                b += b >> 7;
+                a += a >> 7;
+                s = (pip->data[p][si * pip->linesize[p] + sj] * (256 - b) + mask->border_color[p] * b) >> 8;
+                dst[cj] = (uint8_t)((dst[cj] * (256 - a) + s * a) >> 8);
+            }
+        }
+    }
+}
+
+/* 图层混合参考实现：逐像素由图层像素b和视频像素v直接计算，与 pip_blend_layer_build/apply 的定点公式相同 */
+static int reference_div_round(int num, int den)
+{
+    return num >= 0 ? (num + den / 2) / den : -((-num + den / 2) / den);
+}
+
+static void reference_blend_layer(const AVFrame *main_frame, const AVFrame *image, AVFrame *out,
+                                  pip_blend_mode_t mode, float opacity)
+{
+    int alpha = (int)lrintf(opacity * 256.0f);
+
+    for (int p = 0; p < 3; p++)
+    {
+        for (int i = 0; i < plane_height(main_frame, p); i++)
+        {
+            const uint8_t *src = main_frame->data[p] + i * main_frame->linesize[p];
+            const uint8_t *img = image->data[p] + i * image->linesize[p];
+            uint8_t *dst = out->data[p] + i * out->linesize[p];
+
+            for (int j = 0; j < plane_width(main_frame, p); j++)
+            {
+                int v = src[j];
+                int b = img[j];
+                int k;
+                int r;
+
+                if (mode == PIP_BLEND_NORMAL)
+                {
+                    dst[j] = (uint8_t)((v * (256 - alpha) + b * alpha + 128) >> 8);
+                    continue;
+                }
+                if (p)
+                {
+                    r = v + reference_div_round((b - 128) * alpha, 256);
+                    dst[j] = (uint8_t)(r < 0 ? 0 : (r > 255 ? 255 : r));
+                    continue;
+                }
+
+                if (mode == PIP_BLEND_MULTIPLY)
+                {
+                    k = 256 - reference_div_round(alpha * (255 - b), 255);
+                }
+                else if (mode == PIP_BLEND_SCREEN)
+                {
+                    k = 256 + reference_div_round(alpha * b, 255);
+                }
+                else
+                {
+                    k = 256 + reference_div_round(alpha * (2 * b - 255), 255);
+                }
+                if (mode == PIP_BLEND_MULTIPLY || (mode == PIP_BLEND_OVERLAY && v < 128))
+                {
+                    dst[j] = (uint8_t)((v * k + 128) >> 8);
+                }
+                else
+                {
+                    dst[j] = (uint8_t)(255 - (((255 - v) * (512 - k) + 128) >> 8));
+                }
+            }
+        }
+    }
+}
+
+/* 按浮点公式计算的图层混合：blend(v, b)后按透明度与v线性混合，色度按图层颜色偏移。
+ * 用于确认定点系数的推导，不要求逐位一致 */
+static int float_blend_layer_diff(const AVFrame *main_frame, const AVFrame *image, const AVFrame *out,
+                                  pip_blend_mode_t mode, float opacity)
+{
+    int max = 0;
+
+    for (int p = 0; p < 3; p++)
+    {
+        for (int i = 0; i < plane_height(main_frame, p); i++)
+        {
+            const uint8_t *src = main_frame->data[p] + i * main_frame->linesize[p];
+            const uint8_t *img = image->data[p] + i * image->linesize[p];
+            const uint8_t *res = out->data[p] + i * out->linesize[p];
+
+            for (int j = 0; j < plane_width(main_frame, p); j++)
+            {
+                double v = src[j] / 255.0;
+                double b = img[j] / 255.0;
+                double blended;
+                double expect;
+                int d;
+
+                if (mode == PIP_BLEND_NORMAL)
+                {
+                    blended = b;
+                }
+                else if (p)
+                {
+                    blended = v + (img[j] - 128) / 255.0;
+                }
+                else if (mode == PIP_BLEND_MULTIPLY)
+                {
+                    blended = v * b;
+                }
+                else if (mode == PIP_BLEND_SCREEN)
+                {
+                    blended = 1.0 - (1.0 - v) * (1.0 - b);
+                }
+                else
+                {
+                    blended = src[j] < 128 ? 2.0 * v * b : 1.0 - 2.0 * (1.0 - v) * (1.0 - b);
+                }
+                expect = (v + opacity * (blended - v)) * 255.0;
+                expect = expect < 0.0 ? 0.0 : (expect > 255.0 ? 255.0 : expect);
+                d = abs(res[j] - (int)lrint(expect));
+                if (d > max)
+                {
+                    max = d;
+                }
+            }
+        }
+    }
+    return max;
+}
+
+/* 计算一维三角滤波（双线性）权重：缩小时滤波器宽度按缩放比例展开，与swscale的SWS_BILINEAR一致 */
+static int triangle_taps(int dst_pos, int src_size, int dst_size, int *first, double *weights, int max_taps)
+{
+    double scale = (double)src_size / dst_size;
+    double radius = scale > 1.0 ? scale : 1.0;
+    double center = (dst_pos + 0.5) * scale - 0.5;
+    double sum = 0;
+    int start = (int)floor(center - radius) + 1;
+    int taps = 0;
+
+    for (int k = start; k < center + radius && taps < max_taps; k++, taps++)
+    {
+        double w = 1.0 - fabs(k - center) / radius;
+        weights[taps] = w > 0 ? w : 0;
+        sum += weights[taps];
+    }
+    for (int i = 0; i < taps; i++)
+    {
+        weights[i] /= sum;
+    }
+    *first = start;
+    return taps;
+}
+
+static int clamp_index(int v, int size)
+{
+    return v < 0 ? 0 : (v >= size ? size - 1 : v);
+}
+
+/* 缩放参考实现：可分离的三角滤波，浮点计算，边缘按复制处理 */
+static void reference_scale(const AVFrame *src, AVFrame *dst)
+{
+    double weights[64];
+
+    for (int p = 0; p < 3; p++)
+    {
+        int sw = plane_width(src, p), sh = plane_height(src, p);
+        int dw = plane_width(dst, p), dh = plane_height(dst, p);
+        double *tmp = malloc(sizeof(double) * dw * sh);
+
+        if (!tmp)
+        {
+            return;
+        }
+
+        for (int x = 0; x < dw; x++)
+        {
+            int first;
+            int taps = triangle_taps(x, sw, dw, &first, weights, 64);
+
+            for (int y = 0; y < sh; y++)
+            {
+                const uint8_t *row = src->data[p] + y * src->linesize[p];
+                double v = 0;
+                for (int k = 0; k < taps; k++)
+                {
+                    v += row[clamp_index(first + k, sw)] * weights[k];
+                }
+                tmp[y * dw + x] = v;
+            }
+        }
+
+        for (int y = 0; y < dh; y++)
+        {
+            int first;
+            int taps = triangle_taps(y, sh, dh, &first, weights, 64);
+
+            for (int x = 0; x < dw; x++)
+            {
+                double v = 0;
+                for (int k = 0; k < taps; k++)
+                {
+                    v += tmp[clamp_index(first + k, sh) * dw + x] * weights[k];
+                }
+                dst->data[p][y * dst->linesize[p] + x] = (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v + 0.5));
+            }
+        }
+        free(tmp);
+    }
+}
+
+/* ---------- 校验和文件 ---------- */
+
+static void load_checksums(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char line[256];
+
+    if (!fp)
+    {
+        fprintf(stderr, "无法读取校验和文件: %s（请在仓库根目录运行，或用 -g 指定）\n", path);
+        return;
+    }
+    while (stored_count < GOLDEN_MAX_CASES && fgets(line, sizeof(line), fp))
+    {
+        golden_entry_t *e = &stored[stored_count];
+        if (line[0] == '#' || sscanf(line, "%95s %llx", e->name, &e->checksum) != 2)
+        {
+            continue;
+        }
+        stored_count++;
+    }
+    fclose(fp);
+}
+
+static int save_checksums(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (!fp)
+    {
+        fprintf(stderr, "无法写入校验和文件: %s\n", path);
+        return -1;
+    }
+    fprintf(fp, "# pip_golden 叠加用例校验和（FNV-1a 64，可见区域），由 pip_golden -u 生成\n");
+    for (int i = 0; i < computed_count; i++)
+    {
+        fprintf(fp, "%s %016llx\n", computed[i].name, computed[i].checksum);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static const golden_entry_t *find_checksum(const char *name)
+{
+    for (int i = 0; i < stored_count; i++)
+    {
+        if (!strcmp(stored[i].name, name))
+        {
+            return &stored[i];
+        }
+    }
+    return NULL;
+}
+
+/* ---------- 用例 ---------- */
+
+typedef struct blend_case
+{
+    const char *name;
+    int main_w, main_h;
+    int pip_w, pip_h;
+    int x, y; /* 负数表示相对右/下边缘的偏移：x = main_w + x */
+} blend_case_t;
+
+static const blend_case_t blend_cases[] = {
+    {"aligned", 640, 480, 160, 120, 16, 16},
+    {"odd_xy", 640, 480, 160, 120, 13, 7},
+    {"odd_size", 640, 480, 161, 121, 20, 20},
+    {"odd_all", 1280, 720, 321, 181, 101, 33},
+    {"clip_right", 640, 480, 160, 120, -80, 40},
+    {"clip_bottom", 640, 480, 160, 120, 40, -60},
+    {"clip_corner", 1280, 720, 320, 180, -101, -47},
+    {"full_cover", 320, 240, 320, 240, 0, 0},
+    {"offscreen", 640, 480, 160, 120, 700, 10},
+};
+
+static const float blend_opacities[] = {0.0f, 0.5f, 1.0f};
+
+typedef struct style_case
+{
+    const char *name;
+    pip_style_t style;
+} style_case_t;
+
+/* 遮罩叠加用例：黑色边框、圆角、边框+圆角+羽化 */
+static const style_case_t style_cases[] = {
+    {"border3", {3, {16, 128, 128}, 0, 0}},
+    {"rounded", {0, {16, 128, 128}, 24, 0}},
+    {"styled", {4, {235, 128, 128}, 16, 6}},
+};
+
+/* style为NULL时校验普通叠加，否则校验按样式遮罩叠加 */
+static int run_blend_case(const blend_case_t *bc, float opacity, const style_case_t *style, int check_checksum)
+{
+    pip_alpha_mask_t mask = {0};
+    int x = bc->x < 0 ? bc->main_w + bc->x : bc->x;
+    int y = bc->y < 0 ? bc->main_h + bc->y : bc->y;
+    AVFrame *main_frame = alloc_frame(bc->main_w, bc->main_h);
+    AVFrame *pip = alloc_frame(bc->pip_w, bc->pip_h);
+    AVFrame *out = alloc_frame(bc->main_w, bc->main_h);
+    AVFrame *ref = alloc_frame(bc->main_w, bc->main_h);
+    golden_entry_t *entry = &computed[computed_count];
+    const golden_entry_t *golden;
+    int diff;
+    int failed = 0;
+
+    if (!main_frame || !pip || !out || !ref || computed_count >= GOLDEN_MAX_CASES)
+    {
+        fprintf(stderr, "%s: 分配帧失败\n", bc->name);
+        failed = 1;
+        goto end;
+    }
+
+    fill_pattern(main_frame, 1);
+    fill_pattern(pip, 77);
+    /* 输出帧预置与主视频不同的内容，完全越界时也要求输出等于主视频 */
+    fill_pattern(out, 200);
+    copy_frame(ref, out);
+
+    if (style)
+    {
+        if (pip_alpha_mask_build(&mask, bc->pip_w, bc->pip_h, &style->style) < 0)
+        {
+            fprintf(stderr, "%s: 生成遮罩失败\n", bc->name);
+            failed = 1;
+            goto end;
+        }
+        overlay_yuv420p_frames_masked(main_frame, pip, out, x, y, opacity, &mask);
+        reference_overlay_masked(main_frame, pip, ref, x, y, opacity, &mask);
+        snprintf(entry->name, sizeof(entry->name), "masked/%s/%s/%dx%d+%dx%d@%d,%d/o%.1f", style->name, bc->name,
+                 bc->main_w, bc->main_h, bc->pip_w, bc->pip_h, x, y, opacity);
+    }
+    else
+    {
+        overlay_yuv420p_frames(main_frame, pip, out, x, y, opacity);
+        reference_overlay(main_frame, pip, ref, x, y, opacity);
+        snprintf(entry->name, sizeof(entry->name), "blend/%s/%dx%d+%dx%d@%d,%d/o%.1f", bc->name, bc->main_w,
+                 bc->main_h, bc->pip_w, bc->pip_h, x, y, opacity);
+    }
+    entry->checksum = frame_checksum(out);
+    computed_count++;
+
+    diff = max_abs_diff(out, ref);
+    if (diff != 0)
+    {
+        printf("FAIL %s: 与参考实现不一致 (最大差值 %d)\n", entry->name, diff);
+        failed = 1;
+    }
+
+    /* 更新模式下只要求与参考实现一致 */
+    golden = check_checksum ? find_checksum(entry->name) : NULL;
+    if (check_checksum && !golden)
+    {
+        printf("MISS %s: 校验和文件中没有此用例\n", entry->name);
+        failed = 1;
+    }
+    else if (golden && golden->checksum != entry->checksum)
+    {
+        printf("FAIL %s: 校验和 %016llx, 期望 %016llx\n", entry->name, entry->checksum, golden->checksum);
+        failed = 1;
+    }
+    else if (verbose)
+    {
+        printf("ok   %s\n", entry->name);
+    }
+
+end:
+    pip_alpha_mask_free(&mask);
+    av_frame_free(&main_frame);
+    av_frame_free(&pip);
+    av_frame_free(&out);
+    av_frame_free(&ref);
+    return failed;
+}
+
+typedef struct layer_case
+{
+    const char *name;
+    int width, height;
+    int in_place; /* 输出写回输入帧（模块对调色后的背景就是这样调用的） */
+} layer_case_t;
+
+static const layer_case_t layer_cases[] = {
+    {"aligned", 640, 480, 0},
+    {"odd_size", 321, 181, 0},
+    {"in_place", 1280, 720, 1},
+};
+
+static const pip_blend_mode_t layer_modes[] = {PIP_BLEND_NORMAL, PIP_BLEND_OVERLAY, PIP_BLEND_MULTIPLY,
+                                               PIP_BLEND_SCREEN};
+
+static int run_layer_case(const layer_case_t *lc, pip_blend_mode_t mode, float opacity, int check_checksum)
+{
+    pip_blend_layer_t layer = {0};
+    AVFrame *main_frame = alloc_frame(lc->width, lc->height);
+    AVFrame *image = alloc_frame(lc->width, lc->height);
+    AVFrame *out = alloc_frame(lc->width, lc->height);
+    AVFrame *ref = alloc_frame(lc->width, lc->height);
+    golden_entry_t *entry = &computed[computed_count];
+    const golden_entry_t *golden;
+    int diff;
+    int failed = 0;
+
+    if (!main_frame || !image || !out || !ref || computed_count >= GOLDEN_MAX_CASES)
+    {
+        fprintf(stderr, "%s: 分配帧失败\n", lc->name);
+        failed = 1;
+        goto end;
+    }
+
+    fill_full_range_pattern(main_frame, 3);
+    fill_full_range_pattern(image, 101);
+    if (pip_blend_layer_build(&layer, image, mode, opacity) < 0)
+    {
+        fprintf(stderr, "%s: 生成图层失败\n", lc->name);
+        failed = 1;
+        goto end;
+    }
+    reference_blend_layer(main_frame, image, ref, mode, opacity);
+    if (lc->in_place)
+    {
+        copy_frame(out, main_frame);
+        pip_blend_layer_apply(out, out, &layer);
+    }
+    else
+    {
+        pip_blend_layer_apply(out, main_frame, &layer);
+    }
+    snprintf(entry->name, sizeof(entry->name), "layer/%s/%s/%dx%d/o%.1f", pip_blend_mode_name(mode), lc->name,
+             lc->width, lc->height, opacity);
+    entry->checksum = frame_checksum(out);
+    computed_count++;
+
+    diff = max_abs_diff(out, ref);
+    if (diff != 0)
+    {
+        printf("FAIL %s: 与参考实现不一致 (最大差值 %d)\n", entry->name, diff);
+        failed = 1;
+    }
+    diff = float_blend_layer_diff(main_frame, image, out, mode, opacity);
+    if (diff > LAYER_MAX_FLOAT_DIFF)
+    {
+        printf("FAIL %s: 与浮点公式相差 %d > %d\n", entry->name, diff, LAYER_MAX_FLOAT_DIFF);
+        failed = 1;
+    }
+
+    golden = check_checksum ? find_checksum(entry->name) : NULL;
+    if (check_checksum && !golden)
+    {
+        printf("MISS %s: 校验和文件中没有此用例\n", entry->name);
+        failed = 1;
+    }
+    else if (golden && golden->checksum != entry->checksum)
+    {
+        printf("FAIL %s: 校验和 %016llx, 期望 %016llx\n", entry->name, entry->checksum, golden->checksum);
+        failed = 1;
+    }
+    else if (verbose)
+    {
+        printf("ok   %s (与浮点公式最大差值 %d)\n", entry->name, diff);
+    }
+
+end:
+    pip_blend_layer_free(&layer);
+    av_frame_free(&main_frame);
+    av_frame_free(&image);
+    av_frame_free(&out);
+    av_frame_free(&ref);
+    return failed;
+}
+
+typedef struct scale_case
+{
+    const char *name;
+    int src_w, src_h;
+    int dst_w, dst_h;
+} scale_case_t;
+
+static const scale_case_t scale_cases[] = {
+    {"quarter", 640, 480, 160, 120},
+    {"odd_target", 1280, 720, 321, 181},
+    {"hd_to_pip", 1920, 1080, 480, 270},
+    {"upscale", 176, 144, 320, 240},
+    {"aspect_change", 640, 480, 320, 180},
+};
+
+static int run_scale_case(const char *name, const AVFrame *src, int dst_w, int dst_h)
+{
+    struct SwsContext *sws_ctx = pip_scaler_create(src->width, src->height, dst_w, dst_h);
+    AVFrame *out = alloc_frame(dst_w, dst_h);
+    AVFrame *ref = alloc_frame(dst_w, dst_h);
+    double psnr;
+    int failed = 0;
+
+    if (!sws_ctx || !out || !ref)
+    {
+        printf("FAIL scale/%s: 创建缩放上下文或分配帧失败\n", name);
+        failed = 1;
+        goto end;
+    }
+
+    sws_scale(sws_ctx, (const uint8_t *const *)src->data, src->linesize, 0, src->height, out->data, out->linesize);
+    reference_scale(src, ref);
+
+    psnr = frame_psnr(out, ref);
+    if (psnr < SCALE_MIN_PSNR)
+    {
+        printf("FAIL scale/%s: %dx%d -> %dx%d PSNR %.2f dB < %.1f dB\n", name, src->width, src->height, dst_w, dst_h,
+               psnr, SCALE_MIN_PSNR);
+        failed = 1;
+    }
+    else if (verbose)
+    {
+        printf("ok   scale/%s: %dx%d -> %dx%d PSNR %.2f dB\n", name, src->width, src->height, dst_w, dst_h, psnr);
+    }
+
+end:
+    sws_freeContext(sws_ctx);
+    av_frame_free(&out);
+    av_frame_free(&ref);
+    return failed;
+}
+
+/* 缩放+叠加整条路径（对应 convert_and_overlay_frames）与参考管线比较PSNR */
+static int run_pipeline_case(const char *name, const AVFrame *main_frame, const AVFrame *remote, int pip_w, int pip_h,
+                             int x, int y, float opacity)
+{
+    struct SwsContext *sws_ctx = pip_scaler_create(remote->width, remote->height, pip_w, pip_h);
+    AVFrame *pip = alloc_frame(pip_w, pip_h);
+    AVFrame *pip_ref = alloc_frame(pip_w, pip_h);
+    AVFrame *out = alloc_frame(main_frame->width, main_frame->height);
+    AVFrame *ref = alloc_frame(main_frame->width, main_frame->height);
+    double psnr;
+    int failed = 0;
+
+    if (!sws_ctx || !pip || !pip_ref || !out || !ref)
+    {
+        printf("FAIL pipeline/%s: 分配资源失败\n", name);
+        failed = 1;
+        goto end;
+    }
+
+    sws_scale(sws_ctx, (const uint8_t *const *)remote->data, remote->linesize, 0, remote->height, pip->data,
+              pip->linesize);
+    overlay_yuv420p_frames((AVFrame *)main_frame, pip, out, x, y, opacity);
+
+    reference_scale(remote, pip_ref);
+    reference_overlay(main_frame, pip_ref, ref, x, y, opacity);
+
+    psnr = frame_psnr(out, ref);
+    if (psnr < SCALE_MIN_PSNR)
+    {
+        printf("FAIL pipeline/%s: PSNR %.2f dB < %.1f dB\n", name, psnr, SCALE_MIN_PSNR);
+        failed = 1;
+    }
+    else if (verbose)
+    {
+        printf("ok   pipeline/%s: PSNR %.2f dB\n", name, psnr);
+    }
+
+end:
+    sws_freeContext(sws_ctx);
+    av_frame_free(&pip);
+    av_frame_free(&pip_ref);
+    av_frame_free(&out);
+    av_frame_free(&ref);
+    return failed;
+}
+
+/* 读取Y4M第一帧（4:2:0） */
+static AVFrame *load_y4m_frame(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    char line[512];
+    int width = 0, height = 0;
+    AVFrame *frame = NULL;
+
+    if (!fp)
+    {
+        fprintf(stderr, "无法打开Y4M文件: %s\n", path);
+        return NULL;
+    }
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, "YUV4MPEG2", 9) != 0)
+    {
+        fprintf(stderr, "不是Y4M文件: %s\n", path);
+        goto end;
+    }
+    for (char *t = strtok(line + 9, " \n"); t; t = strtok(NULL, " \n"))
+    {
+        if (t[0] == 'W')
+            width = atoi(t + 1);
+        else if (t[0] == 'H')
+            height = atoi(t + 1);
+        else if (t[0] == 'C' && strncmp(t + 1, "420", 3) != 0)
+        {
+            fprintf(stderr, "只支持4:2:0的Y4M文件\n");
+            goto end;
+        }
+    }
+    if (width <= 0 || height <= 0 || !fgets(line, sizeof(line), fp) || strncmp(line, "FRAME", 5) != 0)
+    {
+        fprintf(stderr, "Y4M文件头损坏: %s\n", path);
+        goto end;
+    }
+
+    frame = alloc_frame(width, height);
+    for (int p = 0; frame && p < 3; p++)
+    {
+        for (int y = 0; y < plane_height(frame, p); y++)
+        {
+            if (fread(frame->data[p] + y * frame->linesize[p], 1, plane_width(frame, p), fp) !=
+                (size_t)plane_width(frame, p))
+            {
+                fprintf(stderr, "Y4M帧数据不完整: %s\n", path);
+                av_frame_free(&frame);
+                break;
+            }
+        }
+    }
+
+end:
+    fclose(fp);
+    return frame;
+}
+
+int main(int argc, char **argv)
+{
+    const char *checksum_path = "bench/golden/blend.sum";
+    const char *y4m_path = NULL;
+    int update = 0;
+    int failed = 0;
+    int total = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g:ui:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'g':
+            checksum_path = optarg;
+            break;
+        case 'u':
+            update = 1;
+            break;
+        case 'i':
+            y4m_path = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "用法: %s [-g 校验和文件] [-u] [-i 真实帧.y4m] [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (!update)
+    {
+        load_checksums(checksum_path);
+    }
+
+    /* 叠加用例 */
+    for (size_t i = 0; i < sizeof(blend_cases) / sizeof(blend_cases[0]); i++)
+    {
+        for (size_t j = 0; j < sizeof(blend_opacities) / sizeof(blend_opacities[0]); j++)
+        {
+            failed += run_blend_case(&blend_cases[i], blend_opacities[j], NULL, !update);
+            total++;
+        }
+    }
+
+    /* 遮罩叠加用例（透明度0时输出与主视频相同，不重复校验） */
+    for (size_t s = 0; s < sizeof(style_cases) / sizeof(style_cases[0]); s++)
+    {
+        for (size_t i = 0; i < sizeof(blend_cases) / sizeof(blend_cases[0]); i++)
+        {
+            for (size_t j = 1; j < sizeof(blend_opacities) / sizeof(blend_opacities[0]); j++)
+            {
+                failed += run_blend_case(&blend_cases[i], blend_opacities[j], &style_cases[s], !update);
+                total++;
+            }
+        }
+    }
+
+    /* 图层混合用例（透明度0时输出与输入相同，不重复校验） */
+    for (size_t m = 0; m < sizeof(layer_modes) / sizeof(layer_modes[0]); m++)
+    {
+        for (size_t i = 0; i < sizeof(layer_cases) / sizeof(layer_cases[0]); i++)
+        {
+            for (size_t j = 1; j < sizeof(blend_opacities) / sizeof(blend_opacities[0]); j++)
+            {
+                failed += run_layer_case(&layer_cases[i], layer_modes[m], blend_opacities[j], !update);
+                total++;
+            }
+        }
+    }
+
+    if (update)
+    {
+        /* 与参考实现不一致时不覆盖已有校验和 */
+        if (failed)
+        {
+            printf("%d 个叠加用例与参考实现不一致，未写入校验和\n", failed);
+            return 1;
+        }
+        if (save_checksums(checksum_path) < 0)
+        {
+            return 1;
+        }
+        printf("已写入 %d 个校验和到 %s\n", computed_count, checksum_path);
+        return 0;
+    }
+
+    /* 缩放用例 */
+    for (size_t i = 0; i < sizeof(scale_cases) / sizeof(scale_cases[0]); i++)
+    {
+        const scale_case_t *sc = &scale_cases[i];
+        AVFrame *src = alloc_frame(sc->src_w, sc->src_h);
+
+        if (!src)
+        {
+            failed++;
+            continue;
+        }
+        fill_smooth_pattern(src, 33);
+        failed += run_scale_case(sc->name, src, sc->dst_w, sc->dst_h);
+        total++;
+        av_frame_free(&src);
+    }
+
+    /* 整条路径：合成输入 */
+    {
+        AVFrame *main_frame = alloc_frame(1280, 720);
+        AVFrame *remote = alloc_frame(640, 480);
+
+        if (main_frame && remote)
+        {
+            fill_pattern(main_frame, 5);
+            fill_smooth_pattern(remote, 90);
+            failed += run_pipeline_case("synthetic_mid", main_frame, remote, 320, 240, 951, 11, 0.5f);
+            failed += run_pipeline_case("synthetic_clip", main_frame, remote, 321, 241, 1101, 601, 1.0f);
+            total += 2;
+        }
+        else
+        {
+            failed++;
+        }
+        av_frame_free(&main_frame);
+        av_frame_free(&remote);
+    }
+
+    /* 整条路径：真实输入 */
+    if (y4m_path)
+    {
+        AVFrame *real = load_y4m_frame(y4m_path);
+
+        if (!real)
+        {
+            failed++;
+        }
+        else
+        {
+            failed += run_pipeline_case("real_quarter", real, real, real->width / 4, real->height / 4, 17,
+                                        real->height - real->height / 8, 0.5f);
+            failed += run_pipeline_case("real_opaque", real, real, real->width / 3 | 1, real->height / 3 | 1,
+                                        real->width - real->width / 6, 9, 1.0f);
+            total += 2;
+            av_frame_free(&real);
+        }
+    }
+
+    printf("%d 个用例, %d 个失败\n", total, failed);
+    return failed ? 1 : 0;
+}
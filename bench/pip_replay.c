@@ -0,0 +1,1040 @@
+/*
+ * FreeSWITCH Video Picture-in-Picture Module
+ * 多会话回放压测（不依赖FreeSWITCH）
+ *
+ * 把 mod_video_pip.c 和 bench/shim/switch.h 一起编译，
+ * 通过模块自己注册的API启动N个会话，再由N个线程模拟媒体线程，
+ * 把Y4M录像逐帧送进 pip_read_video_callback。
+ * 结束后报告持续帧率、每会话CPU占用和单帧处理耗时分位数，
+ * 用于评估一台机器能承载多少并发PIP会话。
+ * 挂机后检查每个会话录像的第一个视频包是否为关键帧（否则开头直到下一个关键帧都无法解码）。
+ *
+ * 用法: pip_replay -b 背景文件 [-i remote.y4m | -s 宽x高] [-n 会话数] [-d 秒数]
+ *                  [-f 帧率] [-F 格式] [-R] [-m 预加载帧数] [-o 输出目录] [-c 参数=值] [-G 调色参数]
+ *                  [-A | -a] [-L 毫秒] [-S 组名] [-P 毫秒] [-r 轮数] [-M] [-v]
+ *   -b  本地背景图片或视频（等同于 video_pip_start 的第二个参数）
+ *   -i  远程视频Y4M文件（仅支持4:2:0）
+ *   -s  不提供Y4M时使用合成远程视频，默认640x480
+ *   -n  并发会话数（默认1）
+ *   -d  每个会话的回放时长，秒（默认10）
+ *   -f  覆盖Y4M文件中的帧率（合成视频默认30）
+ *   -F  远程视频格式：i420（默认）、nv12、argb、rgb24，加载后预先转换，
+ *       用于测量非I420远程视频的处理开销
+ *   -R  以最大速度回放，不按实时节奏等待
+ *   -m  最多预加载的Y4M帧数，循环使用（默认150）
+ *   -o  录像输出目录（默认/tmp）
+ *   -c  模块配置参数（相当于video_pip.conf中<settings>的一项，可重复），
+ *       例如 -c max-memory-mb=64 -c memory-cap-action=downgrade。
+ *       默认附加 output-clock=arrival（每个远程帧合成一次），-c output-clock=cfr 可测试输出时钟
+ *   -G  背景调色（相当于<filters>中的一项eq滤镜），例如 -G brightness=0.1:contrast=1.2:saturation=1.1
+ *   -A  不调用video_pip_start，而是设置通道变量video_pip_auto_start/video_pip_file
+ *       后模拟应答，由CHANNEL_ANSWER事件自动启动
+ *   -a  通过video_pip_start_async提交全部会话，报告提交耗时和完成事件
+ *   -L  回放期间每隔指定毫秒用一条video_pip_batch修改全部会话的位置、尺寸和透明度，
+ *       每次修改以半个间隔的过渡动画完成，报告每次调用的耗时
+ *   -S  启动前为全部会话设置通道变量video_pip_share，第一个会话合成和编码，
+ *       其余会话跟随并写入扇出的编码包，用于测量共享合成节省的CPU
+ *   -P  回放期间每隔指定毫秒同时为全部会话各请求一次video_pip_snapshot（160宽、base64），
+ *       报告成功、被限流拒绝和失败的次数及每次调用的耗时
+ *   -r  重复启动、回放、挂机的轮数（默认1），后几轮的会话使用前几轮归还预热池的编码器，
+ *       配合 -c encoder-pool-size=N 检查复用编码器的录像也从关键帧开始
+ *   -M  结束前打印 video_pip_metrics 输出
+ *   -v  输出模块日志（可重复，提高级别）
+ */
+
+#include "../src/mod_video_pip.c"
+
+#include <getopt.h>
+#include <pthread.h>
+
+typedef struct replay_clip
+{
+    int width;
+    int height;
+    double fps;
+    int frame_count;
+    switch_image_t **frames;
+} replay_clip_t;
+
+typedef struct replay_session
+{
+    int index;
+    char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+    char output_file[256]; /* 挂机前从模块取得的录像路径 */
+    switch_core_session_t *session;
+    pthread_t thread;
+    uint64_t frames;
+    double wall_seconds;
+    double cpu_seconds;
+    uint32_t *latency_us;
+    size_t latency_count;
+    size_t latency_size;
+} replay_session_t;
+
+static replay_clip_t clip;
+static double replay_duration = 10.0;
+static int replay_realtime = 1;
+
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double thread_cpu_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 读取Y4M文件头，只接受4:2:0采样 */
+static int y4m_parse_header(FILE *fp, replay_clip_t *out)
+{
+    char line[512];
+    char *token;
+    int fps_num = 30, fps_den = 1;
+
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, "YUV4MPEG2", 9) != 0)
+    {
+        fprintf(stderr, "不是Y4M文件\n");
+        return -1;
+    }
+
+    for (token = strtok(line + 9, " \n"); token; token = strtok(NULL, " \n"))
+    {
+        switch (token[0])
+        {
+        case 'W':
+            out->width = atoi(token + 1);
+            break;
+        case 'H':
+            out->height = atoi(token + 1);
+            break;
+        case 'F':
+            if (sscanf(token + 1, "%d:%d", &fps_num, &fps_den) != 2 || fps_num <= 0 || fps_den <= 0)
+            {
+                fps_num = 30;
+                fps_den = 1;
+            }
+            break;
+        case 'C':
+            if (strncmp(token + 1, "420", 3) != 0)
+            {
+                fprintf(stderr, "不支持的Y4M色彩格式: %s\n", token + 1);
+                return -1;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (out->width <= 0 || out->height <= 0)
+    {
+        fprintf(stderr, "Y4M文件缺少尺寸\n");
+        return -1;
+    }
+    if (out->fps <= 0)
+    {
+        out->fps = (double)fps_num / fps_den;
+    }
+    return 0;
+}
+
+static int load_y4m_clip(const char *path, int max_frames, replay_clip_t *out)
+{
+    FILE *fp = fopen(path, "rb");
+    char line[256];
+
+    if (!fp)
+    {
+        fprintf(stderr, "无法打开Y4M文件: %s\n", path);
+        return -1;
+    }
+    if (y4m_parse_header(fp, out) < 0)
+    {
+        fclose(fp);
+        return -1;
+    }
+
+    out->frames = calloc(max_frames, sizeof(switch_image_t *));
+    while (out->frame_count < max_frames && fgets(line, sizeof(line), fp))
+    {
+        switch_image_t *img;
+        int ok = 1;
+
+        if (strncmp(line, "FRAME", 5) != 0)
+        {
+            fprintf(stderr, "Y4M帧头损坏，停止读取\n");
+            break;
+        }
+
+        img = switch_img_alloc(NULL, SWITCH_IMG_FMT_I420, out->width, out->height, 1);
+        for (int p = 0; p < 3 && ok; p++)
+        {
+            int rows = p == 0 ? out->height : (out->height + 1) / 2;
+            int cols = p == 0 ? out->width : (out->width + 1) / 2;
+
+            for (int r = 0; r < rows; r++)
+            {
+                if (fread(img->planes[p] + (size_t)r * img->stride[p], 1, cols, fp) != (size_t)cols)
+                {
+                    ok = 0;
+                    break;
+                }
+            }
+        }
+        if (!ok)
+        {
+            switch_img_free(&img);
+            break;
+        }
+        out->frames[out->frame_count++] = img;
+    }
+    fclose(fp);
+
+    if (out->frame_count == 0)
+    {
+        fprintf(stderr, "Y4M文件中没有完整的帧\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* 合成远程视频：水平移动的渐变，每帧都不同 */
+static int make_synthetic_clip(int width, int height, int frames, replay_clip_t *out)
+{
+    out->width = width;
+    out->height = height;
+    if (out->fps <= 0)
+    {
+        out->fps = 30.0;
+    }
+    out->frames = calloc(frames, sizeof(switch_image_t *));
+
+    for (int f = 0; f < frames; f++)
+    {
+        switch_image_t *img = switch_img_alloc(NULL, SWITCH_IMG_FMT_I420, width, height, 1);
+
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                img->planes[0][(size_t)y * img->stride[0] + x] = (uint8_t)(x + y + f * 4);
+            }
+        }
+        for (int y = 0; y < (height + 1) / 2; y++)
+        {
+            memset(img->planes[1] + (size_t)y * img->stride[1], (uint8_t)(96 + f), (width + 1) / 2);
+            memset(img->planes[2] + (size_t)y * img->stride[2], (uint8_t)(160 - f), (width + 1) / 2);
+        }
+        out->frames[out->frame_count++] = img;
+    }
+    return 0;
+}
+
+/* 把预加载的I420帧转换为指定格式（BT.601有限范围），回放时不再有转换开销 */
+static int convert_clip_format(replay_clip_t *clip, switch_img_fmt_t fmt)
+{
+    for (int f = 0; f < clip->frame_count; f++)
+    {
+        switch_image_t *src = clip->frames[f];
+        switch_image_t *dst = switch_img_alloc(NULL, fmt, src->d_w, src->d_h, 1);
+
+        if (!dst)
+        {
+            return -1;
+        }
+        for (unsigned int y = 0; y < src->d_h; y++)
+        {
+            const uint8_t *row_y = src->planes[0] + (size_t)y * src->stride[0];
+            const uint8_t *row_u = src->planes[1] + (size_t)(y / 2) * src->stride[1];
+            const uint8_t *row_v = src->planes[2] + (size_t)(y / 2) * src->stride[2];
+
+            if (fmt == SWITCH_IMG_FMT_NV12)
+            {
+                memcpy(dst->planes[0] + (size_t)y * dst->stride[0], row_y, src->d_w);
+                if (y % 2 == 0)
+                {
+                    uint8_t *uv = dst->planes[1] + (size_t)(y / 2) * dst->stride[1];
+                    for (unsigned int x = 0; x < (src->d_w + 1) / 2; x++)
+                    {
+                        uv[2 * x] = row_u[x];
+                        uv[2 * x + 1] = row_v[x];
+                    }
+                }
+                continue;
+            }
+
+            for (unsigned int x = 0; x < src->d_w; x++)
+            {
+                int c = 298 * (row_y[x] - 16);
+                int d = row_u[x / 2] - 128;
+                int e = row_v[x / 2] - 128;
+                int r = (c + 409 * e + 128) >> 8;
+                int g = (c - 100 * d - 208 * e + 128) >> 8;
+                int b = (c + 516 * d + 128) >> 8;
+                int bpp = fmt == SWITCH_IMG_FMT_RGB24 ? 3 : 4;
+                uint8_t *px = dst->planes[0] + (size_t)y * dst->stride[0] + (size_t)x * bpp;
+
+                /* libyuv的ARGB和RGB24在内存中都是B、G、R顺序 */
+                px[0] = (uint8_t)(b < 0 ? 0 : (b > 255 ? 255 : b));
+                px[1] = (uint8_t)(g < 0 ? 0 : (g > 255 ? 255 : g));
+                px[2] = (uint8_t)(r < 0 ? 0 : (r > 255 ? 255 : r));
+                if (bpp == 4)
+                {
+                    px[3] = 255;
+                }
+            }
+        }
+        switch_img_free(&clip->frames[f]);
+        clip->frames[f] = dst;
+    }
+    return 0;
+}
+
+static void record_latency(replay_session_t *rs, uint32_t us)
+{
+    if (rs->latency_count == rs->latency_size)
+    {
+        size_t size = rs->latency_size ? rs->latency_size * 2 : 1024;
+        uint32_t *buf = realloc(rs->latency_us, size * sizeof(uint32_t));
+        if (!buf)
+        {
+            return;
+        }
+        rs->latency_us = buf;
+        rs->latency_size = size;
+    }
+    rs->latency_us[rs->latency_count++] = us;
+}
+
+/* 每个线程扮演一个会话的媒体线程 */
+static void *replay_session_thread(void *arg)
+{
+    replay_session_t *rs = (replay_session_t *)arg;
+    double frame_interval = 1.0 / clip.fps;
+    double start = monotonic_seconds();
+    double cpu_start = thread_cpu_seconds();
+    uint64_t i;
+
+    for (i = 0;; i++)
+    {
+        double t0 = monotonic_seconds();
+
+        if (t0 - start >= replay_duration)
+        {
+            break;
+        }
+
+        /* 各会话错开起始帧，避免所有会话同时处理同一帧 */
+        shim_session_feed_video(rs->session, clip.frames[(i + rs->index) % clip.frame_count]);
+        record_latency(rs, (uint32_t)((monotonic_seconds() - t0) * 1e6));
+
+        if (replay_realtime)
+        {
+            double next = start + (i + 1) * frame_interval;
+            double now = monotonic_seconds();
+            if (next > now)
+            {
+                switch_sleep((switch_interval_time_t)((next - now) * 1e6));
+            }
+        }
+    }
+
+    rs->frames = i;
+    rs->wall_seconds = monotonic_seconds() - start;
+    rs->cpu_seconds = thread_cpu_seconds() - cpu_start;
+    return NULL;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const uint32_t *sorted, size_t count, double p)
+{
+    size_t idx;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+    idx = (size_t)(p / 100.0 * (count - 1) + 0.5);
+    return sorted[idx < count ? idx : count - 1];
+}
+
+static void print_report(replay_session_t *sessions, int count)
+{
+    size_t total_samples = 0;
+    uint64_t total_frames = 0;
+    double total_cpu = 0, total_wall = 0;
+    uint32_t *all;
+    size_t off = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        total_samples += sessions[i].latency_count;
+        total_frames += sessions[i].frames;
+        total_cpu += sessions[i].cpu_seconds;
+        if (sessions[i].wall_seconds > total_wall)
+        {
+            total_wall = sessions[i].wall_seconds;
+        }
+    }
+
+    printf("\n%-4s %10s %10s %10s\n", "会话", "帧数", "fps", "CPU%");
+    for (int i = 0; i < count; i++)
+    {
+        replay_session_t *rs = &sessions[i];
+        printf("%-4d %10llu %10.1f %10.1f\n", i, (unsigned long long)rs->frames,
+               rs->wall_seconds > 0 ? rs->frames / rs->wall_seconds : 0.0,
+               rs->wall_seconds > 0 ? rs->cpu_seconds * 100.0 / rs->wall_seconds : 0.0);
+    }
+
+    printf("\n总计: %d 个会话, %llu 帧, 聚合 %.1f fps, 每会话平均 %.1f fps, 每会话平均CPU %.1f%%\n", count,
+           (unsigned long long)total_frames, total_wall > 0 ? total_frames / total_wall : 0.0,
+           total_wall > 0 ? total_frames / total_wall / count : 0.0,
+           total_wall > 0 ? total_cpu * 100.0 / total_wall / count : 0.0);
+
+    all = malloc((total_samples ? total_samples : 1) * sizeof(uint32_t));
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(all + off, sessions[i].latency_us, sessions[i].latency_count * sizeof(uint32_t));
+        off += sessions[i].latency_count;
+    }
+    qsort(all, total_samples, sizeof(uint32_t), compare_u32);
+    printf("单帧处理耗时(us): p50=%u p90=%u p99=%u p99.9=%u max=%u\n", percentile(all, total_samples, 50),
+           percentile(all, total_samples, 90), percentile(all, total_samples, 99),
+           percentile(all, total_samples, 99.9), total_samples ? all[total_samples - 1] : 0);
+    free(all);
+}
+
+/* 挂机前记下会话的录像路径（共享合成的跟随者是扇出写入的文件） */
+static void replay_record_output(replay_session_t *rs)
+{
+    pip_session_data_t *pip_data;
+
+    rs->output_file[0] = '\0';
+    if ((pip_data = pip_registry_find(rs->uuid)))
+    {
+        switch_mutex_lock(pip_data->frame_mutex);
+        switch_copy_string(rs->output_file, pip_data->output_filename, sizeof(rs->output_file));
+        switch_mutex_unlock(pip_data->frame_mutex);
+        pip_session_release(pip_data);
+    }
+}
+
+/* 录像的第一个视频包是否为关键帧：是返回1，不是返回0，打不开或没有视频包返回-1 */
+static int replay_first_packet_is_key(const char *path)
+{
+    AVFormatContext *fmt_ctx = NULL;
+    AVPacket *packet = av_packet_alloc();
+    int ret = -1;
+
+    if (!packet || avformat_open_input(&fmt_ctx, path, NULL, NULL) < 0)
+    {
+        av_packet_free(&packet);
+        return -1;
+    }
+    while (av_read_frame(fmt_ctx, packet) >= 0)
+    {
+        int video = fmt_ctx->streams[packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+
+        if (video)
+        {
+            ret = (packet->flags & AV_PKT_FLAG_KEY) ? 1 : 0;
+        }
+        av_packet_unref(packet);
+        if (video)
+        {
+            break;
+        }
+    }
+    avformat_close_input(&fmt_ctx);
+    av_packet_free(&packet);
+    return ret;
+}
+
+/* 检查本轮全部录像，返回首包不是关键帧的文件数 */
+static int replay_check_keyframes(replay_session_t *sessions, int count)
+{
+    int checked = 0, bad = 0, empty = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        int key;
+
+        if (!sessions[i].output_file[0])
+        {
+            continue;
+        }
+        checked++;
+        if ((key = replay_first_packet_is_key(sessions[i].output_file)) == 0)
+        {
+            fprintf(stderr, "录像首包不是关键帧: %s\n", sessions[i].output_file);
+            bad++;
+        }
+        else if (key < 0)
+        {
+            empty++;
+        }
+    }
+    printf("录像首包检查: %d 个文件, %d 个首包不是关键帧, %d 个无法读取或没有视频包\n", checked, bad, empty);
+    return bad;
+}
+
+/* 等待异步启动完成：轮询注册表直到会话出现 */
+static int replay_wait_started(replay_session_t *rs)
+{
+    pip_session_data_t *pip_data;
+
+    for (int waited = 0; waited < 10000; waited += 10)
+    {
+        if ((pip_data = pip_registry_find(rs->uuid)))
+        {
+            pip_session_release(pip_data);
+            return 0;
+        }
+        switch_sleep(10000);
+    }
+    return -1;
+}
+
+/* 通过应答事件启动：自动启动由启动工作线程完成 */
+static int replay_auto_start(replay_session_t *rs, const char *background)
+{
+    switch_channel_t *channel = switch_core_session_get_channel(rs->session);
+
+    switch_channel_set_variable(channel, PIP_VAR_AUTO_START, "true");
+    switch_channel_set_variable(channel, PIP_VAR_FILE, background);
+    shim_session_answer(rs->session);
+    return replay_wait_started(rs);
+}
+
+/* 异步启动的完成事件 */
+static uint32_t replay_async_success = 0;
+static uint32_t replay_async_failure = 0;
+
+static void replay_start_result_handler(switch_event_t *event)
+{
+    const char *result = switch_event_get_header(event, "PIP-Result");
+
+    if (result && !strcmp(result, "success"))
+    {
+        __atomic_add_fetch(&replay_async_success, 1, __ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        const char *reason = switch_event_get_header(event, "PIP-Reason");
+        fprintf(stderr, "异步启动失败: %s %s\n", switch_event_get_header(event, "Unique-ID"), reason ? reason : "");
+        __atomic_add_fetch(&replay_async_failure, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* 一次性提交全部会话，统计API返回耗时和全部完成耗时 */
+static int replay_async_start(replay_session_t *sessions, int count, const char *background)
+{
+    switch_event_node_t *node = NULL;
+    double start = monotonic_seconds(), submitted, done;
+    int accepted = 0;
+
+    switch_event_bind_removable("pip_replay", SWITCH_EVENT_CUSTOM, PIP_EVENT_START_RESULT,
+                                replay_start_result_handler, NULL, &node);
+
+    for (int i = 0; i < count; i++)
+    {
+        switch_stream_handle_t stream = {0};
+        char cmd[1024];
+
+        SWITCH_STANDARD_STREAM(stream);
+        snprintf(cmd, sizeof(cmd), "%s %s", sessions[i].uuid, background);
+        switch_api_execute("video_pip_start_async", cmd, NULL, &stream);
+        if (stream.data && !strncmp((char *)stream.data, "+OK", 3))
+        {
+            accepted++;
+        }
+        else
+        {
+            fprintf(stderr, "会话 %d 提交失败: %s", i, stream.data ? (char *)stream.data : "(无输出)\n");
+        }
+        free(stream.data);
+    }
+    submitted = monotonic_seconds();
+
+    while ((int)(__atomic_load_n(&replay_async_success, __ATOMIC_SEQ_CST) +
+                 __atomic_load_n(&replay_async_failure, __ATOMIC_SEQ_CST)) < accepted &&
+           monotonic_seconds() - start < 30)
+    {
+        switch_sleep(1000);
+    }
+    done = monotonic_seconds();
+    switch_event_unbind(&node);
+
+    printf("异步启动: 提交 %d 个用时 %.2f ms（平均 %.3f ms/个），全部完成用时 %.1f ms，成功 %u 失败 %u\n", count,
+           (submitted - start) * 1e3, count ? (submitted - start) * 1e3 / count : 0.0, (done - start) * 1e3,
+           replay_async_success, replay_async_failure);
+    return (int)replay_async_success;
+}
+
+/* 布局修改线程：模拟控制器在回放期间不断调整所有会话的画中画 */
+typedef struct replay_layout_ctl
+{
+    replay_session_t *sessions;
+    int count;
+    int interval_ms;
+    volatile int stop;
+    uint64_t calls;
+    double total_ms;
+    double max_ms;
+} replay_layout_ctl_t;
+
+static void *replay_layout_thread(void *arg)
+{
+    static const char *positions[] = {"top_left", "top_right", "bottom_left", "bottom_right", "center"};
+    static const int sizes[][2] = {{320, 240}, {160, 120}, {426, 240}, {240, 136}};
+    replay_layout_ctl_t *ctl = (replay_layout_ctl_t *)arg;
+    size_t cap = (size_t)ctl->count * 192 + 1;
+    char *cmd = malloc(cap);
+
+    for (int round = 0; cmd && !ctl->stop; round++)
+    {
+        switch_stream_handle_t stream = {0};
+        size_t len = 0;
+        double t0, ms;
+
+        for (int i = 0; i < ctl->count; i++)
+        {
+            int k = round + i;
+            /* 过渡时长取间隔的一半，压测时大部分帧处于动画中 */
+            len += snprintf(cmd + len, cap - len,
+                            "update %s width=%d height=%d position=%s opacity=%.1f duration=%d;",
+                            ctl->sessions[i].uuid, sizes[k % 4][0], sizes[k % 4][1], positions[k % 5],
+                            0.5 + (k % 5) * 0.1, ctl->interval_ms / 2);
+        }
+
+        SWITCH_STANDARD_STREAM(stream);
+        t0 = monotonic_seconds();
+        switch_api_execute("video_pip_batch", cmd, NULL, &stream);
+        ms = (monotonic_seconds() - t0) * 1e3;
+        if (!stream.data || strncmp((char *)stream.data, "+OK", 3) != 0)
+        {
+            fprintf(stderr, "布局修改失败: %s", stream.data ? (char *)stream.data : "(无输出)\n");
+        }
+        free(stream.data);
+
+        ctl->calls++;
+        ctl->total_ms += ms;
+        if (ms > ctl->max_ms)
+        {
+            ctl->max_ms = ms;
+        }
+        switch_sleep((switch_interval_time_t)ctl->interval_ms * 1000);
+    }
+
+    free(cmd);
+    return NULL;
+}
+
+/* 快照线程：模拟监控墙每隔一段时间同时刷新全部会话的缩略图 */
+typedef struct replay_snapshot_ctl
+{
+    replay_session_t *sessions;
+    int count;
+    int interval_ms;
+    volatile int stop;
+    uint64_t ok;
+    uint64_t rejected;
+    uint64_t failed;
+    double total_ms;
+    double max_ms;
+} replay_snapshot_ctl_t;
+
+typedef struct replay_snapshot_call
+{
+    replay_snapshot_ctl_t *ctl;
+    const char *uuid;
+    pthread_t thread;
+    double ms;
+} replay_snapshot_call_t;
+
+static void *replay_snapshot_call_thread(void *arg)
+{
+    replay_snapshot_call_t *call = (replay_snapshot_call_t *)arg;
+    replay_snapshot_ctl_t *ctl = call->ctl;
+    switch_stream_handle_t stream = {0};
+    char cmd[128];
+    double t0;
+
+    snprintf(cmd, sizeof(cmd), "%s 160 jpeg", call->uuid);
+    SWITCH_STANDARD_STREAM(stream);
+    t0 = monotonic_seconds();
+    switch_api_execute("video_pip_snapshot", cmd, NULL, &stream);
+    call->ms = (monotonic_seconds() - t0) * 1e3;
+
+    if (stream.data && !strncmp((char *)stream.data, "+OK data:image/jpeg;base64,", 27))
+    {
+        __atomic_add_fetch(&ctl->ok, 1, __ATOMIC_RELAXED);
+    }
+    else if (stream.data && strstr((char *)stream.data, "过多"))
+    {
+        __atomic_add_fetch(&ctl->rejected, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_add_fetch(&ctl->failed, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "快照失败: %s", stream.data ? (char *)stream.data : "(无输出)\n");
+    }
+    free(stream.data);
+    return NULL;
+}
+
+static void *replay_snapshot_thread(void *arg)
+{
+    replay_snapshot_ctl_t *ctl = (replay_snapshot_ctl_t *)arg;
+    replay_snapshot_call_t *calls = calloc(ctl->count, sizeof(*calls));
+
+    while (calls && !ctl->stop)
+    {
+        for (int i = 0; i < ctl->count; i++)
+        {
+            calls[i].ctl = ctl;
+            calls[i].uuid = ctl->sessions[i].uuid;
+            pthread_create(&calls[i].thread, NULL, replay_snapshot_call_thread, &calls[i]);
+        }
+        for (int i = 0; i < ctl->count; i++)
+        {
+            pthread_join(calls[i].thread, NULL);
+            ctl->total_ms += calls[i].ms;
+            if (calls[i].ms > ctl->max_ms)
+            {
+                ctl->max_ms = calls[i].ms;
+            }
+        }
+        switch_sleep((switch_interval_time_t)ctl->interval_ms * 1000);
+    }
+
+    free(calls);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "用法: %s -b 背景文件 [-i remote.y4m | -s 宽x高] [-n 会话数] [-d 秒数] [-f 帧率] [-F i420|nv12|argb|rgb24] "
+            "[-R] [-m 预加载帧数] [-o 输出目录] [-c 参数=值] [-G 调色参数] [-A | -a] [-L 毫秒] [-S 组名] [-P 毫秒] "
+            "[-r 轮数] [-M] [-v]\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *background = NULL;
+    const char *y4m_path = NULL;
+    const char *output_dir = "/tmp";
+    const char *share_name = NULL;
+    int synth_width = 640, synth_height = 480;
+    int session_count = 1;
+    int max_frames = 150;
+    int print_metrics = 0;
+    int auto_start = 0;
+    int async_start = 0;
+    int layout_interval_ms = 0;
+    int snapshot_interval_ms = 0;
+    int rounds = 1;
+    int failed = 0;
+    switch_img_fmt_t remote_fmt = SWITCH_IMG_FMT_I420;
+    pthread_t layout_thread;
+    pthread_t snapshot_thread;
+    switch_memory_pool_t *pool = NULL;
+    switch_loadable_module_interface_t *module_interface = NULL;
+    int opt;
+
+    /* 默认每个远程帧合成一次，-R最大速度回放和按回放线程统计的CPU才有意义；
+     * 测试输出时钟时用 -c output-clock=cfr 覆盖（合成和编码转到时钟线程，不计入每会话CPU） */
+    shim_config_add("settings", "param", "name", "output-clock", "value", "arrival");
+
+    while ((opt = getopt(argc, argv, "b:i:s:n:d:f:F:Rm:o:c:G:AaL:S:P:r:Mv")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            background = optarg;
+            break;
+        case 'i':
+            y4m_path = optarg;
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &synth_width, &synth_height) != 2 || synth_width <= 0 || synth_height <= 0)
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'n':
+            session_count = atoi(optarg);
+            break;
+        case 'd':
+            replay_duration = atof(optarg);
+            break;
+        case 'f':
+            clip.fps = atof(optarg);
+            break;
+        case 'F':
+            if (!strcasecmp(optarg, "i420"))
+            {
+                remote_fmt = SWITCH_IMG_FMT_I420;
+            }
+            else if (!strcasecmp(optarg, "nv12"))
+            {
+                remote_fmt = SWITCH_IMG_FMT_NV12;
+            }
+            else if (!strcasecmp(optarg, "argb"))
+            {
+                remote_fmt = SWITCH_IMG_FMT_ARGB;
+            }
+            else if (!strcasecmp(optarg, "rgb24"))
+            {
+                remote_fmt = SWITCH_IMG_FMT_RGB24;
+            }
+            else
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'R':
+            replay_realtime = 0;
+            break;
+        case 'm':
+            max_frames = atoi(optarg);
+            break;
+        case 'o':
+            output_dir = optarg;
+            break;
+        case 'c':
+        {
+            char *eq = strchr(optarg, '=');
+            if (!eq)
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            *eq = '\0';
+            shim_config_add("settings", "param", "name", optarg, "value", eq + 1);
+            break;
+        }
+        case 'G':
+            shim_config_add("filters", "filter", "name", "eq", "args", optarg);
+            break;
+        case 'A':
+            auto_start = 1;
+            break;
+        case 'a':
+            async_start = 1;
+            break;
+        case 'L':
+            layout_interval_ms = atoi(optarg);
+            break;
+        case 'S':
+            share_name = optarg;
+            break;
+        case 'P':
+            snapshot_interval_ms = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'M':
+            print_metrics = 1;
+            break;
+        case 'v':
+            if (shim_log_level < SWITCH_LOG_DEBUG)
+            {
+                shim_log_level++;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (!background || session_count <= 0 || replay_duration <= 0 || max_frames <= 0 || rounds <= 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (y4m_path ? load_y4m_clip(y4m_path, max_frames, &clip) < 0
+                 : make_synthetic_clip(synth_width, synth_height, max_frames < 60 ? max_frames : 60, &clip) < 0)
+    {
+        return 1;
+    }
+    if (remote_fmt != SWITCH_IMG_FMT_I420 && convert_clip_format(&clip, remote_fmt) < 0)
+    {
+        fprintf(stderr, "远程视频格式转换失败\n");
+        return 1;
+    }
+
+    printf("远程视频: %dx%d @ %.2f fps, %d 帧循环; 会话数: %d; 时长: %.1f 秒; %s\n", clip.width, clip.height, clip.fps,
+           clip.frame_count, session_count, replay_duration, replay_realtime ? "实时节奏" : "最大速度");
+
+    /* 加载模块，输出目录通过配置指向临时目录 */
+    shim_config_add("settings", "param", "name", "output-dir", "value", output_dir);
+    switch_core_new_memory_pool(&pool);
+    if (mod_video_pip_load(&module_interface, pool) != SWITCH_STATUS_SUCCESS)
+    {
+        fprintf(stderr, "模块加载失败\n");
+        return 1;
+    }
+
+    for (int round = 0; round < rounds; round++)
+    {
+        replay_layout_ctl_t layout_ctl = {0};
+        replay_snapshot_ctl_t snapshot_ctl = {0};
+        replay_session_t *sessions;
+        int started = 0;
+
+        if (rounds > 1)
+        {
+            printf("\n第 %d/%d 轮\n", round + 1, rounds);
+        }
+        sessions = calloc(session_count, sizeof(replay_session_t));
+        for (int i = 0; i < session_count; i++)
+        {
+            replay_session_t *rs = &sessions[i];
+            switch_stream_handle_t stream = {0};
+            char cmd[1024];
+
+            rs->index = i;
+            snprintf(rs->uuid, sizeof(rs->uuid), "%08d-0000-4000-8000-%012d", round, i);
+            rs->session = shim_session_create(rs->uuid);
+            if (share_name)
+            {
+                switch_channel_set_variable(switch_core_session_get_channel(rs->session), PIP_VAR_SHARE, share_name);
+            }
+
+            if (async_start)
+            {
+                continue;
+            }
+            if (auto_start)
+            {
+                if (replay_auto_start(rs, background) < 0)
+                {
+                    fprintf(stderr, "会话 %d 自动启动失败\n", i);
+                    break;
+                }
+                started++;
+                continue;
+            }
+
+            SWITCH_STANDARD_STREAM(stream);
+            snprintf(cmd, sizeof(cmd), "%s %s", rs->uuid, background);
+            switch_api_execute("video_pip_start", cmd, NULL, &stream);
+            if (!stream.data || strncmp((char *)stream.data, "+OK", 3) != 0)
+            {
+                fprintf(stderr, "会话 %d 启动失败: %s", i, stream.data ? (char *)stream.data : "(无输出)\n");
+                free(stream.data);
+                break;
+            }
+            free(stream.data);
+            started++;
+        }
+
+        if (async_start)
+        {
+            started = replay_async_start(sessions, session_count, background);
+            if (started < session_count)
+            {
+                fprintf(stderr, "%d 个会话未能启动\n", session_count - started);
+            }
+        }
+
+        for (int i = 0; i < started; i++)
+        {
+            pthread_create(&sessions[i].thread, NULL, replay_session_thread, &sessions[i]);
+        }
+        if (layout_interval_ms > 0 && started > 0)
+        {
+            layout_ctl.sessions = sessions;
+            layout_ctl.count = started;
+            layout_ctl.interval_ms = layout_interval_ms;
+            pthread_create(&layout_thread, NULL, replay_layout_thread, &layout_ctl);
+        }
+        if (snapshot_interval_ms > 0 && started > 0)
+        {
+            snapshot_ctl.sessions = sessions;
+            snapshot_ctl.count = started;
+            snapshot_ctl.interval_ms = snapshot_interval_ms;
+            pthread_create(&snapshot_thread, NULL, replay_snapshot_thread, &snapshot_ctl);
+        }
+        for (int i = 0; i < started; i++)
+        {
+            pthread_join(sessions[i].thread, NULL);
+        }
+        if (layout_ctl.sessions)
+        {
+            layout_ctl.stop = 1;
+            pthread_join(layout_thread, NULL);
+            printf("布局修改: %llu 次批量调用（每次 %d 个会话），平均 %.3f ms，最大 %.3f ms\n",
+                   (unsigned long long)layout_ctl.calls, started,
+                   layout_ctl.calls ? layout_ctl.total_ms / layout_ctl.calls : 0.0, layout_ctl.max_ms);
+        }
+        if (snapshot_ctl.sessions)
+        {
+            uint64_t calls;
+
+            snapshot_ctl.stop = 1;
+            pthread_join(snapshot_thread, NULL);
+            calls = snapshot_ctl.ok + snapshot_ctl.rejected + snapshot_ctl.failed;
+            printf("快照: %llu 次调用，成功 %llu，限流拒绝 %llu，失败 %llu，平均 %.3f ms，最大 %.3f ms\n",
+                   (unsigned long long)calls, (unsigned long long)snapshot_ctl.ok,
+                   (unsigned long long)snapshot_ctl.rejected, (unsigned long long)snapshot_ctl.failed,
+                   calls ? snapshot_ctl.total_ms / calls : 0.0, snapshot_ctl.max_ms);
+        }
+
+        if (print_metrics)
+        {
+            switch_stream_handle_t stream = {0};
+
+            SWITCH_STANDARD_STREAM(stream);
+            switch_api_execute("video_pip_metrics", "", NULL, &stream);
+            printf("\n%s", stream.data ? (char *)stream.data : "");
+            free(stream.data);
+        }
+
+        /* 模拟挂机，触发CLOSE回调完成录像收尾 */
+        for (int i = 0; i < session_count; i++)
+        {
+            if (sessions[i].session)
+            {
+                replay_record_output(&sessions[i]);
+                shim_session_hangup(sessions[i].session);
+                shim_session_hangup_event(sessions[i].session);
+            }
+        }
+
+        if (started > 0)
+        {
+            print_report(sessions, started);
+            failed |= replay_check_keyframes(sessions, started) > 0;
+        }
+        failed |= started != session_count;
+
+        for (int i = 0; i < session_count; i++)
+        {
+            free(sessions[i].latency_us);
+        }
+        free(sessions);
+    }
+
+    mod_video_pip_shutdown();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,1719 @@
+/*
+ * FreeSWITCH Video Picture-in-Picture Module
+ * 回放测试用的最小FreeSWITCH接口替身
+ *
+ * 只实现模块实际用到的 switch_* 接口（日志、互斥锁、哈希表、内存池、
+ * 会话查找、媒体钩子、switch_img_*、API注册），
+ * 让 mod_video_pip.c 可以脱离FreeSWITCH编译进 pip_replay。
+ * 所有实现都是static函数，只能被单个翻译单元包含。
+ */
+
+#ifndef PIP_SHIM_SWITCH_H
+#define PIP_SHIM_SWITCH_H
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "switch_json.h"
+
+/* ---------- 基本类型 ---------- */
+
+typedef enum
+{
+    SWITCH_STATUS_SUCCESS,
+    SWITCH_STATUS_FALSE,
+    SWITCH_STATUS_TIMEOUT,
+    SWITCH_STATUS_NOTFOUND,
+    SWITCH_STATUS_MEMERR,
+    SWITCH_STATUS_GENERR,
+    SWITCH_STATUS_BREAK,
+    SWITCH_STATUS_TERM
+} switch_status_t;
+
+typedef enum
+{
+    SWITCH_FALSE = 0,
+    SWITCH_TRUE = 1
+} switch_bool_t;
+
+typedef int64_t switch_time_t;
+typedef int64_t switch_interval_time_t;
+typedef size_t switch_size_t;
+
+#define SWITCH_UUID_FORMATTED_LENGTH 36
+static inline int _zstr(const char *s)
+{
+    return !s || *s == '\0';
+}
+#define zstr(x) _zstr(x)
+#define switch_safe_free(it)                                                                                           \
+    if (it)                                                                                                            \
+    {                                                                                                                  \
+        free(it);                                                                                                      \
+        it = NULL;                                                                                                     \
+    }
+#define switch_arraylen(_a) (sizeof(_a) / sizeof(_a[0]))
+
+static inline int switch_true(const char *expr)
+{
+    return expr && (!strcasecmp(expr, "yes") || !strcasecmp(expr, "on") || !strcasecmp(expr, "true") ||
+                    !strcasecmp(expr, "enabled") || !strcasecmp(expr, "active") || !strcasecmp(expr, "allow") ||
+                    atoi(expr) != 0);
+}
+
+static inline char *switch_copy_string(char *to, const char *from, switch_size_t size)
+{
+    if (!to || !size)
+    {
+        return to;
+    }
+    if (!from)
+    {
+        *to = '\0';
+        return to;
+    }
+    strncpy(to, from, size - 1);
+    to[size - 1] = '\0';
+    return to;
+}
+
+/* 按分隔符切分（原地修改），忽略连续分隔符 */
+static inline unsigned int switch_separate_string(char *buf, char delim, char **array, unsigned int arraylen)
+{
+    unsigned int count = 0;
+    char *p = buf;
+
+    while (p && *p && count < arraylen)
+    {
+        while (*p == delim)
+        {
+            p++;
+        }
+        if (!*p)
+        {
+            break;
+        }
+        array[count++] = p;
+        if (count == arraylen)
+        {
+            break;
+        }
+        while (*p && *p != delim)
+        {
+            p++;
+        }
+        if (*p)
+        {
+            *p++ = '\0';
+        }
+    }
+    return count;
+}
+
+/* 十进制数（可带符号和小数点） */
+static inline switch_bool_t switch_is_number(const char *str)
+{
+    const char *p = str;
+    int digits = 0;
+
+    if (!p || !*p)
+    {
+        return SWITCH_FALSE;
+    }
+    if (*p == '-' || *p == '+')
+    {
+        p++;
+    }
+    for (; *p; p++)
+    {
+        if (*p >= '0' && *p <= '9')
+        {
+            digits++;
+        }
+        else if (*p != '.')
+        {
+            return SWITCH_FALSE;
+        }
+    }
+    return digits ? SWITCH_TRUE : SWITCH_FALSE;
+}
+
+/* 标准base64编码，输出以'\0'结尾；olen不足时返回SWITCH_STATUS_FALSE */
+static inline switch_status_t switch_b64_encode(unsigned char *in, switch_size_t ilen, unsigned char *out,
+                                                switch_size_t olen)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    switch_size_t o = 0;
+
+    if ((ilen + 2) / 3 * 4 + 1 > olen)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+    for (switch_size_t i = 0; i < ilen; i += 3)
+    {
+        uint32_t v = (uint32_t)in[i] << 16 | (i + 1 < ilen ? (uint32_t)in[i + 1] << 8 : 0) |
+                     (i + 2 < ilen ? in[i + 2] : 0);
+
+        out[o++] = table[v >> 18 & 63];
+        out[o++] = table[v >> 12 & 63];
+        out[o++] = i + 1 < ilen ? table[v >> 6 & 63] : '=';
+        out[o++] = i + 2 < ilen ? table[v & 63] : '=';
+    }
+    out[o] = '\0';
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 生成随机的v4格式UUID字符串 */
+static inline char *switch_uuid_str(char *buf, switch_size_t len)
+{
+    static uint64_t counter = 0;
+    uint64_t a = (uint64_t)rand() << 32 ^ (uint64_t)rand() ^ (uint64_t)time(NULL);
+    uint64_t b = __atomic_add_fetch(&counter, 1, __ATOMIC_SEQ_CST) ^ ((uint64_t)rand() << 20);
+
+    snprintf(buf, len, "%08x-%04x-4%03x-8%03x-%012llx", (unsigned)(a >> 32), (unsigned)(a >> 16) & 0xffff,
+             (unsigned)a & 0xfff, (unsigned)(b >> 48) & 0xfff, (unsigned long long)(b & 0xffffffffffffULL));
+    return buf;
+}
+
+static inline switch_time_t switch_micro_time_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (switch_time_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#define switch_time_now() switch_micro_time_now()
+
+static inline void switch_sleep(switch_interval_time_t t)
+{
+    struct timespec ts;
+    if (t <= 0)
+    {
+        return;
+    }
+    ts.tv_sec = t / 1000000;
+    ts.tv_nsec = (t % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+#define switch_yield(ms) switch_sleep(ms)
+
+/* ---------- 日志 ---------- */
+
+typedef enum
+{
+    SWITCH_LOG_CRIT = 2,
+    SWITCH_LOG_ERROR = 3,
+    SWITCH_LOG_WARNING = 4,
+    SWITCH_LOG_NOTICE = 5,
+    SWITCH_LOG_INFO = 6,
+    SWITCH_LOG_DEBUG = 7
+} switch_log_level_t;
+
+/* 回放程序通过 -v 调整 */
+static switch_log_level_t shim_log_level = SWITCH_LOG_WARNING;
+
+#define SWITCH_CHANNEL_LOG __FILE__, __func__, __LINE__, NULL
+#define SWITCH_CHANNEL_SESSION_LOG(x) __FILE__, __func__, __LINE__, (const char *)(x)
+
+static void switch_log_printf(const char *file, const char *func, int line, const char *userdata,
+                              switch_log_level_t level, const char *fmt, ...) __attribute__((format(printf, 6, 7)));
+
+static void switch_log_printf(const char *file, const char *func, int line, const char *userdata,
+                              switch_log_level_t level, const char *fmt, ...)
+{
+    va_list ap;
+
+    (void)file;
+    (void)userdata;
+    if (level > shim_log_level)
+    {
+        return;
+    }
+    fprintf(stderr, "[%d] %s:%d ", (int)level, func, line);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+/* ---------- 内存池 ---------- */
+
+typedef struct shim_pool_block
+{
+    struct shim_pool_block *next;
+} shim_pool_block_t;
+
+typedef struct switch_memory_pool
+{
+    pthread_mutex_t lock;
+    shim_pool_block_t *blocks;
+} switch_memory_pool_t;
+
+static inline switch_status_t switch_core_new_memory_pool(switch_memory_pool_t **pool)
+{
+    *pool = calloc(1, sizeof(switch_memory_pool_t));
+    if (!*pool)
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    pthread_mutex_init(&(*pool)->lock, NULL);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_core_destroy_memory_pool(switch_memory_pool_t **pool)
+{
+    shim_pool_block_t *block;
+
+    if (!pool || !*pool)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+    while ((block = (*pool)->blocks))
+    {
+        (*pool)->blocks = block->next;
+        free(block);
+    }
+    pthread_mutex_destroy(&(*pool)->lock);
+    free(*pool);
+    *pool = NULL;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline void *switch_core_alloc(switch_memory_pool_t *pool, switch_size_t size)
+{
+    /* 头部按16字节对齐，保证返回的内存满足任意类型的对齐要求 */
+    size_t header = (sizeof(shim_pool_block_t) + 15) & ~(size_t)15;
+    shim_pool_block_t *block = calloc(1, header + size);
+
+    if (!block)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->lock);
+    block->next = pool->blocks;
+    pool->blocks = block;
+    pthread_mutex_unlock(&pool->lock);
+    return (char *)block + header;
+}
+
+static inline char *switch_core_strdup(switch_memory_pool_t *pool, const char *todup)
+{
+    char *dup;
+
+    if (!todup)
+    {
+        return NULL;
+    }
+    dup = switch_core_alloc(pool, strlen(todup) + 1);
+    if (dup)
+    {
+        strcpy(dup, todup);
+    }
+    return dup;
+}
+
+/* ---------- 互斥锁 ---------- */
+
+#define SWITCH_MUTEX_DEFAULT 0x0
+#define SWITCH_MUTEX_NESTED 0x1
+#define SWITCH_MUTEX_UNNESTED 0x0
+
+typedef struct switch_mutex
+{
+    pthread_mutex_t mutex;
+} switch_mutex_t;
+
+static inline switch_status_t switch_mutex_init(switch_mutex_t **lock, unsigned int flags, switch_memory_pool_t *pool)
+{
+    pthread_mutexattr_t attr;
+
+    *lock = switch_core_alloc(pool, sizeof(switch_mutex_t));
+    if (!*lock)
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    pthread_mutexattr_init(&attr);
+    if (flags & SWITCH_MUTEX_NESTED)
+    {
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    }
+    pthread_mutex_init(&(*lock)->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_mutex_destroy(switch_mutex_t *lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_mutex_lock(switch_mutex_t *lock)
+{
+    return pthread_mutex_lock(&lock->mutex) == 0 ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+}
+
+static inline switch_status_t switch_mutex_unlock(switch_mutex_t *lock)
+{
+    return pthread_mutex_unlock(&lock->mutex) == 0 ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+}
+
+static inline switch_status_t switch_mutex_trylock(switch_mutex_t *lock)
+{
+    return pthread_mutex_trylock(&lock->mutex) == 0 ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+}
+
+/* ---------- 哈希表（线性表实现，规模很小） ---------- */
+
+typedef struct shim_hash_entry
+{
+    char *key;
+    void *val;
+    struct shim_hash_entry *next;
+} shim_hash_entry_t;
+
+typedef struct switch_hash
+{
+    shim_hash_entry_t *head;
+} switch_hash_t;
+
+typedef struct switch_hash_index
+{
+    shim_hash_entry_t *entry;
+} switch_hash_index_t;
+
+static inline switch_status_t switch_core_hash_init(switch_hash_t **hash)
+{
+    *hash = calloc(1, sizeof(switch_hash_t));
+    return *hash ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_MEMERR;
+}
+
+static inline void *switch_core_hash_delete(switch_hash_t *hash, const char *key)
+{
+    shim_hash_entry_t **pp = &hash->head;
+
+    for (; *pp; pp = &(*pp)->next)
+    {
+        if (!strcmp((*pp)->key, key))
+        {
+            shim_hash_entry_t *e = *pp;
+            void *val = e->val;
+            *pp = e->next;
+            free(e->key);
+            free(e);
+            return val;
+        }
+    }
+    return NULL;
+}
+
+static inline switch_status_t switch_core_hash_insert(switch_hash_t *hash, const char *key, const void *data)
+{
+    shim_hash_entry_t *e;
+
+    switch_core_hash_delete(hash, key);
+    e = calloc(1, sizeof(*e));
+    if (!e)
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    e->key = strdup(key);
+    e->val = (void *)data;
+    e->next = hash->head;
+    hash->head = e;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline void *switch_core_hash_find(switch_hash_t *hash, const char *key)
+{
+    for (shim_hash_entry_t *e = hash->head; e; e = e->next)
+    {
+        if (!strcmp(e->key, key))
+        {
+            return e->val;
+        }
+    }
+    return NULL;
+}
+
+static inline switch_hash_index_t *switch_core_hash_first(switch_hash_t *hash)
+{
+    switch_hash_index_t *hi;
+
+    if (!hash->head)
+    {
+        return NULL;
+    }
+    hi = calloc(1, sizeof(*hi));
+    if (hi)
+    {
+        hi->entry = hash->head;
+    }
+    return hi;
+}
+
+static inline switch_hash_index_t *switch_core_hash_next(switch_hash_index_t **hi)
+{
+    (*hi)->entry = (*hi)->entry->next;
+    if (!(*hi)->entry)
+    {
+        free(*hi);
+        *hi = NULL;
+    }
+    return *hi;
+}
+
+static inline void switch_core_hash_this(switch_hash_index_t *hi, const void **key, switch_size_t *klen, void **val)
+{
+    if (key)
+    {
+        *key = hi->entry->key;
+    }
+    if (klen)
+    {
+        *klen = strlen(hi->entry->key) + 1;
+    }
+    if (val)
+    {
+        *val = hi->entry->val;
+    }
+}
+
+static inline switch_status_t switch_core_hash_delete_multi(switch_hash_t *hash, void *callback, void *data)
+{
+    (void)callback;
+    (void)data;
+    while (hash->head)
+    {
+        switch_core_hash_delete(hash, hash->head->key);
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_core_hash_destroy(switch_hash_t **hash)
+{
+    switch_core_hash_delete_multi(*hash, NULL, NULL);
+    free(*hash);
+    *hash = NULL;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* ---------- 图像与帧 ---------- */
+
+typedef enum
+{
+    SWITCH_IMG_FMT_NONE = 0,
+    SWITCH_IMG_FMT_I420,
+    SWITCH_IMG_FMT_I422,
+    SWITCH_IMG_FMT_I444,
+    SWITCH_IMG_FMT_NV12,
+    SWITCH_IMG_FMT_ARGB,
+    SWITCH_IMG_FMT_ARGB_LE,
+    SWITCH_IMG_FMT_RGB24
+} switch_img_fmt_t;
+
+typedef struct switch_image
+{
+    switch_img_fmt_t fmt;
+    unsigned int w;
+    unsigned int h;
+    unsigned int d_w;
+    unsigned int d_h;
+    unsigned char *planes[4];
+    int stride[4];
+    unsigned char *img_data;
+} switch_image_t;
+
+typedef struct switch_frame
+{
+    void *data;
+    uint32_t datalen;
+    switch_image_t *img;
+} switch_frame_t;
+
+/* 只支持平面/交错布局的常见格式，按实际行宽分配 */
+static inline switch_image_t *switch_img_alloc(switch_image_t *img, switch_img_fmt_t fmt, unsigned int d_w,
+                                               unsigned int d_h, unsigned int align)
+{
+    size_t cw = (d_w + 1) / 2;
+    size_t ch = (d_h + 1) / 2;
+    size_t size;
+
+    (void)img;
+    (void)align;
+    img = calloc(1, sizeof(*img));
+    if (!img)
+    {
+        return NULL;
+    }
+    img->fmt = fmt;
+    img->w = img->d_w = d_w;
+    img->h = img->d_h = d_h;
+
+    switch (fmt)
+    {
+    case SWITCH_IMG_FMT_I420:
+        size = (size_t)d_w * d_h + 2 * cw * ch;
+        img->img_data = malloc(size);
+        img->stride[0] = d_w;
+        img->stride[1] = img->stride[2] = cw;
+        img->planes[0] = img->img_data;
+        img->planes[1] = img->planes[0] + (size_t)d_w * d_h;
+        img->planes[2] = img->planes[1] + cw * ch;
+        break;
+    case SWITCH_IMG_FMT_NV12:
+        size = (size_t)d_w * d_h + 2 * cw * ch;
+        img->img_data = malloc(size);
+        img->stride[0] = d_w;
+        img->stride[1] = cw * 2;
+        img->planes[0] = img->img_data;
+        img->planes[1] = img->planes[0] + (size_t)d_w * d_h;
+        break;
+    case SWITCH_IMG_FMT_ARGB:
+    case SWITCH_IMG_FMT_ARGB_LE:
+        img->img_data = malloc((size_t)d_w * d_h * 4);
+        img->stride[0] = d_w * 4;
+        img->planes[0] = img->img_data;
+        break;
+    case SWITCH_IMG_FMT_RGB24:
+        img->img_data = malloc((size_t)d_w * d_h * 3);
+        img->stride[0] = d_w * 3;
+        img->planes[0] = img->img_data;
+        break;
+    default:
+        free(img);
+        return NULL;
+    }
+
+    if (!img->img_data)
+    {
+        free(img);
+        return NULL;
+    }
+    return img;
+}
+
+static inline void switch_img_free(switch_image_t **img)
+{
+    if (img && *img)
+    {
+        free((*img)->img_data);
+        free(*img);
+        *img = NULL;
+    }
+}
+
+static inline void switch_img_copy(switch_image_t *img, switch_image_t **new_img)
+{
+    int planes = 1;
+
+    if (!img || !new_img)
+    {
+        return;
+    }
+    if (!*new_img || (*new_img)->fmt != img->fmt || (*new_img)->d_w != img->d_w || (*new_img)->d_h != img->d_h)
+    {
+        switch_img_free(new_img);
+        *new_img = switch_img_alloc(NULL, img->fmt, img->d_w, img->d_h, 1);
+        if (!*new_img)
+        {
+            return;
+        }
+    }
+
+    if (img->fmt == SWITCH_IMG_FMT_I420)
+    {
+        planes = 3;
+    }
+    else if (img->fmt == SWITCH_IMG_FMT_NV12)
+    {
+        planes = 2;
+    }
+
+    for (int p = 0; p < planes; p++)
+    {
+        unsigned int rows = p == 0 ? img->d_h : (img->d_h + 1) / 2;
+        int bytes = (*new_img)->stride[p] < img->stride[p] ? (*new_img)->stride[p] : img->stride[p];
+
+        for (unsigned int r = 0; r < rows; r++)
+        {
+            memcpy((*new_img)->planes[p] + (size_t)r * (*new_img)->stride[p], img->planes[p] + (size_t)r * img->stride[p],
+                   bytes);
+        }
+    }
+}
+
+/* ---------- 会话、通道与媒体钩子 ---------- */
+
+typedef enum
+{
+    CS_NEW,
+    CS_INIT,
+    CS_ROUTING,
+    CS_SOFT_EXECUTE,
+    CS_EXECUTE,
+    CS_EXCHANGE_MEDIA,
+    CS_PARK,
+    CS_CONSUME_MEDIA,
+    CS_HIBERNATE,
+    CS_RESET,
+    CS_HANGUP,
+    CS_REPORTING,
+    CS_DESTROY,
+    CS_NONE
+} switch_channel_state_t;
+
+typedef enum
+{
+    SWITCH_ABC_TYPE_INIT,
+    SWITCH_ABC_TYPE_READ_VIDEO_PING,
+    SWITCH_ABC_TYPE_CLOSE
+} switch_abc_type_t;
+
+typedef uint32_t switch_media_bug_flag_t;
+#define SMBF_READ_VIDEO_PING (1 << 5)
+
+typedef struct switch_media_bug switch_media_bug_t;
+typedef struct switch_core_session switch_core_session_t;
+typedef switch_bool_t (*switch_media_bug_callback_t)(switch_media_bug_t *, void *, switch_abc_type_t);
+
+typedef enum
+{
+    CF_ANSWERED = (1 << 0),
+    CF_VIDEO = (1 << 1)
+} switch_channel_flag_t;
+
+#define SHIM_CHANNEL_MAX_VARS 16
+
+typedef struct switch_channel
+{
+    switch_core_session_t *session;
+    switch_channel_state_t state;
+    uint32_t flags;
+    int var_count;
+    char *var_names[SHIM_CHANNEL_MAX_VARS];
+    char *var_values[SHIM_CHANNEL_MAX_VARS];
+} switch_channel_t;
+
+struct switch_media_bug
+{
+    switch_core_session_t *session;
+    switch_media_bug_callback_t callback;
+    void *user_data;
+    switch_frame_t *ping_frame;
+    switch_media_bug_t *next;
+};
+
+struct switch_core_session
+{
+    char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+    switch_memory_pool_t *pool;
+    switch_channel_t channel;
+    pthread_mutex_t bug_lock;
+    switch_media_bug_t *bugs;
+    switch_core_session_t *next;
+};
+
+/* 回放程序创建的全部会话 */
+static pthread_mutex_t shim_session_lock = PTHREAD_MUTEX_INITIALIZER;
+static switch_core_session_t *shim_sessions = NULL;
+
+static inline switch_core_session_t *shim_session_create(const char *uuid)
+{
+    switch_core_session_t *session = calloc(1, sizeof(*session));
+
+    if (!session)
+    {
+        return NULL;
+    }
+    switch_copy_string(session->uuid, uuid, sizeof(session->uuid));
+    switch_core_new_memory_pool(&session->pool);
+    session->channel.session = session;
+    session->channel.state = CS_EXECUTE;
+    session->channel.flags = CF_VIDEO; /* 回放的都是视频通话 */
+    pthread_mutex_init(&session->bug_lock, NULL);
+
+    pthread_mutex_lock(&shim_session_lock);
+    session->next = shim_sessions;
+    shim_sessions = session;
+    pthread_mutex_unlock(&shim_session_lock);
+    return session;
+}
+
+static inline switch_core_session_t *switch_core_session_locate(const char *uuid)
+{
+    switch_core_session_t *session;
+
+    pthread_mutex_lock(&shim_session_lock);
+    for (session = shim_sessions; session; session = session->next)
+    {
+        if (!strcmp(session->uuid, uuid) && session->channel.state < CS_HANGUP)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shim_session_lock);
+    return session;
+}
+
+static inline void switch_core_session_rwunlock(switch_core_session_t *session)
+{
+    (void)session;
+}
+
+static inline switch_memory_pool_t *switch_core_session_get_pool(switch_core_session_t *session)
+{
+    return session->pool;
+}
+
+static inline switch_channel_t *switch_core_session_get_channel(switch_core_session_t *session)
+{
+    return &session->channel;
+}
+
+static inline char *switch_core_session_get_uuid(switch_core_session_t *session)
+{
+    return session->uuid;
+}
+
+static inline switch_channel_state_t switch_channel_get_state(switch_channel_t *channel)
+{
+    return channel->state;
+}
+
+static inline uint32_t switch_channel_test_flag(switch_channel_t *channel, switch_channel_flag_t flag)
+{
+    return channel->flags & flag;
+}
+
+/* 通道变量只在应答前由回放程序设置，不加锁 */
+static inline switch_status_t switch_channel_set_variable(switch_channel_t *channel, const char *name, const char *value)
+{
+    for (int i = 0; i < channel->var_count; i++)
+    {
+        if (!strcasecmp(channel->var_names[i], name))
+        {
+            channel->var_values[i] = switch_core_strdup(channel->session->pool, value);
+            return SWITCH_STATUS_SUCCESS;
+        }
+    }
+    if (channel->var_count >= SHIM_CHANNEL_MAX_VARS)
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    channel->var_names[channel->var_count] = switch_core_strdup(channel->session->pool, name);
+    channel->var_values[channel->var_count] = switch_core_strdup(channel->session->pool, value);
+    channel->var_count++;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline const char *switch_channel_get_variable(switch_channel_t *channel, const char *name)
+{
+    for (int i = 0; i < channel->var_count; i++)
+    {
+        if (!strcasecmp(channel->var_names[i], name))
+        {
+            return channel->var_values[i];
+        }
+    }
+    return NULL;
+}
+
+static inline switch_status_t switch_core_media_bug_add(switch_core_session_t *session, const char *function,
+                                                        const char *target, switch_media_bug_callback_t callback,
+                                                        void *user_data, time_t stop_time,
+                                                        switch_media_bug_flag_t flags, switch_media_bug_t **new_bug)
+{
+    switch_media_bug_t *bug = calloc(1, sizeof(*bug));
+
+    (void)function;
+    (void)target;
+    (void)stop_time;
+    (void)flags;
+    if (!bug)
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    bug->session = session;
+    bug->callback = callback;
+    bug->user_data = user_data;
+    if (callback)
+    {
+        callback(bug, user_data, SWITCH_ABC_TYPE_INIT);
+    }
+
+    pthread_mutex_lock(&session->bug_lock);
+    bug->next = session->bugs;
+    session->bugs = bug;
+    pthread_mutex_unlock(&session->bug_lock);
+
+    *new_bug = bug;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 从会话摘除钩子并触发CLOSE回调；在CLOSE回调内部重复调用是安全的 */
+static inline switch_status_t switch_core_media_bug_remove(switch_core_session_t *session, switch_media_bug_t **bug)
+{
+    switch_media_bug_t **pp;
+    switch_media_bug_t *found = NULL;
+
+    if (!bug || !*bug)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    pthread_mutex_lock(&session->bug_lock);
+    for (pp = &session->bugs; *pp; pp = &(*pp)->next)
+    {
+        if (*pp == *bug)
+        {
+            found = *pp;
+            *pp = found->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&session->bug_lock);
+
+    *bug = NULL;
+    if (!found)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+    if (found->callback)
+    {
+        found->callback(found, found->user_data, SWITCH_ABC_TYPE_CLOSE);
+    }
+    free(found);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_frame_t *switch_core_media_bug_get_video_ping_frame(switch_media_bug_t *bug)
+{
+    return bug->ping_frame;
+}
+
+static inline switch_core_session_t *switch_core_media_bug_get_session(switch_media_bug_t *bug)
+{
+    return bug->session;
+}
+
+/* 模拟媒体线程：把一帧远程视频送给会话上的全部钩子 */
+static inline void shim_session_feed_video(switch_core_session_t *session, switch_image_t *img)
+{
+    switch_frame_t frame = {0};
+
+    frame.img = img;
+    pthread_mutex_lock(&session->bug_lock);
+    for (switch_media_bug_t *bug = session->bugs; bug; bug = bug->next)
+    {
+        bug->ping_frame = &frame;
+        bug->callback(bug, bug->user_data, SWITCH_ABC_TYPE_READ_VIDEO_PING);
+        bug->ping_frame = NULL;
+    }
+    pthread_mutex_unlock(&session->bug_lock);
+}
+
+/* 模拟挂机：摘除全部钩子（触发CLOSE） */
+static inline void shim_session_hangup(switch_core_session_t *session)
+{
+    switch_media_bug_t *bug;
+
+    session->channel.state = CS_HANGUP;
+    while (1)
+    {
+        pthread_mutex_lock(&session->bug_lock);
+        bug = session->bugs;
+        pthread_mutex_unlock(&session->bug_lock);
+        if (!bug)
+        {
+            break;
+        }
+        switch_core_media_bug_remove(session, &bug);
+    }
+}
+
+/* ---------- 线程 ---------- */
+
+#define SWITCH_THREAD_FUNC
+#define SWITCH_THREAD_STACKSIZE (240 * 1024)
+
+typedef struct switch_thread switch_thread_t;
+typedef void *(*switch_thread_start_t)(switch_thread_t *, void *);
+
+struct switch_thread
+{
+    pthread_t handle;
+    switch_thread_start_t func;
+    void *data;
+};
+
+typedef struct switch_threadattr
+{
+    int detach;
+    switch_size_t stacksize;
+} switch_threadattr_t;
+
+static inline switch_status_t switch_threadattr_create(switch_threadattr_t **new_attr, switch_memory_pool_t *pool)
+{
+    *new_attr = switch_core_alloc(pool, sizeof(switch_threadattr_t));
+    return *new_attr ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_MEMERR;
+}
+
+static inline switch_status_t switch_threadattr_detach_set(switch_threadattr_t *attr, int32_t on)
+{
+    attr->detach = on;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_threadattr_stacksize_set(switch_threadattr_t *attr, switch_size_t stacksize)
+{
+    attr->stacksize = stacksize;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static void *shim_thread_main(void *arg)
+{
+    switch_thread_t *thread = (switch_thread_t *)arg;
+    switch_thread_start_t func = thread->func;
+    void *data = thread->data;
+
+    /* 分离线程可能在函数内销毁thread所在的内存池，之后不再访问thread */
+    return func(thread, data);
+}
+
+static inline switch_status_t switch_thread_create(switch_thread_t **new_thread, switch_threadattr_t *attr,
+                                                   switch_thread_start_t func, void *data,
+                                                   switch_memory_pool_t *cont)
+{
+    switch_thread_t *thread = switch_core_alloc(cont, sizeof(switch_thread_t));
+    pthread_attr_t pattr;
+    int rc;
+
+    if (!thread)
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    thread->func = func;
+    thread->data = data;
+
+    pthread_attr_init(&pattr);
+    if (attr && attr->detach)
+    {
+        pthread_attr_setdetachstate(&pattr, PTHREAD_CREATE_DETACHED);
+    }
+    rc = pthread_create(&thread->handle, &pattr, shim_thread_main, thread);
+    pthread_attr_destroy(&pattr);
+    if (rc != 0)
+    {
+        return SWITCH_STATUS_GENERR;
+    }
+    *new_thread = thread;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_thread_join(switch_status_t *retval, switch_thread_t *thd)
+{
+    pthread_join(thd->handle, NULL);
+    if (retval)
+    {
+        *retval = SWITCH_STATUS_SUCCESS;
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* ---------- 条件变量 ---------- */
+
+typedef struct switch_thread_cond
+{
+    pthread_cond_t cond;
+} switch_thread_cond_t;
+
+static inline switch_status_t switch_thread_cond_create(switch_thread_cond_t **cond, switch_memory_pool_t *pool)
+{
+    *cond = switch_core_alloc(pool, sizeof(switch_thread_cond_t));
+    if (!*cond)
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    pthread_cond_init(&(*cond)->cond, NULL);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_thread_cond_wait(switch_thread_cond_t *cond, switch_mutex_t *mutex)
+{
+    pthread_cond_wait(&cond->cond, &mutex->mutex);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 等待最多timeout微秒，超时返回SWITCH_STATUS_TIMEOUT */
+static inline switch_status_t switch_thread_cond_timedwait(switch_thread_cond_t *cond, switch_mutex_t *mutex,
+                                                           switch_interval_time_t timeout)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000000;
+    ts.tv_nsec += (timeout % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return pthread_cond_timedwait(&cond->cond, &mutex->mutex, &ts) ? SWITCH_STATUS_TIMEOUT : SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_thread_cond_signal(switch_thread_cond_t *cond)
+{
+    pthread_cond_signal(&cond->cond);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_thread_cond_broadcast(switch_thread_cond_t *cond)
+{
+    pthread_cond_broadcast(&cond->cond);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* ---------- 队列（有界FIFO） ---------- */
+
+typedef struct switch_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    unsigned int capacity;
+    unsigned int head;
+    unsigned int count;
+    void **items;
+} switch_queue_t;
+
+static inline switch_status_t switch_queue_create(switch_queue_t **queue, unsigned int queue_capacity,
+                                                  switch_memory_pool_t *pool)
+{
+    switch_queue_t *q = switch_core_alloc(pool, sizeof(switch_queue_t));
+
+    if (!q || !(q->items = switch_core_alloc(pool, sizeof(void *) * queue_capacity)))
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->capacity = queue_capacity;
+    *queue = q;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline void shim_queue_put(switch_queue_t *queue, void *data)
+{
+    queue->items[(queue->head + queue->count) % queue->capacity] = data;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+}
+
+static inline switch_status_t switch_queue_push(switch_queue_t *queue, void *data)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity)
+    {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    shim_queue_put(queue, data);
+    pthread_mutex_unlock(&queue->lock);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_queue_trypush(switch_queue_t *queue, void *data)
+{
+    switch_status_t status = SWITCH_STATUS_FALSE;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count < queue->capacity)
+    {
+        shim_queue_put(queue, data);
+        status = SWITCH_STATUS_SUCCESS;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return status;
+}
+
+static inline switch_status_t switch_queue_pop(switch_queue_t *queue, void **data)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0)
+    {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    *data = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_queue_trypop(switch_queue_t *queue, void **data)
+{
+    switch_status_t status = SWITCH_STATUS_FALSE;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0)
+    {
+        *data = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+        status = SWITCH_STATUS_SUCCESS;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return status;
+}
+
+static inline unsigned int switch_queue_size(switch_queue_t *queue)
+{
+    unsigned int count;
+
+    pthread_mutex_lock(&queue->lock);
+    count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+/* ---------- 事件 ----------
+ * 真实FreeSWITCH在事件线程中异步分发，这里在switch_event_fire的调用线程中同步分发 */
+
+typedef enum
+{
+    SWITCH_EVENT_CUSTOM,
+    SWITCH_EVENT_CHANNEL_ANSWER,
+    SWITCH_EVENT_CHANNEL_HANGUP,
+    SWITCH_EVENT_ALL
+} switch_event_types_t;
+
+typedef enum
+{
+    SWITCH_STACK_BOTTOM = (1 << 0),
+    SWITCH_STACK_TOP = (1 << 1)
+} switch_stack_t;
+
+#define SWITCH_EVENT_SUBCLASS_ANY NULL
+
+typedef struct switch_event_header
+{
+    char *name;
+    char *value;
+    struct switch_event_header *next;
+} switch_event_header_t;
+
+typedef struct switch_event
+{
+    switch_event_types_t event_id;
+    char *subclass_name;
+    switch_event_header_t *headers;
+    switch_event_header_t *last_header;
+} switch_event_t;
+
+typedef void (*switch_event_callback_t)(switch_event_t *);
+
+typedef struct switch_event_node
+{
+    switch_event_types_t event_id;
+    char *subclass_name;
+    switch_event_callback_t callback;
+    void *user_data;
+    struct switch_event_node *next;
+} switch_event_node_t;
+
+static pthread_mutex_t shim_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static switch_event_node_t *shim_event_nodes = NULL;
+
+static inline switch_status_t switch_event_bind_removable(const char *id, switch_event_types_t event,
+                                                          const char *subclass_name, switch_event_callback_t callback,
+                                                          void *user_data, switch_event_node_t **node)
+{
+    switch_event_node_t *n = calloc(1, sizeof(*n));
+
+    (void)id;
+    if (!n)
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    n->event_id = event;
+    n->subclass_name = subclass_name ? strdup(subclass_name) : NULL;
+    n->callback = callback;
+    n->user_data = user_data;
+
+    pthread_mutex_lock(&shim_event_lock);
+    n->next = shim_event_nodes;
+    shim_event_nodes = n;
+    pthread_mutex_unlock(&shim_event_lock);
+
+    if (node)
+    {
+        *node = n;
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_event_unbind(switch_event_node_t **node)
+{
+    switch_event_node_t **pp;
+    switch_status_t status = SWITCH_STATUS_FALSE;
+
+    if (!node || !*node)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+    pthread_mutex_lock(&shim_event_lock);
+    for (pp = &shim_event_nodes; *pp; pp = &(*pp)->next)
+    {
+        if (*pp == *node)
+        {
+            *pp = (*node)->next;
+            free((*node)->subclass_name);
+            free(*node);
+            status = SWITCH_STATUS_SUCCESS;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shim_event_lock);
+    *node = NULL;
+    return status;
+}
+
+static inline switch_status_t switch_event_create_subclass(switch_event_t **event, switch_event_types_t event_id,
+                                                           const char *subclass_name)
+{
+    *event = calloc(1, sizeof(switch_event_t));
+    if (!*event)
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    (*event)->event_id = event_id;
+    (*event)->subclass_name = subclass_name ? strdup(subclass_name) : NULL;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+#define switch_event_create(event, id) switch_event_create_subclass(event, id, SWITCH_EVENT_SUBCLASS_ANY)
+
+static inline switch_status_t switch_event_reserve_subclass(const char *subclass_name)
+{
+    (void)subclass_name;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_event_free_subclass(const char *subclass_name)
+{
+    (void)subclass_name;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline switch_status_t switch_event_add_header_string(switch_event_t *event, switch_stack_t stack,
+                                                             const char *header_name, const char *data)
+{
+    switch_event_header_t *header = calloc(1, sizeof(*header));
+
+    if (!header)
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    header->name = strdup(header_name);
+    header->value = strdup(data ? data : "");
+    if (stack == SWITCH_STACK_TOP || !event->headers)
+    {
+        header->next = event->headers;
+        event->headers = header;
+        if (!event->last_header)
+        {
+            event->last_header = header;
+        }
+    }
+    else
+    {
+        event->last_header->next = header;
+        event->last_header = header;
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+static inline char *switch_event_get_header(switch_event_t *event, const char *header_name)
+{
+    for (switch_event_header_t *header = event->headers; header; header = header->next)
+    {
+        if (!strcasecmp(header->name, header_name))
+        {
+            return header->value;
+        }
+    }
+    return NULL;
+}
+
+static inline void switch_event_destroy(switch_event_t **event)
+{
+    switch_event_header_t *header, *next;
+
+    if (!event || !*event)
+    {
+        return;
+    }
+    for (header = (*event)->headers; header; header = next)
+    {
+        next = header->next;
+        free(header->name);
+        free(header->value);
+        free(header);
+    }
+    free((*event)->subclass_name);
+    free(*event);
+    *event = NULL;
+}
+
+/* 同步分发给匹配的订阅者后销毁事件 */
+static inline switch_status_t switch_event_fire(switch_event_t **event)
+{
+    switch_event_node_t *matched[32];
+    int count = 0;
+
+    pthread_mutex_lock(&shim_event_lock);
+    for (switch_event_node_t *n = shim_event_nodes; n && count < 32; n = n->next)
+    {
+        if ((n->event_id == SWITCH_EVENT_ALL || n->event_id == (*event)->event_id) &&
+            (!n->subclass_name || ((*event)->subclass_name && !strcasecmp(n->subclass_name, (*event)->subclass_name))))
+        {
+            matched[count++] = n;
+        }
+    }
+    pthread_mutex_unlock(&shim_event_lock);
+
+    for (int i = 0; i < count; i++)
+    {
+        matched[i]->callback(*event);
+    }
+    switch_event_destroy(event);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 模拟应答：设置CF_ANSWERED并发出CHANNEL_ANSWER事件（带通道变量） */
+static inline void shim_session_answer(switch_core_session_t *session)
+{
+    switch_event_t *event = NULL;
+    char name[128];
+
+    session->channel.flags |= CF_ANSWERED;
+    if (switch_event_create(&event, SWITCH_EVENT_CHANNEL_ANSWER) != SWITCH_STATUS_SUCCESS)
+    {
+        return;
+    }
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Unique-ID", session->uuid);
+    for (int i = 0; i < session->channel.var_count; i++)
+    {
+        snprintf(name, sizeof(name), "variable_%s", session->channel.var_names[i]);
+        switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, name, session->channel.var_values[i]);
+    }
+    switch_event_fire(&event);
+}
+
+/* 模拟挂机事件：在shim_session_hangup之后发出CHANNEL_HANGUP */
+static inline void shim_session_hangup_event(switch_core_session_t *session)
+{
+    switch_event_t *event = NULL;
+
+    if (switch_event_create(&event, SWITCH_EVENT_CHANNEL_HANGUP) != SWITCH_STATUS_SUCCESS)
+    {
+        return;
+    }
+    switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Unique-ID", session->uuid);
+    switch_event_fire(&event);
+}
+
+/* ---------- 配置（switch_xml的最小子集） ---------- */
+
+#define SHIM_XML_MAX_ATTRS 4
+
+typedef struct switch_xml *switch_xml_t;
+struct switch_xml
+{
+    char *name;
+    char *attr_name[SHIM_XML_MAX_ATTRS];
+    char *attr_value[SHIM_XML_MAX_ATTRS];
+    switch_xml_t next;    /* 同名的下一个节点 */
+    switch_xml_t sibling; /* 不同名的下一个节点 */
+    switch_xml_t child;
+};
+
+/* 回放程序构造的配置根节点，进程结束前一直有效 */
+static struct switch_xml shim_config_root = {"configuration"};
+
+static inline switch_xml_t switch_xml_child(switch_xml_t xml, const char *name)
+{
+    switch_xml_t child;
+
+    for (child = xml ? xml->child : NULL; child; child = child->sibling)
+    {
+        if (!strcmp(child->name, name))
+        {
+            return child;
+        }
+    }
+    return NULL;
+}
+
+static inline const char *switch_xml_attr(switch_xml_t xml, const char *attr)
+{
+    for (int i = 0; xml && i < SHIM_XML_MAX_ATTRS && xml->attr_name[i]; i++)
+    {
+        if (!strcmp(xml->attr_name[i], attr))
+        {
+            return xml->attr_value[i];
+        }
+    }
+    return NULL;
+}
+
+static inline const char *switch_xml_attr_soft(switch_xml_t xml, const char *attr)
+{
+    const char *value = switch_xml_attr(xml, attr);
+    return value ? value : "";
+}
+
+/* 向 <section> 下追加一个 <tag k1="v1" k2="v2"/> 节点，例如 ("settings", "param", "name", "x", "value", "1") */
+static inline void shim_config_add(const char *section, const char *tag, const char *k1, const char *v1,
+                                   const char *k2, const char *v2)
+{
+    switch_xml_t sec = switch_xml_child(&shim_config_root, section);
+    switch_xml_t node = calloc(1, sizeof(*node));
+    switch_xml_t *link;
+
+    if (!sec)
+    {
+        sec = calloc(1, sizeof(*sec));
+        sec->name = strdup(section);
+        for (link = &shim_config_root.child; *link; link = &(*link)->sibling)
+            ;
+        *link = sec;
+    }
+
+    node->name = strdup(tag);
+    node->attr_name[0] = strdup(k1);
+    node->attr_value[0] = strdup(v1);
+    if (k2)
+    {
+        node->attr_name[1] = strdup(k2);
+        node->attr_value[1] = strdup(v2);
+    }
+
+    /* 同名节点挂在next链上，不同名节点挂在sibling链上 */
+    for (link = &sec->child; *link && strcmp((*link)->name, tag); link = &(*link)->sibling)
+        ;
+    while (*link)
+    {
+        link = &(*link)->next;
+    }
+    *link = node;
+}
+
+static inline switch_xml_t switch_xml_open_cfg(const char *file_path, switch_xml_t *node, void *params)
+{
+    (void)file_path;
+    (void)params;
+
+    if (!shim_config_root.child)
+    {
+        return NULL;
+    }
+    *node = &shim_config_root;
+    return &shim_config_root;
+}
+
+static inline void switch_xml_free(switch_xml_t xml)
+{
+    (void)xml;
+}
+
+/* ---------- API 接口与输出流 ---------- */
+
+typedef struct switch_stream_handle switch_stream_handle_t;
+typedef switch_status_t (*switch_stream_handle_write_function_t)(switch_stream_handle_t *handle, const char *fmt, ...);
+
+struct switch_stream_handle
+{
+    switch_stream_handle_write_function_t write_function;
+    void *data;
+    switch_size_t data_size;
+    switch_size_t data_len;
+};
+
+static switch_status_t shim_stream_write(switch_stream_handle_t *handle, const char *fmt, ...)
+{
+    va_list ap;
+    int need;
+
+    va_start(ap, fmt);
+    need = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (need < 0)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    if (handle->data_len + need + 1 > handle->data_size)
+    {
+        switch_size_t size = (handle->data_len + need + 1) * 2;
+        void *data = realloc(handle->data, size);
+        if (!data)
+        {
+            return SWITCH_STATUS_MEMERR;
+        }
+        handle->data = data;
+        handle->data_size = size;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf((char *)handle->data + handle->data_len, need + 1, fmt, ap);
+    va_end(ap);
+    handle->data_len += need;
+    return SWITCH_STATUS_SUCCESS;
+}
+
+#define SWITCH_STANDARD_STREAM(s)                                                                                      \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        memset(&(s), 0, sizeof(s));                                                                                    \
+        (s).write_function = shim_stream_write;                                                                        \
+    } while (0)
+
+typedef switch_status_t (*switch_api_function_t)(const char *cmd, switch_core_session_t *session,
+                                                 switch_stream_handle_t *stream);
+
+typedef struct switch_api_interface
+{
+    const char *interface_name;
+    switch_api_function_t function;
+    struct switch_api_interface *next;
+} switch_api_interface_t;
+
+typedef void (*switch_application_function_t)(switch_core_session_t *session, const char *data);
+
+#define SAF_NONE 0
+
+typedef struct switch_application_interface
+{
+    const char *interface_name;
+    switch_application_function_t application_function;
+    struct switch_application_interface *next;
+} switch_application_interface_t;
+
+typedef struct switch_loadable_module_interface
+{
+    const char *module_name;
+    switch_api_interface_t *api_interface;
+    switch_application_interface_t *application_interface;
+} switch_loadable_module_interface_t;
+
+static switch_loadable_module_interface_t *shim_module_interface = NULL;
+
+static inline switch_loadable_module_interface_t *switch_loadable_module_create_module_interface(
+    switch_memory_pool_t *pool, const char *name)
+{
+    shim_module_interface = switch_core_alloc(pool, sizeof(*shim_module_interface));
+    shim_module_interface->module_name = name;
+    return shim_module_interface;
+}
+
+static inline switch_api_interface_t *shim_add_api(switch_loadable_module_interface_t *mod, const char *name,
+                                                   switch_api_function_t function)
+{
+    switch_api_interface_t *api = calloc(1, sizeof(*api));
+
+    api->interface_name = name;
+    api->function = function;
+    api->next = mod->api_interface;
+    mod->api_interface = api;
+    return api;
+}
+
+#define SWITCH_ADD_API(api_int, int_name, descript, funcptr, syntax_string)                                            \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        (void)(descript);                                                                                              \
+        (void)(syntax_string);                                                                                         \
+        api_int = shim_add_api(*module_interface, int_name, funcptr);                                                  \
+    } while (0)
+
+static inline switch_application_interface_t *shim_add_app(switch_loadable_module_interface_t *mod, const char *name,
+                                                           switch_application_function_t function)
+{
+    switch_application_interface_t *app = calloc(1, sizeof(*app));
+
+    app->interface_name = name;
+    app->application_function = function;
+    app->next = mod->application_interface;
+    mod->application_interface = app;
+    return app;
+}
+
+#define SWITCH_ADD_APP(app_int, int_name, short_descript, long_descript, funcptr, syntax_string, app_flags)            \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        (void)(short_descript);                                                                                        \
+        (void)(long_descript);                                                                                         \
+        (void)(syntax_string);                                                                                         \
+        (void)(app_flags);                                                                                             \
+        app_int = shim_add_app(*module_interface, int_name, funcptr);                                                  \
+    } while (0)
+
+/* 模拟拨号计划执行模块注册的应用 */
+static inline switch_status_t shim_app_execute(switch_core_session_t *session, const char *app, const char *data)
+{
+    if (!shim_module_interface)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+    for (switch_application_interface_t *a = shim_module_interface->application_interface; a; a = a->next)
+    {
+        if (!strcmp(a->interface_name, app))
+        {
+            a->application_function(session, data);
+            return SWITCH_STATUS_SUCCESS;
+        }
+    }
+    return SWITCH_STATUS_FALSE;
+}
+
+/* 调用已注册的模块API；未注册的命令（如show）返回失败 */
+static inline switch_status_t switch_api_execute(const char *cmd, const char *arg, switch_core_session_t *session,
+                                                 switch_stream_handle_t *stream)
+{
+    if (!shim_module_interface)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+    for (switch_api_interface_t *api = shim_module_interface->api_interface; api; api = api->next)
+    {
+        if (!strcmp(api->interface_name, cmd))
+        {
+            return api->function(arg, session, stream);
+        }
+    }
+    return SWITCH_STATUS_FALSE;
+}
+
+#define SWITCH_STANDARD_API(name)                                                                                      \
+    static switch_status_t name(const char *cmd, switch_core_session_t *session, switch_stream_handle_t *stream)
+
+#define SWITCH_STANDARD_APP(name) static void name(switch_core_session_t *session, const char *data)
+
+#define SWITCH_MODULE_LOAD_ARGS (switch_loadable_module_interface_t * *module_interface, switch_memory_pool_t * pool)
+#define SWITCH_MODULE_SHUTDOWN_ARGS (void)
+#define SWITCH_MODULE_LOAD_FUNCTION(name) switch_status_t name SWITCH_MODULE_LOAD_ARGS
+#define SWITCH_MODULE_SHUTDOWN_FUNCTION(name) switch_status_t name SWITCH_MODULE_SHUTDOWN_ARGS
+#define SWITCH_MODULE_DEFINITION(name, load, shutdown, runtime) static const char modname[] = #name
+
+#endif /* PIP_SHIM_SWITCH_H */
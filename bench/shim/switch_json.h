@@ -0,0 +1,489 @@
+/*
+ * FreeSWITCH Video Picture-in-Picture Module
+ * 压测用的 cJSON 最小子集（FreeSWITCH 通过 switch.h 引入 switch_json.h）
+ *
+ * 只实现模块用到的解析、查询、构造和无格式输出，接口与 cJSON 一致。
+ */
+
+#ifndef PIP_SHIM_SWITCH_JSON_H
+#define PIP_SHIM_SWITCH_JSON_H
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define cJSON_False (1 << 0)
+#define cJSON_True (1 << 1)
+#define cJSON_NULL (1 << 2)
+#define cJSON_Number (1 << 3)
+#define cJSON_String (1 << 4)
+#define cJSON_Array (1 << 5)
+#define cJSON_Object (1 << 6)
+
+typedef struct cJSON
+{
+    struct cJSON *next;
+    struct cJSON *prev;
+    struct cJSON *child;
+    int type;
+    char *valuestring;
+    int valueint;
+    double valuedouble;
+    char *string;
+} cJSON;
+
+#define cJSON_IsArray(item) ((item) && (item)->type == cJSON_Array)
+#define cJSON_IsObject(item) ((item) && (item)->type == cJSON_Object)
+#define cJSON_IsString(item) ((item) && (item)->type == cJSON_String)
+#define cJSON_IsNumber(item) ((item) && (item)->type == cJSON_Number)
+#define cJSON_IsTrue(item) ((item) && (item)->type == cJSON_True)
+#define cJSON_IsBool(item) ((item) && ((item)->type == cJSON_True || (item)->type == cJSON_False))
+#define cJSON_ArrayForEach(element, array) for (element = (array) ? (array)->child : NULL; element; element = element->next)
+
+static inline void cJSON_Delete(cJSON *item)
+{
+    while (item)
+    {
+        cJSON *next = item->next;
+
+        cJSON_Delete(item->child);
+        free(item->valuestring);
+        free(item->string);
+        free(item);
+        item = next;
+    }
+}
+
+static inline cJSON *shim_json_new(int type)
+{
+    cJSON *item = calloc(1, sizeof(cJSON));
+
+    if (item)
+    {
+        item->type = type;
+    }
+    return item;
+}
+
+static inline const char *shim_json_skip(const char *p)
+{
+    while (p && *p && isspace((unsigned char)*p))
+    {
+        p++;
+    }
+    return p;
+}
+
+static const char *shim_json_parse_value(cJSON *item, const char *p);
+
+static inline const char *shim_json_parse_string(char **out, const char *p)
+{
+    size_t len = 0, size = 16;
+    char *buf;
+
+    if (*p != '"' || !(buf = malloc(size)))
+    {
+        return NULL;
+    }
+    for (p++; *p && *p != '"'; p++)
+    {
+        char c = *p;
+
+        if (c == '\\')
+        {
+            p++;
+            switch (*p)
+            {
+            case 'n':
+                c = '\n';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case '\0':
+                free(buf);
+                return NULL;
+            default:
+                /* \uXXXX 不解码，测试数据只含ASCII转义 */
+                c = *p;
+                break;
+            }
+        }
+        if (len + 2 > size)
+        {
+            char *grown = realloc(buf, size *= 2);
+            if (!grown)
+            {
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+        }
+        buf[len++] = c;
+    }
+    if (*p != '"')
+    {
+        free(buf);
+        return NULL;
+    }
+    buf[len] = '\0';
+    *out = buf;
+    return p + 1;
+}
+
+static inline const char *shim_json_parse_container(cJSON *item, const char *p, int is_object)
+{
+    char close = is_object ? '}' : ']';
+    cJSON *last = NULL;
+
+    item->type = is_object ? cJSON_Object : cJSON_Array;
+    p = shim_json_skip(p + 1);
+    if (*p == close)
+    {
+        return p + 1;
+    }
+    for (;;)
+    {
+        cJSON *child = shim_json_new(0);
+
+        if (!child)
+        {
+            return NULL;
+        }
+        if (last)
+        {
+            last->next = child;
+            child->prev = last;
+        }
+        else
+        {
+            item->child = child;
+        }
+        last = child;
+
+        if (is_object)
+        {
+            p = shim_json_parse_string(&child->string, shim_json_skip(p));
+            if (!p || *(p = shim_json_skip(p)) != ':')
+            {
+                return NULL;
+            }
+            p++;
+        }
+        p = shim_json_parse_value(child, shim_json_skip(p));
+        if (!p)
+        {
+            return NULL;
+        }
+        p = shim_json_skip(p);
+        if (*p == ',')
+        {
+            p++;
+            continue;
+        }
+        return *p == close ? p + 1 : NULL;
+    }
+}
+
+static const char *shim_json_parse_value(cJSON *item, const char *p)
+{
+    if (!p)
+    {
+        return NULL;
+    }
+    if (!strncmp(p, "null", 4))
+    {
+        item->type = cJSON_NULL;
+        return p + 4;
+    }
+    if (!strncmp(p, "false", 5))
+    {
+        item->type = cJSON_False;
+        return p + 5;
+    }
+    if (!strncmp(p, "true", 4))
+    {
+        item->type = cJSON_True;
+        item->valueint = 1;
+        return p + 4;
+    }
+    if (*p == '"')
+    {
+        item->type = cJSON_String;
+        return shim_json_parse_string(&item->valuestring, p);
+    }
+    if (*p == '-' || isdigit((unsigned char)*p))
+    {
+        char *end;
+
+        item->type = cJSON_Number;
+        item->valuedouble = strtod(p, &end);
+        item->valueint = (int)item->valuedouble;
+        return end;
+    }
+    if (*p == '[' || *p == '{')
+    {
+        return shim_json_parse_container(item, p, *p == '{');
+    }
+    return NULL;
+}
+
+static inline cJSON *cJSON_Parse(const char *value)
+{
+    cJSON *root = shim_json_new(0);
+    const char *end;
+
+    if (!root)
+    {
+        return NULL;
+    }
+    end = shim_json_parse_value(root, shim_json_skip(value));
+    if (!end || *shim_json_skip(end))
+    {
+        cJSON_Delete(root);
+        return NULL;
+    }
+    return root;
+}
+
+static inline int cJSON_GetArraySize(const cJSON *array)
+{
+    int count = 0;
+
+    for (cJSON *c = array ? array->child : NULL; c; c = c->next)
+    {
+        count++;
+    }
+    return count;
+}
+
+static inline cJSON *cJSON_GetArrayItem(const cJSON *array, int index)
+{
+    cJSON *c = array ? array->child : NULL;
+
+    while (c && index-- > 0)
+    {
+        c = c->next;
+    }
+    return c;
+}
+
+static inline cJSON *cJSON_GetObjectItem(const cJSON *object, const char *string)
+{
+    for (cJSON *c = object ? object->child : NULL; c; c = c->next)
+    {
+        if (c->string && !strcasecmp(c->string, string))
+        {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+static inline cJSON *cJSON_CreateObject(void)
+{
+    return shim_json_new(cJSON_Object);
+}
+
+static inline cJSON *cJSON_CreateArray(void)
+{
+    return shim_json_new(cJSON_Array);
+}
+
+static inline cJSON *cJSON_CreateString(const char *string)
+{
+    cJSON *item = shim_json_new(cJSON_String);
+
+    if (item)
+    {
+        item->valuestring = strdup(string ? string : "");
+    }
+    return item;
+}
+
+static inline cJSON *cJSON_CreateNumber(double num)
+{
+    cJSON *item = shim_json_new(cJSON_Number);
+
+    if (item)
+    {
+        item->valuedouble = num;
+        item->valueint = (int)num;
+    }
+    return item;
+}
+
+static inline cJSON *cJSON_CreateBool(int b)
+{
+    return shim_json_new(b ? cJSON_True : cJSON_False);
+}
+
+static inline void cJSON_AddItemToArray(cJSON *array, cJSON *item)
+{
+    cJSON *c;
+
+    if (!array || !item)
+    {
+        return;
+    }
+    if (!(c = array->child))
+    {
+        array->child = item;
+        return;
+    }
+    while (c->next)
+    {
+        c = c->next;
+    }
+    c->next = item;
+    item->prev = c;
+}
+
+static inline void cJSON_AddItemToObject(cJSON *object, const char *string, cJSON *item)
+{
+    if (!item)
+    {
+        return;
+    }
+    free(item->string);
+    item->string = strdup(string);
+    cJSON_AddItemToArray(object, item);
+}
+
+#define cJSON_AddStringToObject(object, name, s) cJSON_AddItemToObject(object, name, cJSON_CreateString(s))
+#define cJSON_AddNumberToObject(object, name, n) cJSON_AddItemToObject(object, name, cJSON_CreateNumber(n))
+#define cJSON_AddBoolToObject(object, name, b) cJSON_AddItemToObject(object, name, cJSON_CreateBool(b))
+
+typedef struct shim_json_buffer
+{
+    char *data;
+    size_t len;
+    size_t size;
+} shim_json_buffer_t;
+
+static inline void shim_json_append(shim_json_buffer_t *buf, const char *s, size_t n)
+{
+    if (!buf->data)
+    {
+        return;
+    }
+    if (buf->len + n + 1 > buf->size)
+    {
+        size_t size = (buf->len + n + 1) * 2;
+        char *grown = realloc(buf->data, size);
+        if (!grown)
+        {
+            free(buf->data);
+            buf->data = NULL;
+            return;
+        }
+        buf->data = grown;
+        buf->size = size;
+    }
+    memcpy(buf->data + buf->len, s, n);
+    buf->len += n;
+    buf->data[buf->len] = '\0';
+}
+
+static inline void shim_json_print_string(shim_json_buffer_t *buf, const char *s)
+{
+    shim_json_append(buf, "\"", 1);
+    for (; *s; s++)
+    {
+        char esc[8];
+
+        if (*s == '"' || *s == '\\')
+        {
+            esc[0] = '\\';
+            esc[1] = *s;
+            shim_json_append(buf, esc, 2);
+        }
+        else if ((unsigned char)*s < 0x20)
+        {
+            snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*s);
+            shim_json_append(buf, esc, 6);
+        }
+        else
+        {
+            shim_json_append(buf, s, 1);
+        }
+    }
+    shim_json_append(buf, "\"", 1);
+}
+
+static inline void shim_json_print(shim_json_buffer_t *buf, const cJSON *item)
+{
+    char num[64];
+
+    switch (item->type)
+    {
+    case cJSON_NULL:
+        shim_json_append(buf, "null", 4);
+        break;
+    case cJSON_False:
+        shim_json_append(buf, "false", 5);
+        break;
+    case cJSON_True:
+        shim_json_append(buf, "true", 4);
+        break;
+    case cJSON_Number:
+        if (item->valuedouble == (double)item->valueint)
+        {
+            snprintf(num, sizeof(num), "%d", item->valueint);
+        }
+        else
+        {
+            snprintf(num, sizeof(num), "%g", item->valuedouble);
+        }
+        shim_json_append(buf, num, strlen(num));
+        break;
+    case cJSON_String:
+        shim_json_print_string(buf, item->valuestring);
+        break;
+    case cJSON_Array:
+    case cJSON_Object:
+        shim_json_append(buf, item->type == cJSON_Array ? "[" : "{", 1);
+        for (cJSON *c = item->child; c; c = c->next)
+        {
+            if (item->type == cJSON_Object)
+            {
+                shim_json_print_string(buf, c->string);
+                shim_json_append(buf, ":", 1);
+            }
+            shim_json_print(buf, c);
+            if (c->next)
+            {
+                shim_json_append(buf, ",", 1);
+            }
+        }
+        shim_json_append(buf, item->type == cJSON_Array ? "]" : "}", 1);
+        break;
+    default:
+        break;
+    }
+}
+
+static inline char *cJSON_PrintUnformatted(const cJSON *item)
+{
+    shim_json_buffer_t buf = {malloc(64), 0, 64};
+
+    if (buf.data)
+    {
+        buf.data[0] = '\0';
+        shim_json_print(&buf, item);
+    }
+    return buf.data;
+}
+
+#endif /* PIP_SHIM_SWITCH_JSON_H */
@@ -19,17 +19,232 @@
 #include <libswscale/swscale.h>
 #include <switch.h>
 #include <unistd.h> /* for access() */
+#include <sys/stat.h> /* for stat() */
 #include <string.h> /* for string functions */
 #include <math.h>   /* for fmod() */
 
+#include "video_pip_kernels.h"
+#include "video_pip_raw.h"
+#include "video_pip_shm.h"
+#include "video_pip_text.h"
+
 /* 模块声明 */
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_video_pip_shutdown);
 SWITCH_MODULE_LOAD_FUNCTION(mod_video_pip_load);
 SWITCH_MODULE_DEFINITION(mod_video_pip, mod_video_pip_load, mod_video_pip_shutdown, NULL);
 
+/* 处理阶段（用于耗时统计） */
+typedef enum
+{
+    PIP_STAGE_CAPTURE = 0, /* 复制远程视频帧 */
+    PIP_STAGE_DECODE,      /* 读取/解码本地视频帧 */
+    PIP_STAGE_SCALE,       /* 缩放远程视频 */
+    PIP_STAGE_BLEND,       /* 叠加 */
+    PIP_STAGE_ENCODE,      /* 编码并写入输出文件 */
+    PIP_STAGE_TOTAL,       /* 单帧总耗时 */
+    PIP_STAGE_COUNT
+} pip_stage_t;
+
+/* 单个阶段的耗时统计（微秒） */
+typedef struct pip_stage_stats
+{
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+} pip_stage_stats_t;
+
+/* 可累加的计数器集合，会话和模块汇总共用 */
+typedef struct pip_metrics
+{
+    uint64_t frames_captured;   /* 捕获的远程帧 */
+    uint64_t frames_decoded;    /* 解码的本地帧 */
+    uint64_t frames_composited; /* 完成叠加的帧 */
+    uint64_t frames_encoded;    /* 成功编码写入的帧 */
+    uint64_t frames_dropped;    /* 捕获后未能输出的帧 */
+    uint64_t encoder_bytes;     /* 编码器输出字节数 */
+    uint64_t decode_errors;     /* 本地视频解码错误 */
+    uint64_t scaler_rebuilds;   /* 缩放上下文重建次数 */
+    uint64_t frames_repeated;   /* 输出时钟：没有新远程帧、重复使用上一帧合成的输出帧 */
+    uint64_t frames_superseded; /* 输出时钟：两个节拍之间被更新的帧覆盖、未参与合成的远程帧 */
+    uint64_t clock_overruns;    /* 输出时钟：合成耗时超过节拍间隔而跳过的节拍 */
+    uint64_t rendition_frames;  /* 低分辨率码流编码写入的帧 */
+    uint64_t rendition_dropped; /* 低分辨率码流的编码线程来不及处理而跳过的帧 */
+    pip_stage_stats_t stages[PIP_STAGE_COUNT];
+} pip_metrics_t;
+
+/* 内存占用分类（字节数按类别记账） */
+typedef enum
+{
+    PIP_MEM_FRAMES = 0,   /* 模块分配的AVFrame缓冲区（缩放帧、输出帧、本地图片）及输出旁路帧环 */
+    PIP_MEM_REMOTE_IMAGE, /* 复制的远程视频switch_image_t */
+    PIP_MEM_DECODER,      /* 本地视频解码器及其输出帧（估算） */
+    PIP_MEM_ENCODER,      /* 输出编码器的参考帧和前瞻缓冲（估算） */
+    PIP_MEM_SESSION,      /* 会话结构体等内存池分配 */
+    PIP_MEM_COUNT
+} pip_mem_kind_t;
+
+/* 超出内存上限时对新会话的处理方式 */
+typedef enum
+{
+    PIP_MEM_CAP_REJECT = 0, /* 拒绝启动 */
+    PIP_MEM_CAP_DOWNGRADE   /* 降级启动：不创建录像编码器 */
+} pip_mem_cap_action_t;
+
+/* 输出时钟：决定何时合成输出帧以及输出帧的时间戳 */
+typedef enum
+{
+    PIP_OUTPUT_CLOCK_CFR = 0, /* 按output-fps定时合成，时间戳为节拍序号 */
+    PIP_OUTPUT_CLOCK_VFR,     /* 按output-fps定时检查，只在有新远程帧时合成，时间戳为实际时间 */
+    PIP_OUTPUT_CLOCK_ARRIVAL  /* 每个远程帧合成一次，时间戳为帧序号（不校正远程帧率） */
+} pip_output_clock_t;
+
+#define PIP_MAX_RENDITIONS 4 /* 除完整录像外最多的低分辨率码流数 */
+
+/* 模块配置（video_pip.conf） */
+typedef struct pip_config
+{
+    int pip_width;
+    int pip_height;
+    int pip_x;
+    int pip_y;
+    float pip_opacity;
+    pip_style_t style;         /* 新会话的默认窗口样式 */
+    uint64_t max_memory_bytes; /* 模块内存上限，0表示不限制 */
+    pip_mem_cap_action_t memory_cap_action;
+    switch_bool_t auto_start; /* 应答的视频通话自动启动PIP（可被通道变量覆盖） */
+    char local_file[512];     /* 未指定时使用的本地背景文件 */
+    int start_workers;        /* 异步启动工作线程数 */
+    int start_queue_size;     /* 异步启动队列容量，满时拒绝新任务 */
+    int encoder_pool_size;    /* 每个分辨率保持的空闲编码器数，0表示不启用预热池 */
+    char encoder_pool_profiles[256]; /* 预热的分辨率列表，如"1280x720,640x480" */
+    int animation_size_step;  /* 动画中PIP尺寸的量化步长（像素），跨过步长才重建缩放上下文 */
+    int shm_stall_ms;         /* 共享内存渲染源超过此时间没有新帧视为停滞 */
+    switch_bool_t output_tap; /* 新会话自动开启输出旁路 */
+    int output_tap_slots;     /* 输出旁路帧环的槽位数 */
+    pip_output_clock_t output_clock;
+    int output_fps;           /* 输出帧率，同时决定编码器时间基（可变帧率时除外）和关键帧间隔 */
+    float roi_qoffset;        /* PIP窗口作为感兴趣区域的量化偏移（-1到0，越小画质越高），0表示不启用 */
+    int rendition_heights[PIP_MAX_RENDITIONS]; /* 额外录制的低分辨率码流高度（renditions，如"360,180"） */
+    int rendition_count;
+    int snapshot_max_pending; /* 全模块同时处理的快照请求数，超出时拒绝 */
+    switch_bool_t subtitle_enabled; /* 在输出画面上叠加字幕 */
+    char subtitle_text[256];        /* 默认字幕，可被通道变量video_pip_subtitle覆盖，UTF-8 */
+    char subtitle_font[512];        /* 字体文件（TrueType/OpenType） */
+    int subtitle_font_size;         /* 字号（像素） */
+    uint8_t subtitle_color[3];      /* 文字颜色（Y、U、V） */
+    int subtitle_x;                 /* 文字外接矩形左上角在输出画面中的位置 */
+    int subtitle_y;
+    float subtitle_opacity;
+    pip_color_adjust_t color_adjust; /* <filters>中的brightness、contrast、saturation，新会话的背景调色 */
+    char background_image[512];      /* 叠在背景上的静态图片，空表示不使用 */
+    float background_opacity;
+    pip_blend_mode_t background_blend_mode;
+} pip_config_t;
+
+/* 运行期可调整的布局参数，mask标明哪些字段有效 */
+#define PIP_LAYOUT_X (1 << 0)
+#define PIP_LAYOUT_Y (1 << 1)
+#define PIP_LAYOUT_OPACITY (1 << 2)
+#define PIP_LAYOUT_WIDTH (1 << 3)
+#define PIP_LAYOUT_HEIGHT (1 << 4)
+#define PIP_LAYOUT_ANCHOR (1 << 5)
+#define PIP_LAYOUT_DURATION (1 << 6) /* 以动画过渡到目标布局 */
+#define PIP_LAYOUT_EASING (1 << 7)
+#define PIP_LAYOUT_BORDER (1 << 8) /* 窗口样式，修改后重算遮罩 */
+#define PIP_LAYOUT_BORDER_COLOR (1 << 9)
+#define PIP_LAYOUT_RADIUS (1 << 10)
+#define PIP_LAYOUT_FEATHER (1 << 11)
+#define PIP_LAYOUT_STYLE (PIP_LAYOUT_BORDER | PIP_LAYOUT_BORDER_COLOR | PIP_LAYOUT_RADIUS | PIP_LAYOUT_FEATHER)
+#define PIP_LAYOUT_BRIGHTNESS (1 << 12) /* 背景调色，修改后重建查找表 */
+#define PIP_LAYOUT_CONTRAST (1 << 13)
+#define PIP_LAYOUT_SATURATION (1 << 14)
+#define PIP_LAYOUT_COLOR (PIP_LAYOUT_BRIGHTNESS | PIP_LAYOUT_CONTRAST | PIP_LAYOUT_SATURATION)
+#define PIP_LAYOUT_MARGIN 10 /* 按角落定位时与画面边缘的距离 */
+#define DEFAULT_PIP_ANIMATION_SIZE_STEP 16
+#define DEFAULT_PIP_SHM_STALL_MS 1000
+#define PIP_SHM_TORN_RETRIES 2 /* 共享内存帧撕裂时改用最新槽位重新合成的次数 */
+#define PIP_SHM_SOURCE_PREFIX "shm:"
+#define DEFAULT_PIP_OUTPUT_TAP_SLOTS 4
+#define PIP_OUTPUT_TAP_NAME_PREFIX "/video_pip_" /* 未指定名称时为 /video_pip_<uuid> */
+#define DEFAULT_PIP_OUTPUT_FPS PIP_OUTPUT_FPS
+#define PIP_MAX_OUTPUT_FPS 120
+#define PIP_OUTPUT_VFR_TIME_BASE 1000   /* 可变帧率的时间戳单位：毫秒 */
+#define PIP_OUTPUT_VFR_MAX_GAP_MS 1000  /* 可变帧率下远程视频停顿时，至少按此间隔输出一帧 */
+#define DEFAULT_PIP_ROI_QOFFSET -0.1f   /* libx264按51倍换算，约为窗口内QP降低5 */
+#define PIP_RENDITION_MIN_BITRATE 100000 /* 码流码率按像素数从PIP_OUTPUT_BITRATE折算，不低于此值 */
+#define DEFAULT_PIP_SNAPSHOT_WIDTH 320
+#define DEFAULT_PIP_SNAPSHOT_MAX_PENDING 4
+#define PIP_MAX_SNAPSHOT_PENDING 64
+#define PIP_SNAPSHOT_TIMEOUT_MS 3000 /* 等待下一次合成和编码的最长时间 */
+#define PIP_SNAPSHOT_JPEG_QSCALE 4   /* MJPEG量化参数（2-31，越小画质越高） */
+#define DEFAULT_PIP_SUBTITLE_FONT "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf"
+#define DEFAULT_PIP_SUBTITLE_FONT_SIZE 24
+#define DEFAULT_PIP_SUBTITLE_COLOR 0xFFFFFF
+#define DEFAULT_PIP_BACKGROUND_OPACITY 1.0f
+
+/* 按角落定位：在新尺寸生效后计算x/y */
+typedef enum
+{
+    PIP_ANCHOR_TOP_LEFT = 0,
+    PIP_ANCHOR_TOP_RIGHT,
+    PIP_ANCHOR_BOTTOM_LEFT,
+    PIP_ANCHOR_BOTTOM_RIGHT,
+    PIP_ANCHOR_CENTER
+} pip_anchor_t;
+
+/* 动画缓动曲线 */
+typedef enum
+{
+    PIP_EASING_LINEAR = 0,
+    PIP_EASING_EASE_IN,
+    PIP_EASING_EASE_OUT,
+    PIP_EASING_EASE_IN_OUT
+} pip_easing_t;
+
+typedef struct pip_layout
+{
+    int x;
+    int y;
+    float opacity;
+    int width;
+    int height;
+    pip_anchor_t anchor;
+    int duration_ms;
+    pip_easing_t easing;
+    pip_style_t style;
+    pip_color_adjust_t color;
+} pip_layout_t;
+
+/* 一个完整的PIP状态，动画在两个状态之间插值 */
+typedef struct pip_geometry
+{
+    float x;
+    float y;
+    float width;
+    float height;
+    float opacity;
+} pip_geometry_t;
+
+/* 进行中的过渡动画，只在媒体线程中读写 */
+typedef struct pip_animation
+{
+    switch_bool_t active;
+    pip_easing_t easing;
+    switch_time_t start;
+    switch_time_t duration; /* 微秒 */
+    pip_geometry_t from;
+    pip_geometry_t to;
+} pip_animation_t;
+
 /* 简化的画中画会话数据 */
 typedef struct pip_session_data
 {
+    /* 注册表条目：会话数据分配在自己的内存池中，最后一个引用释放时销毁，
+     * 因此可以比通话本身存活得更久；session/channel只在通话存活期间有效 */
+    char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+    switch_memory_pool_t *pool;
+    uint32_t refs;          /* 引用计数（原子操作） */
+    switch_bool_t cleaned;  /* 资源已释放，受mutex保护 */
     switch_core_session_t *session;
     switch_channel_t *channel;
 
@@ -41,10 +256,14 @@ typedef struct pip_session_data
     int pip_x;
     int pip_y;
     float pip_opacity;
+    pip_style_t style;
+    pip_alpha_mask_t alpha_mask;    /* 按pip_width x pip_height和style预先计算，只在媒体线程中使用 */
+    switch_bool_t alpha_mask_dirty; /* 样式已修改，下一次叠加前重算遮罩 */
 
     /* 远程视频参数（动态检测） */
     int remote_width;
     int remote_height;
+    enum AVPixelFormat remote_format; /* 缩放上下文按此格式直接读取远程图像，格式转换与缩放同一遍完成 */
 
     /* FFmpeg处理上下文 */
     struct SwsContext *sws_ctx_pip; /* 用于缩放PIP视频 */
@@ -52,12 +271,61 @@ typedef struct pip_session_data
     AVFrame *frame_pip;             /* 远程视频帧 */
     AVFrame *frame_pip_scaled;      /* 缩放后的远程视频帧 */
     AVFrame *frame_output;          /* 输出帧 */
+    AVFrame *frame_main_yuv;        /* 本地视频解码为其他格式时转换后的YUV420P帧 */
+    struct SwsContext *sws_ctx_main;
+    uint64_t main_converted_frame;  /* frame_main_yuv对应的本地帧序号，同一本地帧只转换一次 */
+
+    /* 背景调色和背景图层：查找表只在参数变化时重建，图层系数启动时从模块共用的缓存取得；
+     * 每个本地帧处理一次写入frame_main_graded，输出时钟重复合成同一本地帧时直接复用 */
+    pip_color_adjust_t color_adjust;
+    pip_color_lut_t color_lut;
+    switch_bool_t color_lut_dirty;
+    struct pip_background *background;
+    AVFrame *frame_main_graded;
+    uint64_t main_graded_frame; /* frame_main_graded对应的本地帧序号 */
 
     /* 本地视频文件处理 */
     AVFormatContext *local_fmt_ctx;  /* 本地MP4文件格式上下文 */
     AVCodecContext *local_codec_ctx; /* 本地视频解码器 */
     int local_video_stream_index;    /* 本地视频流索引 */
     AVPacket *local_packet;          /* 本地视频包 */
+    int local_loop_retries;          /* 循环播放时连续seek重试次数 */
+    struct pip_raw_source *raw_source; /* 预解码背景文件，frame_main直接指向其映射，不经过解码器 */
+
+    /* 共享内存渲染源（本地文件为"shm:<名称>"时）：frame_main直接指向帧环中的最新帧，只在媒体线程中使用 */
+    pip_shm_ring_t shm_ring;
+    char shm_name[256];
+    uint64_t shm_seq;               /* frame_main当前指向的帧号，0表示还没有帧 */
+    switch_time_t shm_last_frame;   /* 最近一次取到新帧的时间 */
+    switch_time_t shm_last_reopen;  /* 停滞期间最近一次尝试重新打开帧环的时间 */
+    switch_bool_t shm_stalled;
+    uint64_t shm_stalls;            /* 进入停滞的次数 */
+    uint64_t shm_torn;              /* 叠加期间被写入方覆盖的帧数 */
+    uint64_t shm_torn_dropped;      /* 重试后仍撕裂、没有发布和编码的节拍数 */
+
+    struct pip_output_tap *output_tap; /* 输出旁路，受frame_mutex保护 */
+
+    /* 低分辨率码流（配置renditions）：与录像一同打开和关闭，数组受frame_mutex保护；
+     * 下面两个计数器由各码流的编码线程原子累加 */
+    struct pip_rendition *renditions[PIP_MAX_RENDITIONS];
+    int rendition_count;
+    uint64_t rendition_frames;
+    uint64_t rendition_dropped;
+
+    /* 快照请求链：API线程原子压入，合成线程在下一次合成前整条取走，同一帧服务链上全部请求 */
+    struct pip_snapshot *snapshot_request;
+    uint64_t snapshots; /* 已交给快照线程的请求数，受frame_mutex保护 */
+
+    /* 字幕遮罩，启动时从模块的文字缓存取得，清理时归还；遮罩内容不变，合成线程直接读取 */
+    pip_text_t *subtitle;
+
+    /* 共享合成（通道变量video_pip_share）：跟随者不捕获、不合成、不编码，录像由组长的编码包扇出写入。
+     * share_group只在持有frame_mutex时（或登记之前）修改；下面三个字段加入组后只由组长线程在组的mutex下修改 */
+    char share_name[128];
+    struct pip_share_group *share_group;
+    switch_bool_t share_synced; /* 跟随者已从关键帧开始写入 */
+    int64_t share_dts_base;     /* 跟随者录像时间戳相对组长编码器的偏移 */
+    uint64_t share_packets;     /* 跟随者写入的扇出包数 */
 
     /* 本地图片处理 */
     AVFrame *local_image_frame;   /* 本地图片帧 */
@@ -71,6 +339,8 @@ typedef struct pip_session_data
     AVPacket *output_packet;          /* 输出视频包 */
     char output_filename[256];        /* 输出文件名 */
     int64_t output_pts;               /* 输出视频PTS计数器 */
+    int64_t output_pts_base;          /* 借用的预热编码器已用到的PTS，送入编码器时加上、取出的包减去 */
+    switch_bool_t output_force_key;   /* 借用的预热编码器：下一帧强制为关键帧，录像从IDR开始 */
 
     /* 媒体钩子 */
     switch_media_bug_t *read_bug; /* 读取远程视频 */
@@ -83,24 +353,81 @@ typedef struct pip_session_data
     switch_mutex_t *mutex;
     switch_bool_t active;
 
+    /* 输出时钟线程（output-clock为cfr/vfr时）：持有frame_mutex合成和编码，媒体钩子只保存远程帧。
+     * 下面的字段只由时钟线程读写 */
+    switch_thread_t *clock_thread;
+    uint64_t clock_remote_seen;     /* 上一次合成时的remote_frames_count */
+    switch_time_t clock_last_output; /* 上一次合成距第一帧的时间（微秒） */
+
     /* 统计 */
     uint64_t frames_processed;
     uint64_t remote_frames_count;
     uint64_t local_frames_count;
+    uint64_t frames_composited;
+    uint64_t frames_dropped;
+    uint64_t encoder_bytes;
+    uint64_t decode_errors;
+    uint64_t scaler_rebuilds;
+    uint64_t frames_repeated;
+    uint64_t frames_superseded;
+    uint64_t clock_overruns;
+    pip_stage_stats_t stage_stats[PIP_STAGE_COUNT];
+    switch_bool_t metrics_retired; /* 计数器已并入模块汇总 */
+
+    /* 内存记账（只由会话自身的线程修改，读取方得到近似快照） */
+    uint64_t mem_bytes[PIP_MEM_COUNT];
+    switch_bool_t mem_downgraded; /* 因内存上限降级，未创建编码器 */
+
+    /* 待生效的布局修改：命令线程写入，媒体线程在下一帧开始时应用 */
+    switch_mutex_t *layout_mutex;
+    pip_layout_t pending_layout;
+    uint32_t pending_layout_mask; /* 原子读取，非零表示有待生效的修改 */
+    pip_animation_t animation;
+    int scaled_capacity_width; /* frame_pip_scaled实际分配的尺寸，缩小时原地复用 */
+    int scaled_capacity_height;
+    uint64_t scaled_capacity_bytes; /* 按分配尺寸计的缓冲区大小，内存记账用；帧宽高只是当前显示尺寸 */
 
     /* 帧率同步 */
     double local_fps;        /* 本地视频文件的帧率 */
     double target_fps;       /* 目标输出帧率 */
+    uint64_t sync_frames;    /* 已输出的帧位置（按target_fps）：含当前帧：按到达合成时为远程帧数，输出时钟下为节拍序号加1 */
     double local_frame_time; /* 本地视频每帧对应的时间间隔 */
     double current_time;     /* 当前处理的时间位置 */
     double last_local_time;  /* 上次读取本地帧的时间 */
 } pip_session_data_t;
 
+/* 会话注册表的不可变快照 */
+typedef struct pip_registry_snapshot
+{
+    int count;
+    pip_session_data_t *sessions[];
+} pip_registry_snapshot_t;
+
+/* 会话注册表
+ * 写入方串行化在write_mutex上，替换快照后翻转纪元并等待旧纪元的读取方退出；
+ * 读取方不加锁，只在当前纪元对应的计数器上登记 */
+typedef struct pip_registry
+{
+    switch_mutex_t *write_mutex;
+    pip_registry_snapshot_t *current;
+    uint32_t epoch;
+    uint32_t readers[2];
+} pip_registry_t;
+
 /* 全局变量 */
-// 全局内存池、互斥锁和会话哈希表
+// 全局内存池和会话注册表
 static switch_memory_pool_t *module_pool = NULL;
-static switch_mutex_t *module_mutex = NULL;
-static switch_hash_t *session_pip_map = NULL;
+static pip_registry_t pip_registry;
+
+/* 已结束会话的累计计数器，保证模块级计数单调递增 */
+static switch_mutex_t *metrics_mutex = NULL;
+static pip_metrics_t retired_metrics;
+static uint64_t sessions_started_total = 0;
+
+/* 模块内存记账，与上面的计数器共用metrics_mutex */
+static uint64_t pip_mem_total = 0;
+static uint64_t sessions_rejected_total = 0;
+static uint64_t sessions_downgraded_total = 0;
 
 /* 默认参数 */
 #define DEFAULT_PIP_WIDTH 320
@@ -108,20 +435,395 @@ static switch_hash_t *session_pip_map = NULL;
 #define DEFAULT_PIP_X 10
 #define DEFAULT_PIP_Y 10
 #define DEFAULT_PIP_OPACITY 0.8f
+#define DEFAULT_PIP_BORDER_WIDTH 3
+#define DEFAULT_PIP_BORDER_COLOR 0x000000 /* 0xRRGGBB */
+
+/* 配置文件名（conf/autoload_configs/video_pip.conf.xml） */
+#define PIP_CONFIG_FILE "video_pip.conf"
+
+/* 编解码器内存估算：内部帧按四周填充后的尺寸计算 */
+#define PIP_MEM_CODEC_PADDING 64
+#define PIP_MEM_DECODER_FRAMES 6 /* 参考帧 + 重排序 + 输出帧 */
+#define PIP_MEM_ENCODER_FRAMES 4 /* 参考帧 + B帧 + 当前帧 + 重建帧（zerolatency无前瞻） */
+
+static pip_config_t pip_config;
+
+/* 未配置local-file时的本地背景文件 */
+#ifndef PIP_DEFAULT_LOCAL_FILE
+#define PIP_DEFAULT_LOCAL_FILE "/home/white/桌面/freeswitch-video-pip-module/test_pictures/test.jpg"
+#endif
+
+/* 通道变量：在拨号计划中于应答前设置，例如
+ *   <action application="set" data="video_pip_auto_start=true"/>
+ *   <action application="set" data="video_pip_file=/path/to/background.mp4"/> */
+#define PIP_VAR_AUTO_START "video_pip_auto_start"
+#define PIP_VAR_FILE "video_pip_file"
+#define PIP_VAR_JOB_UUID "video_pip_job_uuid" /* 拨号计划应用提交的异步启动任务ID */
+#define PIP_VAR_SHARE "video_pip_share"       /* 共享合成组名，见pip_share_group_t */
+#define PIP_VAR_SUBTITLE "video_pip_subtitle" /* 本通话的字幕，覆盖配置subtitle-text */
+
+/* 应答事件订阅：记录最近应答的视频通话（供不带UUID的video_pip_start使用），
+ * 并按通道变量或配置自动启动PIP；挂断事件把通话从记录中移除 */
+#define PIP_RECENT_VIDEO_CALLS 8 /* 记录的最近应答视频通话数，挂断后回退到下一个仍在进行的通话 */
+static switch_event_node_t *pip_answer_node = NULL;
+static switch_event_node_t *pip_hangup_node = NULL;
+static switch_mutex_t *pip_event_mutex = NULL;
+static char pip_recent_video_uuids[PIP_RECENT_VIDEO_CALLS][SWITCH_UUID_FORMATTED_LENGTH + 1]; /* 最近应答的在前 */
+static int pip_recent_video_count = 0;
+static uint32_t pip_shutting_down = 0; /* 模块卸载中，不再接受新的启动任务（原子操作） */
+
+/* 异步启动任务：video_pip_start_async、拨号计划应用video_pip和应答自动启动共用，
+ * 由固定数量的工作线程完成打开文件、解码器、编码器等耗时初始化，结束时发出完成事件 */
+typedef struct pip_start_job
+{
+    switch_memory_pool_t *pool;
+    char job_uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+    char *uuid;
+    char *local_file;
+    struct pip_batch *batch; /* 批量启动：只做准备，结果写回batch->items[index] */
+    int index;
+} pip_start_job_t;
+
+/* 批量命令（video_pip_batch）：先全部停止，再全部启动，最后应用布局修改；
+ * 停止和启动各只发布一次注册表快照，启动的耗时准备在启动工作线程上并行完成 */
+typedef enum
+{
+    PIP_BATCH_STOP = 0,
+    PIP_BATCH_START,
+    PIP_BATCH_UPDATE
+} pip_batch_op_t;
+
+typedef struct pip_batch_item
+{
+    pip_batch_op_t op;
+    char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+    char local_file[512];
+    pip_layout_t layout;
+    uint32_t layout_mask;
+    pip_session_data_t *pip_data;
+    switch_status_t status;
+    char err[256];
+} pip_batch_item_t;
+
+typedef struct pip_batch
+{
+    pip_batch_item_t *items;
+    int count;
+    switch_mutex_t *mutex;
+    switch_thread_cond_t *cond;
+    int pending; /* 尚未完成准备的启动项，受mutex保护 */
+} pip_batch_t;
+
+#define PIP_BATCH_MAX_ITEMS 1024
+
+#define PIP_EVENT_START_RESULT "video_pip::start_result"
+#define PIP_MAX_START_WORKERS 16
+#define DEFAULT_PIP_START_WORKERS 2
+#define DEFAULT_PIP_START_QUEUE_SIZE 256
+
+static switch_queue_t *pip_start_queue = NULL;
+static switch_mutex_t *pip_start_mutex = NULL; /* 入队与停止工作线程互斥，卸载标记的检查和入队不可分割 */
+static switch_thread_t *pip_start_workers[PIP_MAX_START_WORKERS];
+static int pip_start_worker_count = 0;
+
+/* 编码器预热池：按分辨率预先打开的H264编码器，会话启动时借出、停止时重置后归还，
+ * 后台线程把空闲数量补足到encoder-pool-size */
+#define PIP_MAX_ENCODER_PROFILES 8
+#define PIP_MAX_ENCODER_POOL_SIZE 16
+#define DEFAULT_PIP_ENCODER_POOL_PROFILES "1280x720"
+
+typedef struct pip_encoder_profile
+{
+    int width;
+    int height;
+    AVCodecContext *idle[PIP_MAX_ENCODER_POOL_SIZE];
+    int64_t idle_pts[PIP_MAX_ENCODER_POOL_SIZE]; /* 各空闲编码器下一帧可用的PTS（编码器要求PTS递增） */
+    int idle_count;
+    switch_bool_t failed; /* 打开失败后不再补充，避免后台线程空转 */
+} pip_encoder_profile_t;
+
+typedef struct pip_encoder_pool
+{
+    pip_encoder_profile_t profiles[PIP_MAX_ENCODER_PROFILES];
+    int profile_count;
+    switch_mutex_t *mutex;
+    switch_thread_cond_t *cond; /* 借出后唤醒补充线程 */
+    switch_thread_t *thread;
+    switch_bool_t running;
+    uint64_t hits;     /* 借到预热编码器的次数 */
+    uint64_t misses;   /* 池中无空闲、现场打开的次数 */
+    uint64_t recycled; /* 停止时重置归还的次数 */
+} pip_encoder_pool_t;
+
+static pip_encoder_pool_t pip_encoder_pool;
+
+/* 预解码背景文件的共享映射：同一路径的会话共用一份映射，最后一个使用者释放时解除映射。
+ * 文件被替换（inode或修改时间变化）后旧映射标记为stale，新会话重新映射 */
+typedef struct pip_raw_source
+{
+    char path[512];
+    pip_raw_file_t file;
+    int refs;
+    switch_bool_t stale;
+    struct pip_raw_source *next;
+} pip_raw_source_t;
+
+static switch_mutex_t *pip_raw_mutex = NULL;
+static pip_raw_source_t *pip_raw_sources = NULL;
+
+/* 输出旁路：合成后的frame_output逐帧发布到共享内存帧环（格式见video_pip_shm.h），
+ * 同机的分析、预览等进程随时挂上或离开，读取慢的进程只会跳帧，不会阻塞合成 */
+typedef struct pip_output_tap
+{
+    char name[256];
+    pip_shm_ring_t ring;
+    uint64_t published;
+} pip_output_tap_t;
+
+/* 低分辨率码流：合成线程把frame_output缩放一次写入fill，与pending交换后唤醒编码线程；
+ * 编码线程取走pending换成work后在锁外编码。编码线程来不及时新帧替换尚未取走的pending，合成线程从不等待 */
+typedef struct pip_rendition
+{
+    pip_session_data_t *owner;
+    int width;
+    int height;
+    char filename[512];
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *codec_ctx;
+    AVStream *stream;
+    AVPacket *packet; /* 文件头写入成功后才分配，关闭时据此决定是否写文件尾 */
+    struct SwsContext *sws_ctx;
+    AVFrame *fill;    /* 合成线程写入 */
+    AVFrame *pending; /* 等待编码，受mutex保护 */
+    AVFrame *work;    /* 编码线程正在编码 */
+    switch_bool_t has_pending;
+    switch_bool_t stopping;
+    switch_bool_t failed; /* 编码或写入出错后不再提交 */
+    switch_mutex_t *mutex;
+    switch_thread_cond_t *cond;
+    switch_thread_t *thread;
+    uint64_t frames;
+    uint64_t dropped;
+} pip_rendition_t;
+
+/* 快照（video_pip_snapshot）：合成线程把上一次合成的frame_output整帧交给请求，自己换用新缓冲区，
+ * 不复制像素；缩放和JPEG/PNG编码在快照线程上完成。请求方与合成线程/快照线程各持有一个引用 */
+typedef struct pip_snapshot
+{
+    struct pip_snapshot *next; /* 会话请求链中的下一个 */
+    switch_memory_pool_t *pool;
+    switch_mutex_t *mutex;
+    switch_thread_cond_t *cond;
+    int refs;             /* 原子操作，归零时销毁pool */
+    int width;            /* 目标宽度，高度按输出画面宽高比计算 */
+    switch_bool_t png;    /* 否则为JPEG */
+    char path[512];       /* 为空时把图片以base64返回给调用方 */
+    AVFrame *frame;       /* 合成线程交出的输出帧 */
+    char *base64;         /* 编码结果（base64模式），从pool分配 */
+    int out_width;
+    int out_height;
+    size_t bytes;         /* 编码后的图片字节数 */
+    switch_bool_t abandoned; /* 请求方已超时返回，受mutex保护 */
+    switch_bool_t done;   /* 以下字段受mutex保护 */
+    switch_status_t status;
+    char err[256];
+} pip_snapshot_t;
+
+static switch_queue_t *pip_snapshot_queue = NULL;
+static switch_thread_t *pip_snapshot_thread_handle = NULL;
+static int pip_snapshot_pending = 0; /* 已接受、尚未完成的快照请求数（原子操作） */
+
+/* 共享合成组：观看同一远程源的多路通话由拨号计划设置相同的video_pip_share，
+ * 背景文件、主画面尺寸和PIP布局也相同的会话只由组长做解码、缩放、叠加和编码，
+ * 组长的每个编码包扇出写入全部跟随者的录像文件。组长离开或跟随者修改布局时，
+ * 跟随者在自己的下一帧转为独立合成。组表、组长和引用计数受pip_share_mutex保护；成员表和跟随者的录像输出
+ * 受组自己的mutex保护，扇出写文件时不阻塞其他组和状态查询。两把锁都要持有时先取pip_share_mutex */
+typedef struct pip_share_group
+{
+    char key[1024];               /* 组名|背景文件|主画面尺寸|布局|样式，见pip_share_key */
+    switch_memory_pool_t *pool;   /* 组自己的内存池，只用于mutex，随组释放 */
+    switch_mutex_t *mutex;        /* 保护members和跟随者的录像输出 */
+    pip_session_data_t *leader;   /* 组长离开后为NULL（原子读取） */
+    switch_bool_t joinable;       /* 组长修改布局后不再接受按原布局加入的会话 */
+    AVRational time_base;         /* 组长编码包的时间基 */
+    pip_session_data_t **members; /* 跟随者，增删时两把锁都持有，只持其中一把即可读取 */
+    int member_count;
+    int member_capacity;
+    int refs; /* 组长和跟随者各一个 */
+    uint64_t packets; /* 组长扇出的编码包数（原子操作） */
+    struct pip_share_group *next;
+} pip_share_group_t;
+
+static switch_mutex_t *pip_share_mutex = NULL;
+static pip_share_group_t *pip_share_groups = NULL;
+
+/* 字幕：全模块共用一个字体（字形图集）和文字遮罩缓存，内容相同的会话共用同一个遮罩。
+ * 只在会话启动和清理时持pip_text_mutex取得、归还遮罩，合成时不加锁 */
+static pip_text_cache_t pip_text_cache;
+static switch_mutex_t *pip_text_mutex = NULL;
+
+/* 背景图层：background-image在模块加载时解码一次，按背景尺寸缩放并预先算好混合系数，尺寸相同的会话共用。
+ * 只在会话启动和清理时持pip_background_mutex取得、归还，系数不变，合成时不加锁 */
+typedef struct pip_background
+{
+    pip_blend_layer_t layer;
+    int refs;
+    struct pip_background *next;
+} pip_background_t;
+
+static AVFrame *pip_background_image = NULL; /* 原始尺寸，YUV420P */
+static pip_background_t *pip_backgrounds = NULL;
+static switch_mutex_t *pip_background_mutex = NULL;
+
+/* 输出录像目录（文件名为 output_pip_<时间>_<uuid>.mp4） */
+#ifndef PIP_DEFAULT_OUTPUT_DIR
+#define PIP_DEFAULT_OUTPUT_DIR "/home/white/桌面/freeswitch-video-pip-module"
+#endif
+static char pip_output_dir[512] = PIP_DEFAULT_OUTPUT_DIR;
 
 /* 函数声明 */
 static switch_status_t read_local_video_frame(pip_session_data_t *pip_data);
 static switch_status_t load_local_image(pip_session_data_t *pip_data, const char *image_file);
 static switch_status_t init_local_video_file(pip_session_data_t *pip_data, const char *video_file);
+static switch_status_t init_raw_video_file(pip_session_data_t *pip_data, const char *raw_file);
+static switch_bool_t pip_local_source_accessible(const char *local_file);
+static switch_status_t init_shm_video_source(pip_session_data_t *pip_data, const char *name);
+static void read_shm_video_frame(pip_session_data_t *pip_data);
+static switch_bool_t pip_shm_reopen(pip_session_data_t *pip_data);
+static switch_status_t pip_output_tap_start(pip_session_data_t *pip_data, const char *name, int slots, char *err,
+                                            switch_size_t errlen);
+static void pip_output_tap_stop(pip_session_data_t *pip_data);
+static void pip_output_tap_free(pip_output_tap_t *tap);
+static void pip_output_tap_publish(pip_session_data_t *pip_data);
+static void read_raw_video_frame(pip_session_data_t *pip_data, uint64_t n);
+static pip_raw_source_t *pip_raw_source_acquire(const char *path, int *err);
+static void pip_raw_source_release(pip_raw_source_t *source);
 static switch_status_t init_output_video_file(pip_session_data_t *pip_data, const char *output_file);
+static switch_status_t init_share_output_file(pip_session_data_t *pip_data, const char *output_file,
+                                              const AVCodecParameters *par);
+static void pip_output_path(pip_session_data_t *pip_data, const char *suffix, char *path, switch_size_t len);
+static void pip_output_close(pip_session_data_t *pip_data);
+static void pip_share_key(pip_session_data_t *pip_data, const char *local_file, char *key, switch_size_t len);
+static switch_status_t pip_share_join(pip_session_data_t *pip_data, const char *key, const char *output_file);
+static void pip_share_lead(pip_session_data_t *pip_data, const char *key);
+static void pip_share_leave(pip_session_data_t *pip_data);
+static void pip_share_fanout(pip_session_data_t *pip_data, const AVPacket *packet);
+static switch_bool_t pip_share_follow(pip_session_data_t *pip_data);
+static AVRational pip_output_time_base(void);
+static void pip_output_timing_configure(AVCodecContext *codec_ctx);
+static void pip_output_roi_configure(AVCodecContext *codec_ctx);
+static void pip_output_roi_update(pip_session_data_t *pip_data);
+static void pip_rendition_size(int main_width, int main_height, int height, int *width_out, int *height_out);
+static uint64_t pip_mem_encoder_estimate(int width, int height);
+static pip_rendition_t *pip_rendition_open(pip_session_data_t *pip_data, int width, int height, const char *filename);
+static void pip_rendition_free(pip_rendition_t *rendition);
+static switch_status_t pip_rendition_encode(pip_rendition_t *rendition, const AVFrame *frame);
+static void *SWITCH_THREAD_FUNC pip_rendition_thread(switch_thread_t *thread, void *obj);
+static void pip_renditions_open(pip_session_data_t *pip_data, const char *output_file);
+static void pip_renditions_submit(pip_session_data_t *pip_data);
+static void pip_renditions_close(pip_session_data_t *pip_data);
+static switch_status_t pip_clock_start(pip_session_data_t *pip_data);
+static void pip_clock_stop(pip_session_data_t *pip_data);
+static void *SWITCH_THREAD_FUNC pip_clock_thread(switch_thread_t *thread, void *obj);
+static void pip_clock_tick(pip_session_data_t *pip_data, uint64_t tick, switch_time_t elapsed);
+static switch_status_t pip_snapshot_request(pip_session_data_t *pip_data, pip_snapshot_t *snapshot);
+static void pip_snapshot_serve(pip_session_data_t *pip_data);
+static void pip_snapshot_finish(pip_snapshot_t *snapshot, switch_status_t status, const char *err);
+static void pip_snapshot_fail_all(pip_snapshot_t *list, const char *err);
+static void pip_snapshot_release(pip_snapshot_t *snapshot);
+static switch_status_t pip_snapshot_encode(pip_snapshot_t *snapshot);
+static void *SWITCH_THREAD_FUNC pip_snapshot_thread(switch_thread_t *thread, void *obj);
+static switch_status_t pip_snapshot_start(void);
+static void pip_snapshot_stop(void);
+static switch_status_t pip_color_parse(const char *value, uint8_t yuv[3]);
+static void pip_subtitle_start(void);
+static void pip_subtitle_stop(void);
+static void pip_subtitle_acquire(pip_session_data_t *pip_data);
+static void pip_subtitle_release(pip_session_data_t *pip_data);
+static switch_status_t pip_image_decode(const char *image_file, AVFrame **frame);
+static void pip_background_start(void);
+static void pip_background_stop(void);
+static void pip_background_acquire(pip_session_data_t *pip_data);
+static void pip_background_release(pip_session_data_t *pip_data);
+static void pip_output_frame_set_key(AVFrame *frame, switch_bool_t key);
+static void pip_output_packet_unbase(pip_session_data_t *pip_data, AVPacket *packet);
 static switch_status_t write_output_frame(pip_session_data_t *pip_data);
 static switch_status_t flush_encoder(pip_session_data_t *pip_data);
 static switch_status_t process_pip_overlay(pip_session_data_t *pip_data);
 static switch_status_t convert_and_overlay_frames(pip_session_data_t *pip_data);
+static enum AVPixelFormat pip_img_fmt_to_av(switch_img_fmt_t fmt, int *planes);
+static uint64_t pip_img_bytes(const switch_image_t *img);
+static switch_status_t pip_frame_to_yuv420p(struct SwsContext **sws_ctx, const AVFrame *src, AVFrame **dst);
+static switch_status_t pip_composite_frame(pip_session_data_t *pip_data, AVFrame *main_frame);
+static AVFrame *pip_main_frame(pip_session_data_t *pip_data);
+static AVFrame *pip_main_frame_graded(pip_session_data_t *pip_data, AVFrame *main_frame);
 static switch_status_t init_pip_context(pip_session_data_t *pip_data, const char *local_video_file);
-static void overlay_yuv420p_frames(AVFrame *main_frame, AVFrame *pip_frame_scaled, AVFrame *output_frame, int x, int y,
-                                   float opacity);
 static void cleanup_pip_session(pip_session_data_t *pip_data);
+static void pip_stage_record(pip_stage_stats_t *stats, switch_time_t start);
+static void pip_metrics_add_session(pip_metrics_t *dst, const pip_session_data_t *pip_data);
+static void pip_mem_charge(pip_session_data_t *pip_data, pip_mem_kind_t kind, uint64_t bytes);
+static uint64_t pip_mem_session_total(const pip_session_data_t *pip_data);
+static uint64_t pip_frame_bytes(const AVFrame *frame);
+static uint64_t pip_mem_frames_total(const pip_session_data_t *pip_data);
+static uint64_t pip_mem_codec_estimate(int width, int height, int frames);
+static switch_status_t pip_mem_admit(pip_session_data_t *pip_data);
+static switch_status_t pip_load_config(void);
+static pip_registry_snapshot_t *pip_registry_read_begin(uint32_t *slot);
+static void pip_registry_read_end(uint32_t slot);
+static switch_status_t pip_registry_update(pip_session_data_t **add, int add_count, switch_bool_t *added,
+                                           pip_session_data_t **remove, int remove_count, switch_bool_t *removed);
+static switch_status_t pip_registry_insert(pip_session_data_t *pip_data);
+static switch_bool_t pip_registry_remove(pip_session_data_t *pip_data);
+static pip_session_data_t *pip_registry_find(const char *uuid);
+static int pip_registry_list(pip_session_data_t ***list);
+static void pip_registry_list_free(pip_session_data_t **list, int count);
+static void pip_session_ref(pip_session_data_t *pip_data);
+static void pip_session_release(pip_session_data_t *pip_data);
+static void pip_session_retire(pip_session_data_t *pip_data);
+static void pip_session_stop(pip_session_data_t *pip_data);
+static void pip_session_stop_many(pip_session_data_t **list, int count);
+static pip_session_data_t *pip_session_prepare(const char *uuid, const char *local_video_file, char *err,
+                                               switch_size_t errlen, switch_status_t *status);
+static switch_status_t pip_session_commit(pip_session_data_t *pip_data, char *err, switch_size_t errlen);
+static void pip_session_abort(pip_session_data_t *pip_data);
+static void pip_session_set_layout(pip_session_data_t *pip_data, const pip_layout_t *layout, uint32_t mask);
+static void pip_layout_apply_pending(pip_session_data_t *pip_data, switch_time_t now);
+static void pip_layout_target(pip_session_data_t *pip_data, const pip_layout_t *layout, uint32_t mask,
+                              pip_geometry_t *target);
+static void pip_geometry_apply(pip_session_data_t *pip_data, const pip_geometry_t *geometry);
+static void pip_animation_step(pip_session_data_t *pip_data, switch_time_t now);
+static float pip_ease(pip_easing_t easing, float t);
+static switch_status_t pip_layout_reserve(pip_session_data_t *pip_data, int width, int height);
+static switch_status_t pip_layout_resize(pip_session_data_t *pip_data, int width, int height);
+static void pip_style_merge(pip_style_t *dst, const pip_style_t *src, uint32_t mask);
+static void pip_color_adjust_merge(pip_color_adjust_t *dst, const pip_color_adjust_t *src, uint32_t mask);
+static switch_status_t pip_layout_parse(const char *name, const char *value, pip_layout_t *layout, uint32_t *mask);
+static switch_status_t pip_session_start(const char *uuid, const char *local_video_file, char *err, switch_size_t errlen);
+static void pip_answer_event_handler(switch_event_t *event);
+static void pip_hangup_event_handler(switch_event_t *event);
+static switch_bool_t pip_recent_video_pick(char *uuid, switch_size_t len);
+static switch_status_t pip_start_queue_push(pip_start_job_t *job);
+static switch_status_t pip_start_job_submit(const char *uuid, const char *local_file, char *job_uuid,
+                                            switch_size_t job_uuid_len);
+static void *SWITCH_THREAD_FUNC pip_start_worker(switch_thread_t *thread, void *obj);
+static void pip_batch_prepare(pip_batch_item_t *item);
+static void pip_batch_prepare_done(pip_batch_t *batch, int index);
+static switch_status_t pip_batch_submit(pip_batch_t *batch, int index);
+static void pip_batch_run(pip_batch_t *batch);
+static switch_status_t pip_batch_item_init(pip_batch_item_t *item, const char *op, const char *uuid, char *err,
+                                           switch_size_t errlen);
+static int pip_batch_parse_text(char *data, pip_batch_item_t *items, int max, char *err, switch_size_t errlen);
+static int pip_batch_parse_json(cJSON *ops, pip_batch_item_t *items, int max, char *err, switch_size_t errlen);
+static switch_status_t pip_batch_validate(const pip_batch_t *batch, char *err, switch_size_t errlen);
+static AVCodecContext *pip_encoder_open(int width, int height);
+static pip_encoder_profile_t *pip_encoder_pool_find(int width, int height);
+static AVCodecContext *pip_encoder_pool_borrow(int width, int height, int64_t *next_pts);
+static void pip_encoder_pool_return(AVCodecContext *codec_ctx, int64_t next_pts);
+static void *SWITCH_THREAD_FUNC pip_encoder_pool_thread(switch_thread_t *thread, void *obj);
+static void pip_encoder_pool_start(void);
+static void pip_encoder_pool_stop(void);
+static switch_status_t pip_start_workers_launch(void);
+static void pip_start_workers_stop(void);
 static switch_bool_t pip_read_video_callback(switch_media_bug_t *bug, void *user_data, switch_abc_type_t type);
 
 #endif /* MOD_VIDEO_PIP_H */
\ No newline at end of file
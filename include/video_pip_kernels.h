@@ -0,0 +1,150 @@
+/*
+ * FreeSWITCH Video Picture-in-Picture Module
+ * 图像处理内核：缩放、叠加和编码器参数
+ *
+ * 本文件只依赖FFmpeg，不依赖FreeSWITCH，
+ * 便于在模块之外单独编译（基准测试等）。
+ */
+
+#ifndef VIDEO_PIP_KERNELS_H
+#define VIDEO_PIP_KERNELS_H
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+
+/* 输出编码默认参数 */
+#define PIP_OUTPUT_FPS 30
+#define PIP_OUTPUT_BITRATE 1000000 /* 1Mbps */
+#define PIP_OUTPUT_GOP 30
+
+/* 简单的YUV420P帧叠加函数：先把主视频复制到输出，再把PIP裁剪到画面内混合，
+ * 窗口完全越界时输出即为主视频 */
+void overlay_yuv420p_frames(AVFrame *main_frame, AVFrame *pip_frame_scaled, AVFrame *output_frame, int x, int y,
+                            float opacity);
+
+/* PIP窗口样式：边框、圆角和羽化边缘 */
+typedef struct pip_style
+{
+    int border_width;        /* 边框宽度（像素），0表示无边框 */
+    uint8_t border_color[3]; /* 边框颜色（Y、U、V） */
+    int corner_radius;       /* 圆角半径（像素） */
+    int feather;             /* 边缘羽化宽度（像素），0表示只做1像素抗锯齿 */
+} pip_style_t;
+
+/* 按PIP尺寸和样式预先计算的逐像素遮罩，取值0-255：
+ * coverage为窗口覆盖率（圆角外和羽化区小于255），border为边框颜色所占比例。
+ * [0]与亮度平面同尺寸，[1]为2x2平均后的色度遮罩，U、V共用 */
+typedef struct pip_alpha_mask
+{
+    int width;
+    int height;
+    int linesize[2];
+    uint8_t *coverage[2];
+    uint8_t *border[2];
+    uint8_t border_color[3];
+    uint8_t *buffer;
+    size_t buffer_size;
+} pip_alpha_mask_t;
+
+/* 样式是否等同于无样式的矩形窗口（此时使用overlay_yuv420p_frames） */
+int pip_style_is_plain(const pip_style_t *style);
+
+/* 按尺寸和样式重新计算遮罩，缓冲区只在变大时重新分配。成功返回0，失败返回AVERROR */
+int pip_alpha_mask_build(pip_alpha_mask_t *mask, int width, int height, const pip_style_t *style);
+
+/* 由外部计算的覆盖率（如文字）生成纯色遮罩：border全部为255、border_color为color，
+ * 混合时只使用颜色，不需要源帧。成功返回0，失败返回AVERROR */
+int pip_alpha_mask_from_coverage(pip_alpha_mask_t *mask, const uint8_t *coverage, int linesize, int width,
+                                 int height, const uint8_t color[3]);
+
+void pip_alpha_mask_free(pip_alpha_mask_t *mask);
+
+/* 按遮罩逐像素混合的叠加函数，裁剪规则与overlay_yuv420p_frames相同；
+ * opacity作为整体系数与遮罩相乘，淡入淡出不需要重算遮罩 */
+void overlay_yuv420p_frames_masked(AVFrame *main_frame, AVFrame *pip_frame_scaled, AVFrame *output_frame, int x, int y,
+                                   float opacity, const pip_alpha_mask_t *mask);
+
+/* 把纯色遮罩（见pip_alpha_mask_from_coverage）原地混合到帧的(x, y)处，位置向下取偶数，
+ * 只处理遮罩与画面相交的矩形，超出画面的部分裁掉 */
+void overlay_yuv420p_mask_color(AVFrame *frame, int x, int y, float opacity, const pip_alpha_mask_t *mask);
+
+/* 背景调色参数，含义与FFmpeg eq滤镜的同名参数相同 */
+typedef struct pip_color_adjust
+{
+    float brightness; /* 亮度偏移（-1到1），按255缩放后加到Y上，0为不变 */
+    float contrast;   /* 对比度（-2到2），Y围绕128缩放，1为不变 */
+    float saturation; /* 饱和度（0到3），U、V围绕128缩放，1为不变 */
+} pip_color_adjust_t;
+
+/* 调色查找表：Y一张，U、V共用一张，各256项 */
+typedef struct pip_color_lut
+{
+    uint8_t y[256];
+    uint8_t uv[256];
+} pip_color_lut_t;
+
+/* 参数是否为不变（此时不需要查表） */
+int pip_color_adjust_is_identity(const pip_color_adjust_t *adjust);
+
+/* 按参数生成查找表，只需在参数变化时调用 */
+void pip_color_lut_build(pip_color_lut_t *lut, const pip_color_adjust_t *adjust);
+
+/* 按查找表把src（YUV420P）写入dst，每像素一次查表；dst可以与src是同一帧 */
+void pip_color_lut_apply(AVFrame *dst, const AVFrame *src, const pip_color_lut_t *lut);
+
+/* 图层混合模式：图层（上层）叠在视频（下层）上 */
+typedef enum pip_blend_mode
+{
+    PIP_BLEND_NORMAL,   /* 按透明度线性混合 */
+    PIP_BLEND_OVERLAY,  /* 叠加：视频暗部按正片叠底、亮部按滤色，保留视频的明暗 */
+    PIP_BLEND_MULTIPLY, /* 正片叠底：只会变暗，白色图层不改变视频 */
+    PIP_BLEND_SCREEN    /* 滤色：只会变亮，黑色图层不改变视频 */
+} pip_blend_mode_t;
+
+/* 按模式和透明度从静态图层预先计算的逐像素系数，合成时只剩与视频像素有关的定点运算。
+ * normal：coef = 图层 * alpha，out = (v * (256 - alpha) + coef) / 256；
+ * 其他模式的Y平面：coef = k（0-512），暗部 out = v * k / 256，亮部 out = 255 - (255 - v) * (512 - k) / 256，
+ * multiply总按暗部、screen总按亮部、overlay按 v < 128 选择；
+ * 其他模式的U、V平面按图层颜色偏移：coef = (图层 - 128) * alpha / 256（有符号），out = v + coef */
+typedef struct pip_blend_layer
+{
+    int width;
+    int height;
+    pip_blend_mode_t mode;
+    int alpha;       /* 透明度，0-256 */
+    int linesize[3]; /* 以系数个数计 */
+    uint16_t *coef[3];
+    uint8_t *buffer;
+    size_t buffer_size;
+} pip_blend_layer_t;
+
+/* 模式名（normal、overlay、multiply、screen）转换为模式。成功返回0，未知名称返回AVERROR(EINVAL) */
+int pip_blend_mode_parse(const char *name, pip_blend_mode_t *mode);
+
+const char *pip_blend_mode_name(pip_blend_mode_t mode);
+
+/* 由图层图像（YUV420P，尺寸即合成尺寸）计算系数，缓冲区只在变大时重新分配。成功返回0，失败返回AVERROR */
+int pip_blend_layer_build(pip_blend_layer_t *layer, const AVFrame *image, pip_blend_mode_t mode, float opacity);
+
+void pip_blend_layer_free(pip_blend_layer_t *layer);
+
+/* 把图层混合到src（YUV420P）上写入dst，处理两者与图层相交的区域；dst可以与src是同一帧。
+ * x86上走SSE2路径，与标量路径结果逐位一致 */
+void pip_blend_layer_apply(AVFrame *dst, const AVFrame *src, const pip_blend_layer_t *layer);
+
+/* 0xRRGGBB转换为BT.601有限范围的Y、U、V */
+void pip_rgb_to_yuv(uint32_t rgb, uint8_t yuv[3]);
+
+/* 创建远程视频 -> PIP窗口的缩放上下文 */
+struct SwsContext *pip_scaler_create(int src_width, int src_height, int dst_width, int dst_height);
+
+/* 同上，源为任意sws支持的格式（NV12、打包RGB等），输出YUV420P：格式转换与缩放在同一遍完成 */
+struct SwsContext *pip_scaler_create_format(enum AVPixelFormat src_format, int src_width, int src_height,
+                                            int dst_width, int dst_height);
+
+/* 设置输出编码器参数（需在avcodec_open2之前调用） */
+void pip_encoder_configure(AVCodecContext *codec_ctx, int width, int height);
+
+#endif /* VIDEO_PIP_KERNELS_H */
@@ -0,0 +1,74 @@
+/*
+ * FreeSWITCH Video Picture-in-Picture Module
+ * 预解码背景文件（.pipraw）：按页对齐存放的YUV420P帧及帧索引
+ *
+ * 由 tools/pip_rawpack 离线生成，模块以只读方式mmap后直接把帧指针交给叠加，
+ * 播放时不需要解码器，也不占用会话堆内存；同一文件的页缓存由所有会话和进程共享。
+ *
+ * 文件布局（主机字节序）：
+ *   pip_raw_header_t
+ *   帧数据                         每帧起始按alignment对齐，Y、U、V三个平面，行宽按PIP_RAW_LINE_ALIGN对齐
+ *   uint64_t index[frame_count]   每帧相对文件开头的偏移（放在末尾，生成时不需要预先知道帧数）
+ *
+ * 本文件只依赖libc/POSIX，不依赖FFmpeg和FreeSWITCH。
+ */
+
+#ifndef VIDEO_PIP_RAW_H
+#define VIDEO_PIP_RAW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PIP_RAW_MAGIC "PIPRAW\r\n"
+#define PIP_RAW_VERSION 1
+#define PIP_RAW_LINE_ALIGN 64    /* 行宽对齐，叠加内核的向量加载不会越过行尾 */
+#define PIP_RAW_FRAME_ALIGN 4096 /* 帧起始按页对齐 */
+#define PIP_RAW_MAX_DIMENSION 8192
+
+typedef struct pip_raw_header
+{
+    char magic[8];           /* PIP_RAW_MAGIC */
+    uint32_t version;        /* PIP_RAW_VERSION */
+    uint32_t header_size;    /* sizeof(pip_raw_header_t)，便于以后追加字段 */
+    uint32_t width;
+    uint32_t height;
+    uint32_t fps_num;
+    uint32_t fps_den;
+    uint32_t frame_count;
+    uint32_t alignment;      /* 帧起始对齐，PIP_RAW_FRAME_ALIGN */
+    uint32_t linesize[3];    /* Y、U、V行宽 */
+    uint32_t plane_offset[3]; /* 各平面相对帧起始的偏移 */
+    uint64_t frame_size;     /* 单帧三个平面占用的字节数（不含对齐填充） */
+    uint64_t index_offset;   /* 帧索引相对文件开头的偏移 */
+    uint64_t reserved[4];
+} pip_raw_header_t;
+
+/* 已映射的预解码文件 */
+typedef struct pip_raw_file
+{
+    pip_raw_header_t header;
+    const uint8_t *map;
+    size_t map_size;
+    const uint64_t *index;
+    dev_t dev; /* 文件身份，用于判断路径是否已被替换 */
+    ino_t ino;
+    time_t mtime;
+} pip_raw_file_t;
+
+/* 按尺寸和帧率填写头部（平面布局、行宽），frame_count和index_offset由生成方写完帧后设置。
+ * 成功返回0，尺寸无效返回-EINVAL */
+int pip_raw_header_init(pip_raw_header_t *header, int width, int height, int fps_num, int fps_den);
+
+/* 文件开头是否为预解码格式（只检查魔数） */
+int pip_raw_probe(const char *path);
+
+/* 只读映射并校验头部和全部索引项。成功返回0，失败返回负的errno */
+int pip_raw_open(const char *path, pip_raw_file_t *raw);
+
+void pip_raw_close(pip_raw_file_t *raw);
+
+/* 取第n帧的平面指针和行宽，n超出范围时按帧数取模（循环播放） */
+void pip_raw_frame(const pip_raw_file_t *raw, uint64_t n, const uint8_t *data[3], int linesize[3]);
+
+#endif /* VIDEO_PIP_RAW_H */
@@ -0,0 +1,104 @@
+/*
+ * FreeSWITCH Video Picture-in-Picture Module
+ * POSIX共享内存帧环：同机进程之间交换YUV420P原始帧，不经过编解码
+ *
+ * 一个写入方、任意多个读取方。写入方按序号依次覆盖槽位，读取方只取最新帧，
+ * 直接使用槽位中的数据（零拷贝），用完后再核对序号判断期间是否被覆盖。
+ * 写入方从不等待读取方：读取方来不及时只会跳过帧，不会拖慢写入方。
+ * 读取方可以轮询，也可以用pip_shm_ring_wait在futex上等待新帧。
+ *
+ * 共享内存布局（主机字节序）：
+ *   pip_shm_header_t
+ *   pip_shm_slot_t slots[slot_count]   各槽位的序号和时间戳
+ *   帧数据                              从data_offset开始，每槽slot_span字节，平面布局与.pipraw相同
+ *
+ * 槽位序号：帧号n（从1开始）写入中为 n*2+1，写完为 n*2，未写过为0。
+ *
+ * 本文件只依赖libc/POSIX，不依赖FFmpeg和FreeSWITCH。
+ */
+
+#ifndef VIDEO_PIP_SHM_H
+#define VIDEO_PIP_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PIP_SHM_MAGIC "PIPSHM\r\n"
+#define PIP_SHM_VERSION 1
+#define PIP_SHM_MIN_SLOTS 2
+#define PIP_SHM_MAX_SLOTS 64
+
+typedef struct pip_shm_slot
+{
+    uint64_t seq;          /* 见文件头说明，原子读写 */
+    int64_t pts;           /* 写入方给出的时间戳，含义由写入方决定 */
+    uint64_t timestamp_us; /* 写完时的CLOCK_MONOTONIC时间 */
+    uint64_t source_seq;   /* 写入方给出的来源序号（输出旁路中为对应的远程帧序号） */
+} pip_shm_slot_t;
+
+typedef struct pip_shm_header
+{
+    char magic[8];            /* PIP_SHM_MAGIC，写入方初始化完成后最后写入 */
+    uint32_t version;         /* PIP_SHM_VERSION */
+    uint32_t header_size;     /* sizeof(pip_shm_header_t) */
+    uint32_t width;
+    uint32_t height;
+    uint32_t linesize[3];     /* Y、U、V行宽 */
+    uint32_t plane_offset[3]; /* 各平面相对槽位起始的偏移 */
+    uint32_t slot_count;
+    uint32_t producer_pid;
+    uint64_t frame_size;      /* 单帧三个平面占用的字节数 */
+    uint64_t slot_span;       /* 相邻槽位的间隔，按页对齐 */
+    uint64_t data_offset;     /* 第一个槽位相对映射开头的偏移 */
+    uint64_t write_seq;       /* 最新写完的帧号，0表示还没有帧，原子读写 */
+    uint64_t heartbeat_us;    /* 写入方最近一次发布的CLOCK_MONOTONIC时间 */
+    uint32_t wake;            /* 每次发布加1并唤醒等待的读取方（futex） */
+    uint32_t closed;          /* 写入方已停止，不会再有新帧 */
+    uint64_t reserved[7];
+} pip_shm_header_t;
+
+/* 已映射的帧环 */
+typedef struct pip_shm_ring
+{
+    pip_shm_header_t *header;
+    pip_shm_slot_t *slots;
+    uint8_t *map;
+    size_t map_size;
+    int writable;
+} pip_shm_ring_t;
+
+/* 当前CLOCK_MONOTONIC时间（微秒），与heartbeat_us、timestamp_us同一时钟 */
+uint64_t pip_shm_now_us(void);
+
+/* 写入方：创建（或替换同名的）帧环。成功返回0，失败返回负的errno */
+int pip_shm_ring_create(const char *name, int width, int height, int slot_count, pip_shm_ring_t *ring);
+
+/* 读取方：以只读方式映射已有帧环并校验头部。写入方尚未初始化完成时返回-EAGAIN */
+int pip_shm_ring_open(const char *name, pip_shm_ring_t *ring);
+
+/* 解除映射；写入方同时删除共享内存名称（已映射的读取方不受影响） */
+void pip_shm_ring_close(pip_shm_ring_t *ring, const char *name);
+
+/* 写入方：取下一帧的槽位并标记为写入中，返回帧号 */
+uint64_t pip_shm_ring_begin(pip_shm_ring_t *ring, uint8_t *data[3], int linesize[3]);
+
+/* 写入方：发布begin取得的帧，并唤醒在pip_shm_ring_wait中等待的读取方 */
+void pip_shm_ring_commit(pip_shm_ring_t *ring, uint64_t seq, int64_t pts, uint64_t source_seq);
+
+/* 写入方：标记帧环已关闭并唤醒全部读取方，随后通常调用pip_shm_ring_close */
+void pip_shm_ring_shutdown(pip_shm_ring_t *ring);
+
+/* 读取方：取最新的完整帧，返回帧号；还没有帧时返回0 */
+uint64_t pip_shm_ring_latest(const pip_shm_ring_t *ring, const uint8_t *data[3], int linesize[3], int64_t *pts);
+
+/* 读取方：帧seq的数据在读取后是否仍然完整（没有被写入方覆盖） */
+int pip_shm_ring_intact(const pip_shm_ring_t *ring, uint64_t seq);
+
+/* 读取方：等待帧号大于after的帧发布。返回最新帧号；超时返回0，帧环已关闭返回-1 */
+int64_t pip_shm_ring_wait(const pip_shm_ring_t *ring, uint64_t after, int timeout_ms);
+
+/* 读取方：取帧seq的槽位信息（时间戳、来源序号），槽位已被覆盖时返回-1 */
+int pip_shm_ring_slot_info(const pip_shm_ring_t *ring, uint64_t seq, int64_t *pts, uint64_t *timestamp_us,
+                           uint64_t *source_seq);
+
+#endif /* VIDEO_PIP_SHM_H */
@@ -0,0 +1,62 @@
+/*
+ * FreeSWITCH Video Picture-in-Picture Module
+ * 文字渲染：字形图集和文字遮罩缓存
+ *
+ * 字体中的每个字符只光栅化一次，存入8位灰度的字形图集；一段文字第一次使用时
+ * 从图集拼出覆盖率遮罩（pip_alpha_mask_t）并缓存，之后每帧只按遮罩混合文字
+ * 所在的矩形（overlay_yuv420p_mask_color），不再逐个字形处理。
+ *
+ * 本文件依赖FFmpeg（内存分配、AVERROR）和FreeType，不依赖FreeSWITCH。
+ * 编译时未定义PIP_HAVE_FREETYPE则不支持文字，pip_font_open返回AVERROR(ENOSYS)。
+ * 字体和缓存都不是线程安全的，由调用方加锁；取得的遮罩在释放前不会改变，可以不加锁读取。
+ */
+
+#ifndef VIDEO_PIP_TEXT_H
+#define VIDEO_PIP_TEXT_H
+
+#include "video_pip_kernels.h"
+
+#define PIP_FONT_MIN_SIZE 6
+#define PIP_FONT_MAX_SIZE 256
+#define PIP_TEXT_CACHE_IDLE 32 /* 缓存中保留的未使用文字数，超出时释放 */
+
+/* 字体和字形图集，结构在 video_pip_text.c 中定义 */
+typedef struct pip_font pip_font_t;
+
+/* 缓存的文字遮罩，按文字和颜色区分 */
+typedef struct pip_text
+{
+    struct pip_text *next;
+    char *text;
+    uint8_t color[3]; /* Y、U、V */
+    int refs;
+    pip_alpha_mask_t mask; /* coverage为文字覆盖率，尺寸为文字的外接矩形 */
+} pip_text_t;
+
+typedef struct pip_text_cache
+{
+    pip_font_t *font;
+    pip_text_t *entries;
+    int count; /* 缓存中的文字数（含正在使用的） */
+    int idle;  /* 其中未被使用的文字数 */
+} pip_text_cache_t;
+
+/* 打开字体文件，pixel_size为字号（像素）。成功返回0，失败返回AVERROR */
+int pip_font_open(const char *path, int pixel_size, pip_font_t **font);
+
+void pip_font_close(pip_font_t **font);
+
+/* 已光栅化的字形数和字形图集占用的字节数 */
+void pip_font_stats(const pip_font_t *font, int *glyphs, size_t *atlas_bytes);
+
+/* 取得文字遮罩：已缓存时只增加引用计数，否则按UTF-8解码、排版并生成遮罩，'\n'换行。
+ * 成功返回0，文字为空时返回AVERROR(EINVAL)，其他失败返回AVERROR */
+int pip_text_acquire(pip_text_cache_t *cache, const char *text, const uint8_t color[3], pip_text_t **entry);
+
+/* 归还pip_text_acquire取得的遮罩，未使用的文字超过PIP_TEXT_CACHE_IDLE时释放 */
+void pip_text_release(pip_text_cache_t *cache, pip_text_t *entry);
+
+/* 释放全部缓存的文字（调用前需归还全部遮罩），不关闭字体 */
+void pip_text_cache_free(pip_text_cache_t *cache);
+
+#endif /* VIDEO_PIP_TEXT_H */
@@ -4,7 +4,6 @@
 static switch_status_t read_local_video_frame(pip_session_data_t *pip_data)
 {
     int ret;
-    static int retry_count = 0;
 
     // 确保正确初始化，避免空指针访问
     if (!pip_data || !pip_data->local_fmt_ctx || !pip_data->local_codec_ctx)
@@ -23,6 +22,7 @@ static switch_status_t read_local_video_frame(pip_session_data_t *pip_data)
             ret = avcodec_send_packet(pip_data->local_codec_ctx, pip_data->local_packet);
             if (ret < 0)
             {
+                pip_data->decode_errors++;
                 av_packet_unref(pip_data->local_packet);
                 continue;
             }
@@ -36,9 +36,13 @@ static switch_status_t read_local_video_frame(pip_session_data_t *pip_data)
             if (ret >= 0)
             {
                 pip_data->local_frames_count++;
-                retry_count = 0; // 重置重试计数
+                pip_data->local_loop_retries = 0; // 重置重试计数
                 return SWITCH_STATUS_SUCCESS;
             }
+            else if (ret != AVERROR(EAGAIN))
+            {
+                pip_data->decode_errors++;
+            }
         }
         // 当前不是本地视频流，直接释放包
         else
@@ -51,30 +55,31 @@ static switch_status_t read_local_video_frame(pip_session_data_t *pip_data)
     if (ret == AVERROR_EOF)
     {
         // 防止无限递归
-        if (retry_count >= 10)
+        if (pip_data->local_loop_retries >= 10)
         {
             switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "视频文件循环播放重试次数过多，停止处理\n");
-            retry_count = 0;
+            pip_data->local_loop_retries = 0;
             return SWITCH_STATUS_FALSE;
         }
 
-        retry_count++;
+        pip_data->local_loop_retries++;
         ret = av_seek_frame(pip_data->local_fmt_ctx, pip_data->local_video_stream_index, 0, AVSEEK_FLAG_BACKWARD);
         if (ret < 0)
         {
             switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "视频文件seek失败: %d\n", ret);
-            retry_count = 0;
+            pip_data->local_loop_retries = 0;
             return SWITCH_STATUS_FALSE;
         }
         return read_local_video_frame(pip_data); /* 递归调用重新开始 */
     }
 
-    retry_count = 0;
+    pip_data->local_loop_retries = 0;
     return SWITCH_STATUS_FALSE;
 }
 
-/* 初始化本地图片文件 */
-static switch_status_t init_load_local_image(pip_session_data_t *pip_data, const char *image_file)
+/* 解码图片文件的第一帧并转换为YUV420P（本地背景图片和background-image共用）。
+ * 成功时*frame为新分配的帧，由调用方释放 */
+static switch_status_t pip_image_decode(const char *image_file, AVFrame **frame)
 {
     AVFormatContext *fmt_ctx = NULL;
     AVCodecContext *codec_ctx = NULL;
@@ -83,27 +88,11 @@ static switch_status_t init_load_local_image(pip_session_data_t *pip_data, const
     int video_stream_index = -1;
     int ret;
 
-    if (!pip_data || !image_file)
-    {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无效的参数\n");
-        return SWITCH_STATUS_FALSE;
-    }
-
-    /* 检查文件是否存在 */
-    if (access(image_file, R_OK) != 0)
-    {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法访问图片文件: %s\n", image_file);
-        return SWITCH_STATUS_FALSE;
-    }
-
-    /* 保存图片路径 */
-    switch_copy_string(pip_data->local_image_path, image_file, sizeof(pip_data->local_image_path));
-
     /* 打开图片文件 */
-    ret = avformat_open_input(&fmt_ctx, pip_data->local_image_path, NULL, NULL);
+    ret = avformat_open_input(&fmt_ctx, image_file, NULL, NULL);
     if (ret < 0)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法打开图片文件: %s (错误码: %d)\n", pip_data->local_image_path, ret);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法打开图片文件: %s (错误码: %d)\n", image_file, ret);
         return SWITCH_STATUS_FALSE;
     }
 
@@ -172,13 +161,13 @@ static switch_status_t init_load_local_image(pip_session_data_t *pip_data, const
     }
 
     /* 分配帧和包 */
-    pip_data->local_image_frame = av_frame_alloc();
+    *frame = av_frame_alloc();
     packet = av_packet_alloc();
-    if (!pip_data->local_image_frame || !packet)
+    if (!*frame || !packet)
     {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法分配帧或包\n");
-        if (pip_data->local_image_frame)
-            av_frame_free(&pip_data->local_image_frame);
+        if (*frame)
+            av_frame_free(frame);
         if (packet)
             av_packet_free(&packet);
         avcodec_free_context(&codec_ctx);
@@ -193,7 +182,7 @@ static switch_status_t init_load_local_image(pip_session_data_t *pip_data, const
         ret = avcodec_send_packet(codec_ctx, packet);
         if (ret >= 0)
         {
-            ret = avcodec_receive_frame(codec_ctx, pip_data->local_image_frame);
+            ret = avcodec_receive_frame(codec_ctx, *frame);
         }
     }
 
@@ -205,72 +194,58 @@ static switch_status_t init_load_local_image(pip_session_data_t *pip_data, const
     if (ret < 0)
     {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法解码图片帧\n");
-        av_frame_free(&pip_data->local_image_frame);
+        av_frame_free(frame);
         return SWITCH_STATUS_FALSE;
     }
 
-    /* 检查图片格式并转换为YUV420P */
-    if (pip_data->local_image_frame->format != AV_PIX_FMT_YUV420P)
+    /* 检查图片格式并转换为YUV420P（只在加载时做一次） */
+    if ((*frame)->format != AV_PIX_FMT_YUV420P)
     {
-        AVFrame *yuv_frame = av_frame_alloc();
         struct SwsContext *sws_ctx = NULL;
+        AVFrame *yuv_frame = NULL;
+        switch_status_t status = pip_frame_to_yuv420p(&sws_ctx, *frame, &yuv_frame);
 
-        if (!yuv_frame)
-        {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法分配YUV帧\n");
-            av_frame_free(&pip_data->local_image_frame);
-            return SWITCH_STATUS_FALSE;
-        }
-
-        /* 设置YUV帧参数 */
-        yuv_frame->format = AV_PIX_FMT_YUV420P;
-        yuv_frame->width = pip_data->local_image_frame->width;
-        yuv_frame->height = pip_data->local_image_frame->height;
-
-        if (av_frame_get_buffer(yuv_frame, 32) < 0)
+        sws_freeContext(sws_ctx);
+        if (status != SWITCH_STATUS_SUCCESS)
         {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法分配YUV帧缓冲区\n");
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "图片格式转换失败\n");
             av_frame_free(&yuv_frame);
-            av_frame_free(&pip_data->local_image_frame);
+            av_frame_free(frame);
             return SWITCH_STATUS_FALSE;
         }
 
-        /* 创建格式转换上下文 */
-        sws_ctx = sws_getContext(
-            pip_data->local_image_frame->width, pip_data->local_image_frame->height, pip_data->local_image_frame->format,
-            yuv_frame->width, yuv_frame->height, AV_PIX_FMT_YUV420P,
-            SWS_BILINEAR, NULL, NULL, NULL);
+        /* 替换原始帧为转换后的YUV帧 */
+        av_frame_free(frame);
+        *frame = yuv_frame;
 
-        if (!sws_ctx)
-        {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法创建图片格式转换上下文\n");
-            av_frame_free(&yuv_frame);
-            av_frame_free(&pip_data->local_image_frame);
-            return SWITCH_STATUS_FALSE;
-        }
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "图片已转换为YUV420P格式\n");
+    }
 
-        /* 执行格式转换 */
-        int scale_ret = sws_scale(sws_ctx,
-                                  (const uint8_t *const *)pip_data->local_image_frame->data,
-                                  pip_data->local_image_frame->linesize,
-                                  0, pip_data->local_image_frame->height,
-                                  yuv_frame->data, yuv_frame->linesize);
+    return SWITCH_STATUS_SUCCESS;
+}
 
-        sws_freeContext(sws_ctx);
+/* 初始化本地图片文件 */
+static switch_status_t init_load_local_image(pip_session_data_t *pip_data, const char *image_file)
+{
+    if (!pip_data || !image_file)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无效的参数\n");
+        return SWITCH_STATUS_FALSE;
+    }
 
-        if (scale_ret < 0)
-        {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "图片格式转换失败\n");
-            av_frame_free(&yuv_frame);
-            av_frame_free(&pip_data->local_image_frame);
-            return SWITCH_STATUS_FALSE;
-        }
+    /* 检查文件是否存在 */
+    if (access(image_file, R_OK) != 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法访问图片文件: %s\n", image_file);
+        return SWITCH_STATUS_FALSE;
+    }
 
-        /* 替换原始帧为转换后的YUV帧 */
-        av_frame_free(&pip_data->local_image_frame);
-        pip_data->local_image_frame = yuv_frame;
+    /* 保存图片路径 */
+    switch_copy_string(pip_data->local_image_path, image_file, sizeof(pip_data->local_image_path));
 
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "图片已转换为YUV420P格式\n");
+    if (pip_image_decode(pip_data->local_image_path, &pip_data->local_image_frame) != SWITCH_STATUS_SUCCESS)
+    {
+        return SWITCH_STATUS_FALSE;
     }
 
     /* 设置图片模式标志 */
@@ -416,865 +391,5907 @@ static switch_status_t init_local_video_file(pip_session_data_t *pip_data, const
     return SWITCH_STATUS_SUCCESS;
 }
 
-/* 初始化输出视频文件 */
-static switch_status_t init_output_video_file(pip_session_data_t *pip_data, const char *output_file)
+/* 取得路径对应的共享映射（引用计数+1），没有可用映射时打开并校验文件。失败返回NULL，*err为负的errno */
+static pip_raw_source_t *pip_raw_source_acquire(const char *path, int *err)
 {
-    AVCodec *encoder;
-    int ret;
+    pip_raw_source_t *source;
+    struct stat st;
 
-    /* 创建输出格式上下文 */
-    ret = avformat_alloc_output_context2(&pip_data->output_fmt_ctx, NULL, NULL, output_file);
-    if (ret < 0 || !pip_data->output_fmt_ctx)
+    if (stat(path, &st) < 0)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法创建输出格式上下文\n");
-        return SWITCH_STATUS_FALSE;
+        *err = -errno;
+        return NULL;
     }
 
-    /* 查找H264编码器 */
-    encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
-    if (!encoder)
+    switch_mutex_lock(pip_raw_mutex);
+    for (source = pip_raw_sources; source; source = source->next)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "未找到H264编码器\n");
-        return SWITCH_STATUS_FALSE;
+        if (source->stale || strcmp(source->path, path))
+        {
+            continue;
+        }
+        if (source->file.dev == st.st_dev && source->file.ino == st.st_ino && source->file.mtime == st.st_mtime)
+        {
+            source->refs++;
+            switch_mutex_unlock(pip_raw_mutex);
+            return source;
+        }
+        /* 文件已被替换：正在使用旧映射的会话继续播放，新会话使用新文件 */
+        source->stale = SWITCH_TRUE;
     }
 
-    /* 创建输出流 */
-    pip_data->output_stream = avformat_new_stream(pip_data->output_fmt_ctx, encoder);
-    if (!pip_data->output_stream)
+    if (!(source = calloc(1, sizeof(*source))))
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法创建输出流\n");
-        return SWITCH_STATUS_FALSE;
+        switch_mutex_unlock(pip_raw_mutex);
+        *err = -ENOMEM;
+        return NULL;
     }
-
-    /* 分配编码器上下文 */
-    pip_data->output_codec_ctx = avcodec_alloc_context3(encoder);
-    if (!pip_data->output_codec_ctx)
+    if ((*err = pip_raw_open(path, &source->file)) < 0)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配编码器上下文失败\n");
-        return SWITCH_STATUS_FALSE;
+        switch_mutex_unlock(pip_raw_mutex);
+        free(source);
+        return NULL;
     }
+    switch_copy_string(source->path, path, sizeof(source->path));
+    source->refs = 1;
+    source->next = pip_raw_sources;
+    pip_raw_sources = source;
+    switch_mutex_unlock(pip_raw_mutex);
+    return source;
+}
 
-    /* 设置编码器参数 */
-    pip_data->output_codec_ctx->width = pip_data->main_width;
-    pip_data->output_codec_ctx->height = pip_data->main_height;
-    pip_data->output_codec_ctx->time_base = (AVRational){1, 30}; /* 30fps */
-    pip_data->output_codec_ctx->framerate = (AVRational){30, 1};
-    pip_data->output_codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-    pip_data->output_codec_ctx->bit_rate = 1000000; /* 1Mbps */
-    pip_data->output_codec_ctx->gop_size = 30;
-    pip_data->output_codec_ctx->max_b_frames = 1;
+static void pip_raw_source_release(pip_raw_source_t *source)
+{
+    pip_raw_source_t **link;
 
-    /* H264特定设置 */
-    if (pip_data->output_codec_ctx->codec_id == AV_CODEC_ID_H264)
+    if (!source)
     {
-        av_opt_set(pip_data->output_codec_ctx->priv_data, "preset", "ultrafast", 0);
-        av_opt_set(pip_data->output_codec_ctx->priv_data, "tune", "zerolatency", 0);
+        return;
     }
 
-    /* 如果是MP4格式，需要全局头 */
-    // 判断是否需要全局头
-    if (pip_data->output_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    switch_mutex_lock(pip_raw_mutex);
+    if (--source->refs > 0)
     {
-        // 设置编码器标志以包含全局头
-        pip_data->output_codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        switch_mutex_unlock(pip_raw_mutex);
+        return;
     }
-
-    /* 打开编码器 */
-    ret = avcodec_open2(pip_data->output_codec_ctx, encoder, NULL);
-    if (ret < 0)
+    for (link = &pip_raw_sources; *link; link = &(*link)->next)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "打开编码器失败\n");
-        return SWITCH_STATUS_FALSE;
+        if (*link == source)
+        {
+            *link = source->next;
+            break;
+        }
     }
+    switch_mutex_unlock(pip_raw_mutex);
 
-    /* 复制编码器参数到流 */
-    ret = avcodec_parameters_from_context(pip_data->output_stream->codecpar, pip_data->output_codec_ctx);
-    if (ret < 0)
+    pip_raw_close(&source->file);
+    free(source);
+}
+
+/* 初始化预解码背景文件：只做映射和校验，没有解码器 */
+static switch_status_t init_raw_video_file(pip_session_data_t *pip_data, const char *raw_file)
+{
+    const pip_raw_header_t *header;
+    int err = 0;
+
+    if (!(pip_data->raw_source = pip_raw_source_acquire(raw_file, &err)))
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "复制编码器参数失败\n");
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "打开预解码背景文件失败: %s (%s)\n", raw_file,
+                          strerror(-err));
         return SWITCH_STATUS_FALSE;
     }
 
-    /* 设置流的时间基 - 确保时间戳从0开始 */
-    pip_data->output_stream->time_base = pip_data->output_codec_ctx->time_base;
-    pip_data->output_stream->start_time = 0;
+    header = &pip_data->raw_source->file.header;
+    pip_data->main_width = header->width;
+    pip_data->main_height = header->height;
+    pip_data->local_fps = (double)header->fps_num / header->fps_den;
+    pip_data->local_frame_time = 1.0 / pip_data->local_fps;
 
-    /* 打开输出文件 */
-    // 我们准备使用的输出格式，是不是那种不需要物理文件的特殊格式？
-    // mp4格式通常需要物理文件，所以我们需要打开文件进行写入
-    if (!(pip_data->output_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "预解码背景文件映射成功: %s (%dx%d, %.2f fps, %u帧)\n",
+                      raw_file, pip_data->main_width, pip_data->main_height, pip_data->local_fps,
+                      header->frame_count);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 让frame_main指向映射中的第n帧（循环），不复制数据；frame_main没有AVBufferRef，释放时不会触及映射 */
+static void read_raw_video_frame(pip_session_data_t *pip_data, uint64_t n)
+{
+    const pip_raw_file_t *raw = &pip_data->raw_source->file;
+    const uint8_t *data[3];
+    int linesize[3];
+
+    pip_raw_frame(raw, n, data, linesize);
+    for (int i = 0; i < 3; i++)
     {
-        ret = avio_open(&pip_data->output_fmt_ctx->pb, output_file, AVIO_FLAG_WRITE);
-        if (ret < 0)
-        {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法打开输出文件: %s\n", output_file);
-            return SWITCH_STATUS_FALSE;
-        }
+        pip_data->frame_main->data[i] = (uint8_t *)data[i];
+        pip_data->frame_main->linesize[i] = linesize[i];
     }
+    pip_data->frame_main->width = raw->header.width;
+    pip_data->frame_main->height = raw->header.height;
+    pip_data->frame_main->format = AV_PIX_FMT_YUV420P;
+    pip_data->local_frames_count = n + 1;
+}
 
-    /* 写入文件头 */
-    ret = avformat_write_header(pip_data->output_fmt_ctx, NULL);
-    if (ret < 0)
+/* 启动前的背景源检查：文件需要可读；共享内存帧环在初始化时打开并校验 */
+static switch_bool_t pip_local_source_accessible(const char *local_file)
+{
+    if (!strncmp(local_file, PIP_SHM_SOURCE_PREFIX, strlen(PIP_SHM_SOURCE_PREFIX)))
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "写入文件头失败\n");
-        return SWITCH_STATUS_FALSE;
+        return local_file[strlen(PIP_SHM_SOURCE_PREFIX)] ? SWITCH_TRUE : SWITCH_FALSE;
     }
+    return access(local_file, R_OK) == 0 ? SWITCH_TRUE : SWITCH_FALSE;
+}
 
-    /* 分配输出包 */
-    pip_data->output_packet = av_packet_alloc();
-    if (!pip_data->output_packet)
+/* 初始化共享内存渲染源：帧环由写入方（如tools/pip_shm_producer）创建，尺寸在启动时确定 */
+static switch_status_t init_shm_video_source(pip_session_data_t *pip_data, const char *name)
+{
+    int ret;
+
+    switch_copy_string(pip_data->shm_name, name, sizeof(pip_data->shm_name));
+    if ((ret = pip_shm_ring_open(pip_data->shm_name, &pip_data->shm_ring)) < 0)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配输出包失败\n");
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "打开共享内存帧环失败: %s (%s)\n", name,
+                          ret == -EAGAIN ? "写入方尚未初始化" : strerror(-ret));
         return SWITCH_STATUS_FALSE;
     }
 
-    strncpy(pip_data->output_filename, output_file, sizeof(pip_data->output_filename) - 1);
-
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "输出视频文件初始化成功: %s (%dx%d)\n", output_file,
-                      pip_data->main_width, pip_data->main_height);
+    pip_data->main_width = pip_data->shm_ring.header->width;
+    pip_data->main_height = pip_data->shm_ring.header->height;
+    pip_data->local_fps = 30.0; /* 按写入方的节奏取最新帧，帧率只用于统计 */
+    pip_data->local_frame_time = 1.0 / pip_data->local_fps;
+    pip_data->shm_seq = 0;
+    pip_data->shm_last_frame = switch_micro_time_now();
 
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "共享内存帧环映射成功: %s (%dx%d, %u个槽位, 写入方pid %u)\n",
+                      name, pip_data->main_width, pip_data->main_height, pip_data->shm_ring.header->slot_count,
+                      pip_data->shm_ring.header->producer_pid);
     return SWITCH_STATUS_SUCCESS;
 }
 
-/* 写入输出帧 */
-static switch_status_t write_output_frame(pip_session_data_t *pip_data)
+/* 写入方停滞时按名称重新打开：写入方重启后会重新创建帧环，旧映射不会再有新帧。
+ * 只有新帧环已经有帧时才切换，切换前frame_main指向的旧映射仍然有效 */
+static switch_bool_t pip_shm_reopen(pip_session_data_t *pip_data)
 {
-    int ret;
+    const pip_shm_header_t *old = pip_data->shm_ring.header;
+    pip_shm_ring_t ring;
 
-    if (!pip_data->output_codec_ctx || !pip_data->frame_output)
+    if (pip_shm_ring_open(pip_data->shm_name, &ring) < 0)
     {
-        return SWITCH_STATUS_FALSE;
+        return SWITCH_FALSE;
     }
-
-    /* 设置帧时间戳 - 使用会话专用的PTS计数器 */
-    pip_data->frame_output->pts = pip_data->output_pts++;
-
-    /* 发送帧到编码器 */
-    ret = avcodec_send_frame(pip_data->output_codec_ctx, pip_data->frame_output);
-    if (ret < 0)
+    if (ring.header->producer_pid == old->producer_pid &&
+        __atomic_load_n(&ring.header->write_seq, __ATOMIC_ACQUIRE) == __atomic_load_n(&old->write_seq, __ATOMIC_ACQUIRE))
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "发送帧到编码器失败\n");
-        return SWITCH_STATUS_FALSE;
+        /* 同一个帧环，写入方只是暂停 */
+        pip_shm_ring_close(&ring, NULL);
+        return SWITCH_FALSE;
+    }
+    if (ring.header->width != old->width || ring.header->height != old->height)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "共享内存帧环 %s 尺寸变为 %ux%u，与会话的 %dx%d 不符，忽略\n",
+                          pip_data->shm_name, ring.header->width, ring.header->height, pip_data->main_width,
+                          pip_data->main_height);
+        pip_shm_ring_close(&ring, NULL);
+        return SWITCH_FALSE;
+    }
+    if (__atomic_load_n(&ring.header->write_seq, __ATOMIC_ACQUIRE) == 0)
+    {
+        pip_shm_ring_close(&ring, NULL);
+        return SWITCH_FALSE;
     }
 
-    /* 从编码器接收包 */
-    while (ret >= 0)
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "共享内存帧环 %s 已由写入方 pid %u 重新创建，切换到新帧环\n",
+                      pip_data->shm_name, ring.header->producer_pid);
+    pip_shm_ring_close(&pip_data->shm_ring, NULL);
+    pip_data->shm_ring = ring;
+    pip_data->shm_seq = 0;
+    pip_data->frame_main->data[0] = NULL;
+    return SWITCH_TRUE;
+}
+
+/* 让frame_main指向帧环中的最新帧；写入方停滞时保持最后一帧（槽位不会被覆盖），并定期尝试重新打开 */
+static void read_shm_video_frame(pip_session_data_t *pip_data)
+{
+    switch_time_t now = switch_micro_time_now();
+    switch_time_t stall_us = (switch_time_t)pip_config.shm_stall_ms * 1000;
+    const uint8_t *data[3];
+    int linesize[3];
+    uint64_t seq;
+
+    if ((seq = pip_shm_ring_latest(&pip_data->shm_ring, data, linesize, NULL)) && seq != pip_data->shm_seq)
     {
-        ret = avcodec_receive_packet(pip_data->output_codec_ctx, pip_data->output_packet);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+        for (int i = 0; i < 3; i++)
         {
-            break;
+            pip_data->frame_main->data[i] = (uint8_t *)data[i];
+            pip_data->frame_main->linesize[i] = linesize[i];
         }
-        else if (ret < 0)
+        pip_data->frame_main->width = pip_data->main_width;
+        pip_data->frame_main->height = pip_data->main_height;
+        pip_data->frame_main->format = AV_PIX_FMT_YUV420P;
+        pip_data->shm_seq = seq;
+        pip_data->shm_last_frame = now;
+        pip_data->local_frames_count++;
+
+        if (pip_data->shm_stalled)
         {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "接收编码包失败\n");
-            return SWITCH_STATUS_FALSE;
+            pip_data->shm_stalled = SWITCH_FALSE;
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "共享内存渲染源 %s 已恢复\n", pip_data->shm_name);
         }
+        return;
+    }
 
-        /* 设置包时间戳 */
-        av_packet_rescale_ts(pip_data->output_packet, pip_data->output_codec_ctx->time_base,
-                             pip_data->output_stream->time_base);
-        pip_data->output_packet->stream_index = pip_data->output_stream->index;
-
-        /* 写入包到文件 */
-        ret = av_interleaved_write_frame(pip_data->output_fmt_ctx, pip_data->output_packet);
-        av_packet_unref(pip_data->output_packet);
-
-        if (ret < 0)
+    if (now - pip_data->shm_last_frame < stall_us)
+    {
+        return;
+    }
+    if (!pip_data->shm_stalled)
+    {
+        pip_data->shm_stalled = SWITCH_TRUE;
+        pip_data->shm_stalls++;
+        pip_data->shm_last_reopen = now;
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "共享内存渲染源 %s 超过%dms没有新帧，保持%s\n",
+                          pip_data->shm_name, pip_config.shm_stall_ms, pip_data->shm_seq ? "最后一帧" : "等待第一帧");
+    }
+    else if (now - pip_data->shm_last_reopen >= stall_us)
+    {
+        pip_data->shm_last_reopen = now;
+        if (pip_shm_reopen(pip_data))
         {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "写入帧失败\n");
-            return SWITCH_STATUS_FALSE;
+            read_shm_video_frame(pip_data);
         }
     }
-
-    return SWITCH_STATUS_SUCCESS;
 }
 
-/* 刷新编码器缓冲区 */
-static switch_status_t flush_encoder(pip_session_data_t *pip_data)
+/* 开启（或以新名称重新开启）输出旁路。帧环在调用线程中创建，只在安装时短暂持有frame_mutex */
+static switch_status_t pip_output_tap_start(pip_session_data_t *pip_data, const char *name, int slots, char *err,
+                                            switch_size_t errlen)
 {
+    pip_output_tap_t *tap, *old;
+    switch_bool_t over_limit;
     int ret;
 
-    if (!pip_data->output_codec_ctx || !pip_data->output_fmt_ctx || !pip_data->output_packet)
+    if (!(tap = calloc(1, sizeof(*tap))))
     {
-        return SWITCH_STATUS_FALSE;
+        snprintf(err, errlen, "内存不足");
+        return SWITCH_STATUS_MEMERR;
+    }
+    if (zstr(name))
+    {
+        snprintf(tap->name, sizeof(tap->name), "%s%s", PIP_OUTPUT_TAP_NAME_PREFIX, pip_data->uuid);
+    }
+    else
+    {
+        snprintf(tap->name, sizeof(tap->name), "%s%s", *name == '/' ? "" : "/", name);
     }
 
-    /* 发送NULL帧来刷新编码器 */
-    ret = avcodec_send_frame(pip_data->output_codec_ctx, NULL);
-    if (ret < 0)
+    if ((ret = pip_shm_ring_create(tap->name, pip_data->main_width, pip_data->main_height, slots, &tap->ring)) < 0)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "刷新编码器时发送NULL帧失败: %d\n", ret);
+        snprintf(err, errlen, "创建共享内存帧环失败: %s (%s)", tap->name, strerror(-ret));
+        free(tap);
         return SWITCH_STATUS_FALSE;
     }
-
-    /* 接收所有剩余的包 */
-    while (1)
+    switch_mutex_lock(metrics_mutex);
+    over_limit = pip_config.max_memory_bytes && pip_mem_total + tap->ring.map_size > pip_config.max_memory_bytes;
+    switch_mutex_unlock(metrics_mutex);
+    if (over_limit)
     {
-        ret = avcodec_receive_packet(pip_data->output_codec_ctx, pip_data->output_packet);
-        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
-        {
-            break; // 没有更多帧了
-        }
-        else if (ret < 0)
-        {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "刷新编码器时接收包失败: %d\n", ret);
-            break;
-        }
-
-        /* 设置包时间戳 */
-        av_packet_rescale_ts(pip_data->output_packet, pip_data->output_codec_ctx->time_base,
-                             pip_data->output_stream->time_base);
-        pip_data->output_packet->stream_index = pip_data->output_stream->index;
+        snprintf(err, errlen, "超出模块内存上限");
+        pip_shm_ring_close(&tap->ring, tap->name);
+        free(tap);
+        return SWITCH_STATUS_MEMERR;
+    }
 
-        /* 写入包到文件 */
-        ret = av_interleaved_write_frame(pip_data->output_fmt_ctx, pip_data->output_packet);
-        av_packet_unref(pip_data->output_packet);
+    switch_mutex_lock(pip_data->frame_mutex);
+    if (pip_data->cleaned)
+    {
+        switch_mutex_unlock(pip_data->frame_mutex);
+        snprintf(err, errlen, "会话已停止");
+        pip_output_tap_free(tap);
+        return SWITCH_STATUS_FALSE;
+    }
+    old = pip_data->output_tap;
+    pip_data->output_tap = tap;
+    pip_mem_charge(pip_data, PIP_MEM_FRAMES, pip_mem_frames_total(pip_data));
+    switch_mutex_unlock(pip_data->frame_mutex);
 
-        if (ret < 0)
-        {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "刷新时写入帧失败: %d\n", ret);
-        }
+    /* 同名重开时旧帧环的名称已被新帧环替换，只解除映射 */
+    if (old && !strcmp(old->name, tap->name))
+    {
+        pip_shm_ring_shutdown(&old->ring);
+        pip_shm_ring_close(&old->ring, NULL);
+        free(old);
+    }
+    else
+    {
+        pip_output_tap_free(old);
     }
 
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "会话 %s 输出旁路已开启: %s (%dx%d, %d个槽位)\n",
+                      pip_data->uuid, tap->name, pip_data->main_width, pip_data->main_height, slots);
     return SWITCH_STATUS_SUCCESS;
 }
 
-/* 媒体钩子回调：处理远程视频（读取） */
-static switch_bool_t pip_read_video_callback(switch_media_bug_t *bug, void *user_data, switch_abc_type_t type)
+static void pip_output_tap_stop(pip_session_data_t *pip_data)
 {
-    pip_session_data_t *pip_data = (pip_session_data_t *)user_data;
-    switch_frame_t *frame = NULL;
+    pip_output_tap_t *tap;
 
-    switch (type)
-    {
-    case SWITCH_ABC_TYPE_INIT:
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "PIP远程视频钩子初始化\n");
-        break;
+    switch_mutex_lock(pip_data->frame_mutex);
+    tap = pip_data->output_tap;
+    pip_data->output_tap = NULL;
+    pip_mem_charge(pip_data, PIP_MEM_FRAMES, pip_mem_frames_total(pip_data));
+    switch_mutex_unlock(pip_data->frame_mutex);
 
-    case SWITCH_ABC_TYPE_READ_VIDEO_PING:
-        // 从媒体钩子中获取视频帧
+    pip_output_tap_free(tap);
+}
+
+/* 通知读取方帧环已关闭并删除名称；已挂上的读取方保留映射，直到自行离开 */
+static void pip_output_tap_free(pip_output_tap_t *tap)
+{
+    if (!tap)
+    {
+        return;
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "输出旁路已关闭: %s (发布 %llu 帧)\n", tap->name,
+                      (unsigned long long)tap->published);
+    pip_shm_ring_shutdown(&tap->ring);
+    pip_shm_ring_close(&tap->ring, tap->name);
+    free(tap);
+}
+
+/* 把frame_output写入下一个槽位并唤醒读取方；从不等待读取方。调用方持有frame_mutex */
+static void pip_output_tap_publish(pip_session_data_t *pip_data)
+{
+    pip_output_tap_t *tap = pip_data->output_tap;
+    AVFrame *out = pip_data->frame_output;
+    uint8_t *data[3];
+    int linesize[3];
+    uint64_t seq = pip_shm_ring_begin(&tap->ring, data, linesize);
+
+    for (int i = 0; i < 3; i++)
+    {
+        int width = i ? (out->width + 1) / 2 : out->width;
+        int height = i ? (out->height + 1) / 2 : out->height;
+
+        for (int y = 0; y < height; y++)
+        {
+            memcpy(data[i] + (size_t)y * linesize[i], out->data[i] + (size_t)y * out->linesize[i], width);
+        }
+    }
+    pip_shm_ring_commit(&tap->ring, seq, (int64_t)pip_data->frames_composited, pip_data->remote_frames_count);
+    tap->published++;
+}
+
+/* ---------- 快照 ---------- */
+
+/* API线程：把请求压入会话的请求链，由合成线程在下一次合成前一并处理。会话已停止时返回失败 */
+static switch_status_t pip_snapshot_request(pip_session_data_t *pip_data, pip_snapshot_t *snapshot)
+{
+    pip_snapshot_t *head = __atomic_load_n(&pip_data->snapshot_request, __ATOMIC_ACQUIRE);
+
+    __atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL);
+    do
+    {
+        snapshot->next = head;
+    } while (!__atomic_compare_exchange_n(&pip_data->snapshot_request, &head, snapshot, SWITCH_TRUE, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+
+    /* 清理在压入之前已经取走过请求链：链上的请求（含本请求）不会再有人处理，由这里结束 */
+    if (!pip_data->active)
+    {
+        pip_snapshot_fail_all(__atomic_exchange_n(&pip_data->snapshot_request, NULL, __ATOMIC_ACQ_REL), "会话已停止");
+        return SWITCH_STATUS_FALSE;
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 合成线程（持有frame_mutex，叠加之前）：把上一次合成的frame_output连同缓冲区交给快照线程，
+ * 换上新分配的缓冲区供本次叠加写入。两个叠加函数都先把主视频复制到整帧再混合PIP，
+ * 窗口完全移出画面或遮罩尺寸不符时也是如此，新缓冲区不需要初始化。
+ * 同一帧上的其他请求各持有一份缓冲区引用，都不复制像素 */
+static void pip_snapshot_serve(pip_session_data_t *pip_data)
+{
+    pip_snapshot_t *list, *snapshot, *next;
+    AVFrame *fresh, *frame;
+
+    /* 还没有合成过时frame_output没有内容，请求留到下一次 */
+    if (!pip_data->frames_composited ||
+        !(list = __atomic_exchange_n(&pip_data->snapshot_request, NULL, __ATOMIC_ACQ_REL)))
+    {
+        return;
+    }
+
+    if (!(fresh = av_frame_alloc()))
+    {
+        pip_snapshot_fail_all(list, "分配输出帧失败");
+        return;
+    }
+    fresh->format = pip_data->frame_output->format;
+    fresh->width = pip_data->frame_output->width;
+    fresh->height = pip_data->frame_output->height;
+    if (av_frame_get_buffer(fresh, 32) < 0 || av_frame_copy_props(fresh, pip_data->frame_output) < 0)
+    {
+        av_frame_free(&fresh);
+        pip_snapshot_fail_all(list, "分配输出帧失败");
+        return;
+    }
+
+    /* 感兴趣区域等侧数据随属性复制到新帧，录像编码不受影响 */
+    frame = pip_data->frame_output;
+    pip_data->frame_output = fresh;
+
+    /* 压入队列后请求可能随即完成并释放，先取下一个 */
+    for (; list; list = next)
+    {
+        snapshot = list;
+        next = snapshot->next;
+        if (!next)
+        {
+            snapshot->frame = frame;
+            frame = NULL;
+        }
+        else if (!(snapshot->frame = av_frame_clone(frame)))
+        {
+            pip_snapshot_finish(snapshot, SWITCH_STATUS_MEMERR, "分配输出帧失败");
+            continue;
+        }
+        pip_data->snapshots++;
+        if (switch_queue_trypush(pip_snapshot_queue, snapshot) != SWITCH_STATUS_SUCCESS)
+        {
+            pip_snapshot_finish(snapshot, SWITCH_STATUS_FALSE, "快照队列已满");
+        }
+    }
+    av_frame_free(&frame);
+}
+
+/* 交出的输出帧在这里释放；通知等待的请求方并放下合成/快照线程持有的引用 */
+static void pip_snapshot_finish(pip_snapshot_t *snapshot, switch_status_t status, const char *err)
+{
+    av_frame_free(&snapshot->frame);
+
+    switch_mutex_lock(snapshot->mutex);
+    snapshot->status = status;
+    if (err)
+    {
+        switch_copy_string(snapshot->err, err, sizeof(snapshot->err));
+    }
+    snapshot->done = SWITCH_TRUE;
+    switch_thread_cond_signal(snapshot->cond);
+    switch_mutex_unlock(snapshot->mutex);
+
+    pip_snapshot_release(snapshot);
+}
+
+/* 以失败结束整条请求链（会话停止、分配失败） */
+static void pip_snapshot_fail_all(pip_snapshot_t *list, const char *err)
+{
+    while (list)
+    {
+        pip_snapshot_t *next = list->next;
+
+        pip_snapshot_finish(list, SWITCH_STATUS_FALSE, err);
+        list = next;
+    }
+}
+
+static void pip_snapshot_release(pip_snapshot_t *snapshot)
+{
+    switch_memory_pool_t *pool;
+
+    if (__atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        av_frame_free(&snapshot->frame);
+        pool = snapshot->pool;
+        switch_core_destroy_memory_pool(&pool);
+    }
+}
+
+/* 快照线程：缩放到目标宽度并编码为JPEG或PNG，写入文件（先写临时文件再改名）或转为base64 */
+static switch_status_t pip_snapshot_encode(pip_snapshot_t *snapshot)
+{
+    const AVFrame *src = snapshot->frame;
+    enum AVPixelFormat format = snapshot->png ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_YUVJ420P;
+    struct SwsContext *sws_ctx = NULL;
+    AVCodecContext *codec_ctx = NULL;
+    AVCodec *encoder;
+    AVFrame *frame = NULL;
+    AVPacket *packet = NULL;
+    switch_status_t status = SWITCH_STATUS_FALSE;
+    int width = snapshot->width < src->width ? snapshot->width & ~1 : src->width;
+    int height = (int)((int64_t)src->height * width / src->width) & ~1;
+
+    if (width < 16 || height < 16)
+    {
+        snprintf(snapshot->err, sizeof(snapshot->err), "快照尺寸过小: %dx%d", width, height);
+        return SWITCH_STATUS_FALSE;
+    }
+    snapshot->out_width = width;
+    snapshot->out_height = height;
+
+    if (!(encoder = avcodec_find_encoder(snapshot->png ? AV_CODEC_ID_PNG : AV_CODEC_ID_MJPEG)) ||
+        !(codec_ctx = avcodec_alloc_context3(encoder)) || !(frame = av_frame_alloc()) ||
+        !(packet = av_packet_alloc()))
+    {
+        snprintf(snapshot->err, sizeof(snapshot->err), "%s编码器不可用", snapshot->png ? "PNG" : "JPEG");
+        goto done;
+    }
+    codec_ctx->width = width;
+    codec_ctx->height = height;
+    codec_ctx->pix_fmt = format;
+    codec_ctx->time_base = (AVRational){1, PIP_OUTPUT_FPS};
+    if (!snapshot->png)
+    {
+        codec_ctx->flags |= AV_CODEC_FLAG_QSCALE;
+        codec_ctx->global_quality = FF_QP2LAMBDA * PIP_SNAPSHOT_JPEG_QSCALE;
+    }
+
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    if (avcodec_open2(codec_ctx, encoder, NULL) < 0 || av_frame_get_buffer(frame, 32) < 0 ||
+        !(sws_ctx = sws_getContext(src->width, src->height, src->format, width, height, format, SWS_BILINEAR, NULL,
+                                   NULL, NULL)))
+    {
+        snprintf(snapshot->err, sizeof(snapshot->err), "初始化快照编码失败");
+        goto done;
+    }
+    if (!snapshot->png)
+    {
+        frame->quality = codec_ctx->global_quality; /* 固定量化时MJPEG取帧上的quality */
+    }
+    if (sws_scale(sws_ctx, (const uint8_t *const *)src->data, src->linesize, 0, src->height, frame->data,
+                  frame->linesize) < 0 ||
+        avcodec_send_frame(codec_ctx, frame) < 0 || avcodec_send_frame(codec_ctx, NULL) < 0 ||
+        avcodec_receive_packet(codec_ctx, packet) < 0)
+    {
+        snprintf(snapshot->err, sizeof(snapshot->err), "快照编码失败");
+        goto done;
+    }
+    snapshot->bytes = packet->size;
+
+    if (!zstr(snapshot->path))
+    {
+        char tmp[sizeof(snapshot->path) + 8];
+        FILE *fp;
+
+        snprintf(tmp, sizeof(tmp), "%s.tmp", snapshot->path);
+        if (!(fp = fopen(tmp, "wb")))
+        {
+            snprintf(snapshot->err, sizeof(snapshot->err), "无法创建文件: %s (%s)", tmp, strerror(errno));
+            goto done;
+        }
+        if (fwrite(packet->data, 1, packet->size, fp) != (size_t)packet->size || fclose(fp) != 0 ||
+            rename(tmp, snapshot->path) < 0)
+        {
+            snprintf(snapshot->err, sizeof(snapshot->err), "写入文件失败: %s", snapshot->path);
+            unlink(tmp);
+            goto done;
+        }
+    }
+    else
+    {
+        switch_size_t len = ((switch_size_t)packet->size + 2) / 3 * 4 + 1;
+
+        if (!(snapshot->base64 = switch_core_alloc(snapshot->pool, len)) ||
+            switch_b64_encode(packet->data, packet->size, (unsigned char *)snapshot->base64, len) !=
+                SWITCH_STATUS_SUCCESS)
+        {
+            snprintf(snapshot->err, sizeof(snapshot->err), "base64编码失败");
+            goto done;
+        }
+    }
+    status = SWITCH_STATUS_SUCCESS;
+
+done:
+    if (sws_ctx)
+    {
+        sws_freeContext(sws_ctx);
+    }
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&codec_ctx);
+    return status;
+}
+
+/* 快照线程：取到NULL时退出。编码串行进行，大量请求同时到达时由pip_snapshot_pending限流 */
+static void *SWITCH_THREAD_FUNC pip_snapshot_thread(switch_thread_t *thread, void *obj)
+{
+    void *pop = NULL;
+
+    while (switch_queue_pop(pip_snapshot_queue, &pop) == SWITCH_STATUS_SUCCESS && pop)
+    {
+        pip_snapshot_t *snapshot = (pip_snapshot_t *)pop;
+        switch_bool_t abandoned;
+
+        /* 请求方已超时返回的不再编码 */
+        switch_mutex_lock(snapshot->mutex);
+        abandoned = snapshot->abandoned;
+        switch_mutex_unlock(snapshot->mutex);
+        pip_snapshot_finish(snapshot, abandoned ? SWITCH_STATUS_FALSE : pip_snapshot_encode(snapshot), NULL);
+    }
+
+    return NULL;
+}
+
+static switch_status_t pip_snapshot_start(void)
+{
+    switch_threadattr_t *thd_attr = NULL;
+
+    /* 已接受的请求数不超过snapshot-max-pending，队列不会满 */
+    if (switch_queue_create(&pip_snapshot_queue, pip_config.snapshot_max_pending, module_pool) !=
+        SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "创建PIP快照队列失败\n");
+        return SWITCH_STATUS_FALSE;
+    }
+
+    switch_threadattr_create(&thd_attr, module_pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    if (switch_thread_create(&pip_snapshot_thread_handle, thd_attr, pip_snapshot_thread, NULL, module_pool) !=
+        SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "创建PIP快照线程失败\n");
+        pip_snapshot_thread_handle = NULL;
+        return SWITCH_STATUS_FALSE;
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 会话全部停止之后调用：队列中已交出的帧处理完再退出 */
+static void pip_snapshot_stop(void)
+{
+    switch_status_t retval;
+
+    if (pip_snapshot_thread_handle)
+    {
+        switch_queue_push(pip_snapshot_queue, NULL);
+        switch_thread_join(&retval, pip_snapshot_thread_handle);
+        pip_snapshot_thread_handle = NULL;
+    }
+}
+
+/* ---------- 字幕 ----------
+ * 字体在模块加载时打开一次，字形第一次出现时光栅化进字形图集；每段文字第一次使用时拼成遮罩并缓存，
+ * 合成时只混合文字外接矩形内的像素，与文字长度无关。 */
+
+/* 颜色：常用颜色名，或RRGGBB（可带#或0x前缀），转换为Y、U、V */
+static switch_status_t pip_color_parse(const char *value, uint8_t yuv[3])
+{
+    static const struct
+    {
+        const char *name;
+        uint32_t rgb;
+    } names[] = {{"white", 0xFFFFFF}, {"black", 0x000000}, {"red", 0xFF0000},  {"green", 0x00FF00},
+                 {"blue", 0x0000FF},  {"yellow", 0xFFFF00}, {"cyan", 0x00FFFF}, {"magenta", 0xFF00FF},
+                 {"gray", 0x808080},  {"grey", 0x808080}};
+    const char *hex = value;
+    unsigned long rgb;
+    char *end;
+
+    for (size_t i = 0; i < switch_arraylen(names); i++)
+    {
+        if (!strcasecmp(value, names[i].name))
+        {
+            pip_rgb_to_yuv(names[i].rgb, yuv);
+            return SWITCH_STATUS_SUCCESS;
+        }
+    }
+
+    if (*hex == '#')
+    {
+        hex++;
+    }
+    else if (!strncasecmp(hex, "0x", 2))
+    {
+        hex += 2;
+    }
+    rgb = strtoul(hex, &end, 16);
+    if (*end || end - hex != 6)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+    pip_rgb_to_yuv((uint32_t)rgb, yuv);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 模块加载时打开字体；打不开时字幕不启用，不影响画中画本身 */
+static void pip_subtitle_start(void)
+{
+    pip_font_t *font = NULL;
+    int ret;
+
+    memset(&pip_text_cache, 0, sizeof(pip_text_cache));
+    switch_mutex_init(&pip_text_mutex, SWITCH_MUTEX_UNNESTED, module_pool);
+    if (!pip_config.subtitle_enabled)
+    {
+        return;
+    }
+
+    if ((ret = pip_font_open(pip_config.subtitle_font, pip_config.subtitle_font_size, &font)) < 0)
+    {
+        if (ret == AVERROR(ENOSYS))
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "模块编译时未找到FreeType，字幕不可用\n");
+        }
+        else
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "打开字幕字体失败，字幕不可用: %s (%d)\n",
+                              pip_config.subtitle_font, ret);
+        }
+        return;
+    }
+    pip_text_cache.font = font;
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "字幕字体: %s %dpx\n", pip_config.subtitle_font,
+                      pip_config.subtitle_font_size);
+}
+
+/* 会话全部停止之后调用 */
+static void pip_subtitle_stop(void)
+{
+    if (!pip_text_mutex)
+    {
+        return;
+    }
+    switch_mutex_lock(pip_text_mutex);
+    pip_text_cache_free(&pip_text_cache);
+    pip_font_close(&pip_text_cache.font);
+    switch_mutex_unlock(pip_text_mutex);
+    switch_mutex_destroy(pip_text_mutex);
+    pip_text_mutex = NULL;
+}
+
+/* 会话启动时取得字幕遮罩：通道变量video_pip_subtitle优先，为空时使用配置subtitle-text。
+ * 配置和通道变量中不方便写换行，文字中的反斜杠加n按换行处理 */
+static void pip_subtitle_acquire(pip_session_data_t *pip_data)
+{
+    const char *text;
+    char buf[sizeof(pip_config.subtitle_text)];
+    size_t n = 0;
+    int ret;
+
+    if (!pip_text_cache.font)
+    {
+        return;
+    }
+    if (!(text = switch_channel_get_variable(pip_data->channel, PIP_VAR_SUBTITLE)))
+    {
+        text = pip_config.subtitle_text;
+    }
+    if (zstr(text))
+    {
+        return;
+    }
+    for (const char *p = text; *p && n + 1 < sizeof(buf); p++)
+    {
+        if (p[0] == '\\' && p[1] == 'n')
+        {
+            buf[n++] = '\n';
+            p++;
+        }
+        else
+        {
+            buf[n++] = *p;
+        }
+    }
+    buf[n] = '\0';
+
+    switch_mutex_lock(pip_text_mutex);
+    ret = pip_text_acquire(&pip_text_cache, buf, pip_config.subtitle_color, &pip_data->subtitle);
+    switch_mutex_unlock(pip_text_mutex);
+    if (ret < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "生成字幕失败，本会话不显示字幕: %s (%d)\n", text,
+                          ret);
+    }
+}
+
+static void pip_subtitle_release(pip_session_data_t *pip_data)
+{
+    if (!pip_data->subtitle)
+    {
+        return;
+    }
+    switch_mutex_lock(pip_text_mutex);
+    pip_text_release(&pip_text_cache, pip_data->subtitle);
+    switch_mutex_unlock(pip_text_mutex);
+    pip_data->subtitle = NULL;
+}
+
+/* ---------- 背景图层 ----------
+ * background-image按background-blend-mode和background-opacity叠在背景视频上（PIP窗口和字幕之下）。
+ * 图片是静态的，它在混合公式中的部分按背景尺寸预先算成逐像素系数，合成时每个本地帧只做一遍定点运算。 */
+
+/* 模块加载时解码图片；打不开时不使用背景图层，不影响画中画本身 */
+static void pip_background_start(void)
+{
+    switch_mutex_init(&pip_background_mutex, SWITCH_MUTEX_UNNESTED, module_pool);
+    if (zstr(pip_config.background_image))
+    {
+        return;
+    }
+    if (pip_config.background_opacity <= 0.0f)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "background-opacity为0，不使用背景图层\n");
+        return;
+    }
+    if (access(pip_config.background_image, R_OK) != 0 ||
+        pip_image_decode(pip_config.background_image, &pip_background_image) != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "无法加载背景图片，不使用背景图层: %s\n",
+                          pip_config.background_image);
+        return;
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "背景图层: %s (%dx%d) %s 透明度=%.2f\n",
+                      pip_config.background_image, pip_background_image->width, pip_background_image->height,
+                      pip_blend_mode_name(pip_config.background_blend_mode), pip_config.background_opacity);
+}
+
+/* 会话全部停止之后调用 */
+static void pip_background_stop(void)
+{
+    if (!pip_background_mutex)
+    {
+        return;
+    }
+    switch_mutex_lock(pip_background_mutex);
+    while (pip_backgrounds)
+    {
+        pip_background_t *background = pip_backgrounds;
+
+        pip_backgrounds = background->next;
+        pip_blend_layer_free(&background->layer);
+        free(background);
+    }
+    av_frame_free(&pip_background_image);
+    switch_mutex_unlock(pip_background_mutex);
+    switch_mutex_destroy(pip_background_mutex);
+    pip_background_mutex = NULL;
+}
+
+/* 按背景尺寸缩放图片并计算混合系数 */
+static pip_background_t *pip_background_create(int width, int height)
+{
+    struct SwsContext *sws_ctx = pip_scaler_create_format(AV_PIX_FMT_YUV420P, pip_background_image->width,
+                                                          pip_background_image->height, width, height);
+    pip_background_t *background = calloc(1, sizeof(*background));
+    AVFrame *scaled = av_frame_alloc();
+    int ret = AVERROR(ENOMEM);
+
+    if (sws_ctx && background && scaled)
+    {
+        scaled->format = AV_PIX_FMT_YUV420P;
+        scaled->width = width;
+        scaled->height = height;
+        if ((ret = av_frame_get_buffer(scaled, 32)) >= 0 &&
+            (ret = sws_scale(sws_ctx, (const uint8_t *const *)pip_background_image->data,
+                             pip_background_image->linesize, 0, pip_background_image->height, scaled->data,
+                             scaled->linesize)) >= 0)
+        {
+            ret = pip_blend_layer_build(&background->layer, scaled, pip_config.background_blend_mode,
+                                        pip_config.background_opacity);
+        }
+    }
+    sws_freeContext(sws_ctx);
+    av_frame_free(&scaled);
+
+    if (ret < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "生成背景图层失败: %dx%d (%d)\n", width, height,
+                          ret);
+        if (background)
+        {
+            pip_blend_layer_free(&background->layer);
+            free(background);
+        }
+        return NULL;
+    }
+    return background;
+}
+
+/* 会话启动时（背景尺寸已知）取得同尺寸的背景图层，没有时生成一份 */
+static void pip_background_acquire(pip_session_data_t *pip_data)
+{
+    pip_background_t *background;
+
+    if (!pip_background_image)
+    {
+        return;
+    }
+
+    switch_mutex_lock(pip_background_mutex);
+    for (background = pip_backgrounds; background; background = background->next)
+    {
+        if (background->layer.width == pip_data->main_width && background->layer.height == pip_data->main_height)
+        {
+            break;
+        }
+    }
+    if (!background && (background = pip_background_create(pip_data->main_width, pip_data->main_height)))
+    {
+        background->next = pip_backgrounds;
+        pip_backgrounds = background;
+    }
+    if (background)
+    {
+        background->refs++;
+        pip_data->background = background;
+    }
+    switch_mutex_unlock(pip_background_mutex);
+}
+
+/* 最后一个使用该尺寸的会话归还时释放系数 */
+static void pip_background_release(pip_session_data_t *pip_data)
+{
+    pip_background_t **link;
+
+    if (!pip_data->background)
+    {
+        return;
+    }
+    switch_mutex_lock(pip_background_mutex);
+    if (--pip_data->background->refs == 0)
+    {
+        for (link = &pip_backgrounds; *link != pip_data->background; link = &(*link)->next)
+            ;
+        *link = pip_data->background->next;
+        pip_blend_layer_free(&pip_data->background->layer);
+        free(pip_data->background);
+    }
+    switch_mutex_unlock(pip_background_mutex);
+    pip_data->background = NULL;
+}
+
+/* 初始化输出视频文件 */
+/* 输出编码器的时间基：固定帧率和按到达合成时为1/output-fps（时间戳即帧序号），可变帧率时为毫秒 */
+static AVRational pip_output_time_base(void)
+{
+    if (pip_config.output_clock == PIP_OUTPUT_CLOCK_VFR)
+    {
+        return (AVRational){1, PIP_OUTPUT_VFR_TIME_BASE};
+    }
+    return (AVRational){1, pip_config.output_fps};
+}
+
+/* 在pip_encoder_configure之后按输出时钟覆盖帧率、时间基和关键帧间隔（需在avcodec_open2之前调用）。
+ * 预热池的编码器同样经过这里，配置只在模块加载时读取，因此池中编码器总与新会话一致 */
+static void pip_output_timing_configure(AVCodecContext *codec_ctx)
+{
+    codec_ctx->time_base = pip_output_time_base();
+    codec_ctx->framerate = (AVRational){pip_config.output_fps, 1};
+    codec_ctx->gop_size = pip_config.output_fps; /* 与PIP_OUTPUT_GOP一样每秒一个关键帧 */
+}
+
+/* 启用感兴趣区域时打开自适应量化：ultrafast预设关闭了AQ，libx264在AQ关闭时忽略ROI侧数据 */
+static void pip_output_roi_configure(AVCodecContext *codec_ctx)
+{
+    if (pip_config.roi_qoffset < 0 && codec_ctx->codec_id == AV_CODEC_ID_H264)
+    {
+        av_opt_set(codec_ctx->priv_data, "aq-mode", "variance", 0);
+    }
+}
+
+/* 把PIP窗口（裁剪到画面内）作为感兴趣区域附加到输出帧，码率不变时编码器把更多比特分给窗口内的人脸，
+ * 背景静止或变化缓慢，少分一些几乎看不出来。侧数据随frame_output复用，只在窗口位置或尺寸变化时
+ * 重新分配：已送入编码器的帧持有旧缓冲区的引用，不能原地修改 */
+static void pip_output_roi_update(pip_session_data_t *pip_data)
+{
+    AVFrame *frame = pip_data->frame_output;
+    AVFrameSideData *side_data = av_frame_get_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    AVRegionOfInterest *roi;
+    int top = pip_data->pip_y > 0 ? pip_data->pip_y : 0;
+    int left = pip_data->pip_x > 0 ? pip_data->pip_x : 0;
+    int bottom = pip_data->pip_y + pip_data->pip_height;
+    int right = pip_data->pip_x + pip_data->pip_width;
+
+    bottom = bottom < pip_data->main_height ? bottom : pip_data->main_height;
+    right = right < pip_data->main_width ? right : pip_data->main_width;
+
+    if (side_data)
+    {
+        roi = (AVRegionOfInterest *)side_data->data;
+        if (roi->top == top && roi->left == left && roi->bottom == bottom && roi->right == right)
+        {
+            return;
+        }
+        av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    }
+
+    /* 窗口完全移出画面时不附加 */
+    if (bottom <= top || right <= left ||
+        !(side_data = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, sizeof(*roi))))
+    {
+        return;
+    }
+    roi = (AVRegionOfInterest *)side_data->data;
+    roi->self_size = sizeof(*roi);
+    roi->top = top;
+    roi->bottom = bottom;
+    roi->left = left;
+    roi->right = right;
+    roi->qoffset = (AVRational){(int)lrintf(pip_config.roi_qoffset * 100), 100};
+}
+
+static switch_status_t init_output_video_file(pip_session_data_t *pip_data, const char *output_file)
+{
+    AVCodec *encoder;
+    int ret;
+
+    /* 创建输出格式上下文 */
+    ret = avformat_alloc_output_context2(&pip_data->output_fmt_ctx, NULL, NULL, output_file);
+    if (ret < 0 || !pip_data->output_fmt_ctx)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法创建输出格式上下文\n");
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 查找H264编码器 */
+    encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!encoder)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "未找到H264编码器\n");
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 创建输出流 */
+    pip_data->output_stream = avformat_new_stream(pip_data->output_fmt_ctx, encoder);
+    if (!pip_data->output_stream)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法创建输出流\n");
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 优先借用预热池中已打开的编码器（池中编码器带全局头，只用于需要全局头的格式） */
+    if (pip_data->output_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    {
+        pip_data->output_codec_ctx =
+            pip_encoder_pool_borrow(pip_data->main_width, pip_data->main_height, &pip_data->output_pts_base);
+    }
+
+    if (pip_data->output_codec_ctx)
+    {
+        /* 复用的编码器GOP没有重置，第一帧强制为关键帧；时间戳接着上一个会话递增 */
+        pip_data->output_force_key = SWITCH_TRUE;
+        pip_data->output_pts_base -= pip_data->output_pts;
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "使用预热编码器 (%dx%d)\n", pip_data->main_width,
+                          pip_data->main_height);
+    }
+    else
+    {
+        pip_data->output_pts_base = 0;
+        pip_data->output_force_key = SWITCH_FALSE;
+
+        /* 分配编码器上下文 */
+        pip_data->output_codec_ctx = avcodec_alloc_context3(encoder);
+        if (!pip_data->output_codec_ctx)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配编码器上下文失败\n");
+            return SWITCH_STATUS_FALSE;
+        }
+
+        /* 设置编码器参数（与基准测试共用同一套配置），帧率和时间基按输出时钟覆盖 */
+        pip_encoder_configure(pip_data->output_codec_ctx, pip_data->main_width, pip_data->main_height);
+        pip_output_timing_configure(pip_data->output_codec_ctx);
+        pip_output_roi_configure(pip_data->output_codec_ctx);
+
+        /* 如果是MP4格式，需要全局头 */
+        // 判断是否需要全局头
+        if (pip_data->output_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+        {
+            // 设置编码器标志以包含全局头
+            pip_data->output_codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+
+        /* 打开编码器（失败时立即释放，会话上保留的编码器总是已打开的，可以归还预热池） */
+        ret = avcodec_open2(pip_data->output_codec_ctx, encoder, NULL);
+        if (ret < 0)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "打开编码器失败\n");
+            avcodec_free_context(&pip_data->output_codec_ctx);
+            return SWITCH_STATUS_FALSE;
+        }
+    }
+
+    /* 复制编码器参数到流 */
+    ret = avcodec_parameters_from_context(pip_data->output_stream->codecpar, pip_data->output_codec_ctx);
+    if (ret < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "复制编码器参数失败\n");
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 设置流的时间基 - 确保时间戳从0开始 */
+    pip_data->output_stream->time_base = pip_data->output_codec_ctx->time_base;
+    pip_data->output_stream->start_time = 0;
+
+    /* 打开输出文件 */
+    // 我们准备使用的输出格式，是不是那种不需要物理文件的特殊格式？
+    // mp4格式通常需要物理文件，所以我们需要打开文件进行写入
+    if (!(pip_data->output_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+    {
+        ret = avio_open(&pip_data->output_fmt_ctx->pb, output_file, AVIO_FLAG_WRITE);
+        if (ret < 0)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法打开输出文件: %s\n", output_file);
+            return SWITCH_STATUS_FALSE;
+        }
+    }
+
+    /* 写入文件头 */
+    ret = avformat_write_header(pip_data->output_fmt_ctx, NULL);
+    if (ret < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "写入文件头失败\n");
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 分配输出包 */
+    pip_data->output_packet = av_packet_alloc();
+    if (!pip_data->output_packet)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配输出包失败\n");
+        return SWITCH_STATUS_FALSE;
+    }
+
+    strncpy(pip_data->output_filename, output_file, sizeof(pip_data->output_filename) - 1);
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "输出视频文件初始化成功: %s (%dx%d)\n", output_file,
+                      pip_data->main_width, pip_data->main_height);
+
+    /* 同一合成结果的低分辨率码流 */
+    pip_renditions_open(pip_data, output_file);
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 初始化共享合成跟随者的录像文件：只有封装器，流参数复制自组长的编码器，不创建编码器 */
+static switch_status_t init_share_output_file(pip_session_data_t *pip_data, const char *output_file,
+                                              const AVCodecParameters *par)
+{
+    int ret;
+
+    ret = avformat_alloc_output_context2(&pip_data->output_fmt_ctx, NULL, NULL, output_file);
+    if (ret < 0 || !pip_data->output_fmt_ctx)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法创建输出格式上下文\n");
+        return SWITCH_STATUS_FALSE;
+    }
+
+    pip_data->output_stream = avformat_new_stream(pip_data->output_fmt_ctx, NULL);
+    if (!pip_data->output_stream || avcodec_parameters_copy(pip_data->output_stream->codecpar, par) < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法创建输出流\n");
+        return SWITCH_STATUS_FALSE;
+    }
+    pip_data->output_stream->time_base = pip_output_time_base();
+    pip_data->output_stream->start_time = 0;
+
+    if (!(pip_data->output_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+    {
+        ret = avio_open(&pip_data->output_fmt_ctx->pb, output_file, AVIO_FLAG_WRITE);
+        if (ret < 0)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法打开输出文件: %s\n", output_file);
+            return SWITCH_STATUS_FALSE;
+        }
+    }
+
+    ret = avformat_write_header(pip_data->output_fmt_ctx, NULL);
+    if (ret < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "写入文件头失败\n");
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 输出包只在文件头写入成功后分配，pip_output_close据此判断是否需要写文件尾 */
+    pip_data->output_packet = av_packet_alloc();
+    if (!pip_data->output_packet)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配输出包失败\n");
+        return SWITCH_STATUS_FALSE;
+    }
+
+    switch_copy_string(pip_data->output_filename, output_file, sizeof(pip_data->output_filename));
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 录像文件路径：<输出目录>/output_pip_<时间>_<uuid><后缀>.mp4，带UUID避免同一秒启动的会话写同一个文件 */
+static void pip_output_path(pip_session_data_t *pip_data, const char *suffix, char *path, switch_size_t len)
+{
+    time_t now = time(NULL);
+    struct tm tm_now;
+
+    localtime_r(&now, &tm_now);
+    snprintf(path, len, "%s/output_pip_%04d%02d%02d_%02d%02d%02d_%s%s.mp4", pip_output_dir, tm_now.tm_year + 1900,
+             tm_now.tm_mon + 1, tm_now.tm_mday, tm_now.tm_hour, tm_now.tm_min, tm_now.tm_sec, pip_data->uuid,
+             suffix);
+}
+
+/* 结束录像：刷新并归还编码器、写文件尾、关闭文件。
+ * 跟随者先退出共享组，组长在刷新出的最后几个包扇出之后才退出 */
+static void pip_output_close(pip_session_data_t *pip_data)
+{
+    if (pip_data->share_group && !pip_data->output_codec_ctx)
+    {
+        pip_share_leave(pip_data);
+    }
+
+    /* 低分辨率码流的编码线程写完已提交的帧后关闭 */
+    pip_renditions_close(pip_data);
+
+    if (pip_data->output_codec_ctx)
+    {
+        /* 刷新编码器 */
+        if (pip_data->output_fmt_ctx)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "开始刷新编码器...\n");
+            flush_encoder(pip_data);
+        }
+
+        /* 归还预热池（重置后复用），不能复用时释放 */
+        pip_encoder_pool_return(pip_data->output_codec_ctx, pip_data->output_pts_base + pip_data->output_pts);
+        pip_data->output_codec_ctx = NULL;
+    }
+
+    if (pip_data->share_group)
+    {
+        pip_share_leave(pip_data);
+    }
+
+    if (pip_data->output_fmt_ctx)
+    {
+        /* 写入文件尾（文件头未写成功时没有输出包，跳过） */
+        if (pip_data->output_packet)
+        {
+            int ret = av_write_trailer(pip_data->output_fmt_ctx);
+            if (ret < 0)
+            {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "写入视频文件尾失败: %d\n", ret);
+            }
+        }
+
+        if (!(pip_data->output_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+        {
+            avio_closep(&pip_data->output_fmt_ctx->pb);
+        }
+        avformat_free_context(pip_data->output_fmt_ctx);
+        pip_data->output_fmt_ctx = NULL;
+        pip_data->output_stream = NULL;
+
+        if (pip_data->output_packet)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "PIP输出视频已保存: %s\n",
+                              pip_data->output_filename);
+        }
+    }
+
+    av_packet_free(&pip_data->output_packet);
+}
+
+/* ---------- 低分辨率码流 ----------
+ * 与完整录像同时录制供回看界面使用的低分辨率版本，不需要通话结束后再转码。
+ * 每个码流从合成结果缩放一次，由自己的线程编码和写文件，与完整录像的编码并行。 */
+
+/* 按主画面宽高比计算码流尺寸（偶数）；不小于主画面的高度不生成码流，返回的高度为0 */
+static void pip_rendition_size(int main_width, int main_height, int height, int *width_out, int *height_out)
+{
+    *width_out = 0;
+    *height_out = 0;
+    if (height <= 0 || height >= main_height)
+    {
+        return;
+    }
+    *height_out = height & ~1;
+    *width_out = (int)((int64_t)main_width * *height_out / main_height + 1) & ~1;
+}
+
+/* 录像编码器的内存估算：完整录像加上配置的各低分辨率码流 */
+static uint64_t pip_mem_encoder_estimate(int width, int height)
+{
+    uint64_t total = pip_mem_codec_estimate(width, height, PIP_MEM_ENCODER_FRAMES);
+
+    for (int i = 0; i < pip_config.rendition_count; i++)
+    {
+        int rendition_width, rendition_height;
+
+        pip_rendition_size(width, height, pip_config.rendition_heights[i], &rendition_width, &rendition_height);
+        if (rendition_height)
+        {
+            total += pip_mem_codec_estimate(rendition_width, rendition_height, PIP_MEM_ENCODER_FRAMES);
+        }
+    }
+    return total;
+}
+
+static AVFrame *pip_rendition_frame_alloc(int width, int height)
+{
+    AVFrame *frame = av_frame_alloc();
+
+    if (frame)
+    {
+        frame->format = AV_PIX_FMT_YUV420P;
+        frame->width = width;
+        frame->height = height;
+        if (av_frame_get_buffer(frame, 32) < 0)
+        {
+            av_frame_free(&frame);
+        }
+    }
+    return frame;
+}
+
+/* 打开一个码流：编码器参数与完整录像相同（帧率、时间基、关键帧间隔），码率按像素数折算 */
+static pip_rendition_t *pip_rendition_open(pip_session_data_t *pip_data, int width, int height, const char *filename)
+{
+    pip_rendition_t *rendition;
+    AVCodec *encoder;
+    switch_threadattr_t *thd_attr = NULL;
+    int64_t bit_rate;
+
+    if (!(rendition = calloc(1, sizeof(*rendition))))
+    {
+        return NULL;
+    }
+    rendition->owner = pip_data;
+    rendition->width = width;
+    rendition->height = height;
+    switch_copy_string(rendition->filename, filename, sizeof(rendition->filename));
+
+    if (avformat_alloc_output_context2(&rendition->fmt_ctx, NULL, NULL, filename) < 0 || !rendition->fmt_ctx ||
+        !(encoder = avcodec_find_encoder(AV_CODEC_ID_H264)) ||
+        !(rendition->stream = avformat_new_stream(rendition->fmt_ctx, encoder)) ||
+        !(rendition->codec_ctx = avcodec_alloc_context3(encoder)))
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "创建%dp码流的输出上下文失败\n", height);
+        pip_rendition_free(rendition);
+        return NULL;
+    }
+
+    pip_encoder_configure(rendition->codec_ctx, width, height);
+    pip_output_timing_configure(rendition->codec_ctx);
+    bit_rate = (int64_t)PIP_OUTPUT_BITRATE * width * height / ((int64_t)pip_data->main_width * pip_data->main_height);
+    rendition->codec_ctx->bit_rate = bit_rate > PIP_RENDITION_MIN_BITRATE ? bit_rate : PIP_RENDITION_MIN_BITRATE;
+    if (rendition->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    {
+        rendition->codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (avcodec_open2(rendition->codec_ctx, encoder, NULL) < 0 ||
+        avcodec_parameters_from_context(rendition->stream->codecpar, rendition->codec_ctx) < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "打开%dp码流的编码器失败\n", height);
+        pip_rendition_free(rendition);
+        return NULL;
+    }
+    rendition->stream->time_base = rendition->codec_ctx->time_base;
+    rendition->stream->start_time = 0;
+
+    if ((!(rendition->fmt_ctx->oformat->flags & AVFMT_NOFILE) &&
+         avio_open(&rendition->fmt_ctx->pb, filename, AVIO_FLAG_WRITE) < 0) ||
+        avformat_write_header(rendition->fmt_ctx, NULL) < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法写入%dp码流文件: %s\n", height, filename);
+        pip_rendition_free(rendition);
+        return NULL;
+    }
+
+    if (!(rendition->packet = av_packet_alloc()) ||
+        !(rendition->sws_ctx = pip_scaler_create_format(AV_PIX_FMT_YUV420P, pip_data->main_width,
+                                                        pip_data->main_height, width, height)) ||
+        !(rendition->fill = pip_rendition_frame_alloc(width, height)) ||
+        !(rendition->pending = pip_rendition_frame_alloc(width, height)) ||
+        !(rendition->work = pip_rendition_frame_alloc(width, height)))
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配%dp码流的缩放帧失败\n", height);
+        pip_rendition_free(rendition);
+        return NULL;
+    }
+
+    switch_mutex_init(&rendition->mutex, SWITCH_MUTEX_UNNESTED, pip_data->pool);
+    switch_thread_cond_create(&rendition->cond, pip_data->pool);
+    switch_threadattr_create(&thd_attr, pip_data->pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    if (!rendition->mutex || !rendition->cond ||
+        switch_thread_create(&rendition->thread, thd_attr, pip_rendition_thread, rendition, pip_data->pool) !=
+            SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "启动%dp码流的编码线程失败\n", height);
+        rendition->thread = NULL;
+        pip_rendition_free(rendition);
+        return NULL;
+    }
+
+    return rendition;
+}
+
+/* 停止编码线程（先编码完尚未取走的帧），刷新编码器，写文件尾并释放 */
+static void pip_rendition_free(pip_rendition_t *rendition)
+{
+    switch_status_t status;
+
+    if (!rendition)
+    {
+        return;
+    }
+
+    if (rendition->thread)
+    {
+        switch_mutex_lock(rendition->mutex);
+        rendition->stopping = SWITCH_TRUE;
+        switch_thread_cond_signal(rendition->cond);
+        switch_mutex_unlock(rendition->mutex);
+        switch_thread_join(&status, rendition->thread);
+    }
+
+    if (rendition->packet && !rendition->failed)
+    {
+        pip_rendition_encode(rendition, NULL);
+    }
+    if (rendition->fmt_ctx)
+    {
+        if (rendition->packet && av_write_trailer(rendition->fmt_ctx) < 0)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "写入%dp码流文件尾失败\n", rendition->height);
+        }
+        if (!(rendition->fmt_ctx->oformat->flags & AVFMT_NOFILE))
+        {
+            avio_closep(&rendition->fmt_ctx->pb);
+        }
+        avformat_free_context(rendition->fmt_ctx);
+        if (rendition->packet)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "PIP %dp码流已保存: %s (%llu 帧, 跳过 %llu 帧)\n",
+                              rendition->height, rendition->filename, (unsigned long long)rendition->frames,
+                              (unsigned long long)rendition->dropped);
+        }
+    }
+
+    avcodec_free_context(&rendition->codec_ctx);
+    av_packet_free(&rendition->packet);
+    if (rendition->sws_ctx)
+    {
+        sws_freeContext(rendition->sws_ctx);
+    }
+    av_frame_free(&rendition->fill);
+    av_frame_free(&rendition->pending);
+    av_frame_free(&rendition->work);
+    free(rendition);
+}
+
+/* 编码线程（关闭时为调用线程）：编码一帧并写入码流文件，frame为NULL时刷新编码器 */
+static switch_status_t pip_rendition_encode(pip_rendition_t *rendition, const AVFrame *frame)
+{
+    int ret = avcodec_send_frame(rendition->codec_ctx, frame);
+
+    while (ret >= 0)
+    {
+        ret = avcodec_receive_packet(rendition->codec_ctx, rendition->packet);
+        if (ret < 0)
+        {
+            break;
+        }
+        av_packet_rescale_ts(rendition->packet, rendition->codec_ctx->time_base, rendition->stream->time_base);
+        rendition->packet->stream_index = rendition->stream->index;
+        ret = av_interleaved_write_frame(rendition->fmt_ctx, rendition->packet);
+        av_packet_unref(rendition->packet);
+    }
+
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+    {
+        return SWITCH_STATUS_SUCCESS;
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "%dp码流编码或写入失败: %d\n", rendition->height, ret);
+    return SWITCH_STATUS_FALSE;
+}
+
+static void *SWITCH_THREAD_FUNC pip_rendition_thread(switch_thread_t *thread, void *obj)
+{
+    pip_rendition_t *rendition = (pip_rendition_t *)obj;
+
+    switch_mutex_lock(rendition->mutex);
+    for (;;)
+    {
+        AVFrame *frame;
+
+        while (!rendition->has_pending && !rendition->stopping)
+        {
+            switch_thread_cond_wait(rendition->cond, rendition->mutex);
+        }
+        if (!rendition->has_pending)
+        {
+            break;
+        }
+        frame = rendition->pending;
+        rendition->pending = rendition->work;
+        rendition->work = frame;
+        rendition->has_pending = SWITCH_FALSE;
+        switch_mutex_unlock(rendition->mutex);
+
+        if (pip_rendition_encode(rendition, frame) == SWITCH_STATUS_SUCCESS)
+        {
+            rendition->frames++;
+            __atomic_add_fetch(&rendition->owner->rendition_frames, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            rendition->failed = SWITCH_TRUE;
+        }
+
+        switch_mutex_lock(rendition->mutex);
+        if (rendition->failed)
+        {
+            break;
+        }
+    }
+    switch_mutex_unlock(rendition->mutex);
+
+    return NULL;
+}
+
+/* 完整录像打开后按配置打开各码流，文件名为完整录像加 _<高度>p 后缀；单个码流失败不影响录像 */
+static void pip_renditions_open(pip_session_data_t *pip_data, const char *output_file)
+{
+    const char *ext = strrchr(output_file, '.');
+    int stem = ext ? (int)(ext - output_file) : (int)strlen(output_file);
+
+    for (int i = 0; i < pip_config.rendition_count && pip_data->rendition_count < PIP_MAX_RENDITIONS; i++)
+    {
+        pip_rendition_t *rendition;
+        char filename[512];
+        int width, height;
+
+        pip_rendition_size(pip_data->main_width, pip_data->main_height, pip_config.rendition_heights[i], &width,
+                           &height);
+        if (!height)
+        {
+            continue;
+        }
+        snprintf(filename, sizeof(filename), "%.*s_%dp%s", stem, output_file, height, ext ? ext : "");
+        if ((rendition = pip_rendition_open(pip_data, width, height, filename)))
+        {
+            pip_data->renditions[pip_data->rendition_count++] = rendition;
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "低分辨率码流已打开: %s (%dx%d)\n", filename,
+                              width, height);
+        }
+    }
+}
+
+/* 合成线程（持有frame_mutex）：把frame_output缩放到各码流并交给编码线程，从不等待编码线程 */
+static void pip_renditions_submit(pip_session_data_t *pip_data)
+{
+    for (int i = 0; i < pip_data->rendition_count; i++)
+    {
+        pip_rendition_t *rendition = pip_data->renditions[i];
+        AVFrame *frame;
+
+        if (rendition->failed)
+        {
+            continue;
+        }
+        if (sws_scale(rendition->sws_ctx, (const uint8_t *const *)pip_data->frame_output->data,
+                      pip_data->frame_output->linesize, 0, pip_data->main_height, rendition->fill->data,
+                      rendition->fill->linesize) < 0)
+        {
+            continue;
+        }
+        rendition->fill->pts = pip_data->frame_output->pts;
+
+        switch_mutex_lock(rendition->mutex);
+        if (rendition->has_pending)
+        {
+            rendition->dropped++;
+            __atomic_add_fetch(&pip_data->rendition_dropped, 1, __ATOMIC_RELAXED);
+        }
+        frame = rendition->pending;
+        rendition->pending = rendition->fill;
+        rendition->fill = frame;
+        rendition->has_pending = SWITCH_TRUE;
+        switch_thread_cond_signal(rendition->cond);
+        switch_mutex_unlock(rendition->mutex);
+    }
+}
+
+/* 关闭全部码流（持有frame_mutex，或会话尚未开始合成） */
+static void pip_renditions_close(pip_session_data_t *pip_data)
+{
+    for (int i = 0; i < pip_data->rendition_count; i++)
+    {
+        pip_rendition_free(pip_data->renditions[i]);
+        pip_data->renditions[i] = NULL;
+    }
+    pip_data->rendition_count = 0;
+}
+
+/* 设置或清除强制关键帧：pict_type为I时x264输出IDR（GOP是封闭的） */
+static void pip_output_frame_set_key(AVFrame *frame, switch_bool_t key)
+{
+    frame->pict_type = key ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+#ifdef AV_FRAME_FLAG_KEY
+    frame->flags = key ? frame->flags | AV_FRAME_FLAG_KEY : frame->flags & ~AV_FRAME_FLAG_KEY;
+#else
+    frame->key_frame = key ? 1 : 0;
+#endif
+}
+
+/* 编码器输出的包减去借用时的时间戳基准，录像时间戳仍从本会话的第一帧开始 */
+static void pip_output_packet_unbase(pip_session_data_t *pip_data, AVPacket *packet)
+{
+    if (!pip_data->output_pts_base)
+    {
+        return;
+    }
+    if (packet->pts != AV_NOPTS_VALUE)
+    {
+        packet->pts -= pip_data->output_pts_base;
+    }
+    if (packet->dts != AV_NOPTS_VALUE)
+    {
+        packet->dts -= pip_data->output_pts_base;
+    }
+}
+
+/* 写入输出帧 */
+static switch_status_t write_output_frame(pip_session_data_t *pip_data)
+{
+    int ret;
+
+    if (!pip_data->output_codec_ctx || !pip_data->frame_output)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 设置帧时间戳 - 使用会话专用的PTS计数器 */
+    pip_data->frame_output->pts = pip_data->output_pts++;
+
+    /* 低分辨率码流先交给各自的编码线程，与下面的完整录像编码并行 */
+    if (pip_data->rendition_count)
+    {
+        pip_renditions_submit(pip_data);
+    }
+
+    if (pip_config.roi_qoffset < 0)
+    {
+        pip_output_roi_update(pip_data);
+    }
+
+    /* 发送帧到编码器：借用的编码器时间戳加上基准，第一帧强制为关键帧，发送后恢复（输出旁路、快照仍用原值） */
+    pip_data->frame_output->pts += pip_data->output_pts_base;
+    if (pip_data->output_force_key)
+    {
+        pip_output_frame_set_key(pip_data->frame_output, SWITCH_TRUE);
+    }
+    ret = avcodec_send_frame(pip_data->output_codec_ctx, pip_data->frame_output);
+    pip_data->frame_output->pts -= pip_data->output_pts_base;
+    if (pip_data->output_force_key)
+    {
+        pip_output_frame_set_key(pip_data->frame_output, SWITCH_FALSE);
+        pip_data->output_force_key = ret < 0 ? SWITCH_TRUE : SWITCH_FALSE;
+    }
+    if (ret < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "发送帧到编码器失败\n");
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 从编码器接收包 */
+    while (ret >= 0)
+    {
+        ret = avcodec_receive_packet(pip_data->output_codec_ctx, pip_data->output_packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+        {
+            break;
+        }
+        else if (ret < 0)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "接收编码包失败\n");
+            return SWITCH_STATUS_FALSE;
+        }
+
+        pip_output_packet_unbase(pip_data, pip_data->output_packet);
+
+        /* 共享合成组长：同一个包先写入各跟随者的录像 */
+        if (pip_data->share_group)
+        {
+            pip_share_fanout(pip_data, pip_data->output_packet);
+        }
+
+        /* 设置包时间戳 */
+        av_packet_rescale_ts(pip_data->output_packet, pip_data->output_codec_ctx->time_base,
+                             pip_data->output_stream->time_base);
+        pip_data->output_packet->stream_index = pip_data->output_stream->index;
+        pip_data->encoder_bytes += pip_data->output_packet->size;
+
+        /* 写入包到文件 */
+        ret = av_interleaved_write_frame(pip_data->output_fmt_ctx, pip_data->output_packet);
+        av_packet_unref(pip_data->output_packet);
+
+        if (ret < 0)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "写入帧失败\n");
+            return SWITCH_STATUS_FALSE;
+        }
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 刷新编码器缓冲区 */
+static switch_status_t flush_encoder(pip_session_data_t *pip_data)
+{
+    int ret;
+
+    if (!pip_data->output_codec_ctx || !pip_data->output_fmt_ctx || !pip_data->output_packet)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 发送NULL帧来刷新编码器 */
+    ret = avcodec_send_frame(pip_data->output_codec_ctx, NULL);
+    if (ret < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "刷新编码器时发送NULL帧失败: %d\n", ret);
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 接收所有剩余的包 */
+    while (1)
+    {
+        ret = avcodec_receive_packet(pip_data->output_codec_ctx, pip_data->output_packet);
+        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+        {
+            break; // 没有更多帧了
+        }
+        else if (ret < 0)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "刷新编码器时接收包失败: %d\n", ret);
+            break;
+        }
+
+        pip_output_packet_unbase(pip_data, pip_data->output_packet);
+
+        /* 共享合成组长：同一个包先写入各跟随者的录像 */
+        if (pip_data->share_group)
+        {
+            pip_share_fanout(pip_data, pip_data->output_packet);
+        }
+
+        /* 设置包时间戳 */
+        av_packet_rescale_ts(pip_data->output_packet, pip_data->output_codec_ctx->time_base,
+                             pip_data->output_stream->time_base);
+        pip_data->output_packet->stream_index = pip_data->output_stream->index;
+        pip_data->encoder_bytes += pip_data->output_packet->size;
+
+        /* 写入包到文件 */
+        ret = av_interleaved_write_frame(pip_data->output_fmt_ctx, pip_data->output_packet);
+        av_packet_unref(pip_data->output_packet);
+
+        if (ret < 0)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "刷新时写入帧失败: %d\n", ret);
+        }
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 共享合成组的键：组名相同只说明远程源相同，背景、尺寸、布局和样式也一致时合成结果才相同 */
+static void pip_share_key(pip_session_data_t *pip_data, const char *local_file, char *key, switch_size_t len)
+{
+    const pip_style_t *style = &pip_data->style;
+    const pip_color_adjust_t *color = &pip_data->color_adjust;
+
+    snprintf(key, len, "%s|%s|%dx%d|%dx%d+%d+%d|%.3f|%d,%02x%02x%02x,%d,%d|%.3f,%.3f,%.3f|%s", pip_data->share_name,
+             local_file, pip_data->main_width, pip_data->main_height, pip_data->pip_width, pip_data->pip_height,
+             pip_data->pip_x, pip_data->pip_y, pip_data->pip_opacity, style->border_width, style->border_color[0],
+             style->border_color[1], style->border_color[2], style->corner_radius, style->feather, color->brightness,
+             color->contrast, color->saturation, pip_data->subtitle ? pip_data->subtitle->text : "");
+}
+
+/* 查找可加入的同键组，成功时以跟随者身份加入并打开只有封装器的录像文件。
+ * 文件在锁外打开，期间组长可能离开，重新持锁后再确认一次 */
+static switch_status_t pip_share_join(pip_session_data_t *pip_data, const char *key, const char *output_file)
+{
+    pip_share_group_t *group;
+    AVCodecParameters *par;
+    pip_session_data_t **members;
+    switch_status_t status = SWITCH_STATUS_FALSE;
+
+    if (!(par = avcodec_parameters_alloc()))
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+
+    switch_mutex_lock(pip_share_mutex);
+    for (group = pip_share_groups; group; group = group->next)
+    {
+        if (group->joinable && group->leader && !strcmp(group->key, key))
+        {
+            break;
+        }
+    }
+    if (!group || avcodec_parameters_copy(par, group->leader->output_stream->codecpar) < 0)
+    {
+        switch_mutex_unlock(pip_share_mutex);
+        avcodec_parameters_free(&par);
+        return SWITCH_STATUS_FALSE;
+    }
+    group->refs++; /* 打开文件期间保持组存活 */
+    switch_mutex_unlock(pip_share_mutex);
+
+    if (init_share_output_file(pip_data, output_file, par) != SWITCH_STATUS_SUCCESS)
+    {
+        pip_output_close(pip_data);
+        unlink(output_file);
+    }
+    else
+    {
+        status = SWITCH_STATUS_SUCCESS;
+    }
+    avcodec_parameters_free(&par);
+
+    switch_mutex_lock(pip_share_mutex);
+    if (status == SWITCH_STATUS_SUCCESS && group->leader && group->member_count == group->member_capacity)
+    {
+        int capacity = group->member_capacity ? group->member_capacity * 2 : 8;
+
+        /* 扇出只持组锁遍历成员表，换表也要持组锁 */
+        switch_mutex_lock(group->mutex);
+        if ((members = realloc(group->members, capacity * sizeof(*members))))
+        {
+            group->members = members;
+            group->member_capacity = capacity;
+        }
+        switch_mutex_unlock(group->mutex);
+    }
+    if (status == SWITCH_STATUS_SUCCESS && group->leader && group->member_count < group->member_capacity)
+    {
+        switch_mutex_lock(group->mutex);
+        group->members[group->member_count++] = pip_data;
+        switch_mutex_unlock(group->mutex);
+        pip_data->share_group = group;
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "会话 %s 加入共享合成组 %s（组长 %s，跟随者 %d）\n",
+                          pip_data->uuid, pip_data->share_name, group->leader->uuid, group->member_count);
+        if (pip_config.rendition_count)
+        {
+            /* 跟随者没有编码器，低分辨率码流只由组长写；转为独立合成时才打开自己的码流 */
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "会话 %s 是共享合成的跟随者，不写低分辨率码流\n",
+                              pip_data->uuid);
+        }
+    }
+    else
+    {
+        status = SWITCH_STATUS_FALSE;
+    }
+    switch_mutex_unlock(pip_share_mutex);
+
+    if (status != SWITCH_STATUS_SUCCESS)
+    {
+        /* 组长已离开：归还引用，放弃已打开的空文件，由调用方改为独立合成 */
+        pip_data->share_group = group;
+        pip_share_leave(pip_data);
+        if (pip_data->output_fmt_ctx)
+        {
+            pip_output_close(pip_data);
+            unlink(output_file);
+        }
+    }
+    return status;
+}
+
+/* 以组长身份建立新组，组长必须有自己的编码器 */
+static void pip_share_lead(pip_session_data_t *pip_data, const char *key)
+{
+    pip_share_group_t *group;
+
+    if (!(group = calloc(1, sizeof(*group))))
+    {
+        return;
+    }
+    if (switch_core_new_memory_pool(&group->pool) != SWITCH_STATUS_SUCCESS)
+    {
+        free(group);
+        return;
+    }
+    if (switch_mutex_init(&group->mutex, SWITCH_MUTEX_UNNESTED, group->pool) != SWITCH_STATUS_SUCCESS)
+    {
+        switch_core_destroy_memory_pool(&group->pool);
+        free(group);
+        return;
+    }
+    switch_copy_string(group->key, key, sizeof(group->key));
+    group->leader = pip_data;
+    group->joinable = SWITCH_TRUE;
+    group->time_base = pip_data->output_codec_ctx->time_base;
+    group->refs = 1;
+
+    switch_mutex_lock(pip_share_mutex);
+    group->next = pip_share_groups;
+    pip_share_groups = group;
+    switch_mutex_unlock(pip_share_mutex);
+
+    pip_data->share_group = group;
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "会话 %s 建立共享合成组 %s\n", pip_data->uuid,
+                      pip_data->share_name);
+}
+
+/* 退出所在的组，最后一个成员退出时释放组 */
+static void pip_share_leave(pip_session_data_t *pip_data)
+{
+    pip_share_group_t *group = pip_data->share_group;
+    pip_share_group_t **link;
+
+    if (!group)
+    {
+        return;
+    }
+
+    switch_mutex_lock(pip_share_mutex);
+    if (group->leader == pip_data)
+    {
+        /* 跟随者在各自的下一帧发现组长离开，转为独立合成 */
+        __atomic_store_n(&group->leader, NULL, __ATOMIC_RELEASE);
+        group->joinable = SWITCH_FALSE;
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "共享合成组 %s 的组长 %s 已离开，扇出 %llu 个包\n",
+                          pip_data->share_name, pip_data->uuid, (unsigned long long)group->packets);
+    }
+    else
+    {
+        /* 等组长写完正在扇出的包，之后调用方才能关闭录像文件 */
+        switch_mutex_lock(group->mutex);
+        for (int i = 0; i < group->member_count; i++)
+        {
+            if (group->members[i] == pip_data)
+            {
+                group->members[i] = group->members[--group->member_count];
+                break;
+            }
+        }
+        switch_mutex_unlock(group->mutex);
+    }
+
+    if (--group->refs == 0)
+    {
+        for (link = &pip_share_groups; *link; link = &(*link)->next)
+        {
+            if (*link == group)
+            {
+                *link = group->next;
+                break;
+            }
+        }
+        free(group->members);
+        switch_core_destroy_memory_pool(&group->pool);
+        free(group);
+    }
+    pip_data->share_group = NULL;
+    switch_mutex_unlock(pip_share_mutex);
+}
+
+/* 组长线程：把一个编码包（编码器时间基）写入每个跟随者的录像。
+ * 中途加入的跟随者从下一个关键帧开始，时间戳以该关键帧为零点。
+ * 组长持有组的引用，组不会被释放；只持组锁，写文件期间其他组的加入、退出和状态查询不受影响 */
+static void pip_share_fanout(pip_session_data_t *pip_data, const AVPacket *packet)
+{
+    pip_share_group_t *group = pip_data->share_group;
+
+    __atomic_add_fetch(&group->packets, 1, __ATOMIC_RELAXED);
+    switch_mutex_lock(group->mutex);
+    for (int i = 0; i < group->member_count; i++)
+    {
+        pip_session_data_t *member = group->members[i];
+
+        if (!member->share_synced)
+        {
+            if (!(packet->flags & AV_PKT_FLAG_KEY))
+            {
+                continue;
+            }
+            member->share_synced = SWITCH_TRUE;
+            member->share_dts_base = packet->dts;
+        }
+        if (av_packet_ref(member->output_packet, packet) < 0)
+        {
+            continue;
+        }
+        member->output_packet->pts -= member->share_dts_base;
+        member->output_packet->dts -= member->share_dts_base;
+        av_packet_rescale_ts(member->output_packet, group->time_base, member->output_stream->time_base);
+        member->output_packet->stream_index = member->output_stream->index;
+        if (av_interleaved_write_frame(member->output_fmt_ctx, member->output_packet) >= 0)
+        {
+            member->share_packets++;
+        }
+        av_packet_unref(member->output_packet);
+    }
+    switch_mutex_unlock(group->mutex);
+}
+
+/* 跟随者的媒体线程（持有frame_mutex）：仍跟随组长时返回TRUE，本帧不做任何处理。
+ * 组长已离开或本会话的布局被单独修改时退出组，改为独立合成并录制到新的文件 */
+static switch_bool_t pip_share_follow(pip_session_data_t *pip_data)
+{
+    char output_file[512];
+    uint64_t encoder;
+    switch_bool_t over_limit;
+
+    if (__atomic_load_n(&pip_data->share_group->leader, __ATOMIC_ACQUIRE) &&
+        !__atomic_load_n(&pip_data->pending_layout_mask, __ATOMIC_SEQ_CST))
+    {
+        return SWITCH_TRUE;
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "会话 %s 退出共享合成组 %s，转为独立合成\n",
+                      pip_data->uuid, pip_data->share_name);
+    pip_output_close(pip_data);
+
+    /* 独立合成需要自己的编码器，超出内存上限时只合成不录制 */
+    encoder = pip_mem_encoder_estimate(pip_data->main_width, pip_data->main_height);
+    switch_mutex_lock(metrics_mutex);
+    over_limit = pip_config.max_memory_bytes && pip_mem_total + encoder > pip_config.max_memory_bytes;
+    switch_mutex_unlock(metrics_mutex);
+    if (over_limit)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "模块内存接近上限，会话 %s 不再保存输出视频\n",
+                          pip_data->uuid);
+        pip_data->mem_downgraded = SWITCH_TRUE;
+        return SWITCH_FALSE;
+    }
+
+    pip_output_path(pip_data, "_solo", output_file, sizeof(output_file));
+    if (init_output_video_file(pip_data, output_file) == SWITCH_STATUS_SUCCESS)
+    {
+        pip_mem_charge(pip_data, PIP_MEM_ENCODER, encoder);
+    }
+    else
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "输出文件初始化失败，将跳过保存\n");
+        pip_output_close(pip_data);
+    }
+    return SWITCH_FALSE;
+}
+
+/* 媒体钩子回调：处理远程视频（读取） */
+static switch_bool_t pip_read_video_callback(switch_media_bug_t *bug, void *user_data, switch_abc_type_t type)
+{
+    pip_session_data_t *pip_data = (pip_session_data_t *)user_data;
+    switch_frame_t *frame = NULL;
+    switch_time_t start;
+
+    switch (type)
+    {
+    case SWITCH_ABC_TYPE_INIT:
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "PIP远程视频钩子初始化\n");
+        break;
+
+    case SWITCH_ABC_TYPE_READ_VIDEO_PING:
+        // 从媒体钩子中获取视频帧
         frame = switch_core_media_bug_get_video_ping_frame(bug);
         if (frame && frame->img && pip_data->active)
         {
-            // 锁定互斥锁，确保线程安全
-            switch_mutex_lock(pip_data->frame_mutex);
+            // 锁定互斥锁，确保线程安全
+            switch_mutex_lock(pip_data->frame_mutex);
+
+            /* 共享合成的跟随者（没有编码器）：组长已完成同样的合成和编码，本帧不做处理 */
+            if (pip_data->share_group && !pip_data->output_codec_ctx && pip_share_follow(pip_data))
+            {
+                switch_mutex_unlock(pip_data->frame_mutex);
+                break;
+            }
+
+            start = switch_micro_time_now();
+
+            /* 输出时钟开启时布局和合成都在时钟线程中进行，这里只保存远程帧 */
+            if (!pip_data->clock_thread)
+            {
+                pip_layout_apply_pending(pip_data, start);
+            }
+
+            /* 保存最新的远程视频帧 */
+            if (pip_data->last_remote_frame)
+            {
+                if (pip_data->last_remote_frame->img)
+                {
+                    // 释放之前的图像数据，防止内存泄漏
+                    switch_img_free(&pip_data->last_remote_frame->img);
+                }
+            }
+            else
+            {
+                // 如果没有分配过last_remote_frame，分配内存
+                pip_data->last_remote_frame = switch_core_alloc(pip_data->pool, sizeof(switch_frame_t));
+                // 初始化内存
+                memset(pip_data->last_remote_frame, 0, sizeof(switch_frame_t));
+            }
+
+            /* 复制帧数据 */
+            pip_data->last_remote_frame->img =
+                switch_img_alloc(NULL, frame->img->fmt, frame->img->d_w, frame->img->d_h, 1);
+            if (pip_data->last_remote_frame->img)
+            {
+                uint64_t img_bytes = pip_img_bytes(pip_data->last_remote_frame->img);
+
+                /* 远程分辨率很少变化，只在大小变化时更新记账 */
+                if (img_bytes != pip_data->mem_bytes[PIP_MEM_REMOTE_IMAGE])
+                {
+                    pip_mem_charge(pip_data, PIP_MEM_REMOTE_IMAGE, img_bytes);
+                }
+
+                switch_img_copy(frame->img, &pip_data->last_remote_frame->img);
+                pip_data->remote_frames_count++;
+                pip_stage_record(&pip_data->stage_stats[PIP_STAGE_CAPTURE], start);
+
+                /* 处理画中画叠加 */
+                if (!pip_data->clock_thread)
+                {
+                    pip_data->sync_frames = pip_data->remote_frames_count;
+                    if (process_pip_overlay(pip_data) != SWITCH_STATUS_SUCCESS)
+                    {
+                        pip_data->frames_dropped++;
+                    }
+                    pip_stage_record(&pip_data->stage_stats[PIP_STAGE_TOTAL], start);
+                }
+            }
+
+            switch_mutex_unlock(pip_data->frame_mutex);
+
+            if (pip_data->remote_frames_count % 300 == 0)
+            { /* 每10秒记录一次 */
+                switch_log_printf(
+                    SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "捕获远程视频帧: %dx%d, 远程: %llu, 本地: %llu, PIP: %llu\n",
+                    frame->img->d_w, frame->img->d_h, (unsigned long long)pip_data->remote_frames_count,
+                    (unsigned long long)pip_data->local_frames_count, (unsigned long long)pip_data->frames_processed);
+            }
+        }
+        break;
+
+    case SWITCH_ABC_TYPE_CLOSE:
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "PIP远程视频钩子关闭\n");
+        /* 钩子已被摘除（挂机或停止命令）：注销并清理会话，再释放钩子持有的引用 */
+        if (pip_data)
+        {
+            pip_data->read_bug = NULL;
+            pip_session_retire(pip_data);
+            pip_session_release(pip_data);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return SWITCH_TRUE;
+}
+
+/* ---------- 输出时钟 ----------
+ * output-clock为cfr或vfr时，每个会话的时钟线程按output-fps的节拍合成和编码，媒体钩子只保存最新的远程帧。
+ * 远程帧率低于输出帧率或远程视频停顿时重复使用上一帧，高于输出帧率时多余的远程帧被覆盖，
+ * 录像时长与实际经过的时间一致，编码器负载也不随远程帧率抖动。 */
+
+/* 在挂媒体钩子之前启动；线程在第一帧远程视频到达后开始计时 */
+static switch_status_t pip_clock_start(pip_session_data_t *pip_data)
+{
+    switch_threadattr_t *thd_attr = NULL;
+
+    switch_threadattr_create(&thd_attr, pip_data->pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    if (switch_thread_create(&pip_data->clock_thread, thd_attr, pip_clock_thread, pip_data, pip_data->pool) !=
+        SWITCH_STATUS_SUCCESS)
+    {
+        pip_data->clock_thread = NULL;
+        return SWITCH_STATUS_FALSE;
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 等待时钟线程退出：调用方已把active置为FALSE，且不能持有frame_mutex。
+ * clock_thread保持非空，之后到达的远程帧仍只保存不合成 */
+static void pip_clock_stop(pip_session_data_t *pip_data)
+{
+    switch_status_t status;
+
+    if (pip_data->clock_thread)
+    {
+        switch_thread_join(&status, pip_data->clock_thread);
+    }
+}
+
+static void *SWITCH_THREAD_FUNC pip_clock_thread(switch_thread_t *thread, void *obj)
+{
+    pip_session_data_t *pip_data = (pip_session_data_t *)obj;
+    switch_time_t interval = 1000000 / pip_config.output_fps;
+    switch_time_t start = 0, next = switch_micro_time_now();
+    uint64_t tick = 0;
+
+    while (pip_data->active)
+    {
+        switch_time_t now = switch_micro_time_now();
+        uint64_t due;
+
+        if (now < next)
+        {
+            switch_sleep(next - now);
+            continue;
+        }
+
+        switch_mutex_lock(pip_data->frame_mutex);
+        if (!pip_data->active)
+        {
+            switch_mutex_unlock(pip_data->frame_mutex);
+            break;
+        }
+        if (!start && pip_data->last_remote_frame && pip_data->last_remote_frame->img)
+        {
+            start = now;
+        }
+        if (start)
+        {
+            pip_clock_tick(pip_data, tick, now - start);
+        }
+        switch_mutex_unlock(pip_data->frame_mutex);
+
+        if (!start)
+        {
+            next = now + interval;
+            continue;
+        }
+
+        /* 节拍时间按起点和序号计算，不累积取整误差；合成超过一个节拍时直接跳到当前节拍，不补帧 */
+        tick++;
+        due = (uint64_t)(switch_micro_time_now() - start) * pip_config.output_fps / 1000000;
+        if (due > tick)
+        {
+            pip_data->clock_overruns += due - tick;
+            tick = due;
+        }
+        next = start + (switch_time_t)(tick * 1000000 / pip_config.output_fps);
+    }
+
+    return NULL;
+}
+
+/* 时钟线程（持有frame_mutex）：合成并编码第tick个节拍的输出帧，elapsed为距第一个节拍的实际时间（微秒） */
+static void pip_clock_tick(pip_session_data_t *pip_data, uint64_t tick, switch_time_t elapsed)
+{
+    switch_time_t start = switch_micro_time_now();
+    uint64_t arrived = pip_data->remote_frames_count - pip_data->clock_remote_seen;
+
+    /* 可变帧率：没有新的远程帧时跳过本节拍，停顿过久时仍补一帧，背景继续播放 */
+    if (pip_config.output_clock == PIP_OUTPUT_CLOCK_VFR && !arrived &&
+        elapsed - pip_data->clock_last_output < PIP_OUTPUT_VFR_MAX_GAP_MS * 1000)
+    {
+        return;
+    }
+
+    if (!arrived)
+    {
+        pip_data->frames_repeated++;
+    }
+    else
+    {
+        pip_data->frames_superseded += arrived - 1;
+    }
+    pip_data->clock_remote_seen = pip_data->remote_frames_count;
+    pip_data->clock_last_output = elapsed;
+
+    pip_layout_apply_pending(pip_data, start);
+
+    /* 背景按节拍推进（与按到达合成时的远程帧数一样从1开始计数）；write_output_frame使用output_pts作为本帧时间戳 */
+    pip_data->sync_frames = tick + 1;
+    if (pip_config.output_clock == PIP_OUTPUT_CLOCK_VFR)
+    {
+        int64_t pts = elapsed / (1000000 / PIP_OUTPUT_VFR_TIME_BASE);
+
+        /* output_pts已是上一帧加1，保证时间戳严格递增 */
+        if (pts > pip_data->output_pts)
+        {
+            pip_data->output_pts = pts;
+        }
+    }
+    else
+    {
+        pip_data->output_pts = (int64_t)tick;
+    }
+
+    if (process_pip_overlay(pip_data) != SWITCH_STATUS_SUCCESS)
+    {
+        pip_data->frames_dropped++;
+    }
+    pip_stage_record(&pip_data->stage_stats[PIP_STAGE_TOTAL], start);
+}
+
+/* 处理画中画叠加 */
+static switch_status_t process_pip_overlay(pip_session_data_t *pip_data)
+{
+    if (!pip_data || !pip_data->active)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 检查是否使用图片模式 */
+    if (pip_data->use_image_mode)
+    {
+        /* 图片模式：使用固定的本地图片，不需要读取新帧 */
+        if (!pip_data->local_image_frame)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "图片模式下本地图片帧为空\n");
+            return SWITCH_STATUS_FALSE;
+        }
+
+        /* 将图片帧复制到frame_main用于处理 */
+        if (!pip_data->frame_main)
+        {
+            pip_data->frame_main = av_frame_alloc();
+            if (!pip_data->frame_main)
+            {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法分配主帧\n");
+                return SWITCH_STATUS_FALSE;
+            }
+        }
+
+        /* 复制图片帧数据到主帧 */
+        av_frame_unref(pip_data->frame_main);
+        if (av_frame_ref(pip_data->frame_main, pip_data->local_image_frame) < 0)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法复制图片帧\n");
+            return SWITCH_STATUS_FALSE;
+        }
+    }
+    else if (pip_data->shm_ring.map)
+    {
+        /* 共享内存模式：不做帧率换算，总是取写入方最新发布的帧 */
+        switch_time_t start = switch_micro_time_now();
+
+        read_shm_video_frame(pip_data);
+        pip_stage_record(&pip_data->stage_stats[PIP_STAGE_DECODE], start);
+    }
+    else if (pip_data->raw_source)
+    {
+        /* 预解码模式：按同样的帧率同步算出本地帧号，直接切换到映射中的对应帧 */
+        uint64_t expected_local_frames = (pip_data->sync_frames * pip_data->local_fps) / pip_data->target_fps;
+        switch_time_t start = switch_micro_time_now();
+
+        if (!pip_data->frame_main->data[0] || pip_data->local_frames_count <= expected_local_frames)
+        {
+            read_raw_video_frame(pip_data, expected_local_frames);
+        }
+        pip_stage_record(&pip_data->stage_stats[PIP_STAGE_DECODE], start);
+    }
+    else
+    {
+        /* 视频模式：使用原有的帧率同步策略 */
+        uint64_t expected_local_frames = (pip_data->sync_frames * pip_data->local_fps) / pip_data->target_fps;
+        switch_time_t start = switch_micro_time_now();
+
+        /* 如果本地帧数不足，读取更多帧 */
+        while (pip_data->local_frames_count < expected_local_frames)
+        {
+            if (read_local_video_frame(pip_data) != SWITCH_STATUS_SUCCESS)
+            {
+                /* 如果读取失败，可能到了文件末尾，停止处理 */
+                break;
+            }
+        }
+        pip_stage_record(&pip_data->stage_stats[PIP_STAGE_DECODE], start);
+
+        /* 记录同步信息 */
+        if (pip_data->sync_frames % 300 == 0)
+        { /* 每300个输出帧记录一次 */
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG,
+                              "帧率同步: 输出帧=%llu, 本地帧=%llu, 期望本地帧=%llu, 本地fps=%.2f, 目标fps=%.2f\n",
+                              (unsigned long long)pip_data->sync_frames,
+                              (unsigned long long)pip_data->local_frames_count,
+                              (unsigned long long)expected_local_frames,
+                              pip_data->local_fps, pip_data->target_fps);
+        }
+    }
+
+    /* 确保有远程视频帧 */
+    if (!pip_data->last_remote_frame || !pip_data->last_remote_frame->img)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 将switch_image_t转换为AVFrame进行处理 */
+    return convert_and_overlay_frames(pip_data);
+}
+
+/* 转换switch_image_t为AVFrame并执行叠加 */
+static switch_status_t convert_and_overlay_frames(pip_session_data_t *pip_data)
+{
+    switch_image_t *remote_img = pip_data->last_remote_frame->img;
+    enum AVPixelFormat remote_format;
+    AVFrame *main_frame;
+    switch_time_t start;
+    int planes = 0;
+
+    /* 检查远程视频帧尺寸 */
+    if (!remote_img || remote_img->d_w <= 0 || remote_img->d_h <= 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "远程视频帧尺寸无效: %dx%d\n",
+                          remote_img ? remote_img->d_w : 0, remote_img ? remote_img->d_h : 0);
+        return SWITCH_STATUS_FALSE;
+    }
+
+    if ((remote_format = pip_img_fmt_to_av(remote_img->fmt, &planes)) == AV_PIX_FMT_NONE)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "不支持的远程视频格式: %d\n", remote_img->fmt);
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 如果远程视频尺寸或格式改变（或布局修改了PIP尺寸），重新创建缩放上下文 */
+    if (!pip_data->sws_ctx_pip || pip_data->remote_width != remote_img->d_w ||
+        pip_data->remote_height != remote_img->d_h || pip_data->remote_format != remote_format)
+    {
+
+        if (pip_data->sws_ctx_pip)
+        {
+            sws_freeContext(pip_data->sws_ctx_pip);
+        }
+
+        pip_data->remote_width = remote_img->d_w;
+        pip_data->remote_height = remote_img->d_h;
+        pip_data->remote_format = remote_format;
+
+        pip_data->sws_ctx_pip = pip_scaler_create_format(remote_format, pip_data->remote_width,
+                                                         pip_data->remote_height, pip_data->pip_width,
+                                                         pip_data->pip_height);
+
+        if (!pip_data->sws_ctx_pip)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "重新创建缩放上下文失败: %dx%d -> %dx%d\n",
+                              pip_data->remote_width, pip_data->remote_height, pip_data->pip_width,
+                              pip_data->pip_height);
+            return SWITCH_STATUS_FALSE;
+        }
+
+        pip_data->scaler_rebuilds++;
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "缩放上下文已更新: %dx%d %s -> %dx%d\n",
+                          pip_data->remote_width, pip_data->remote_height, av_get_pix_fmt_name(remote_format),
+                          pip_data->pip_width, pip_data->pip_height);
+    }
+
+    /* 设置远程视频帧数据 */
+    pip_data->frame_pip->format = remote_format;
+    pip_data->frame_pip->width = remote_img->d_w;
+    pip_data->frame_pip->height = remote_img->d_h;
+
+    /* 直接引用远程图像的平面（NV12为2个，打包RGB为1个），不做中间转换 */
+    for (int i = 0; i < 3; i++)
+    {
+        pip_data->frame_pip->data[i] = i < planes ? remote_img->planes[i] : NULL;
+        pip_data->frame_pip->linesize[i] = i < planes ? remote_img->stride[i] : 0;
+
+        /* 验证数据完整性 */
+        if (i < planes && !pip_data->frame_pip->data[i])
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "远程视频数据指针为空\n");
+            return SWITCH_STATUS_FALSE;
+        }
+    }
+
+    /* 缩放远程视频 */
+    start = switch_micro_time_now();
+    int ret = sws_scale(pip_data->sws_ctx_pip, (const uint8_t *const *)pip_data->frame_pip->data,
+                        pip_data->frame_pip->linesize, 0, pip_data->frame_pip->height, pip_data->frame_pip_scaled->data,
+                        pip_data->frame_pip_scaled->linesize);
+
+    if (ret < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "视频缩放失败: %d (%dx%d -> %dx%d)\n", ret,
+                          pip_data->frame_pip->width, pip_data->frame_pip->height, pip_data->pip_width,
+                          pip_data->pip_height);
+        return SWITCH_STATUS_FALSE;
+    }
+    pip_stage_record(&pip_data->stage_stats[PIP_STAGE_SCALE], start);
+
+    /* 本地视频解码为非YUV420P格式时在叠加前转换一次 */
+    if (!(main_frame = pip_main_frame(pip_data)))
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 有快照请求时交出上一次合成的输出帧，本次叠加写入新缓冲区 */
+    if (__atomic_load_n(&pip_data->snapshot_request, __ATOMIC_ACQUIRE))
+    {
+        pip_snapshot_serve(pip_data);
+    }
+
+    /* 叠加视频 */
+    start = switch_micro_time_now();
+    if (pip_composite_frame(pip_data, main_frame) != SWITCH_STATUS_SUCCESS)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 共享内存帧是零拷贝读取的：叠加期间写入方绕环一整圈覆盖了该槽位时，这一帧可能有撕裂。
+     * 改用最新的槽位重新合成；重试后仍撕裂时本节拍不发布也不编码，录像和输出旁路停在上一帧 */
+    for (int retries = 0; pip_data->shm_ring.map && !pip_shm_ring_intact(&pip_data->shm_ring, pip_data->shm_seq);
+         retries++)
+    {
+        pip_data->shm_torn++;
+        if (retries == PIP_SHM_TORN_RETRIES)
+        {
+            pip_data->shm_torn_dropped++;
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "共享内存帧重新合成%d次后仍有撕裂，跳过本节拍\n",
+                              PIP_SHM_TORN_RETRIES);
+            pip_stage_record(&pip_data->stage_stats[PIP_STAGE_BLEND], start);
+            return SWITCH_STATUS_SUCCESS;
+        }
+        read_shm_video_frame(pip_data);
+        if (!(main_frame = pip_main_frame(pip_data)) ||
+            pip_composite_frame(pip_data, main_frame) != SWITCH_STATUS_SUCCESS)
+        {
+            return SWITCH_STATUS_FALSE;
+        }
+    }
+    pip_data->frames_composited++;
+    pip_stage_record(&pip_data->stage_stats[PIP_STAGE_BLEND], start);
+
+    if (pip_data->output_tap)
+    {
+        pip_output_tap_publish(pip_data);
+    }
+
+    /* 写入叠加后的帧到输出文件 */
+    if (pip_data->output_fmt_ctx)
+    {
+        start = switch_micro_time_now();
+        if (write_output_frame(pip_data) != SWITCH_STATUS_SUCCESS)
+        {
+            pip_stage_record(&pip_data->stage_stats[PIP_STAGE_ENCODE], start);
+            return SWITCH_STATUS_FALSE;
+        }
+        pip_stage_record(&pip_data->stage_stats[PIP_STAGE_ENCODE], start);
+        pip_data->frames_processed++; /* 增加处理帧数计数 */
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 把PIP和字幕叠加到main_frame上，结果写入frame_output */
+static switch_status_t pip_composite_frame(pip_session_data_t *pip_data, AVFrame *main_frame)
+{
+    if (pip_style_is_plain(&pip_data->style))
+    {
+        overlay_yuv420p_frames(main_frame, pip_data->frame_pip_scaled, pip_data->frame_output, pip_data->pip_x,
+                               pip_data->pip_y, pip_data->pip_opacity);
+    }
+    else
+    {
+        /* 遮罩只在尺寸或样式变化时重算，动画中尺寸按步长变化，透明度变化不需要重算 */
+        if (pip_data->alpha_mask_dirty || pip_data->alpha_mask.width != pip_data->pip_width ||
+            pip_data->alpha_mask.height != pip_data->pip_height)
+        {
+            if (pip_alpha_mask_build(&pip_data->alpha_mask, pip_data->pip_width, pip_data->pip_height,
+                                     &pip_data->style) < 0)
+            {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "生成PIP遮罩失败: %dx%d\n",
+                                  pip_data->pip_width, pip_data->pip_height);
+                return SWITCH_STATUS_FALSE;
+            }
+            pip_data->alpha_mask_dirty = SWITCH_FALSE;
+            pip_mem_charge(pip_data, PIP_MEM_FRAMES, pip_mem_frames_total(pip_data));
+        }
+        overlay_yuv420p_frames_masked(main_frame, pip_data->frame_pip_scaled, pip_data->frame_output,
+                                      pip_data->pip_x, pip_data->pip_y, pip_data->pip_opacity,
+                                      &pip_data->alpha_mask);
+    }
+    if (pip_data->subtitle)
+    {
+        overlay_yuv420p_mask_color(pip_data->frame_output, pip_config.subtitle_x, pip_config.subtitle_y,
+                                   pip_config.subtitle_opacity, &pip_data->subtitle->mask);
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* switch_image_t格式对应的FFmpeg像素格式及平面数，不支持时返回AV_PIX_FMT_NONE。
+ * FreeSWITCH按libyuv命名打包RGB：ARGB在内存中为B、G、R、A，RGB24为B、G、R */
+static enum AVPixelFormat pip_img_fmt_to_av(switch_img_fmt_t fmt, int *planes)
+{
+    switch (fmt)
+    {
+    case SWITCH_IMG_FMT_I420:
+        *planes = 3;
+        return AV_PIX_FMT_YUV420P;
+    case SWITCH_IMG_FMT_I422:
+        *planes = 3;
+        return AV_PIX_FMT_YUV422P;
+    case SWITCH_IMG_FMT_I444:
+        *planes = 3;
+        return AV_PIX_FMT_YUV444P;
+    case SWITCH_IMG_FMT_NV12:
+        *planes = 2;
+        return AV_PIX_FMT_NV12;
+    case SWITCH_IMG_FMT_ARGB:
+        *planes = 1;
+        return AV_PIX_FMT_BGRA;
+    case SWITCH_IMG_FMT_ARGB_LE:
+        *planes = 1;
+        return AV_PIX_FMT_RGBA;
+    case SWITCH_IMG_FMT_RGB24:
+        *planes = 1;
+        return AV_PIX_FMT_BGR24;
+    default:
+        *planes = 0;
+        return AV_PIX_FMT_NONE;
+    }
+}
+
+/* 远程图像副本占用的字节数，按各格式的平面数和色度行数计算 */
+static uint64_t pip_img_bytes(const switch_image_t *img)
+{
+    uint64_t chroma_rows = (img->fmt == SWITCH_IMG_FMT_I422 || img->fmt == SWITCH_IMG_FMT_I444) ? img->d_h
+                                                                                                : (img->d_h + 1) / 2;
+    int planes = 0;
+
+    pip_img_fmt_to_av(img->fmt, &planes);
+    return (uint64_t)img->stride[0] * img->d_h +
+           (uint64_t)((planes > 1 ? img->stride[1] : 0) + (planes > 2 ? img->stride[2] : 0)) * chroma_rows;
+}
+
+/* 把任意格式的帧转换为同尺寸的YUV420P帧；*dst尺寸不符时重新分配，*sws_ctx按参数复用 */
+static switch_status_t pip_frame_to_yuv420p(struct SwsContext **sws_ctx, const AVFrame *src, AVFrame **dst)
+{
+    if (!*dst || (*dst)->width != src->width || (*dst)->height != src->height)
+    {
+        av_frame_free(dst);
+        if (!(*dst = av_frame_alloc()))
+        {
+            return SWITCH_STATUS_MEMERR;
+        }
+        (*dst)->format = AV_PIX_FMT_YUV420P;
+        (*dst)->width = src->width;
+        (*dst)->height = src->height;
+        if (av_frame_get_buffer(*dst, 32) < 0)
+        {
+            av_frame_free(dst);
+            return SWITCH_STATUS_MEMERR;
+        }
+    }
+
+    *sws_ctx = sws_getCachedContext(*sws_ctx, src->width, src->height, src->format, src->width, src->height,
+                                    AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!*sws_ctx)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    if (sws_scale(*sws_ctx, (const uint8_t *const *)src->data, src->linesize, 0, src->height, (*dst)->data,
+                  (*dst)->linesize) < 0)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 叠加使用的主视频帧：YUV420P直接使用；其他格式（如yuv422p、yuvj420p）转换后缓存，
+ * 本地帧率低于输出帧率时同一本地帧不重复转换 */
+static AVFrame *pip_main_frame(pip_session_data_t *pip_data)
+{
+    AVFrame *main_frame = pip_data->frame_main;
+    AVFrame *converted;
+
+    /* 视频模式下第一帧尚未解码 */
+    if (!main_frame->data[0])
+    {
+        return NULL;
+    }
+    if (main_frame->format == AV_PIX_FMT_YUV420P)
+    {
+        return pip_main_frame_graded(pip_data, main_frame);
+    }
+
+    if (pip_data->frame_main_yuv && pip_data->main_converted_frame == pip_data->local_frames_count)
+    {
+        return pip_main_frame_graded(pip_data, pip_data->frame_main_yuv);
+    }
+
+    converted = pip_data->frame_main_yuv;
+    if (pip_frame_to_yuv420p(&pip_data->sws_ctx_main, main_frame, &pip_data->frame_main_yuv) !=
+        SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "本地视频帧格式转换失败: %s\n",
+                          av_get_pix_fmt_name(main_frame->format));
+        return NULL;
+    }
+    if (converted != pip_data->frame_main_yuv)
+    {
+        pip_mem_charge(pip_data, PIP_MEM_FRAMES, pip_mem_frames_total(pip_data));
+    }
+    pip_data->main_converted_frame = pip_data->local_frames_count;
+    return pip_main_frame_graded(pip_data, pip_data->frame_main_yuv);
+}
+
+/* 背景调色（<filters>或video_pip_update的brightness、contrast、saturation）和背景图层（background-image）：
+ * 都不需要时直接使用main_frame；否则每个本地帧先查表、再混合图层，重复合成同一本地帧时复用结果。
+ * 预解码文件和共享内存帧是只读映射，因此写入会话自己的缓冲区而不是原地修改 */
+static AVFrame *pip_main_frame_graded(pip_session_data_t *pip_data, AVFrame *main_frame)
+{
+    AVFrame *graded = pip_data->frame_main_graded;
+    switch_bool_t grade = !pip_color_adjust_is_identity(&pip_data->color_adjust);
+    switch_bool_t refresh = SWITCH_FALSE;
+    const pip_blend_layer_t *layer = NULL;
+
+    /* 图层按启动时的背景尺寸生成，尺寸不符的帧不混合 */
+    if (pip_data->background && pip_data->background->layer.width == main_frame->width &&
+        pip_data->background->layer.height == main_frame->height)
+    {
+        layer = &pip_data->background->layer;
+    }
+    if (!grade && !layer)
+    {
+        return main_frame;
+    }
+    /* 参数变化（包括恢复为不调色）后，缓存的结果不再有效 */
+    if (pip_data->color_lut_dirty)
+    {
+        if (grade)
+        {
+            pip_color_lut_build(&pip_data->color_lut, &pip_data->color_adjust);
+        }
+        pip_data->color_lut_dirty = SWITCH_FALSE;
+        refresh = SWITCH_TRUE;
+    }
+    if (graded && graded->width == main_frame->width && graded->height == main_frame->height && !refresh &&
+        pip_data->main_graded_frame == pip_data->local_frames_count)
+    {
+        return graded;
+    }
+
+    if (!graded || graded->width != main_frame->width || graded->height != main_frame->height)
+    {
+        av_frame_free(&pip_data->frame_main_graded);
+        if (!(graded = av_frame_alloc()))
+        {
+            return NULL;
+        }
+        graded->format = AV_PIX_FMT_YUV420P;
+        graded->width = main_frame->width;
+        graded->height = main_frame->height;
+        if (av_frame_get_buffer(graded, 32) < 0)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配调色帧失败: %dx%d\n", graded->width,
+                              graded->height);
+            av_frame_free(&graded);
+            return NULL;
+        }
+        pip_data->frame_main_graded = graded;
+        pip_mem_charge(pip_data, PIP_MEM_FRAMES, pip_mem_frames_total(pip_data));
+    }
+
+    if (grade)
+    {
+        pip_color_lut_apply(graded, main_frame, &pip_data->color_lut);
+    }
+    if (layer)
+    {
+        pip_blend_layer_apply(graded, grade ? graded : main_frame, layer);
+    }
+    pip_data->main_graded_frame = pip_data->local_frames_count;
+    return graded;
+}
+
+/* 初始化画中画处理上下文 */
+static switch_status_t init_pip_context(pip_session_data_t *pip_data, const char *local_video_file)
+{
+    char output_file[512];
+    char share_key[1024] = "";
+    const char *file_ext;
+
+    /* 检查文件扩展名以确定是图片还是视频 */
+    file_ext = strrchr(local_video_file, '.');
+    pip_data->use_image_mode = SWITCH_FALSE;
+
+    if (!strncmp(local_video_file, PIP_SHM_SOURCE_PREFIX, strlen(PIP_SHM_SOURCE_PREFIX)))
+    {
+        /* 共享内存模式：读取本机渲染进程写入的原始帧 */
+        if (init_shm_video_source(pip_data, local_video_file + strlen(PIP_SHM_SOURCE_PREFIX)) != SWITCH_STATUS_SUCCESS)
+        {
+            return SWITCH_STATUS_FALSE;
+        }
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "使用共享内存模式: %s\n", local_video_file);
+    }
+    else if ((file_ext && strcasecmp(file_ext, ".pipraw") == 0) || pip_raw_probe(local_video_file))
+    {
+        /* 预解码模式：映射pip_rawpack生成的文件，不打开解码器 */
+        if (init_raw_video_file(pip_data, local_video_file) != SWITCH_STATUS_SUCCESS)
+        {
+            return SWITCH_STATUS_FALSE;
+        }
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "使用预解码模式: %s\n", local_video_file);
+    }
+    else if (file_ext)
+    {
+        /* 检查是否为常见的图片格式 */
+        if (strcasecmp(file_ext, ".jpg") == 0 || strcasecmp(file_ext, ".jpeg") == 0 ||
+            strcasecmp(file_ext, ".png") == 0 || strcasecmp(file_ext, ".bmp") == 0 ||
+            strcasecmp(file_ext, ".gif") == 0 || strcasecmp(file_ext, ".tiff") == 0)
+        {
+            /* 图片模式：加载静态图片 */
+            if (init_load_local_image(pip_data, local_video_file) != SWITCH_STATUS_SUCCESS)
+            {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "加载本地图片失败: %s\n", local_video_file);
+                return SWITCH_STATUS_FALSE;
+            }
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "使用图片模式: %s\n", local_video_file);
+        }
+        else
+        {
+            /* 视频模式：加载视频文件 */
+            if (init_local_video_file(pip_data, local_video_file) != SWITCH_STATUS_SUCCESS)
+            {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "初始化本地视频失败: %s\n", local_video_file);
+                return SWITCH_STATUS_FALSE;
+            }
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "使用视频模式: %s\n", local_video_file);
+        }
+    }
+    else
+    {
+        /* 无扩展名，默认尝试视频模式 */
+        if (init_local_video_file(pip_data, local_video_file) != SWITCH_STATUS_SUCCESS)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "初始化本地文件失败: %s\n", local_video_file);
+            return SWITCH_STATUS_FALSE;
+        }
+    }
+
+    /* 背景源已打开、主视频尺寸已知，按内存上限决定是否继续 */
+    if (pip_data->use_image_mode)
+    {
+        pip_mem_charge(pip_data, PIP_MEM_FRAMES, pip_frame_bytes(pip_data->local_image_frame));
+    }
+    else if (!pip_data->raw_source && !pip_data->shm_ring.map) /* 映射的帧由页缓存或写入方持有，不计入会话内存 */
+    {
+        pip_mem_charge(pip_data, PIP_MEM_DECODER,
+                       pip_mem_codec_estimate(pip_data->main_width, pip_data->main_height, PIP_MEM_DECODER_FRAMES));
+    }
+
+    pip_background_acquire(pip_data);
+
+    if (pip_mem_admit(pip_data) != SWITCH_STATUS_SUCCESS)
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+
+    pip_output_path(pip_data, "", output_file, sizeof(output_file));
+    if (!zstr(pip_data->share_name))
+    {
+        pip_share_key(pip_data, local_video_file, share_key, sizeof(share_key));
+    }
+
+    /* 初始化输出视频文件（内存降级时不录制） */
+    if (pip_data->mem_downgraded)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "模块内存接近上限，会话降级运行，不保存输出视频\n");
+    }
+    else if (share_key[0] && pip_share_join(pip_data, share_key, output_file) == SWITCH_STATUS_SUCCESS)
+    {
+        /* 跟随者不创建编码器，归还预占的编码器内存 */
+        pip_mem_charge(pip_data, PIP_MEM_ENCODER, 0);
+    }
+    else if (init_output_video_file(pip_data, output_file) != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "输出文件初始化失败，将跳过保存\n");
+        pip_mem_charge(pip_data, PIP_MEM_ENCODER, 0);
+    }
+    else if (share_key[0])
+    {
+        pip_share_lead(pip_data, share_key);
+    }
+
+    /* 初始化PTS计数器 */
+    pip_data->output_pts = 0;
+
+    /* 初始化帧率同步 */
+    pip_data->target_fps = pip_config.output_fps; /* 目标输出帧率 */
+    pip_data->current_time = 0.0;
+    pip_data->last_local_time = 0.0;
+
+    /* 分配AVFrame */
+    pip_data->frame_main = av_frame_alloc();
+    pip_data->frame_pip = av_frame_alloc();
+    pip_data->frame_pip_scaled = av_frame_alloc();
+    pip_data->frame_output = av_frame_alloc();
+
+    if (!pip_data->frame_main || !pip_data->frame_pip || !pip_data->frame_pip_scaled || !pip_data->frame_output)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配AVFrame失败\n");
+        // 清理已分配的frame
+        if (pip_data->frame_main)
+            av_frame_free(&pip_data->frame_main);
+        if (pip_data->frame_pip)
+            av_frame_free(&pip_data->frame_pip);
+        if (pip_data->frame_pip_scaled)
+            av_frame_free(&pip_data->frame_pip_scaled);
+        if (pip_data->frame_output)
+            av_frame_free(&pip_data->frame_output);
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 初始化远程视频尺寸（将在运行时动态设置） */
+    pip_data->remote_width = 0;
+    pip_data->remote_height = 0;
+    pip_data->remote_format = AV_PIX_FMT_NONE;
+    pip_data->sws_ctx_pip = NULL; /* 将在第一次处理时创建 */
+
+    /* 为缩放后的帧分配内存 */
+    pip_data->frame_pip_scaled->format = AV_PIX_FMT_YUV420P;
+    pip_data->frame_pip_scaled->width = pip_data->pip_width;
+    pip_data->frame_pip_scaled->height = pip_data->pip_height;
+
+    if (av_frame_get_buffer(pip_data->frame_pip_scaled, 32) < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配缩放帧缓冲区失败\n");
+        return SWITCH_STATUS_FALSE;
+    }
+    pip_data->scaled_capacity_width = pip_data->pip_width;
+    pip_data->scaled_capacity_height = pip_data->pip_height;
+    pip_data->scaled_capacity_bytes = pip_frame_bytes(pip_data->frame_pip_scaled);
+
+    /* 为输出帧分配内存 */
+    pip_data->frame_output->format = AV_PIX_FMT_YUV420P;
+    pip_data->frame_output->width = pip_data->main_width;
+    pip_data->frame_output->height = pip_data->main_height;
+
+    if (av_frame_get_buffer(pip_data->frame_output, 32) < 0)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配输出帧缓冲区失败\n");
+        return SWITCH_STATUS_FALSE;
+    }
+
+    /* 用实际分配的大小替换预占的估算值 */
+    pip_mem_charge(pip_data, PIP_MEM_FRAMES, pip_mem_frames_total(pip_data));
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "PIP上下文初始化成功: 本地视频%dx%d, PIP%dx%d@(%d,%d)\n",
+                      pip_data->main_width, pip_data->main_height, pip_data->pip_width, pip_data->pip_height,
+                      pip_data->pip_x, pip_data->pip_y);
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 处理视频帧 */
+// static switch_status_t process_video_frame(pip_session_data_t *pip_data, switch_frame_t *main_frame,
+//                                            switch_frame_t *pip_frame)
+// {
+//     if (!pip_data || !main_frame || !pip_frame)
+//     {
+//         return SWITCH_STATUS_FALSE;
+//     }
+
+//     switch_mutex_lock(pip_data->mutex);
+
+//     if (!pip_data->active)
+//     {
+//         switch_mutex_unlock(pip_data->mutex);
+//         return SWITCH_STATUS_FALSE;
+//     }
+
+//     /* 设置主视频帧数据 */
+//     if (av_image_fill_arrays(pip_data->frame_main->data, pip_data->frame_main->linesize, (uint8_t *)main_frame->data,
+//                              AV_PIX_FMT_YUV420P, pip_data->main_width, pip_data->main_height, 1) < 0)
+//     {
+//         switch_mutex_unlock(pip_data->mutex);
+//         return SWITCH_STATUS_FALSE;
+//     }
+//     pip_data->frame_main->width = pip_data->main_width;
+//     pip_data->frame_main->height = pip_data->main_height;
+//     pip_data->frame_main->format = AV_PIX_FMT_YUV420P;
+
+//     /* 设置PIP视频帧数据 */
+//     if (av_image_fill_arrays(pip_data->frame_pip->data, pip_data->frame_pip->linesize, (uint8_t *)pip_frame->data,
+//                              AV_PIX_FMT_YUV420P, pip_data->main_width, pip_data->main_height, 1) < 0)
+//     {
+//         switch_mutex_unlock(pip_data->mutex);
+//         return SWITCH_STATUS_FALSE;
+//     }
+//     pip_data->frame_pip->width = pip_data->main_width;
+//     pip_data->frame_pip->height = pip_data->main_height;
+//     pip_data->frame_pip->format = AV_PIX_FMT_YUV420P;
+
+//     /* 缩放PIP视频 */
+//     if (sws_scale(pip_data->sws_ctx_pip, (const uint8_t *const *)pip_data->frame_pip->data,
+//                   pip_data->frame_pip->linesize, 0, pip_data->main_height, pip_data->frame_pip_scaled->data,
+//                   pip_data->frame_pip_scaled->linesize) < 0)
+//     {
+//         switch_mutex_unlock(pip_data->mutex);
+//         return SWITCH_STATUS_FALSE;
+//     }
+
+//     /* 叠加视频 */
+//     overlay_yuv420p_frames(pip_data->frame_main, pip_data->frame_pip_scaled, pip_data->frame_output, pip_data->pip_x,
+//                            pip_data->pip_y, pip_data->pip_opacity);
+
+//     /* 将处理后的数据拷贝回main_frame */
+//     int frame_size = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, pip_data->main_width, pip_data->main_height, 1);
+
+//     if (frame_size > 0 && frame_size <= main_frame->buflen)
+//     {
+//         // (const uint8_t *const *)  常量指针+指针常量的组合，表示指向常量数据的指针的指针
+//         av_image_copy_to_buffer((uint8_t *)main_frame->data, frame_size,
+//                                 (const uint8_t *const *)pip_data->frame_output->data, pip_data->frame_output->linesize,
+//                                 AV_PIX_FMT_YUV420P, pip_data->main_width, pip_data->main_height, 1);
+//         main_frame->datalen = frame_size;
+//         pip_data->frames_processed++;
+//     }
+
+//     switch_mutex_unlock(pip_data->mutex);
+//     return SWITCH_STATUS_SUCCESS;
+// }
+
+/* 清理PIP会话
+ * 只释放处理资源，不摘除媒体钩子：调用时钩子已摘除（CLOSE回调、停止命令）或从未挂上（启动失败） */
+static void cleanup_pip_session(pip_session_data_t *pip_data)
+{
+    if (!pip_data)
+        return;
+
+    /* 避免重复清理（停止命令和CLOSE回调都可能走到这里） */
+    switch_mutex_lock(pip_data->mutex);
+    if (pip_data->cleaned)
+    {
+        switch_mutex_unlock(pip_data->mutex);
+        return;
+    }
+    pip_data->cleaned = SWITCH_TRUE;
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "开始清理PIP会话...\n");
+
+    /* 立即设置为非活跃状态，等待时钟线程退出和正在进行的帧处理结束 */
+    pip_data->active = SWITCH_FALSE;
+    pip_clock_stop(pip_data);
+    switch_mutex_lock(pip_data->frame_mutex);
+
+    /* 合成线程来不及取走的快照请求以失败结束 */
+    pip_snapshot_fail_all(__atomic_exchange_n(&pip_data->snapshot_request, NULL, __ATOMIC_ACQ_REL), "会话已停止");
+
+    /* 清理本地视频文件资源 */
+    // 清理视频包
+    if (pip_data->local_packet)
+    {
+        av_packet_free(&pip_data->local_packet);
+        pip_data->local_packet = NULL;
+    }
+    // 关闭解码器上下文
+    if (pip_data->local_codec_ctx)
+    {
+        avcodec_close(pip_data->local_codec_ctx);
+        avcodec_free_context(&pip_data->local_codec_ctx);
+        pip_data->local_codec_ctx = NULL;
+    }
+    // 关闭输入格式上下文
+    if (pip_data->local_fmt_ctx)
+    {
+        avformat_close_input(&pip_data->local_fmt_ctx);
+        pip_data->local_fmt_ctx = NULL;
+    }
+
+    /* 清理输出视频文件资源（共享合成的组长或跟随者同时退出共享组） */
+    pip_output_close(pip_data);
+
+    /* 清理FFmpeg资源 */
+    if (pip_data->sws_ctx_pip)
+    {
+        sws_freeContext(pip_data->sws_ctx_pip);
+        pip_data->sws_ctx_pip = NULL;
+    }
+
+    /* 安全释放AVFrame */
+    if (pip_data->frame_main)
+    {
+        av_frame_free(&pip_data->frame_main);
+        pip_data->frame_main = NULL;
+    }
+    if (pip_data->frame_pip)
+    {
+        av_frame_free(&pip_data->frame_pip);
+        pip_data->frame_pip = NULL;
+    }
+    if (pip_data->frame_pip_scaled)
+    {
+        av_frame_free(&pip_data->frame_pip_scaled);
+        pip_data->frame_pip_scaled = NULL;
+        pip_data->scaled_capacity_bytes = 0;
+    }
+    pip_alpha_mask_free(&pip_data->alpha_mask);
+    pip_subtitle_release(pip_data);
+    pip_background_release(pip_data);
+    av_frame_free(&pip_data->frame_main_yuv);
+    av_frame_free(&pip_data->frame_main_graded);
+    if (pip_data->sws_ctx_main)
+    {
+        sws_freeContext(pip_data->sws_ctx_main);
+        pip_data->sws_ctx_main = NULL;
+    }
+    if (pip_data->frame_output)
+    {
+        av_frame_free(&pip_data->frame_output);
+        pip_data->frame_output = NULL;
+    }
+
+    /* 清理本地图片帧 */
+    if (pip_data->local_image_frame)
+    {
+        av_frame_free(&pip_data->local_image_frame);
+        pip_data->local_image_frame = NULL;
+    }
+
+    /* frame_main已释放，归还预解码文件映射和共享内存帧环 */
+    pip_raw_source_release(pip_data->raw_source);
+    pip_data->raw_source = NULL;
+    pip_shm_ring_close(&pip_data->shm_ring, NULL);
+
+    /* 关闭输出旁路，已挂上的读取方会收到关闭通知 */
+    pip_output_tap_free(pip_data->output_tap);
+    pip_data->output_tap = NULL;
+
+    /* 清理远程视频帧 */
+    if (pip_data->last_remote_frame && pip_data->last_remote_frame->img)
+    {
+        switch_img_free(&pip_data->last_remote_frame->img);
+        pip_data->last_remote_frame->img = NULL;
+        pip_data->last_remote_frame = NULL;
+    }
+    switch_mutex_unlock(pip_data->frame_mutex);
+
+    /* 将会话计数器并入模块汇总，并归还内存记账 */
+    switch_mutex_lock(metrics_mutex);
+    for (int i = 0; i < PIP_MEM_COUNT; i++)
+    {
+        pip_mem_total -= pip_data->mem_bytes[i];
+        pip_data->mem_bytes[i] = 0;
+    }
+    if (!pip_data->metrics_retired)
+    {
+        pip_metrics_add_session(&retired_metrics, pip_data);
+        pip_data->metrics_retired = SWITCH_TRUE;
+    }
+    switch_mutex_unlock(metrics_mutex);
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO,
+                      "PIP会话清理完成，处理帧数: %llu, 远程帧: %llu, 本地帧: %llu\n",
+                      (unsigned long long)pip_data->frames_processed, (unsigned long long)pip_data->remote_frames_count,
+                      (unsigned long long)pip_data->local_frames_count);
+    switch_mutex_unlock(pip_data->mutex);
+}
+
+/* 记录一次阶段耗时 */
+static void pip_stage_record(pip_stage_stats_t *stats, switch_time_t start)
+{
+    uint64_t elapsed = (uint64_t)(switch_micro_time_now() - start);
+
+    stats->count++;
+    stats->sum_us += elapsed;
+    if (elapsed > stats->max_us)
+    {
+        stats->max_us = elapsed;
+    }
+}
+
+/* 把单个会话的计数器累加到汇总中
+ * 计数器由媒体线程无锁更新，这里读到的是近似快照，对监控用途足够 */
+static void pip_metrics_add_session(pip_metrics_t *dst, const pip_session_data_t *pip_data)
+{
+    dst->frames_captured += pip_data->remote_frames_count;
+    dst->frames_decoded += pip_data->local_frames_count;
+    dst->frames_composited += pip_data->frames_composited;
+    dst->frames_encoded += pip_data->frames_processed;
+    dst->frames_dropped += pip_data->frames_dropped;
+    dst->encoder_bytes += pip_data->encoder_bytes;
+    dst->decode_errors += pip_data->decode_errors;
+    dst->scaler_rebuilds += pip_data->scaler_rebuilds;
+    dst->frames_repeated += pip_data->frames_repeated;
+    dst->frames_superseded += pip_data->frames_superseded;
+    dst->clock_overruns += pip_data->clock_overruns;
+    dst->rendition_frames += pip_data->rendition_frames;
+    dst->rendition_dropped += pip_data->rendition_dropped;
+
+    for (int i = 0; i < PIP_STAGE_COUNT; i++)
+    {
+        dst->stages[i].count += pip_data->stage_stats[i].count;
+        dst->stages[i].sum_us += pip_data->stage_stats[i].sum_us;
+        if (pip_data->stage_stats[i].max_us > dst->stages[i].max_us)
+        {
+            dst->stages[i].max_us = pip_data->stage_stats[i].max_us;
+        }
+    }
+}
+
+/* 更新会话某类内存的记账值，并同步模块总量 */
+static void pip_mem_charge(pip_session_data_t *pip_data, pip_mem_kind_t kind, uint64_t bytes)
+{
+    switch_mutex_lock(metrics_mutex);
+    pip_mem_total = pip_mem_total - pip_data->mem_bytes[kind] + bytes;
+    pip_data->mem_bytes[kind] = bytes;
+    switch_mutex_unlock(metrics_mutex);
+}
+
+static uint64_t pip_mem_session_total(const pip_session_data_t *pip_data)
+{
+    uint64_t total = 0;
+
+    for (int i = 0; i < PIP_MEM_COUNT; i++)
+    {
+        total += pip_data->mem_bytes[i];
+    }
+    return total;
+}
+
+/* AVFrame自身持有的缓冲区大小（引用外部数据的帧为0） */
+static uint64_t pip_frame_bytes(const AVFrame *frame)
+{
+    uint64_t bytes = 0;
+
+    if (!frame)
+    {
+        return 0;
+    }
+    for (int i = 0; i < AV_NUM_DATA_POINTERS; i++)
+    {
+        if (frame->buf[i])
+        {
+            bytes += frame->buf[i]->size;
+        }
+    }
+    return bytes;
+}
+
+/* 会话持有的帧缓冲区总量（含样式遮罩） */
+static uint64_t pip_mem_frames_total(const pip_session_data_t *pip_data)
+{
+    uint64_t total = pip_data->scaled_capacity_bytes + pip_frame_bytes(pip_data->frame_output) +
+                     pip_frame_bytes(pip_data->local_image_frame) + pip_frame_bytes(pip_data->frame_main_yuv) +
+                     pip_frame_bytes(pip_data->frame_main_graded) +
+                     pip_data->alpha_mask.buffer_size +
+                     (pip_data->output_tap ? pip_data->output_tap->ring.map_size : 0);
+
+    for (int i = 0; i < pip_data->rendition_count; i++)
+    {
+        total += pip_frame_bytes(pip_data->renditions[i]->fill) * 3; /* fill、pending、work大小相同 */
+    }
+    return total;
+}
+
+/* 编解码器内部帧的内存估算：FFmpeg不暴露实际用量，按帧数乘以带填充的YUV420P帧大小计算 */
+static uint64_t pip_mem_codec_estimate(int width, int height, int frames)
+{
+    int size = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width + PIP_MEM_CODEC_PADDING,
+                                        height + PIP_MEM_CODEC_PADDING, 32);
+
+    return size > 0 ? (uint64_t)size * frames : 0;
+}
+
+/* 按模块内存上限决定会话能否继续初始化
+ * 通过时立即预占帧缓冲、远程图像和编码器的估算值，避免并发启动同时越过上限；
+ * 实际分配完成后由调用方用真实大小修正 */
+static switch_status_t pip_mem_admit(pip_session_data_t *pip_data)
+{
+    int frame_size = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, pip_data->main_width, pip_data->main_height, 32);
+    int pip_size = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, pip_data->pip_width, pip_data->pip_height, 32);
+    uint64_t frames = pip_data->mem_bytes[PIP_MEM_FRAMES] + (uint64_t)(frame_size > 0 ? frame_size : 0) +
+                      (uint64_t)(pip_size > 0 ? pip_size : 0);
+    uint64_t remote = frame_size > 0 ? (uint64_t)frame_size : 0; /* 远程分辨率未知，按主视频尺寸估算 */
+    uint64_t encoder = pip_mem_encoder_estimate(pip_data->main_width, pip_data->main_height);
+    uint64_t limit = pip_config.max_memory_bytes;
+    uint64_t used;
+    switch_status_t status = SWITCH_STATUS_SUCCESS;
+
+    /* 调色或背景图层处理后的背景帧 */
+    if ((!pip_color_adjust_is_identity(&pip_data->color_adjust) || pip_data->background) && frame_size > 0)
+    {
+        frames += frame_size;
+    }
+
+    switch_mutex_lock(metrics_mutex);
+    used = pip_mem_total - pip_data->mem_bytes[PIP_MEM_FRAMES] - pip_data->mem_bytes[PIP_MEM_REMOTE_IMAGE] -
+           pip_data->mem_bytes[PIP_MEM_ENCODER];
+
+    if (limit > 0 && used + frames + remote + encoder > limit)
+    {
+        if (pip_config.memory_cap_action == PIP_MEM_CAP_DOWNGRADE && used + frames + remote <= limit)
+        {
+            pip_data->mem_downgraded = SWITCH_TRUE;
+            encoder = 0;
+            sessions_downgraded_total++;
+        }
+        else
+        {
+            sessions_rejected_total++;
+            status = SWITCH_STATUS_MEMERR;
+        }
+    }
+
+    if (status == SWITCH_STATUS_SUCCESS)
+    {
+        pip_mem_total = used + frames + remote + encoder;
+        pip_data->mem_bytes[PIP_MEM_FRAMES] = frames;
+        pip_data->mem_bytes[PIP_MEM_REMOTE_IMAGE] = remote;
+        pip_data->mem_bytes[PIP_MEM_ENCODER] = encoder;
+    }
+    switch_mutex_unlock(metrics_mutex);
+
+    if (status != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR,
+                          "超出模块内存上限，拒绝启动PIP会话: 已用 %llu 字节, 需要 %llu 字节, 上限 %llu 字节\n",
+                          (unsigned long long)used, (unsigned long long)(frames + remote + encoder),
+                          (unsigned long long)limit);
+    }
+    return status;
+}
+
+/* 读取 video_pip.conf，文件不存在时使用内置默认值 */
+static switch_status_t pip_load_config(void)
+{
+    switch_xml_t cfg, xml, settings, xml_filters, param;
+
+    pip_config.pip_width = DEFAULT_PIP_WIDTH;
+    pip_config.pip_height = DEFAULT_PIP_HEIGHT;
+    pip_config.pip_x = DEFAULT_PIP_X;
+    pip_config.pip_y = DEFAULT_PIP_Y;
+    pip_config.pip_opacity = DEFAULT_PIP_OPACITY;
+    memset(&pip_config.style, 0, sizeof(pip_config.style));
+    pip_config.style.border_width = DEFAULT_PIP_BORDER_WIDTH;
+    pip_rgb_to_yuv(DEFAULT_PIP_BORDER_COLOR, pip_config.style.border_color);
+    pip_config.max_memory_bytes = 0;
+    pip_config.memory_cap_action = PIP_MEM_CAP_REJECT;
+    pip_config.auto_start = SWITCH_FALSE;
+    switch_copy_string(pip_config.local_file, PIP_DEFAULT_LOCAL_FILE, sizeof(pip_config.local_file));
+    pip_config.start_workers = DEFAULT_PIP_START_WORKERS;
+    pip_config.start_queue_size = DEFAULT_PIP_START_QUEUE_SIZE;
+    pip_config.encoder_pool_size = 0;
+    switch_copy_string(pip_config.encoder_pool_profiles, DEFAULT_PIP_ENCODER_POOL_PROFILES,
+                       sizeof(pip_config.encoder_pool_profiles));
+    pip_config.animation_size_step = DEFAULT_PIP_ANIMATION_SIZE_STEP;
+    pip_config.shm_stall_ms = DEFAULT_PIP_SHM_STALL_MS;
+    pip_config.output_tap = SWITCH_FALSE;
+    pip_config.output_tap_slots = DEFAULT_PIP_OUTPUT_TAP_SLOTS;
+    pip_config.output_clock = PIP_OUTPUT_CLOCK_CFR;
+    pip_config.output_fps = DEFAULT_PIP_OUTPUT_FPS;
+    pip_config.roi_qoffset = DEFAULT_PIP_ROI_QOFFSET;
+    pip_config.rendition_count = 0;
+    pip_config.snapshot_max_pending = DEFAULT_PIP_SNAPSHOT_MAX_PENDING;
+    pip_config.subtitle_enabled = SWITCH_FALSE;
+    pip_config.subtitle_text[0] = '\0';
+    switch_copy_string(pip_config.subtitle_font, DEFAULT_PIP_SUBTITLE_FONT, sizeof(pip_config.subtitle_font));
+    pip_config.subtitle_font_size = DEFAULT_PIP_SUBTITLE_FONT_SIZE;
+    pip_rgb_to_yuv(DEFAULT_PIP_SUBTITLE_COLOR, pip_config.subtitle_color);
+    pip_config.subtitle_x = 10;
+    pip_config.subtitle_y = 10;
+    pip_config.subtitle_opacity = 1.0f;
+    pip_config.color_adjust.brightness = 0.0f;
+    pip_config.color_adjust.contrast = 1.0f;
+    pip_config.color_adjust.saturation = 1.0f;
+    pip_config.background_image[0] = '\0';
+    pip_config.background_opacity = DEFAULT_PIP_BACKGROUND_OPACITY;
+    pip_config.background_blend_mode = PIP_BLEND_NORMAL;
+
+    if (!(xml = switch_xml_open_cfg(PIP_CONFIG_FILE, &cfg, NULL)))
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "未找到配置 %s，使用默认参数\n", PIP_CONFIG_FILE);
+        return SWITCH_STATUS_FALSE;
+    }
+
+    if ((settings = switch_xml_child(cfg, "settings")))
+    {
+        for (param = switch_xml_child(settings, "param"); param; param = param->next)
+        {
+            const char *var = switch_xml_attr_soft(param, "name");
+            const char *val = switch_xml_attr_soft(param, "value");
+
+            if (!strcasecmp(var, "pip-width") && atoi(val) > 0)
+            {
+                pip_config.pip_width = atoi(val);
+            }
+            else if (!strcasecmp(var, "pip-height") && atoi(val) > 0)
+            {
+                pip_config.pip_height = atoi(val);
+            }
+            else if (!strcasecmp(var, "pip-x"))
+            {
+                pip_config.pip_x = atoi(val);
+            }
+            else if (!strcasecmp(var, "pip-y"))
+            {
+                pip_config.pip_y = atoi(val);
+            }
+            else if (!strcasecmp(var, "pip-opacity"))
+            {
+                float opacity = (float)atof(val);
+                if (opacity >= 0.0f && opacity <= 1.0f)
+                {
+                    pip_config.pip_opacity = opacity;
+                }
+            }
+            else if (!strcasecmp(var, "border-width") || !strcasecmp(var, "border-color") ||
+                     !strcasecmp(var, "corner-radius") || !strcasecmp(var, "feather"))
+            {
+                /* 与video_pip_update的样式参数共用解析和取值范围 */
+                static const char *keys[][2] = {{"border-width", "border"},
+                                                {"border-color", "border_color"},
+                                                {"corner-radius", "radius"},
+                                                {"feather", "feather"}};
+                pip_layout_t layout = {0};
+                uint32_t mask = 0;
+
+                for (size_t k = 0; k < switch_arraylen(keys); k++)
+                {
+                    if (!strcasecmp(var, keys[k][0]) &&
+                        pip_layout_parse(keys[k][1], val, &layout, &mask) != SWITCH_STATUS_SUCCESS)
+                    {
+                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "忽略无效的%s: %s\n", var, val);
+                    }
+                }
+                pip_style_merge(&pip_config.style, &layout.style, mask);
+            }
+            else if (!strcasecmp(var, "output-dir") && !zstr(val))
+            {
+                switch_copy_string(pip_output_dir, val, sizeof(pip_output_dir));
+            }
+            else if (!strcasecmp(var, "max-memory-mb"))
+            {
+                long mb = atol(val);
+                pip_config.max_memory_bytes = mb > 0 ? (uint64_t)mb * 1024 * 1024 : 0;
+            }
+            else if (!strcasecmp(var, "memory-cap-action"))
+            {
+                pip_config.memory_cap_action =
+                    !strcasecmp(val, "downgrade") ? PIP_MEM_CAP_DOWNGRADE : PIP_MEM_CAP_REJECT;
+            }
+            else if (!strcasecmp(var, "auto-start"))
+            {
+                pip_config.auto_start = switch_true(val) ? SWITCH_TRUE : SWITCH_FALSE;
+            }
+            else if (!strcasecmp(var, "local-file") && !zstr(val))
+            {
+                switch_copy_string(pip_config.local_file, val, sizeof(pip_config.local_file));
+            }
+            else if (!strcasecmp(var, "start-workers"))
+            {
+                int workers = atoi(val);
+                if (workers > 0)
+                {
+                    pip_config.start_workers = workers > PIP_MAX_START_WORKERS ? PIP_MAX_START_WORKERS : workers;
+                }
+            }
+            else if (!strcasecmp(var, "start-queue-size") && atoi(val) > 0)
+            {
+                pip_config.start_queue_size = atoi(val);
+            }
+            else if (!strcasecmp(var, "encoder-pool-size"))
+            {
+                int size = atoi(val);
+                pip_config.encoder_pool_size =
+                    size > PIP_MAX_ENCODER_POOL_SIZE ? PIP_MAX_ENCODER_POOL_SIZE : (size > 0 ? size : 0);
+            }
+            else if (!strcasecmp(var, "encoder-pool-profiles") && !zstr(val))
+            {
+                switch_copy_string(pip_config.encoder_pool_profiles, val, sizeof(pip_config.encoder_pool_profiles));
+            }
+            else if (!strcasecmp(var, "animation-size-step") && atoi(val) > 0)
+            {
+                pip_config.animation_size_step = atoi(val);
+            }
+            else if (!strcasecmp(var, "shm-stall-ms") && atoi(val) > 0)
+            {
+                pip_config.shm_stall_ms = atoi(val);
+            }
+            else if (!strcasecmp(var, "output-tap"))
+            {
+                pip_config.output_tap = switch_true(val) ? SWITCH_TRUE : SWITCH_FALSE;
+            }
+            else if (!strcasecmp(var, "output-tap-slots") && atoi(val) >= PIP_SHM_MIN_SLOTS &&
+                     atoi(val) <= PIP_SHM_MAX_SLOTS)
+            {
+                pip_config.output_tap_slots = atoi(val);
+            }
+            else if (!strcasecmp(var, "output-clock"))
+            {
+                if (!strcasecmp(val, "cfr"))
+                {
+                    pip_config.output_clock = PIP_OUTPUT_CLOCK_CFR;
+                }
+                else if (!strcasecmp(val, "vfr"))
+                {
+                    pip_config.output_clock = PIP_OUTPUT_CLOCK_VFR;
+                }
+                else if (!strcasecmp(val, "arrival"))
+                {
+                    pip_config.output_clock = PIP_OUTPUT_CLOCK_ARRIVAL;
+                }
+                else
+                {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "忽略无效的%s: %s\n", var, val);
+                }
+            }
+            else if (!strcasecmp(var, "output-fps") && atoi(val) > 0 && atoi(val) <= PIP_MAX_OUTPUT_FPS)
+            {
+                pip_config.output_fps = atoi(val);
+            }
+            else if (!strcasecmp(var, "snapshot-max-pending") && atoi(val) > 0 &&
+                     atoi(val) <= PIP_MAX_SNAPSHOT_PENDING)
+            {
+                pip_config.snapshot_max_pending = atoi(val);
+            }
+            else if (!strcasecmp(var, "enable-subtitle"))
+            {
+                pip_config.subtitle_enabled = switch_true(val) ? SWITCH_TRUE : SWITCH_FALSE;
+            }
+            else if (!strcasecmp(var, "subtitle-text"))
+            {
+                switch_copy_string(pip_config.subtitle_text, val, sizeof(pip_config.subtitle_text));
+            }
+            else if (!strcasecmp(var, "subtitle-font") && !zstr(val))
+            {
+                switch_copy_string(pip_config.subtitle_font, val, sizeof(pip_config.subtitle_font));
+            }
+            else if (!strcasecmp(var, "subtitle-font-size") && atoi(val) >= PIP_FONT_MIN_SIZE &&
+                     atoi(val) <= PIP_FONT_MAX_SIZE)
+            {
+                pip_config.subtitle_font_size = atoi(val);
+            }
+            else if (!strcasecmp(var, "subtitle-font-color"))
+            {
+                if (pip_color_parse(val, pip_config.subtitle_color) != SWITCH_STATUS_SUCCESS)
+                {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "忽略无效的%s: %s\n", var, val);
+                }
+            }
+            else if (!strcasecmp(var, "subtitle-x"))
+            {
+                pip_config.subtitle_x = atoi(val);
+            }
+            else if (!strcasecmp(var, "subtitle-y"))
+            {
+                pip_config.subtitle_y = atoi(val);
+            }
+            else if (!strcasecmp(var, "subtitle-opacity"))
+            {
+                float opacity = (float)atof(val);
+                if (opacity >= 0.0f && opacity <= 1.0f)
+                {
+                    pip_config.subtitle_opacity = opacity;
+                }
+            }
+            else if (!strcasecmp(var, "background-image"))
+            {
+                switch_copy_string(pip_config.background_image, val, sizeof(pip_config.background_image));
+            }
+            else if (!strcasecmp(var, "background-opacity"))
+            {
+                float opacity = (float)atof(val);
+                if (opacity >= 0.0f && opacity <= 1.0f)
+                {
+                    pip_config.background_opacity = opacity;
+                }
+            }
+            else if (!strcasecmp(var, "background-blend-mode"))
+            {
+                if (pip_blend_mode_parse(val, &pip_config.background_blend_mode) < 0)
+                {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "忽略未知的背景混合模式: %s\n", val);
+                }
+            }
+            else if (!strcasecmp(var, "renditions"))
+            {
+                /* 逗号分隔的高度列表，如"360,180"；宽度按主画面宽高比计算 */
+                char buf[128];
+                char *heights[PIP_MAX_RENDITIONS + 1];
+                int count;
+
+                switch_copy_string(buf, val, sizeof(buf));
+                count = switch_separate_string(buf, ',', heights, switch_arraylen(heights));
+                pip_config.rendition_count = 0;
+                for (int i = 0; i < count && pip_config.rendition_count < PIP_MAX_RENDITIONS; i++)
+                {
+                    int height = atoi(heights[i]);
+
+                    if (height >= 16 && height <= PIP_RAW_MAX_DIMENSION)
+                    {
+                        pip_config.rendition_heights[pip_config.rendition_count++] = height;
+                    }
+                    else if (!zstr(heights[i]))
+                    {
+                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "忽略无效的码流高度: %s\n",
+                                          heights[i]);
+                    }
+                }
+            }
+            else if (!strcasecmp(var, "roi-qoffset"))
+            {
+                float qoffset = (float)atof(val);
+                if (qoffset >= -1.0f && qoffset <= 0.0f)
+                {
+                    pip_config.roi_qoffset = qoffset;
+                }
+            }
+        }
+    }
+
+    /* 背景调色：<filter name="eq" args="brightness=0.1:contrast=1.2"/>，写法与FFmpeg滤镜参数一致。
+     * 只支持能折算成查找表的亮度、对比度和饱和度，参数与video_pip_update共用解析和取值范围 */
+    if ((xml_filters = switch_xml_child(cfg, "filters")))
+    {
+        for (param = switch_xml_child(xml_filters, "filter"); param; param = param->next)
+        {
+            const char *name = switch_xml_attr_soft(param, "name");
+            char buf[256];
+            char *args[8];
+            pip_layout_t layout = {0};
+            uint32_t mask = 0;
+            int count;
+
+            if (strcasecmp(name, "eq") && strcasecmp(name, "brightness") && strcasecmp(name, "contrast") &&
+                strcasecmp(name, "saturation"))
+            {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "忽略不支持的滤镜: %s\n", name);
+                continue;
+            }
+
+            /* name="contrast" value="1.2" 是单个参数的简写 */
+            if (strcasecmp(name, "eq") && !zstr(switch_xml_attr_soft(param, "value")))
+            {
+                snprintf(buf, sizeof(buf), "%s=%s", name, switch_xml_attr_soft(param, "value"));
+            }
+            else
+            {
+                switch_copy_string(buf, switch_xml_attr_soft(param, "args"), sizeof(buf));
+            }
+            count = switch_separate_string(buf, ':', args, switch_arraylen(args));
+            for (int i = 0; i < count; i++)
+            {
+                char *value = strchr(args[i], '=');
+                uint32_t item = 0;
+
+                if (zstr(args[i]))
+                {
+                    continue;
+                }
+                if (value)
+                {
+                    *value++ = '\0';
+                }
+                if (!value || pip_layout_parse(args[i], value, &layout, &item) != SWITCH_STATUS_SUCCESS ||
+                    !(item & PIP_LAYOUT_COLOR))
+                {
+                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "忽略无效的滤镜参数: %s %s\n", name,
+                                      args[i]);
+                    continue;
+                }
+                mask |= item;
+            }
+            pip_color_adjust_merge(&pip_config.color_adjust, &layout.color, mask);
+        }
+    }
+
+    switch_xml_free(xml);
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "配置已加载: 内存上限 %llu MB (%s), 输出目录 %s, 自动启动 %s\n",
+                      (unsigned long long)(pip_config.max_memory_bytes / (1024 * 1024)),
+                      pip_config.memory_cap_action == PIP_MEM_CAP_DOWNGRADE ? "downgrade" : "reject", pip_output_dir,
+                      pip_config.auto_start ? "是" : "否");
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* ---------- 会话注册表 ----------
+ * 快照数组一经发布就不再修改。读取方（状态、指标、查找）不加锁，
+ * 写入方（启动、停止、挂机）互相串行化，但从不等待读取方持有的锁，只等待旧纪元的读区退出。
+ * 快照中的每个会话持有注册表的一个引用；读取方需要在读区之外继续使用会话时自行加引用。 */
+
+/* 进入读区，返回当前快照（可能为NULL），slot用于退出读区 */
+static pip_registry_snapshot_t *pip_registry_read_begin(uint32_t *slot)
+{
+    for (;;)
+    {
+        uint32_t epoch = __atomic_load_n(&pip_registry.epoch, __ATOMIC_SEQ_CST);
+
+        __atomic_add_fetch(&pip_registry.readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        /* 登记期间纪元被翻转时，写入方可能已经错过了这次登记，换到新纪元重试 */
+        if (__atomic_load_n(&pip_registry.epoch, __ATOMIC_SEQ_CST) == epoch)
+        {
+            *slot = epoch & 1;
+            return __atomic_load_n(&pip_registry.current, __ATOMIC_SEQ_CST);
+        }
+        __atomic_sub_fetch(&pip_registry.readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void pip_registry_read_end(uint32_t slot)
+{
+    __atomic_sub_fetch(&pip_registry.readers[slot], 1, __ATOMIC_SEQ_CST);
+}
+
+/* 发布新快照并等待所有可能持有旧快照的读取方退出，返回旧快照由调用方释放
+ * 调用方必须持有write_mutex */
+static pip_registry_snapshot_t *pip_registry_publish(pip_registry_snapshot_t *snapshot)
+{
+    pip_registry_snapshot_t *old = pip_registry.current;
+    uint32_t slot;
+
+    __atomic_store_n(&pip_registry.current, snapshot, __ATOMIC_SEQ_CST);
+    slot = __atomic_fetch_add(&pip_registry.epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    while (__atomic_load_n(&pip_registry.readers[slot], __ATOMIC_SEQ_CST) > 0)
+    {
+        switch_yield(100);
+    }
+    return old;
+}
+
+/* 一次发布完成多个登记和注销。
+ * added[i]为真表示add[i]已登记，注册表持有一个引用；同一UUID已登记（或在add中重复）时为假。
+ * removed[i]为真表示remove[i]已注销，注册表的引用转交调用方，此时不再有读取方能看到该会话 */
+static switch_status_t pip_registry_update(pip_session_data_t **add, int add_count, switch_bool_t *added,
+                                           pip_session_data_t **remove, int remove_count, switch_bool_t *removed)
+{
+    pip_registry_snapshot_t *old, *snapshot;
+    int count, n = 0, changes = 0;
+
+    for (int i = 0; i < add_count; i++)
+    {
+        added[i] = SWITCH_FALSE;
+    }
+    for (int j = 0; j < remove_count; j++)
+    {
+        removed[j] = SWITCH_FALSE;
+    }
+
+    switch_mutex_lock(pip_registry.write_mutex);
+    old = pip_registry.current;
+    count = old ? old->count : 0;
+
+    snapshot = malloc(sizeof(pip_registry_snapshot_t) + sizeof(pip_session_data_t *) * (count + add_count));
+    if (!snapshot)
+    {
+        switch_mutex_unlock(pip_registry.write_mutex);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "更新PIP会话注册表时内存不足\n");
+        return SWITCH_STATUS_MEMERR;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        switch_bool_t keep = SWITCH_TRUE;
+
+        for (int j = 0; j < remove_count; j++)
+        {
+            if (old->sessions[i] == remove[j])
+            {
+                removed[j] = SWITCH_TRUE;
+                keep = SWITCH_FALSE;
+                changes++;
+                break;
+            }
+        }
+        if (keep)
+        {
+            snapshot->sessions[n++] = old->sessions[i];
+        }
+    }
+
+    for (int i = 0; i < add_count; i++)
+    {
+        int k;
+
+        for (k = 0; k < n; k++)
+        {
+            if (!strcmp(snapshot->sessions[k]->uuid, add[i]->uuid))
+            {
+                break;
+            }
+        }
+        if (k == n)
+        {
+            pip_session_ref(add[i]);
+            snapshot->sessions[n++] = add[i];
+            added[i] = SWITCH_TRUE;
+            changes++;
+        }
+    }
+
+    if (changes == 0)
+    {
+        free(snapshot);
+        switch_mutex_unlock(pip_registry.write_mutex);
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    snapshot->count = n;
+    if (n == 0)
+    {
+        free(snapshot);
+        snapshot = NULL;
+    }
+    free(pip_registry_publish(snapshot));
+    switch_mutex_unlock(pip_registry.write_mutex);
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 登记会话，注册表持有一个引用；同一UUID已登记时返回SWITCH_STATUS_FALSE */
+static switch_status_t pip_registry_insert(pip_session_data_t *pip_data)
+{
+    switch_bool_t added;
+    switch_status_t status = pip_registry_update(&pip_data, 1, &added, NULL, 0, NULL);
+
+    if (status != SWITCH_STATUS_SUCCESS)
+    {
+        return status;
+    }
+    return added ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+}
+
+/* 注销会话；返回SWITCH_TRUE时注册表的引用已转交调用方 */
+static switch_bool_t pip_registry_remove(pip_session_data_t *pip_data)
+{
+    switch_bool_t removed;
+
+    if (pip_registry_update(NULL, 0, NULL, &pip_data, 1, &removed) != SWITCH_STATUS_SUCCESS)
+    {
+        return SWITCH_FALSE;
+    }
+    return removed;
+}
+
+/* 按UUID查找会话，找到时返回的会话已加引用，用完后调用pip_session_release */
+static pip_session_data_t *pip_registry_find(const char *uuid)
+{
+    pip_registry_snapshot_t *snapshot;
+    pip_session_data_t *found = NULL;
+    uint32_t slot;
+
+    snapshot = pip_registry_read_begin(&slot);
+    for (int i = 0; snapshot && i < snapshot->count; i++)
+    {
+        if (!strcmp(snapshot->sessions[i]->uuid, uuid))
+        {
+            found = snapshot->sessions[i];
+            pip_session_ref(found);
+            break;
+        }
+    }
+    pip_registry_read_end(slot);
+
+    return found;
+}
+
+/* 复制当前全部会话（每个都加引用），用pip_registry_list_free释放；返回会话数 */
+static int pip_registry_list(pip_session_data_t ***list)
+{
+    pip_registry_snapshot_t *snapshot;
+    uint32_t slot;
+    int count = 0;
+
+    *list = NULL;
+    snapshot = pip_registry_read_begin(&slot);
+    if (snapshot && snapshot->count > 0 && (*list = malloc(sizeof(pip_session_data_t *) * snapshot->count)))
+    {
+        for (count = 0; count < snapshot->count; count++)
+        {
+            (*list)[count] = snapshot->sessions[count];
+            pip_session_ref((*list)[count]);
+        }
+    }
+    pip_registry_read_end(slot);
+
+    return count;
+}
+
+static void pip_registry_list_free(pip_session_data_t **list, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        pip_session_release(list[i]);
+    }
+    switch_safe_free(list);
+}
+
+static void pip_session_ref(pip_session_data_t *pip_data)
+{
+    __atomic_add_fetch(&pip_data->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+/* 释放一个引用，最后一个引用释放时销毁会话内存池（资源应已由cleanup_pip_session释放） */
+static void pip_session_release(pip_session_data_t *pip_data)
+{
+    if (__atomic_sub_fetch(&pip_data->refs, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        switch_memory_pool_t *pool = pip_data->pool;
+        switch_core_destroy_memory_pool(&pool);
+    }
+}
+
+/* 注销并清理会话，可重复调用；调用方必须持有自己的引用 */
+static void pip_session_retire(pip_session_data_t *pip_data)
+{
+    switch_bool_t removed;
+
+    pip_data->active = SWITCH_FALSE;
+    removed = pip_registry_remove(pip_data);
+    cleanup_pip_session(pip_data);
+    if (removed)
+    {
+        pip_session_release(pip_data); /* 注册表持有的引用 */
+    }
+}
+
+/* 停止会话：摘除媒体钩子后由CLOSE回调完成注销；通话已不存在时直接注销 */
+static void pip_session_stop(pip_session_data_t *pip_data)
+{
+    switch_core_session_t *session = switch_core_session_locate(pip_data->uuid);
+
+    if (session)
+    {
+        switch_media_bug_t *bug = pip_data->read_bug;
+
+        if (bug)
+        {
+            switch_core_media_bug_remove(session, &bug);
+        }
+        switch_core_session_rwunlock(session);
+    }
+    pip_session_retire(pip_data);
+}
+
+/* 批量停止：一次发布把全部会话从注册表注销，再逐个摘除媒体钩子；调用方持有每个会话的引用 */
+static void pip_session_stop_many(pip_session_data_t **list, int count)
+{
+    switch_bool_t *removed;
+
+    if (count <= 0)
+    {
+        return;
+    }
+
+    if (!(removed = malloc(sizeof(switch_bool_t) * count)) ||
+        pip_registry_update(NULL, 0, NULL, list, count, removed) != SWITCH_STATUS_SUCCESS)
+    {
+        /* 内存不足时逐个停止 */
+        for (int i = 0; i < count; i++)
+        {
+            pip_session_stop(list[i]);
+        }
+        switch_safe_free(removed);
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        pip_session_stop(list[i]);
+        if (removed[i])
+        {
+            pip_session_release(list[i]); /* 注册表持有的引用 */
+        }
+    }
+    free(removed);
+}
+
+/* 启动第一步：定位通话、分配会话并完成耗时的初始化（打开本地文件、解码器、编码器）。
+ * 成功时返回持有创建者引用的会话，尚未登记也未挂媒体钩子；失败时返回NULL并把原因写入err */
+static pip_session_data_t *pip_session_prepare(const char *uuid, const char *local_video_file, char *err,
+                                               switch_size_t errlen, switch_status_t *status)
+{
+    switch_core_session_t *psession = NULL;
+    pip_session_data_t *pip_data = NULL;
+    switch_memory_pool_t *pip_pool = NULL;
+    const char *share;
+
+    /* 查找会话 */
+    // 使用UUID查找会话,并且会上锁
+    psession = switch_core_session_locate(uuid);
+    if (!psession)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "找不到会话: %s\n", uuid);
+        snprintf(err, errlen, "找不到会话: %s", uuid);
+        *status = SWITCH_STATUS_NOTFOUND;
+        return NULL;
+    }
+
+    /* 同一个通话只允许一个PIP实例 */
+    if ((pip_data = pip_registry_find(uuid)))
+    {
+        pip_session_release(pip_data);
+        switch_core_session_rwunlock(psession);
+        snprintf(err, errlen, "会话已启动PIP: %s", uuid);
+        *status = SWITCH_STATUS_FALSE;
+        return NULL;
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "成功找到会话，开始分配PIP数据结构\n");
+
+    /* 分配PIP数据结构：使用独立内存池，最后一个引用释放时销毁 */
+    if (switch_core_new_memory_pool(&pip_pool) != SWITCH_STATUS_SUCCESS ||
+        !(pip_data = switch_core_alloc(pip_pool, sizeof(pip_session_data_t))))
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配PIP数据结构失败\n");
+        if (pip_pool)
+        {
+            switch_core_destroy_memory_pool(&pip_pool);
+        }
+        switch_core_session_rwunlock(psession);
+        snprintf(err, errlen, "内存分配失败");
+        *status = SWITCH_STATUS_MEMERR;
+        return NULL;
+    }
+    memset(pip_data, 0, sizeof(pip_session_data_t));
+
+    pip_data->pool = pip_pool;
+    pip_data->refs = 1; /* 启动流程持有的引用 */
+    switch_copy_string(pip_data->uuid, uuid, sizeof(pip_data->uuid));
+    pip_data->session = psession;
+    pip_data->channel = switch_core_session_get_channel(psession);
+
+    /* 设置默认参数 */
+    pip_data->main_width = 640; /* 将由本地视频文件确定 */
+    pip_data->main_height = 480;
+    pip_data->pip_width = pip_config.pip_width;
+    pip_data->pip_height = pip_config.pip_height;
+    pip_data->pip_x = pip_config.pip_x;
+    pip_data->pip_y = pip_config.pip_y;
+    pip_data->pip_opacity = pip_config.pip_opacity;
+    pip_data->style = pip_config.style;
+    pip_data->alpha_mask_dirty = SWITCH_TRUE;
+    pip_data->color_adjust = pip_config.color_adjust;
+    pip_data->color_lut_dirty = SWITCH_TRUE;
+    pip_data->active = SWITCH_TRUE;
+
+    /* 初始化互斥锁 */
+    if (switch_mutex_init(&pip_data->mutex, SWITCH_MUTEX_UNNESTED, pip_pool) != SWITCH_STATUS_SUCCESS ||
+        switch_mutex_init(&pip_data->frame_mutex, SWITCH_MUTEX_UNNESTED, pip_pool) != SWITCH_STATUS_SUCCESS ||
+        switch_mutex_init(&pip_data->layout_mutex, SWITCH_MUTEX_UNNESTED, pip_pool) != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "初始化mutex失败\n");
+        pip_session_release(pip_data);
+        switch_core_session_rwunlock(psession);
+        snprintf(err, errlen, "初始化互斥锁失败");
+        *status = SWITCH_STATUS_GENERR;
+        return NULL;
+    }
+
+    pip_mem_charge(pip_data, PIP_MEM_SESSION, sizeof(pip_session_data_t) + sizeof(switch_frame_t));
+    if ((share = switch_channel_get_variable(pip_data->channel, PIP_VAR_SHARE)))
+    {
+        switch_copy_string(pip_data->share_name, share, sizeof(pip_data->share_name));
+    }
+    pip_subtitle_acquire(pip_data);
+
+    /* 初始化PIP上下文（包含本地视频文件） */
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "开始初始化PIP上下文\n");
+
+    // 确认本地文件是图片还是视频，并进行相应初始化
+    *status = init_pip_context(pip_data, local_video_file);
+    switch_core_session_rwunlock(psession);
+    if (*status != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "初始化PIP上下文失败\n");
+        pip_session_abort(pip_data);
+        if (*status == SWITCH_STATUS_MEMERR)
+        {
+            snprintf(err, errlen, "超出模块内存上限 (max-memory-mb=%llu)",
+                     (unsigned long long)(pip_config.max_memory_bytes / (1024 * 1024)));
+        }
+        else
+        {
+            snprintf(err, errlen, "初始化PIP上下文失败");
+            *status = SWITCH_STATUS_GENERR;
+        }
+        return NULL;
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "PIP上下文初始化成功\n");
+
+    return pip_data;
+}
+
+/* 启动第二步：会话已登记到注册表后挂媒体钩子，失败时注销会话。
+ * 无论成功与否都释放创建者引用；降级启动等提示写入err */
+static switch_status_t pip_session_commit(pip_session_data_t *pip_data, char *err, switch_size_t errlen)
+{
+    switch_core_session_t *psession;
+
+    /* 准备期间通话可能已经挂机 */
+    if (!(psession = switch_core_session_locate(pip_data->uuid)))
+    {
+        snprintf(err, errlen, "通话已结束: %s", pip_data->uuid);
+        pip_session_retire(pip_data);
+        pip_session_release(pip_data);
+        return SWITCH_STATUS_NOTFOUND;
+    }
+    pip_data->session = psession;
+    pip_data->channel = switch_core_session_get_channel(psession);
+
+    /* 输出时钟先于媒体钩子启动，钩子收到的第一帧即由时钟线程合成 */
+    if (pip_config.output_clock != PIP_OUTPUT_CLOCK_ARRIVAL && pip_clock_start(pip_data) != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "启动输出时钟线程失败\n");
+        pip_session_retire(pip_data);
+        pip_session_release(pip_data);
+        switch_core_session_rwunlock(psession);
+        snprintf(err, errlen, "启动输出时钟线程失败");
+        return SWITCH_STATUS_GENERR;
+    }
+
+    /* 创建媒体钩子来捕获远程视频 */
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "开始创建媒体钩子\n");
+    pip_session_ref(pip_data); /* 媒体钩子持有的引用，在CLOSE回调中释放 */
+    // 第四个参数是一个回调函数指针，指向处理远程视频帧的函数
+    if (switch_core_media_bug_add(psession, "video_pip_read", pip_data->uuid, pip_read_video_callback, pip_data, 0,
+                                  SMBF_READ_VIDEO_PING, &pip_data->read_bug) != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "创建媒体钩子失败\n");
+        pip_session_release(pip_data);
+        pip_session_retire(pip_data);
+        pip_session_release(pip_data);
+        switch_core_session_rwunlock(psession);
+        snprintf(err, errlen, "创建媒体钩子失败");
+        return SWITCH_STATUS_GENERR;
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "媒体钩子创建成功\n");
+
+    /* 输出旁路是可选的，开启失败不影响合成；放在登记之后，重复启动不会替换正在使用的帧环 */
+    if (pip_config.output_tap)
+    {
+        char tap_err[256];
+
+        if (pip_output_tap_start(pip_data, NULL, pip_config.output_tap_slots, tap_err, sizeof(tap_err)) !=
+            SWITCH_STATUS_SUCCESS)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "会话 %s 开启输出旁路失败: %s\n",
+                              pip_data->uuid, tap_err);
+        }
+    }
+
+    switch_mutex_lock(metrics_mutex);
+    sessions_started_total++;
+    switch_mutex_unlock(metrics_mutex);
+
+    switch_core_session_rwunlock(psession);
+
+    if (pip_data->mem_downgraded)
+    {
+        snprintf(err, errlen, "内存降级: 不录制");
+    }
+    pip_session_release(pip_data);
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 放弃已准备但未登记的会话，释放创建者引用 */
+static void pip_session_abort(pip_session_data_t *pip_data)
+{
+    cleanup_pip_session(pip_data);
+    pip_session_release(pip_data);
+}
+
+/* 为指定通话启动PIP：准备、登记到注册表、挂媒体钩子，合成从钩子收到的第一帧远程视频开始。
+ * 失败时把原因写入err；同一通话重复启动返回SWITCH_STATUS_FALSE */
+static switch_status_t pip_session_start(const char *uuid, const char *local_video_file, char *err, switch_size_t errlen)
+{
+    pip_session_data_t *pip_data;
+    switch_status_t status;
+
+    if (!(pip_data = pip_session_prepare(uuid, local_video_file, err, errlen, &status)))
+    {
+        return status;
+    }
+
+    /* 先登记到注册表（并发重复启动在这里被拒绝），再挂媒体钩子 */
+    if (pip_registry_insert(pip_data) != SWITCH_STATUS_SUCCESS)
+    {
+        pip_session_abort(pip_data);
+        snprintf(err, errlen, "会话已启动PIP: %s", uuid);
+        return SWITCH_STATUS_FALSE;
+    }
+
+    return pip_session_commit(pip_data, err, errlen);
+}
+
+/* ---------- 布局修改 ---------- */
+
+/* 合并到待生效的修改中，媒体线程在下一帧开始时应用，调用方不会等待正在处理的帧 */
+static void pip_session_set_layout(pip_session_data_t *pip_data, const pip_layout_t *layout, uint32_t mask)
+{
+    switch_mutex_lock(pip_data->layout_mutex);
+    if (mask & PIP_LAYOUT_X)
+    {
+        pip_data->pending_layout.x = layout->x;
+    }
+    if (mask & PIP_LAYOUT_Y)
+    {
+        pip_data->pending_layout.y = layout->y;
+    }
+    if (mask & PIP_LAYOUT_OPACITY)
+    {
+        pip_data->pending_layout.opacity = layout->opacity;
+    }
+    if (mask & PIP_LAYOUT_WIDTH)
+    {
+        pip_data->pending_layout.width = layout->width;
+    }
+    if (mask & PIP_LAYOUT_HEIGHT)
+    {
+        pip_data->pending_layout.height = layout->height;
+    }
+    if (mask & PIP_LAYOUT_ANCHOR)
+    {
+        pip_data->pending_layout.anchor = layout->anchor;
+    }
+    if (mask & PIP_LAYOUT_DURATION)
+    {
+        pip_data->pending_layout.duration_ms = layout->duration_ms;
+    }
+    if (mask & PIP_LAYOUT_EASING)
+    {
+        pip_data->pending_layout.easing = layout->easing;
+    }
+    pip_style_merge(&pip_data->pending_layout.style, &layout->style, mask);
+    pip_color_adjust_merge(&pip_data->pending_layout.color, &layout->color, mask);
+    /* 显式坐标覆盖同一批修改中更早的角落定位 */
+    if (mask & (PIP_LAYOUT_X | PIP_LAYOUT_Y) && !(mask & PIP_LAYOUT_ANCHOR))
+    {
+        __atomic_and_fetch(&pip_data->pending_layout_mask, ~(uint32_t)PIP_LAYOUT_ANCHOR, __ATOMIC_SEQ_CST);
+    }
+    __atomic_or_fetch(&pip_data->pending_layout_mask, mask, __ATOMIC_SEQ_CST);
+    switch_mutex_unlock(pip_data->layout_mutex);
+}
+
+/* 在媒体线程中调用（持有frame_mutex）：几何参数在两帧之间一次性切换，编码器不受影响。
+ * 带duration的修改不直接生效，而是启动一段过渡动画，之后每帧由pip_animation_step推进 */
+static void pip_layout_apply_pending(pip_session_data_t *pip_data, switch_time_t now)
+{
+    pip_animation_t *anim = &pip_data->animation;
+    pip_geometry_t current, target;
+    pip_layout_t layout;
+    uint32_t mask;
+
+    if (!__atomic_load_n(&pip_data->pending_layout_mask, __ATOMIC_SEQ_CST))
+    {
+        pip_animation_step(pip_data, now);
+        return;
+    }
+
+    switch_mutex_lock(pip_data->layout_mutex);
+    layout = pip_data->pending_layout;
+    mask = __atomic_exchange_n(&pip_data->pending_layout_mask, 0, __ATOMIC_SEQ_CST);
+    switch_mutex_unlock(pip_data->layout_mutex);
+
+    /* 组长的布局修改对全组生效；之后按原布局启动的会话另建新组 */
+    if (pip_data->share_group)
+    {
+        switch_mutex_lock(pip_share_mutex);
+        pip_data->share_group->joinable = SWITCH_FALSE;
+        switch_mutex_unlock(pip_share_mutex);
+    }
+
+    /* 样式不参与动画，立即生效，遮罩在下一次叠加前重算 */
+    if (mask & PIP_LAYOUT_STYLE)
+    {
+        pip_style_merge(&pip_data->style, &layout.style, mask);
+        pip_data->alpha_mask_dirty = SWITCH_TRUE;
+    }
+
+    /* 调色同样立即生效，查找表在下一次叠加前重建 */
+    if (mask & PIP_LAYOUT_COLOR)
+    {
+        pip_color_adjust_merge(&pip_data->color_adjust, &layout.color, mask);
+        pip_data->color_lut_dirty = SWITCH_TRUE;
+    }
+
+    current.x = (float)pip_data->pip_x;
+    current.y = (float)pip_data->pip_y;
+    current.width = (float)pip_data->pip_width;
+    current.height = (float)pip_data->pip_height;
+    current.opacity = pip_data->pip_opacity;
+
+    /* 未指定的参数沿用进行中动画的终点，而不是动画的中间状态 */
+    target = anim->active ? anim->to : current;
+    pip_layout_target(pip_data, &layout, mask, &target);
+
+    if ((mask & PIP_LAYOUT_DURATION) && layout.duration_ms > 0)
+    {
+        /* 从当前画面状态出发，打断进行中的动画时不会跳变 */
+        anim->from = current;
+        anim->to = target;
+        anim->easing = (mask & PIP_LAYOUT_EASING) ? layout.easing : PIP_EASING_EASE_IN_OUT;
+        anim->start = now;
+        anim->duration = (switch_time_t)layout.duration_ms * 1000;
+        anim->active = SWITCH_TRUE;
+
+        /* 按动画过程中的最大尺寸一次分配缩放帧，之后每帧只改宽高 */
+        pip_layout_reserve(pip_data, (int)(current.width > target.width ? current.width : target.width),
+                           (int)(current.height > target.height ? current.height : target.height));
+        pip_animation_step(pip_data, now);
+    }
+    else
+    {
+        anim->active = SWITCH_FALSE;
+        pip_geometry_apply(pip_data, &target);
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "PIP布局已更新: %s %.0fx%.0f@(%.0f,%.0f) 透明度=%.2f%s\n",
+                      pip_data->uuid, target.width, target.height, target.x, target.y, target.opacity,
+                      anim->active ? " (动画中)" : "");
+}
+
+/* 把一次布局修改合并到target上（传入时为基准状态），角落定位按目标尺寸计算 */
+static void pip_layout_target(pip_session_data_t *pip_data, const pip_layout_t *layout, uint32_t mask,
+                              pip_geometry_t *target)
+{
+    if (mask & PIP_LAYOUT_WIDTH)
+    {
+        target->width = (float)layout->width;
+    }
+    if (mask & PIP_LAYOUT_HEIGHT)
+    {
+        target->height = (float)layout->height;
+    }
+    /* 与pip_layout_resize相同的取整规则，保证动画终点就是最终尺寸 */
+    target->width = (float)(((int)target->width > pip_data->main_width ? pip_data->main_width : (int)target->width) & ~1);
+    target->height =
+        (float)(((int)target->height > pip_data->main_height ? pip_data->main_height : (int)target->height) & ~1);
+    if (target->width < 2)
+    {
+        target->width = 2;
+    }
+    if (target->height < 2)
+    {
+        target->height = 2;
+    }
+
+    if (mask & PIP_LAYOUT_X)
+    {
+        target->x = (float)layout->x;
+    }
+    if (mask & PIP_LAYOUT_Y)
+    {
+        target->y = (float)layout->y;
+    }
+    if (mask & PIP_LAYOUT_ANCHOR)
+    {
+        float right = pip_data->main_width - target->width - PIP_LAYOUT_MARGIN;
+        float bottom = pip_data->main_height - target->height - PIP_LAYOUT_MARGIN;
+
+        switch (layout->anchor)
+        {
+        case PIP_ANCHOR_TOP_LEFT:
+            target->x = PIP_LAYOUT_MARGIN;
+            target->y = PIP_LAYOUT_MARGIN;
+            break;
+        case PIP_ANCHOR_TOP_RIGHT:
+            target->x = right;
+            target->y = PIP_LAYOUT_MARGIN;
+            break;
+        case PIP_ANCHOR_BOTTOM_LEFT:
+            target->x = PIP_LAYOUT_MARGIN;
+            target->y = bottom;
+            break;
+        case PIP_ANCHOR_BOTTOM_RIGHT:
+            target->x = right;
+            target->y = bottom;
+            break;
+        case PIP_ANCHOR_CENTER:
+            target->x = (float)((pip_data->main_width - (int)target->width) / 2);
+            target->y = (float)((pip_data->main_height - (int)target->height) / 2);
+            break;
+        }
+    }
+    if (mask & PIP_LAYOUT_OPACITY)
+    {
+        target->opacity = layout->opacity;
+    }
 
-            /* 保存最新的远程视频帧 */
-            if (pip_data->last_remote_frame)
-            {
-                if (pip_data->last_remote_frame->img)
-                {
-                    // 释放之前的图像数据，防止内存泄漏
-                    switch_img_free(&pip_data->last_remote_frame->img);
-                }
-            }
-            else
-            {
-                // 如果没有分配过last_remote_frame，分配内存
-                pip_data->last_remote_frame =
-                    switch_core_alloc(switch_core_session_get_pool(pip_data->session), sizeof(switch_frame_t));
-                // 初始化内存
-                memset(pip_data->last_remote_frame, 0, sizeof(switch_frame_t));
-            }
+    if (target->x > pip_data->main_width - target->width)
+    {
+        target->x = pip_data->main_width - target->width;
+    }
+    if (target->y > pip_data->main_height - target->height)
+    {
+        target->y = pip_data->main_height - target->height;
+    }
+    if (target->x < 0)
+    {
+        target->x = 0;
+    }
+    if (target->y < 0)
+    {
+        target->y = 0;
+    }
+}
 
-            /* 复制帧数据 */
-            pip_data->last_remote_frame->img =
-                switch_img_alloc(NULL, frame->img->fmt, frame->img->d_w, frame->img->d_h, 1);
-            if (pip_data->last_remote_frame->img)
-            {
-                switch_img_copy(frame->img, &pip_data->last_remote_frame->img);
-                pip_data->remote_frames_count++;
+/* 让画面呈现给定状态：尺寸不变时只改坐标和透明度，几乎没有开销 */
+static void pip_geometry_apply(pip_session_data_t *pip_data, const pip_geometry_t *geometry)
+{
+    pip_layout_resize(pip_data, (int)lroundf(geometry->width), (int)lroundf(geometry->height));
+    pip_data->pip_x = (int)lroundf(geometry->x);
+    pip_data->pip_y = (int)lroundf(geometry->y);
+    pip_data->pip_opacity = geometry->opacity;
+
+    /* 叠加内核遇到负坐标会跳过整帧，这里保证窗口完全落在主画面内 */
+    if (pip_data->pip_x > pip_data->main_width - pip_data->pip_width)
+    {
+        pip_data->pip_x = pip_data->main_width - pip_data->pip_width;
+    }
+    if (pip_data->pip_y > pip_data->main_height - pip_data->pip_height)
+    {
+        pip_data->pip_y = pip_data->main_height - pip_data->pip_height;
+    }
+    if (pip_data->pip_x < 0)
+    {
+        pip_data->pip_x = 0;
+    }
+    if (pip_data->pip_y < 0)
+    {
+        pip_data->pip_y = 0;
+    }
+}
+
+/* 推进过渡动画：坐标和透明度逐帧插值；尺寸按animation-size-step量化，
+ * 只有跨过一个步长时才换缩放上下文，其余帧的开销只是几次浮点运算 */
+static void pip_animation_step(pip_session_data_t *pip_data, switch_time_t now)
+{
+    pip_animation_t *anim = &pip_data->animation;
+    pip_geometry_t g;
+    int step = pip_config.animation_size_step;
+    float t, e;
+
+    if (!anim->active)
+    {
+        return;
+    }
+
+    t = anim->duration > 0 ? (float)(now - anim->start) / (float)anim->duration : 1.0f;
+    if (t >= 1.0f)
+    {
+        anim->active = SWITCH_FALSE;
+        pip_geometry_apply(pip_data, &anim->to);
+        return;
+    }
+    if (t < 0.0f)
+    {
+        t = 0.0f;
+    }
+
+    e = pip_ease(anim->easing, t);
+    g.x = anim->from.x + (anim->to.x - anim->from.x) * e;
+    g.y = anim->from.y + (anim->to.y - anim->from.y) * e;
+    g.width = anim->from.width + (anim->to.width - anim->from.width) * e;
+    g.height = anim->from.height + (anim->to.height - anim->from.height) * e;
+    g.opacity = anim->from.opacity + (anim->to.opacity - anim->from.opacity) * e;
+
+    /* 与当前尺寸相差不到一个步长时保持不变，动画结束时再精确落到目标尺寸 */
+    if (step > 1)
+    {
+        if (fabsf(g.width - pip_data->pip_width) < step)
+        {
+            g.width = (float)pip_data->pip_width;
+        }
+        if (fabsf(g.height - pip_data->pip_height) < step)
+        {
+            g.height = (float)pip_data->pip_height;
+        }
+    }
+
+    pip_geometry_apply(pip_data, &g);
+}
+
+/* 三次缓动曲线，t在[0,1]内 */
+static float pip_ease(pip_easing_t easing, float t)
+{
+    float u;
+
+    switch (easing)
+    {
+    case PIP_EASING_EASE_IN:
+        return t * t * t;
+    case PIP_EASING_EASE_OUT:
+        u = 1.0f - t;
+        return 1.0f - u * u * u;
+    case PIP_EASING_EASE_IN_OUT:
+        if (t < 0.5f)
+        {
+            return 4.0f * t * t * t;
+        }
+        u = 2.0f - 2.0f * t;
+        return 1.0f - u * u * u / 2.0f;
+    case PIP_EASING_LINEAR:
+    default:
+        return t;
+    }
+}
+
+/* 分配能容纳width x height的缩放帧缓冲区，当前显示尺寸不变；已足够大时什么都不做 */
+static switch_status_t pip_layout_reserve(pip_session_data_t *pip_data, int width, int height)
+{
+    AVFrame *scaled;
+
+    width = (width > pip_data->main_width ? pip_data->main_width : width) & ~1;
+    height = (height > pip_data->main_height ? pip_data->main_height : height) & ~1;
+    if (width <= pip_data->scaled_capacity_width && height <= pip_data->scaled_capacity_height)
+    {
+        return SWITCH_STATUS_SUCCESS;
+    }
+    if (width < pip_data->scaled_capacity_width)
+    {
+        width = pip_data->scaled_capacity_width;
+    }
+    if (height < pip_data->scaled_capacity_height)
+    {
+        height = pip_data->scaled_capacity_height;
+    }
+
+    if (!(scaled = av_frame_alloc()))
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    scaled->format = AV_PIX_FMT_YUV420P;
+    scaled->width = width;
+    scaled->height = height;
+    if (av_frame_get_buffer(scaled, 32) < 0)
+    {
+        av_frame_free(&scaled);
+        return SWITCH_STATUS_MEMERR;
+    }
+
+    /* 缩放上下文只与尺寸有关，换缓冲区不需要重建
+     * 宽高改回显示尺寸前记下分配大小，记账和上限按实际预留的容量算 */
+    pip_data->scaled_capacity_bytes = pip_frame_bytes(scaled);
+    scaled->width = pip_data->pip_width;
+    scaled->height = pip_data->pip_height;
+    av_frame_free(&pip_data->frame_pip_scaled);
+    pip_data->frame_pip_scaled = scaled;
+    pip_data->scaled_capacity_width = width;
+    pip_data->scaled_capacity_height = height;
+
+    pip_mem_charge(pip_data, PIP_MEM_FRAMES, pip_mem_frames_total(pip_data));
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 在媒体线程中调整PIP窗口尺寸：尺寸不变时什么都不做；缓冲区够大时原地改宽高，
+ * 否则换上新的缩放目标帧。缩放上下文在下一次缩放前按新尺寸重建。分配失败时保持原尺寸 */
+static switch_status_t pip_layout_resize(pip_session_data_t *pip_data, int width, int height)
+{
+    /* YUV420P要求偶数尺寸，且不超过主画面 */
+    width = (width > pip_data->main_width ? pip_data->main_width : width) & ~1;
+    height = (height > pip_data->main_height ? pip_data->main_height : height) & ~1;
+    if (width < 2 || height < 2)
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+    if (pip_data->frame_pip_scaled && width == pip_data->frame_pip_scaled->width &&
+        height == pip_data->frame_pip_scaled->height)
+    {
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    /* 缩小后缓冲区不还给系统：行跨度不变，sws_scale和叠加内核都只按宽高访问 */
+    if (pip_layout_reserve(pip_data, width, height) != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "调整PIP尺寸失败，保持%dx%d\n",
+                          pip_data->pip_width, pip_data->pip_height);
+        return SWITCH_STATUS_MEMERR;
+    }
+
+    pip_data->frame_pip_scaled->width = width;
+    pip_data->frame_pip_scaled->height = height;
+    pip_data->pip_width = width;
+    pip_data->pip_height = height;
+
+    if (pip_data->sws_ctx_pip)
+    {
+        sws_freeContext(pip_data->sws_ctx_pip);
+        pip_data->sws_ctx_pip = NULL;
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 把mask中选中的样式参数合并到dst */
+static void pip_style_merge(pip_style_t *dst, const pip_style_t *src, uint32_t mask)
+{
+    if (mask & PIP_LAYOUT_BORDER)
+    {
+        dst->border_width = src->border_width;
+    }
+    if (mask & PIP_LAYOUT_BORDER_COLOR)
+    {
+        memcpy(dst->border_color, src->border_color, sizeof(dst->border_color));
+    }
+    if (mask & PIP_LAYOUT_RADIUS)
+    {
+        dst->corner_radius = src->corner_radius;
+    }
+    if (mask & PIP_LAYOUT_FEATHER)
+    {
+        dst->feather = src->feather;
+    }
+}
+
+/* 把mask中选中的调色参数合并到dst */
+static void pip_color_adjust_merge(pip_color_adjust_t *dst, const pip_color_adjust_t *src, uint32_t mask)
+{
+    if (mask & PIP_LAYOUT_BRIGHTNESS)
+    {
+        dst->brightness = src->brightness;
+    }
+    if (mask & PIP_LAYOUT_CONTRAST)
+    {
+        dst->contrast = src->contrast;
+    }
+    if (mask & PIP_LAYOUT_SATURATION)
+    {
+        dst->saturation = src->saturation;
+    }
+}
+
+/* 解析一个布局参数：位置、尺寸、透明度、动画（duration、easing）、样式（border、border_color、radius、feather）
+ * 和背景调色（brightness、contrast、saturation） */
+static switch_status_t pip_layout_parse(const char *name, const char *value, pip_layout_t *layout, uint32_t *mask)
+{
+    static const char *anchors[] = {"top_left", "top_right", "bottom_left", "bottom_right", "center"};
+    static const char *easings[] = {"linear", "ease_in", "ease_out", "ease_in_out"};
+    char *end = NULL;
+
+    if (zstr(name) || zstr(value))
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    if (!strcasecmp(name, "x") || !strcasecmp(name, "y"))
+    {
+        long v = strtol(value, &end, 10);
+        if (*end)
+        {
+            return SWITCH_STATUS_FALSE;
+        }
+        if (!strcasecmp(name, "x"))
+        {
+            layout->x = (int)v;
+            *mask |= PIP_LAYOUT_X;
+        }
+        else
+        {
+            layout->y = (int)v;
+            *mask |= PIP_LAYOUT_Y;
+        }
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    if (!strcasecmp(name, "width") || !strcasecmp(name, "height"))
+    {
+        long v = strtol(value, &end, 10);
+        if (*end || v < 2 || v > 8192)
+        {
+            return SWITCH_STATUS_FALSE;
+        }
+        if (!strcasecmp(name, "width"))
+        {
+            layout->width = (int)v;
+            *mask |= PIP_LAYOUT_WIDTH;
+        }
+        else
+        {
+            layout->height = (int)v;
+            *mask |= PIP_LAYOUT_HEIGHT;
+        }
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    if (!strcasecmp(name, "opacity"))
+    {
+        double v = strtod(value, &end);
+        if (*end || v < 0.0 || v > 1.0)
+        {
+            return SWITCH_STATUS_FALSE;
+        }
+        layout->opacity = (float)v;
+        *mask |= PIP_LAYOUT_OPACITY;
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    if (!strcasecmp(name, "border") || !strcasecmp(name, "radius") || !strcasecmp(name, "feather"))
+    {
+        long v = strtol(value, &end, 10);
+        if (*end || v < 0 || v > (!strcasecmp(name, "radius") ? 4096 : 256))
+        {
+            return SWITCH_STATUS_FALSE;
+        }
+        if (!strcasecmp(name, "border"))
+        {
+            layout->style.border_width = (int)v;
+            *mask |= PIP_LAYOUT_BORDER;
+        }
+        else if (!strcasecmp(name, "radius"))
+        {
+            layout->style.corner_radius = (int)v;
+            *mask |= PIP_LAYOUT_RADIUS;
+        }
+        else
+        {
+            layout->style.feather = (int)v;
+            *mask |= PIP_LAYOUT_FEATHER;
+        }
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    if (!strcasecmp(name, "border_color"))
+    {
+        if (pip_color_parse(value, layout->style.border_color) != SWITCH_STATUS_SUCCESS)
+        {
+            return SWITCH_STATUS_FALSE;
+        }
+        *mask |= PIP_LAYOUT_BORDER_COLOR;
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    if (!strcasecmp(name, "brightness") || !strcasecmp(name, "contrast") || !strcasecmp(name, "saturation"))
+    {
+        /* 取值范围与FFmpeg eq滤镜一致（对比度只取常用的-2到2） */
+        double v = strtod(value, &end);
+        if (*end || (!strcasecmp(name, "brightness") && (v < -1.0 || v > 1.0)) ||
+            (!strcasecmp(name, "contrast") && (v < -2.0 || v > 2.0)) ||
+            (!strcasecmp(name, "saturation") && (v < 0.0 || v > 3.0)))
+        {
+            return SWITCH_STATUS_FALSE;
+        }
+        if (!strcasecmp(name, "brightness"))
+        {
+            layout->color.brightness = (float)v;
+            *mask |= PIP_LAYOUT_BRIGHTNESS;
+        }
+        else if (!strcasecmp(name, "contrast"))
+        {
+            layout->color.contrast = (float)v;
+            *mask |= PIP_LAYOUT_CONTRAST;
+        }
+        else
+        {
+            layout->color.saturation = (float)v;
+            *mask |= PIP_LAYOUT_SATURATION;
+        }
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    if (!strcasecmp(name, "duration"))
+    {
+        long v = strtol(value, &end, 10);
+        if (*end || v < 0 || v > 60000)
+        {
+            return SWITCH_STATUS_FALSE;
+        }
+        layout->duration_ms = (int)v;
+        *mask |= PIP_LAYOUT_DURATION;
+        return SWITCH_STATUS_SUCCESS;
+    }
 
-                /* 处理画中画叠加 */
-                process_pip_overlay(pip_data);
+    if (!strcasecmp(name, "easing"))
+    {
+        for (size_t i = 0; i < switch_arraylen(easings); i++)
+        {
+            if (!strcasecmp(value, easings[i]))
+            {
+                layout->easing = (pip_easing_t)i;
+                *mask |= PIP_LAYOUT_EASING;
+                return SWITCH_STATUS_SUCCESS;
             }
+        }
+        return SWITCH_STATUS_FALSE;
+    }
 
-            switch_mutex_unlock(pip_data->frame_mutex);
-
-            if (pip_data->remote_frames_count % 300 == 0)
-            { /* 每10秒记录一次 */
-                switch_log_printf(
-                    SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "捕获远程视频帧: %dx%d, 远程: %llu, 本地: %llu, PIP: %llu\n",
-                    frame->img->d_w, frame->img->d_h, (unsigned long long)pip_data->remote_frames_count,
-                    (unsigned long long)pip_data->local_frames_count, (unsigned long long)pip_data->frames_processed);
+    if (!strcasecmp(name, "position"))
+    {
+        for (size_t i = 0; i < switch_arraylen(anchors); i++)
+        {
+            if (!strcasecmp(value, anchors[i]))
+            {
+                layout->anchor = (pip_anchor_t)i;
+                *mask |= PIP_LAYOUT_ANCHOR;
+                return SWITCH_STATUS_SUCCESS;
             }
         }
-        break;
+        return SWITCH_STATUS_FALSE;
+    }
 
-    case SWITCH_ABC_TYPE_CLOSE:
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "PIP远程视频钩子关闭\n");
-        /* 确保清理PIP会话 */
-        if (pip_data)
+    return SWITCH_STATUS_FALSE;
+}
+
+/* 从最近应答的视频通话记录中移除uuid，调用方持有pip_event_mutex */
+static void pip_recent_video_remove_locked(const char *uuid)
+{
+    for (int i = 0; i < pip_recent_video_count; i++)
+    {
+        if (!strcmp(pip_recent_video_uuids[i], uuid))
         {
-            cleanup_pip_session(pip_data);
+            memmove(pip_recent_video_uuids[i], pip_recent_video_uuids[i + 1],
+                    sizeof(pip_recent_video_uuids[0]) * (pip_recent_video_count - i - 1));
+            pip_recent_video_count--;
+            return;
         }
-        break;
+    }
+}
 
-    default:
-        break;
+/* 记录为最近应答的视频通话，超出PIP_RECENT_VIDEO_CALLS时丢弃最早的一个 */
+static void pip_recent_video_add(const char *uuid)
+{
+    switch_mutex_lock(pip_event_mutex);
+    pip_recent_video_remove_locked(uuid);
+    if (pip_recent_video_count == PIP_RECENT_VIDEO_CALLS)
+    {
+        pip_recent_video_count--;
     }
+    memmove(pip_recent_video_uuids[1], pip_recent_video_uuids[0],
+            sizeof(pip_recent_video_uuids[0]) * pip_recent_video_count);
+    switch_copy_string(pip_recent_video_uuids[0], uuid, sizeof(pip_recent_video_uuids[0]));
+    pip_recent_video_count++;
+    switch_mutex_unlock(pip_event_mutex);
+}
 
-    return SWITCH_TRUE;
+/* 取最近应答且仍在进行的视频通话。挂断事件可能还没处理，逐个确认会话存在，
+ * 已不存在的顺便移除。找到时返回SWITCH_TRUE */
+static switch_bool_t pip_recent_video_pick(char *uuid, switch_size_t len)
+{
+    switch_core_session_t *session;
+    switch_bool_t found = SWITCH_FALSE;
+
+    switch_mutex_lock(pip_event_mutex);
+    while (pip_recent_video_count > 0 && !found)
+    {
+        if ((session = switch_core_session_locate(pip_recent_video_uuids[0])))
+        {
+            switch_core_session_rwunlock(session);
+            switch_copy_string(uuid, pip_recent_video_uuids[0], len);
+            found = SWITCH_TRUE;
+        }
+        else
+        {
+            pip_recent_video_remove_locked(pip_recent_video_uuids[0]);
+        }
+    }
+    switch_mutex_unlock(pip_event_mutex);
+    return found;
 }
 
-/* 处理画中画叠加 */
-static switch_status_t process_pip_overlay(pip_session_data_t *pip_data)
+/* 挂断事件：通话不再作为不带UUID的video_pip_start的目标 */
+static void pip_hangup_event_handler(switch_event_t *event)
 {
-    if (!pip_data || !pip_data->active)
+    const char *uuid = switch_event_get_header(event, "Unique-ID");
+
+    if (zstr(uuid))
     {
-        return SWITCH_STATUS_FALSE;
+        return;
     }
+    switch_mutex_lock(pip_event_mutex);
+    pip_recent_video_remove_locked(uuid);
+    switch_mutex_unlock(pip_event_mutex);
+}
 
-    /* 检查是否使用图片模式 */
-    if (pip_data->use_image_mode)
+/* 应答事件：记录最近应答的视频通话，并按通道变量或配置自动启动PIP。
+ * 事件线程中只做判断，初始化交给启动工作线程 */
+static void pip_answer_event_handler(switch_event_t *event)
+{
+    const char *uuid = switch_event_get_header(event, "Unique-ID");
+    switch_core_session_t *session;
+    switch_channel_t *channel;
+    const char *auto_start, *local_file;
+    char job_uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+    switch_bool_t start;
+
+    if (zstr(uuid) || !(session = switch_core_session_locate(uuid)))
     {
-        /* 图片模式：使用固定的本地图片，不需要读取新帧 */
-        if (!pip_data->local_image_frame)
+        return;
+    }
+
+    channel = switch_core_session_get_channel(session);
+    if (!switch_channel_test_flag(channel, CF_VIDEO))
+    {
+        switch_core_session_rwunlock(session);
+        return;
+    }
+
+    pip_recent_video_add(uuid);
+
+    /* 通道变量优先于配置中的auto-start */
+    auto_start = switch_channel_get_variable(channel, PIP_VAR_AUTO_START);
+    start = zstr(auto_start) ? pip_config.auto_start : (switch_true(auto_start) ? SWITCH_TRUE : SWITCH_FALSE);
+    if (start)
+    {
+        local_file = switch_channel_get_variable(channel, PIP_VAR_FILE);
+        if (pip_start_job_submit(uuid, zstr(local_file) ? pip_config.local_file : local_file, job_uuid,
+                                 sizeof(job_uuid)) == SWITCH_STATUS_SUCCESS)
         {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "图片模式下本地图片帧为空\n");
-            return SWITCH_STATUS_FALSE;
+            switch_channel_set_variable(channel, PIP_VAR_JOB_UUID, job_uuid);
         }
-
-        /* 将图片帧复制到frame_main用于处理 */
-        if (!pip_data->frame_main)
+        else
         {
-            pip_data->frame_main = av_frame_alloc();
-            if (!pip_data->frame_main)
-            {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法分配主帧\n");
-                return SWITCH_STATUS_FALSE;
-            }
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "自动启动PIP失败，启动队列不可用: %s\n", uuid);
         }
+    }
 
-        /* 复制图片帧数据到主帧 */
-        av_frame_unref(pip_data->frame_main);
-        if (av_frame_ref(pip_data->frame_main, pip_data->local_image_frame) < 0)
+    switch_core_session_rwunlock(session);
+}
+
+/* ---------- 异步启动 ---------- */
+
+/* 把任务放入启动队列。卸载标记在pip_start_mutex内检查，pip_start_workers_stop也持有它放入退出标记，
+ * 因此入队成功的任务一定排在退出标记之前，会被工作线程处理。
+ * 模块卸载中或没有工作线程时返回SWITCH_STATUS_TERM，队列已满时返回SWITCH_STATUS_FALSE */
+static switch_status_t pip_start_queue_push(pip_start_job_t *job)
+{
+    switch_status_t status = SWITCH_STATUS_TERM;
+
+    if (!pip_start_queue)
+    {
+        return status;
+    }
+    switch_mutex_lock(pip_start_mutex);
+    if (pip_start_worker_count > 0 && !__atomic_load_n(&pip_shutting_down, __ATOMIC_SEQ_CST))
+    {
+        status = switch_queue_trypush(pip_start_queue, job) == SWITCH_STATUS_SUCCESS ? SWITCH_STATUS_SUCCESS
+                                                                                     : SWITCH_STATUS_FALSE;
+    }
+    switch_mutex_unlock(pip_start_mutex);
+    return status;
+}
+
+/* 提交启动任务，立即返回任务ID；结果通过video_pip::start_result事件通知 */
+static switch_status_t pip_start_job_submit(const char *uuid, const char *local_file, char *job_uuid,
+                                            switch_size_t job_uuid_len)
+{
+    switch_memory_pool_t *pool = NULL;
+    pip_start_job_t *job;
+    switch_status_t status;
+
+    if (!pip_start_queue || __atomic_load_n(&pip_shutting_down, __ATOMIC_SEQ_CST))
+    {
+        return SWITCH_STATUS_FALSE;
+    }
+
+    if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS)
+    {
+        return SWITCH_STATUS_MEMERR;
+    }
+    job = switch_core_alloc(pool, sizeof(*job));
+    job->pool = pool;
+    switch_uuid_str(job->job_uuid, sizeof(job->job_uuid));
+    job->uuid = switch_core_strdup(pool, uuid);
+    job->local_file = switch_core_strdup(pool, local_file);
+    switch_copy_string(job_uuid, job->job_uuid, job_uuid_len);
+
+    if ((status = pip_start_queue_push(job)) != SWITCH_STATUS_SUCCESS)
+    {
+        if (status == SWITCH_STATUS_FALSE)
         {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法复制图片帧\n");
-            return SWITCH_STATUS_FALSE;
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "PIP启动队列已满，拒绝任务: %s\n", uuid);
         }
+        switch_core_destroy_memory_pool(&pool);
+        return SWITCH_STATUS_FALSE;
+    }
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "提交PIP启动任务 %s: UUID=%s, 本地文件=%s\n", job_uuid, uuid,
+                      local_file);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 执行启动任务并发出完成事件，Result为success或failure */
+static void pip_start_job_run(pip_start_job_t *job)
+{
+    switch_event_t *event = NULL;
+    switch_status_t status = SWITCH_STATUS_FALSE;
+    char err[256] = "";
+
+    if (__atomic_load_n(&pip_shutting_down, __ATOMIC_SEQ_CST))
+    {
+        snprintf(err, sizeof(err), "模块正在卸载");
+    }
+    else if (!pip_local_source_accessible(job->local_file))
+    {
+        snprintf(err, sizeof(err), "无法访问本地视频文件: %s", job->local_file);
     }
     else
     {
-        /* 视频模式：使用原有的帧率同步策略 */
-        uint64_t expected_local_frames = (pip_data->remote_frames_count * pip_data->local_fps) / pip_data->target_fps;
+        status = pip_session_start(job->uuid, job->local_file, err, sizeof(err));
+    }
 
-        /* 如果本地帧数不足，读取更多帧 */
-        while (pip_data->local_frames_count < expected_local_frames)
+    if (status == SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "PIP启动任务 %s 完成: UUID=%s, 本地文件=%s%s%s\n",
+                          job->job_uuid, job->uuid, job->local_file, zstr(err) ? "" : " ", err);
+    }
+    else
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "PIP启动任务 %s 失败: UUID=%s, %s\n", job->job_uuid,
+                          job->uuid, err);
+    }
+
+    if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, PIP_EVENT_START_RESULT) == SWITCH_STATUS_SUCCESS)
+    {
+        switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Job-UUID", job->job_uuid);
+        switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Unique-ID", job->uuid);
+        switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "PIP-Local-File", job->local_file);
+        switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "PIP-Result",
+                                       status == SWITCH_STATUS_SUCCESS ? "success" : "failure");
+        if (!zstr(err))
         {
-            if (read_local_video_frame(pip_data) != SWITCH_STATUS_SUCCESS)
-            {
-                /* 如果读取失败，可能到了文件末尾，停止处理 */
-                break;
-            }
+            switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "PIP-Reason", err);
         }
+        switch_event_fire(&event);
+    }
+}
 
-        /* 记录同步信息 */
-        if (pip_data->remote_frames_count % 300 == 0)
-        { /* 每10秒记录一次 */
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG,
-                              "帧率同步: 远程帧=%llu, 本地帧=%llu, 期望本地帧=%llu, 本地fps=%.2f, 目标fps=%.2f\n",
-                              (unsigned long long)pip_data->remote_frames_count,
-                              (unsigned long long)pip_data->local_frames_count,
-                              (unsigned long long)expected_local_frames,
-                              pip_data->local_fps, pip_data->target_fps);
+/* 启动工作线程：取到NULL时退出 */
+static void *SWITCH_THREAD_FUNC pip_start_worker(switch_thread_t *thread, void *obj)
+{
+    void *pop = NULL;
+
+    while (switch_queue_pop(pip_start_queue, &pop) == SWITCH_STATUS_SUCCESS && pop)
+    {
+        pip_start_job_t *job = (pip_start_job_t *)pop;
+        switch_memory_pool_t *pool = job->pool;
+
+        if (job->batch)
+        {
+            pip_batch_prepare_done(job->batch, job->index);
+        }
+        else
+        {
+            pip_start_job_run(job);
         }
+        switch_core_destroy_memory_pool(&pool);
     }
 
-    /* 确保有远程视频帧 */
-    if (!pip_data->last_remote_frame || !pip_data->last_remote_frame->img)
+    return NULL;
+}
+
+static switch_status_t pip_start_workers_launch(void)
+{
+    switch_threadattr_t *thd_attr = NULL;
+
+    if (switch_queue_create(&pip_start_queue, pip_config.start_queue_size, module_pool) != SWITCH_STATUS_SUCCESS)
     {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "创建PIP启动队列失败\n");
         return SWITCH_STATUS_FALSE;
     }
 
-    /* 将switch_image_t转换为AVFrame进行处理 */
-    return convert_and_overlay_frames(pip_data);
+    switch_threadattr_create(&thd_attr, module_pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    for (pip_start_worker_count = 0; pip_start_worker_count < pip_config.start_workers; pip_start_worker_count++)
+    {
+        if (switch_thread_create(&pip_start_workers[pip_start_worker_count], thd_attr, pip_start_worker, NULL,
+                                 module_pool) != SWITCH_STATUS_SUCCESS)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "创建PIP启动线程失败\n");
+            break;
+        }
+    }
+
+    return pip_start_worker_count > 0 ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
 }
 
-/* 转换switch_image_t为AVFrame并执行叠加 */
-static switch_status_t convert_and_overlay_frames(pip_session_data_t *pip_data)
+/* 已排队的任务在退出标记之前处理完（模块卸载中会以failure结束）。调用前已设置pip_shutting_down，
+ * 持有pip_start_mutex放入退出标记之后不会再有任务入队 */
+static void pip_start_workers_stop(void)
 {
-    switch_image_t *remote_img = pip_data->last_remote_frame->img;
+    switch_status_t retval;
+    int count;
 
-    /* 检查远程视频帧尺寸 */
-    if (!remote_img || remote_img->d_w <= 0 || remote_img->d_h <= 0)
+    if (!pip_start_queue)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "远程视频帧尺寸无效: %dx%d\n",
-                          remote_img ? remote_img->d_w : 0, remote_img ? remote_img->d_h : 0);
-        return SWITCH_STATUS_FALSE;
+        return;
     }
 
-    /* 如果远程视频尺寸改变，重新创建缩放上下文 */
-    if (!pip_data->sws_ctx_pip || pip_data->remote_width != remote_img->d_w ||
-        pip_data->remote_height != remote_img->d_h)
+    switch_mutex_lock(pip_start_mutex);
+    count = pip_start_worker_count;
+    for (int i = 0; i < count; i++)
     {
+        switch_queue_push(pip_start_queue, NULL);
+    }
+    switch_mutex_unlock(pip_start_mutex);
 
-        if (pip_data->sws_ctx_pip)
+    for (int i = 0; i < count; i++)
+    {
+        switch_thread_join(&retval, pip_start_workers[i]);
+    }
+    pip_start_worker_count = 0;
+}
+
+/* ---------- 编码器预热池 ----------
+ * x264初始化是启动耗时的大头。按配置的分辨率预先打开编码器，会话启动时借出，
+ * 停止时刷新并重置后归还；借出后由后台线程把空闲数量补足到encoder-pool-size。
+ * 解码器依赖各文件的流参数（extradata），不做预热 */
+
+/* 打开一个与init_output_video_file配置相同、带全局头的H264编码器 */
+static AVCodecContext *pip_encoder_open(int width, int height)
+{
+    AVCodec *encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+    AVCodecContext *codec_ctx;
+
+    if (!encoder || !(codec_ctx = avcodec_alloc_context3(encoder)))
+    {
+        return NULL;
+    }
+
+    pip_encoder_configure(codec_ctx, width, height);
+    pip_output_timing_configure(codec_ctx);
+    pip_output_roi_configure(codec_ctx);
+    codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (avcodec_open2(codec_ctx, encoder, NULL) < 0)
+    {
+        avcodec_free_context(&codec_ctx);
+        return NULL;
+    }
+
+    return codec_ctx;
+}
+
+/* 调用方持有pip_encoder_pool.mutex */
+static pip_encoder_profile_t *pip_encoder_pool_find(int width, int height)
+{
+    for (int i = 0; i < pip_encoder_pool.profile_count; i++)
+    {
+        if (pip_encoder_pool.profiles[i].width == width && pip_encoder_pool.profiles[i].height == height)
         {
-            sws_freeContext(pip_data->sws_ctx_pip);
+            return &pip_encoder_pool.profiles[i];
         }
+    }
+    return NULL;
+}
 
-        pip_data->remote_width = remote_img->d_w;
-        pip_data->remote_height = remote_img->d_h;
+/* 借出一个已打开的编码器；未启用、分辨率未预热或暂无空闲时返回NULL，由调用方现场打开 */
+static AVCodecContext *pip_encoder_pool_borrow(int width, int height, int64_t *next_pts)
+{
+    pip_encoder_profile_t *profile;
+    AVCodecContext *codec_ctx = NULL;
 
-        pip_data->sws_ctx_pip =
-            sws_getContext(pip_data->remote_width, pip_data->remote_height, AV_PIX_FMT_YUV420P,
-                           pip_data->pip_width, pip_data->pip_height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+    *next_pts = 0;
 
-        if (!pip_data->sws_ctx_pip)
+    if (!pip_encoder_pool.mutex)
+    {
+        return NULL;
+    }
+
+    switch_mutex_lock(pip_encoder_pool.mutex);
+    if (pip_encoder_pool.running && (profile = pip_encoder_pool_find(width, height)))
+    {
+        if (profile->idle_count > 0)
         {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "重新创建缩放上下文失败: %dx%d -> %dx%d\n",
-                              pip_data->remote_width, pip_data->remote_height, pip_data->pip_width,
-                              pip_data->pip_height);
-            return SWITCH_STATUS_FALSE;
+            codec_ctx = profile->idle[--profile->idle_count];
+            *next_pts = profile->idle_pts[profile->idle_count];
+            pip_encoder_pool.hits++;
+        }
+        else
+        {
+            pip_encoder_pool.misses++;
+        }
+        switch_thread_cond_signal(pip_encoder_pool.cond);
+    }
+    switch_mutex_unlock(pip_encoder_pool.mutex);
+
+    return codec_ctx;
+}
+
+/* 归还已刷新的编码器：支持重置、分辨率在池中且未满时放回，否则释放。
+ * 现场打开的编码器同样可以归还，补充线程因此少打开一个。
+ * avcodec_flush_buffers不重置GOP和时间戳，next_pts是下一帧可用的时间戳，借出时交给下一个会话 */
+static void pip_encoder_pool_return(AVCodecContext *codec_ctx, int64_t next_pts)
+{
+    if (!codec_ctx)
+    {
+        return;
+    }
+
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+    if (pip_encoder_pool.mutex && (codec_ctx->flags & AV_CODEC_FLAG_GLOBAL_HEADER) && codec_ctx->codec &&
+        (codec_ctx->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH))
+    {
+        pip_encoder_profile_t *profile;
+
+        switch_mutex_lock(pip_encoder_pool.mutex);
+        if (pip_encoder_pool.running && (profile = pip_encoder_pool_find(codec_ctx->width, codec_ctx->height)) &&
+            profile->idle_count < pip_config.encoder_pool_size)
+        {
+            avcodec_flush_buffers(codec_ctx);
+            profile->idle_pts[profile->idle_count] = next_pts;
+            profile->idle[profile->idle_count++] = codec_ctx;
+            pip_encoder_pool.recycled++;
+            codec_ctx = NULL;
+        }
+        switch_mutex_unlock(pip_encoder_pool.mutex);
+    }
+#endif
+
+    if (codec_ctx)
+    {
+        avcodec_free_context(&codec_ctx);
+    }
+}
+
+/* 补充线程：把每个分辨率的空闲编码器补足，打开编码器时不持锁 */
+static void *SWITCH_THREAD_FUNC pip_encoder_pool_thread(switch_thread_t *thread, void *obj)
+{
+    switch_mutex_lock(pip_encoder_pool.mutex);
+    while (pip_encoder_pool.running)
+    {
+        pip_encoder_profile_t *profile = NULL;
+        AVCodecContext *codec_ctx;
+        int width, height;
+
+        for (int i = 0; i < pip_encoder_pool.profile_count; i++)
+        {
+            if (!pip_encoder_pool.profiles[i].failed &&
+                pip_encoder_pool.profiles[i].idle_count < pip_config.encoder_pool_size)
+            {
+                profile = &pip_encoder_pool.profiles[i];
+                break;
+            }
+        }
+        if (!profile)
+        {
+            switch_thread_cond_wait(pip_encoder_pool.cond, pip_encoder_pool.mutex);
+            continue;
+        }
+
+        width = profile->width;
+        height = profile->height;
+        switch_mutex_unlock(pip_encoder_pool.mutex);
+        codec_ctx = pip_encoder_open(width, height);
+        switch_mutex_lock(pip_encoder_pool.mutex);
+
+        if (!codec_ctx)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "预热编码器打开失败 (%dx%d)，停止补充该分辨率\n",
+                              width, height);
+            profile->failed = SWITCH_TRUE;
+        }
+        else if (pip_encoder_pool.running && profile->idle_count < pip_config.encoder_pool_size)
+        {
+            profile->idle_pts[profile->idle_count] = 0;
+            profile->idle[profile->idle_count++] = codec_ctx;
+        }
+        else
+        {
+            switch_mutex_unlock(pip_encoder_pool.mutex);
+            avcodec_free_context(&codec_ctx);
+            switch_mutex_lock(pip_encoder_pool.mutex);
         }
-
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "缩放上下文已更新: %dx%d -> %dx%d\n",
-                          pip_data->remote_width, pip_data->remote_height, pip_data->pip_width, pip_data->pip_height);
     }
+    switch_mutex_unlock(pip_encoder_pool.mutex);
 
-    /* 设置远程视频帧数据 */
-    pip_data->frame_pip->format = AV_PIX_FMT_YUV420P;
-    pip_data->frame_pip->width = remote_img->d_w;
-    pip_data->frame_pip->height = remote_img->d_h;
+    return NULL;
+}
 
-    /* 复制远程视频数据到AVFrame */
-    pip_data->frame_pip->data[0] = remote_img->planes[0];
-    pip_data->frame_pip->data[1] = remote_img->planes[1];
-    pip_data->frame_pip->data[2] = remote_img->planes[2];
-    pip_data->frame_pip->linesize[0] = remote_img->stride[0];
-    pip_data->frame_pip->linesize[1] = remote_img->stride[1];
-    pip_data->frame_pip->linesize[2] = remote_img->stride[2];
+/* 解析encoder-pool-profiles并启动补充线程；encoder-pool-size为0时不启用 */
+static void pip_encoder_pool_start(void)
+{
+    switch_threadattr_t *thd_attr = NULL;
+    char profiles[sizeof(pip_config.encoder_pool_profiles)];
+    char *argv[PIP_MAX_ENCODER_PROFILES] = {0};
+    int argc;
 
-    /* 验证数据完整性 */
-    if (!pip_data->frame_pip->data[0] || !pip_data->frame_pip->data[1] || !pip_data->frame_pip->data[2])
+    memset(&pip_encoder_pool, 0, sizeof(pip_encoder_pool));
+    if (pip_config.encoder_pool_size <= 0)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "远程视频数据指针为空\n");
-        return SWITCH_STATUS_FALSE;
+        return;
     }
 
-    /* 缩放远程视频 */
-    int ret = sws_scale(pip_data->sws_ctx_pip, (const uint8_t *const *)pip_data->frame_pip->data,
-                        pip_data->frame_pip->linesize, 0, pip_data->frame_pip->height, pip_data->frame_pip_scaled->data,
-                        pip_data->frame_pip_scaled->linesize);
+    switch_copy_string(profiles, pip_config.encoder_pool_profiles, sizeof(profiles));
+    argc = switch_separate_string(profiles, ',', argv, switch_arraylen(argv));
+    for (int i = 0; i < argc; i++)
+    {
+        int width = 0, height = 0;
 
-    if (ret < 0)
+        if (sscanf(argv[i], " %dx%d", &width, &height) != 2 || width <= 0 || height <= 0 || (width | height) & 1)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "忽略无效的预热分辨率: %s\n", argv[i]);
+            continue;
+        }
+        pip_encoder_pool.profiles[pip_encoder_pool.profile_count].width = width;
+        pip_encoder_pool.profiles[pip_encoder_pool.profile_count].height = height;
+        pip_encoder_pool.profile_count++;
+    }
+    if (pip_encoder_pool.profile_count == 0)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "视频缩放失败: %d (%dx%d -> %dx%d)\n", ret,
-                          pip_data->frame_pip->width, pip_data->frame_pip->height, pip_data->pip_width,
-                          pip_data->pip_height);
-        return SWITCH_STATUS_FALSE;
+        return;
     }
 
-    /* 叠加视频 */
-    overlay_yuv420p_frames(pip_data->frame_main, pip_data->frame_pip_scaled, pip_data->frame_output, pip_data->pip_x,
-                           pip_data->pip_y, pip_data->pip_opacity);
+    if (switch_mutex_init(&pip_encoder_pool.mutex, SWITCH_MUTEX_UNNESTED, module_pool) != SWITCH_STATUS_SUCCESS ||
+        switch_thread_cond_create(&pip_encoder_pool.cond, module_pool) != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "初始化编码器预热池失败\n");
+        pip_encoder_pool.mutex = NULL;
+        return;
+    }
 
-    /* 写入叠加后的帧到输出文件 */
-    if (pip_data->output_fmt_ctx)
+    pip_encoder_pool.running = SWITCH_TRUE;
+    switch_threadattr_create(&thd_attr, module_pool);
+    switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+    if (switch_thread_create(&pip_encoder_pool.thread, thd_attr, pip_encoder_pool_thread, NULL, module_pool) !=
+        SWITCH_STATUS_SUCCESS)
     {
-        write_output_frame(pip_data);
-        pip_data->frames_processed++; /* 增加处理帧数计数 */
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "创建编码器预热线程失败\n");
+        pip_encoder_pool.running = SWITCH_FALSE;
+        return;
     }
 
-    return SWITCH_STATUS_SUCCESS;
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "编码器预热池已启动: %d 个分辨率, 每个保持 %d 个空闲编码器\n",
+                      pip_encoder_pool.profile_count, pip_config.encoder_pool_size);
 }
 
-/* 初始化画中画处理上下文 */
-static switch_status_t init_pip_context(pip_session_data_t *pip_data, const char *local_video_file)
+/* 停止补充线程并释放全部空闲编码器；在所有会话停止之后调用 */
+static void pip_encoder_pool_stop(void)
 {
-    char output_file[512];
-    time_t now = time(NULL);
-    struct tm *tm_now = localtime(&now);
-    const char *file_ext;
+    switch_status_t retval;
 
-    /* 检查文件扩展名以确定是图片还是视频 */
-    file_ext = strrchr(local_video_file, '.');
-    pip_data->use_image_mode = SWITCH_FALSE;
+    if (!pip_encoder_pool.mutex)
+    {
+        return;
+    }
 
-    if (file_ext)
+    switch_mutex_lock(pip_encoder_pool.mutex);
+    pip_encoder_pool.running = SWITCH_FALSE;
+    switch_thread_cond_broadcast(pip_encoder_pool.cond);
+    switch_mutex_unlock(pip_encoder_pool.mutex);
+
+    if (pip_encoder_pool.thread)
     {
-        /* 检查是否为常见的图片格式 */
-        if (strcasecmp(file_ext, ".jpg") == 0 || strcasecmp(file_ext, ".jpeg") == 0 ||
-            strcasecmp(file_ext, ".png") == 0 || strcasecmp(file_ext, ".bmp") == 0 ||
-            strcasecmp(file_ext, ".gif") == 0 || strcasecmp(file_ext, ".tiff") == 0)
-        {
-            /* 图片模式：加载静态图片 */
-            if (init_load_local_image(pip_data, local_video_file) != SWITCH_STATUS_SUCCESS)
-            {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "加载本地图片失败: %s\n", local_video_file);
-                return SWITCH_STATUS_FALSE;
-            }
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "使用图片模式: %s\n", local_video_file);
-        }
-        else
-        {
-            /* 视频模式：加载视频文件 */
-            if (init_local_video_file(pip_data, local_video_file) != SWITCH_STATUS_SUCCESS)
-            {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "初始化本地视频失败: %s\n", local_video_file);
-                return SWITCH_STATUS_FALSE;
-            }
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "使用视频模式: %s\n", local_video_file);
-        }
+        switch_thread_join(&retval, pip_encoder_pool.thread);
+        pip_encoder_pool.thread = NULL;
     }
-    else
+
+    for (int i = 0; i < pip_encoder_pool.profile_count; i++)
     {
-        /* 无扩展名，默认尝试视频模式 */
-        if (init_local_video_file(pip_data, local_video_file) != SWITCH_STATUS_SUCCESS)
+        pip_encoder_profile_t *profile = &pip_encoder_pool.profiles[i];
+
+        while (profile->idle_count > 0)
         {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "初始化本地文件失败: %s\n", local_video_file);
-            return SWITCH_STATUS_FALSE;
+            avcodec_free_context(&profile->idle[--profile->idle_count]);
         }
     }
+}
 
-    /* 生成输出文件名 */
-    snprintf(output_file, sizeof(output_file),
-             "/home/white/桌面/freeswitch-video-pip-module/output_pip_%04d%02d%02d_%02d%02d%02d.mp4",
-             tm_now->tm_year + 1900, tm_now->tm_mon + 1, tm_now->tm_mday, tm_now->tm_hour, tm_now->tm_min,
-             tm_now->tm_sec);
+/* ---------- 批量命令 ---------- */
+
+/* 准备一个批量启动项：检查本地文件并完成耗时初始化，结果写回item */
+static void pip_batch_prepare(pip_batch_item_t *item)
+{
+    item->pip_data = NULL;
+    item->status = SWITCH_STATUS_FALSE;
 
-    /* 初始化输出视频文件 */
-    if (init_output_video_file(pip_data, output_file) != SWITCH_STATUS_SUCCESS)
+    if (__atomic_load_n(&pip_shutting_down, __ATOMIC_SEQ_CST))
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "输出文件初始化失败，将跳过保存\n");
+        snprintf(item->err, sizeof(item->err), "模块正在卸载");
     }
+    else if (!pip_local_source_accessible(item->local_file))
+    {
+        snprintf(item->err, sizeof(item->err), "无法访问本地视频文件: %s", item->local_file);
+    }
+    else
+    {
+        item->pip_data =
+            pip_session_prepare(item->uuid, item->local_file, item->err, sizeof(item->err), &item->status);
+    }
+}
 
-    /* 初始化PTS计数器 */
-    pip_data->output_pts = 0;
-
-    /* 初始化帧率同步 */
-    pip_data->target_fps = 30.0; /* 目标输出帧率 */
-    pip_data->current_time = 0.0;
-    pip_data->last_local_time = 0.0;
-
-    /* 分配AVFrame */
-    pip_data->frame_main = av_frame_alloc();
-    pip_data->frame_pip = av_frame_alloc();
-    pip_data->frame_pip_scaled = av_frame_alloc();
-    pip_data->frame_output = av_frame_alloc();
+/* 启动工作线程完成一项准备，最后一项完成时唤醒等待中的批量命令 */
+static void pip_batch_prepare_done(pip_batch_t *batch, int index)
+{
+    pip_batch_prepare(&batch->items[index]);
 
-    if (!pip_data->frame_main || !pip_data->frame_pip || !pip_data->frame_pip_scaled || !pip_data->frame_output)
+    switch_mutex_lock(batch->mutex);
+    if (--batch->pending == 0)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配AVFrame失败\n");
-        // 清理已分配的frame
-        if (pip_data->frame_main)
-            av_frame_free(&pip_data->frame_main);
-        if (pip_data->frame_pip)
-            av_frame_free(&pip_data->frame_pip);
-        if (pip_data->frame_pip_scaled)
-            av_frame_free(&pip_data->frame_pip_scaled);
-        if (pip_data->frame_output)
-            av_frame_free(&pip_data->frame_output);
-        return SWITCH_STATUS_FALSE;
+        switch_thread_cond_signal(batch->cond);
     }
+    switch_mutex_unlock(batch->mutex);
+}
 
-    /* 初始化远程视频尺寸（将在运行时动态设置） */
-    pip_data->remote_width = 0;
-    pip_data->remote_height = 0;
-    pip_data->sws_ctx_pip = NULL; /* 将在第一次处理时创建 */
-
-    /* 为缩放后的帧分配内存 */
-    pip_data->frame_pip_scaled->format = AV_PIX_FMT_YUV420P;
-    pip_data->frame_pip_scaled->width = pip_data->pip_width;
-    pip_data->frame_pip_scaled->height = pip_data->pip_height;
+/* 把启动项交给启动工作线程准备；队列不可用或已满时返回失败，由调用方就地准备 */
+static switch_status_t pip_batch_submit(pip_batch_t *batch, int index)
+{
+    switch_memory_pool_t *pool = NULL;
+    pip_start_job_t *job;
 
-    if (av_frame_get_buffer(pip_data->frame_pip_scaled, 32) < 0)
+    if (!pip_start_queue || __atomic_load_n(&pip_shutting_down, __ATOMIC_SEQ_CST) ||
+        switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配缩放帧缓冲区失败\n");
         return SWITCH_STATUS_FALSE;
     }
+    job = switch_core_alloc(pool, sizeof(*job));
+    job->pool = pool;
+    job->batch = batch;
+    job->index = index;
 
-    /* 为输出帧分配内存 */
-    pip_data->frame_output->format = AV_PIX_FMT_YUV420P;
-    pip_data->frame_output->width = pip_data->main_width;
-    pip_data->frame_output->height = pip_data->main_height;
+    switch_mutex_lock(batch->mutex);
+    batch->pending++;
+    switch_mutex_unlock(batch->mutex);
 
-    if (av_frame_get_buffer(pip_data->frame_output, 32) < 0)
+    /* 入队成功的任务一定会被处理，pending不会停在非0 */
+    if (pip_start_queue_push(job) != SWITCH_STATUS_SUCCESS)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配输出帧缓冲区失败\n");
+        switch_mutex_lock(batch->mutex);
+        batch->pending--;
+        switch_mutex_unlock(batch->mutex);
+        switch_core_destroy_memory_pool(&pool);
         return SWITCH_STATUS_FALSE;
     }
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "PIP上下文初始化成功: 本地视频%dx%d, PIP%dx%d@(%d,%d)\n",
-                      pip_data->main_width, pip_data->main_height, pip_data->pip_width, pip_data->pip_height,
-                      pip_data->pip_x, pip_data->pip_y);
-
     return SWITCH_STATUS_SUCCESS;
 }
 
-/* 简单的YUV420P帧叠加函数 */
-static void overlay_yuv420p_frames(AVFrame *main_frame, AVFrame *pip_frame_scaled, AVFrame *output_frame, int x, int y,
-                                   float opacity)
+/* 执行批量命令：停止项一次注销；启动项并行准备后一次登记，再逐个挂媒体钩子；
+ * 布局修改交给各自的媒体线程在下一帧应用。每项的结果写回items */
+static void pip_batch_run(pip_batch_t *batch)
 {
-    int pip_width = pip_frame_scaled->width;
-    int pip_height = pip_frame_scaled->height;
-    int main_width = main_frame->width;
-    int main_height = main_frame->height;
-
-    /* 边界检查 */
-    if (x + pip_width > main_width)
-        pip_width = main_width - x;
-    if (y + pip_height > main_height)
-        pip_height = main_height - y;
-    if (x < 0 || y < 0 || pip_width <= 0 || pip_height <= 0)
-        return;
+    pip_session_data_t **list = malloc(sizeof(pip_session_data_t *) * batch->count);
+    switch_bool_t *added = malloc(sizeof(switch_bool_t) * batch->count);
+    int *index = malloc(sizeof(int) * batch->count);
+    int n = 0;
 
-    /* 首先复制主视频到输出 */
-    av_frame_copy(output_frame, main_frame);
+    if (!list || !added || !index)
+    {
+        for (int i = 0; i < batch->count; i++)
+        {
+            batch->items[i].status = SWITCH_STATUS_MEMERR;
+            snprintf(batch->items[i].err, sizeof(batch->items[i].err), "内存分配失败");
+        }
+        goto end;
+    }
 
-    /* Y分量叠加 */
-    for (int i = 0; i < pip_height; i++)
+    /* 第一步：停止 */
+    for (int i = 0; i < batch->count; i++)
     {
-        uint8_t *main_y = output_frame->data[0] + (y + i) * output_frame->linesize[0] + x;
-        uint8_t *pip_y = pip_frame_scaled->data[0] + i * pip_frame_scaled->linesize[0];
+        pip_batch_item_t *item = &batch->items[i];
 
-        for (int j = 0; j < pip_width; j++)
+        if (item->op != PIP_BATCH_STOP)
+        {
+            continue;
+        }
+        if (!(list[n] = pip_registry_find(item->uuid)))
         {
-            main_y[j] = (uint8_t)(main_y[j] * (1.0f - opacity) + pip_y[j] * opacity);
+            item->status = SWITCH_STATUS_NOTFOUND;
+            snprintf(item->err, sizeof(item->err), "找不到对应的PIP会话: %s", item->uuid);
+            continue;
         }
+        item->status = SWITCH_STATUS_SUCCESS;
+        n++;
+    }
+    pip_session_stop_many(list, n);
+    for (int k = 0; k < n; k++)
+    {
+        pip_session_release(list[k]);
     }
 
-    /* U分量叠加 (色度分量，尺寸减半) */
-    int pip_width_uv = pip_width / 2;
-    int pip_height_uv = pip_height / 2;
-    int x_uv = x / 2;
-    int y_uv = y / 2;
+    /* 第二步：启动项交给启动工作线程并行准备，全部完成后一次登记 */
+    for (int i = 0; i < batch->count; i++)
+    {
+        if (batch->items[i].op == PIP_BATCH_START && pip_batch_submit(batch, i) != SWITCH_STATUS_SUCCESS)
+        {
+            pip_batch_prepare(&batch->items[i]);
+        }
+    }
+    switch_mutex_lock(batch->mutex);
+    while (batch->pending > 0)
+    {
+        switch_thread_cond_wait(batch->cond, batch->mutex);
+    }
+    switch_mutex_unlock(batch->mutex);
 
-    for (int i = 0; i < pip_height_uv; i++)
+    n = 0;
+    for (int i = 0; i < batch->count; i++)
+    {
+        if (batch->items[i].op == PIP_BATCH_START && batch->items[i].pip_data)
+        {
+            list[n] = batch->items[i].pip_data;
+            index[n++] = i;
+        }
+    }
+    if (n > 0 && pip_registry_update(list, n, added, NULL, 0, NULL) != SWITCH_STATUS_SUCCESS)
+    {
+        /* 内存不足时逐个登记 */
+        for (int k = 0; k < n; k++)
+        {
+            added[k] = pip_registry_insert(list[k]) == SWITCH_STATUS_SUCCESS ? SWITCH_TRUE : SWITCH_FALSE;
+        }
+    }
+    for (int k = 0; k < n; k++)
     {
-        uint8_t *main_u = output_frame->data[1] + (y_uv + i) * output_frame->linesize[1] + x_uv;
-        uint8_t *pip_u = pip_frame_scaled->data[1] + i * pip_frame_scaled->linesize[1];
+        pip_batch_item_t *item = &batch->items[index[k]];
 
-        for (int j = 0; j < pip_width_uv; j++)
+        item->pip_data = NULL;
+        if (!added[k])
+        {
+            pip_session_abort(list[k]);
+            item->status = SWITCH_STATUS_FALSE;
+            snprintf(item->err, sizeof(item->err), "会话已启动PIP: %s", item->uuid);
+            continue;
+        }
+        /* 还未挂媒体钩子，初始布局在第一帧生效 */
+        if (item->layout_mask)
         {
-            // Alpha混合算法
-            main_u[j] = (uint8_t)(main_u[j] * (1.0f - opacity) + pip_u[j] * opacity);
+            pip_session_set_layout(list[k], &item->layout, item->layout_mask);
         }
+        item->status = pip_session_commit(list[k], item->err, sizeof(item->err));
     }
 
-    /* V分量叠加 */
-    for (int i = 0; i < pip_height_uv; i++)
+    /* 第三步：布局修改 */
+    for (int i = 0; i < batch->count; i++)
     {
-        uint8_t *main_v = output_frame->data[2] + (y_uv + i) * output_frame->linesize[2] + x_uv;
-        uint8_t *pip_v = pip_frame_scaled->data[2] + i * pip_frame_scaled->linesize[2];
+        pip_batch_item_t *item = &batch->items[i];
+        pip_session_data_t *pip_data;
 
-        for (int j = 0; j < pip_width_uv; j++)
+        if (item->op != PIP_BATCH_UPDATE)
+        {
+            continue;
+        }
+        if (!(pip_data = pip_registry_find(item->uuid)))
         {
-            main_v[j] = (uint8_t)(main_v[j] * (1.0f - opacity) + pip_v[j] * opacity);
+            item->status = SWITCH_STATUS_NOTFOUND;
+            snprintf(item->err, sizeof(item->err), "找不到对应的PIP会话: %s", item->uuid);
+            continue;
         }
+        pip_session_set_layout(pip_data, &item->layout, item->layout_mask);
+        pip_session_release(pip_data);
+        item->status = SWITCH_STATUS_SUCCESS;
     }
+
+end:
+    switch_safe_free(list);
+    switch_safe_free(added);
+    switch_safe_free(index);
 }
 
-/* 处理视频帧 */
-// static switch_status_t process_video_frame(pip_session_data_t *pip_data, switch_frame_t *main_frame,
-//                                            switch_frame_t *pip_frame)
-// {
-//     if (!pip_data || !main_frame || !pip_frame)
-//     {
-//         return SWITCH_STATUS_FALSE;
-//     }
+/* 按pip_batch_op_t的顺序，用于校验错误和结果输出 */
+static const char *pip_batch_op_names[] = {"stop", "start", "update"};
 
-//     switch_mutex_lock(pip_data->mutex);
+static switch_status_t pip_batch_item_init(pip_batch_item_t *item, const char *op, const char *uuid, char *err,
+                                           switch_size_t errlen)
+{
+    if (zstr(op) || zstr(uuid))
+    {
+        snprintf(err, errlen, "缺少操作或UUID");
+        return SWITCH_STATUS_FALSE;
+    }
 
-//     if (!pip_data->active)
-//     {
-//         switch_mutex_unlock(pip_data->mutex);
-//         return SWITCH_STATUS_FALSE;
-//     }
+    if (!strcasecmp(op, "start"))
+    {
+        item->op = PIP_BATCH_START;
+    }
+    else if (!strcasecmp(op, "stop"))
+    {
+        item->op = PIP_BATCH_STOP;
+    }
+    else if (!strcasecmp(op, "update"))
+    {
+        item->op = PIP_BATCH_UPDATE;
+    }
+    else
+    {
+        snprintf(err, errlen, "未知操作: %s", op);
+        return SWITCH_STATUS_FALSE;
+    }
 
-//     /* 设置主视频帧数据 */
-//     if (av_image_fill_arrays(pip_data->frame_main->data, pip_data->frame_main->linesize, (uint8_t *)main_frame->data,
-//                              AV_PIX_FMT_YUV420P, pip_data->main_width, pip_data->main_height, 1) < 0)
-//     {
-//         switch_mutex_unlock(pip_data->mutex);
-//         return SWITCH_STATUS_FALSE;
-//     }
-//     pip_data->frame_main->width = pip_data->main_width;
-//     pip_data->frame_main->height = pip_data->main_height;
-//     pip_data->frame_main->format = AV_PIX_FMT_YUV420P;
+    if (strlen(uuid) >= sizeof(item->uuid))
+    {
+        snprintf(err, errlen, "UUID过长: %s", uuid);
+        return SWITCH_STATUS_FALSE;
+    }
+    switch_copy_string(item->uuid, uuid, sizeof(item->uuid));
+    switch_copy_string(item->local_file, pip_config.local_file, sizeof(item->local_file));
+    item->status = SWITCH_STATUS_FALSE;
 
-//     /* 设置PIP视频帧数据 */
-//     if (av_image_fill_arrays(pip_data->frame_pip->data, pip_data->frame_pip->linesize, (uint8_t *)pip_frame->data,
-//                              AV_PIX_FMT_YUV420P, pip_data->main_width, pip_data->main_height, 1) < 0)
-//     {
-//         switch_mutex_unlock(pip_data->mutex);
-//         return SWITCH_STATUS_FALSE;
-//     }
-//     pip_data->frame_pip->width = pip_data->main_width;
-//     pip_data->frame_pip->height = pip_data->main_height;
-//     pip_data->frame_pip->format = AV_PIX_FMT_YUV420P;
+    return SWITCH_STATUS_SUCCESS;
+}
 
-//     /* 缩放PIP视频 */
-//     if (sws_scale(pip_data->sws_ctx_pip, (const uint8_t *const *)pip_data->frame_pip->data,
-//                   pip_data->frame_pip->linesize, 0, pip_data->main_height, pip_data->frame_pip_scaled->data,
-//                   pip_data->frame_pip_scaled->linesize) < 0)
-//     {
-//         switch_mutex_unlock(pip_data->mutex);
-//         return SWITCH_STATUS_FALSE;
-//     }
+/* 文本格式：每项一行或以分号分隔，
+ * start <uuid> [local_video_file] [布局参数] | stop <uuid> | update <uuid> 布局参数，
+ * 布局参数为 x=N y=N width=N height=N opacity=F position=top_left|top_right|bottom_left|bottom_right|center */
+static int pip_batch_parse_text(char *data, pip_batch_item_t *items, int max, char *err, switch_size_t errlen)
+{
+    char *line = data;
+    int count = 0;
 
-//     /* 叠加视频 */
-//     overlay_yuv420p_frames(pip_data->frame_main, pip_data->frame_pip_scaled, pip_data->frame_output, pip_data->pip_x,
-//                            pip_data->pip_y, pip_data->pip_opacity);
+    for (char *p = data; *p; p++)
+    {
+        if (*p == '\t' || *p == '\r')
+        {
+            *p = ' ';
+        }
+    }
 
-//     /* 将处理后的数据拷贝回main_frame */
-//     int frame_size = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, pip_data->main_width, pip_data->main_height, 1);
+    while (line)
+    {
+        char *next = strpbrk(line, ";\n");
+        char *argv[16] = {0};
+        int argc;
 
-//     if (frame_size > 0 && frame_size <= main_frame->buflen)
-//     {
-//         // (const uint8_t *const *)  常量指针+指针常量的组合，表示指向常量数据的指针的指针
-//         av_image_copy_to_buffer((uint8_t *)main_frame->data, frame_size,
-//                                 (const uint8_t *const *)pip_data->frame_output->data, pip_data->frame_output->linesize,
-//                                 AV_PIX_FMT_YUV420P, pip_data->main_width, pip_data->main_height, 1);
-//         main_frame->datalen = frame_size;
-//         pip_data->frames_processed++;
-//     }
+        if (next)
+        {
+            *next++ = '\0';
+        }
+        argc = switch_separate_string(line, ' ', argv, switch_arraylen(argv));
+        line = next;
+        if (argc == 0)
+        {
+            continue;
+        }
+
+        if (count >= max)
+        {
+            snprintf(err, errlen, "批量操作过多（最多%d项）", max);
+            return -1;
+        }
+        if (argc < 2 || pip_batch_item_init(&items[count], argv[0], argv[1], err, errlen) != SWITCH_STATUS_SUCCESS)
+        {
+            if (argc < 2)
+            {
+                snprintf(err, errlen, "第%d项缺少UUID: %s", count + 1, argv[0]);
+            }
+            return -1;
+        }
+
+        for (int i = 2; i < argc; i++)
+        {
+            char *value = strchr(argv[i], '=');
 
-//     switch_mutex_unlock(pip_data->mutex);
-//     return SWITCH_STATUS_SUCCESS;
-// }
+            if (!value)
+            {
+                if (items[count].op != PIP_BATCH_START)
+                {
+                    snprintf(err, errlen, "第%d项参数无效: %s", count + 1, argv[i]);
+                    return -1;
+                }
+                switch_copy_string(items[count].local_file, argv[i], sizeof(items[count].local_file));
+                continue;
+            }
+            *value++ = '\0';
+            if (pip_layout_parse(argv[i], value, &items[count].layout, &items[count].layout_mask) !=
+                SWITCH_STATUS_SUCCESS)
+            {
+                snprintf(err, errlen, "第%d项参数无效: %s=%s", count + 1, argv[i], value);
+                return -1;
+            }
+        }
+        count++;
+    }
 
-/* 清理PIP会话 */
-static void cleanup_pip_session(pip_session_data_t *pip_data)
+    return count;
+}
+
+/* JSON格式：[{"op":"start","uuid":"...","file":"...","x":10,"y":10,"width":320,"opacity":0.8}, ...]，
+ * 也接受{"ops":[...]}；调用方传入操作数组 */
+static int pip_batch_parse_json(cJSON *ops, pip_batch_item_t *items, int max, char *err, switch_size_t errlen)
 {
-    if (!pip_data)
-        return;
+    static const char *layout_keys[] = {"x",          "y",        "width",      "height",     "opacity",
+                                        "position",   "duration", "easing",     "border",     "border_color",
+                                        "radius",     "feather",  "brightness", "contrast",   "saturation"};
+    cJSON *op = NULL;
+    int count = 0;
 
-    /* 避免重复清理 */
-    if (!pip_data->active)
-        return;
+    cJSON_ArrayForEach(op, ops)
+    {
+        cJSON *name = cJSON_GetObjectItem(op, "op");
+        cJSON *uuid = cJSON_GetObjectItem(op, "uuid");
+        cJSON *file = cJSON_GetObjectItem(op, "file");
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "开始清理PIP会话...\n");
+        if (count >= max)
+        {
+            snprintf(err, errlen, "批量操作过多（最多%d项）", max);
+            return -1;
+        }
+        if (!cJSON_IsObject(op) || !cJSON_IsString(name) || !cJSON_IsString(uuid))
+        {
+            snprintf(err, errlen, "第%d项缺少op或uuid", count + 1);
+            return -1;
+        }
+        if (pip_batch_item_init(&items[count], name->valuestring, uuid->valuestring, err, errlen) !=
+            SWITCH_STATUS_SUCCESS)
+        {
+            return -1;
+        }
+        if (cJSON_IsString(file) && !zstr(file->valuestring))
+        {
+            switch_copy_string(items[count].local_file, file->valuestring, sizeof(items[count].local_file));
+        }
 
-    /* 立即设置为非活跃状态 */
-    pip_data->active = SWITCH_FALSE;
+        for (size_t k = 0; k < switch_arraylen(layout_keys); k++)
+        {
+            cJSON *v = cJSON_GetObjectItem(op, layout_keys[k]);
+            char value[64];
 
-    /* 清理媒体钩子 */
-    if (pip_data->read_bug)
-    {
-        switch_core_media_bug_remove(pip_data->session, &pip_data->read_bug);
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "已移除媒体钩子\n");
-        pip_data->read_bug = NULL;
+            if (!v)
+            {
+                continue;
+            }
+            if (cJSON_IsNumber(v))
+            {
+                snprintf(value, sizeof(value), "%g", v->valuedouble);
+            }
+            else if (cJSON_IsString(v))
+            {
+                switch_copy_string(value, v->valuestring, sizeof(value));
+            }
+            else
+            {
+                value[0] = '\0';
+            }
+            if (pip_layout_parse(layout_keys[k], value, &items[count].layout, &items[count].layout_mask) !=
+                SWITCH_STATUS_SUCCESS)
+            {
+                snprintf(err, errlen, "第%d项参数无效: %s", count + 1, layout_keys[k]);
+                return -1;
+            }
+        }
+        count++;
     }
 
-    /* 清理本地视频文件资源 */
-    // 清理视频包
-    if (pip_data->local_packet)
-    {
-        av_packet_free(&pip_data->local_packet);
-        pip_data->local_packet = NULL;
-    }
-    // 关闭解码器上下文
-    if (pip_data->local_codec_ctx)
-    {
-        avcodec_close(pip_data->local_codec_ctx);
-        avcodec_free_context(&pip_data->local_codec_ctx);
-        pip_data->local_codec_ctx = NULL;
-    }
-    // 关闭输入格式上下文
-    if (pip_data->local_fmt_ctx)
-    {
-        avformat_close_input(&pip_data->local_fmt_ctx);
-        pip_data->local_fmt_ctx = NULL;
-    }
+    return count;
+}
 
-    /* 清理输出视频文件资源 */
-    if (pip_data->output_codec_ctx && pip_data->output_fmt_ctx)
+/* 同一UUID的同一种操作只能出现一次，修改项至少要带一个布局参数 */
+static switch_status_t pip_batch_validate(const pip_batch_t *batch, char *err, switch_size_t errlen)
+{
+    for (int i = 0; i < batch->count; i++)
     {
-        /* 刷新编码器 */
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "开始刷新编码器...\n");
-        flush_encoder(pip_data);
+        const pip_batch_item_t *item = &batch->items[i];
 
-        avcodec_close(pip_data->output_codec_ctx);
-        avcodec_free_context(&pip_data->output_codec_ctx);
-        pip_data->output_codec_ctx = NULL;
+        if (item->op == PIP_BATCH_UPDATE && !item->layout_mask)
+        {
+            snprintf(err, errlen, "第%d项没有要修改的参数: %s", i + 1, item->uuid);
+            return SWITCH_STATUS_FALSE;
+        }
+        for (int j = 0; j < i; j++)
+        {
+            if (batch->items[j].op == item->op && !strcmp(batch->items[j].uuid, item->uuid))
+            {
+                snprintf(err, errlen, "第%d项重复: %s %s", i + 1, pip_batch_op_names[item->op], item->uuid);
+                return SWITCH_STATUS_FALSE;
+            }
+        }
     }
 
-    if (pip_data->output_packet)
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* API: 批量启动/停止/修改，一次调用处理多个通话。
+ * 参数为文本列表或JSON文档，JSON输入时以JSON返回每项结果 */
+SWITCH_STANDARD_API(video_pip_batch_function)
+{
+    switch_time_t start = switch_micro_time_now();
+    switch_memory_pool_t *pool = NULL;
+    pip_batch_t *batch = NULL;
+    cJSON *json = NULL, *ops = NULL;
+    char *mydata = NULL;
+    const char *p = cmd;
+    char err[256] = "";
+    int max = 1, succeeded = 0;
+    double elapsed_ms;
+
+    while (p && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    {
+        p++;
+    }
+    if (zstr(p))
     {
-        av_packet_free(&pip_data->output_packet);
-        pip_data->output_packet = NULL;
+        stream->write_function(stream, "-ERR 用法: video_pip_batch <start|stop|update> <uuid> [参数]; ... 或JSON数组\n");
+        return SWITCH_STATUS_SUCCESS;
     }
 
-    if (pip_data->output_fmt_ctx)
+    if (*p == '[' || *p == '{')
     {
-        /* 写入文件尾 */
-        int ret = av_write_trailer(pip_data->output_fmt_ctx);
-        if (ret < 0)
+        if (!(json = cJSON_Parse(p)))
         {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "写入视频文件尾失败: %d\n", ret);
+            stream->write_function(stream, "-ERR JSON解析失败\n");
+            return SWITCH_STATUS_SUCCESS;
         }
-
-        if (!(pip_data->output_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+        ops = cJSON_IsArray(json) ? json : cJSON_GetObjectItem(json, "ops");
+        if (!cJSON_IsArray(ops))
         {
-            avio_closep(&pip_data->output_fmt_ctx->pb);
+            stream->write_function(stream, "-ERR JSON需要是操作数组或包含ops数组\n");
+            goto end;
         }
-        avformat_free_context(pip_data->output_fmt_ctx);
-        pip_data->output_fmt_ctx = NULL;
-
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "PIP输出视频已保存: %s\n", pip_data->output_filename);
+        max = cJSON_GetArraySize(ops);
     }
-
-    /* 清理FFmpeg资源 */
-    if (pip_data->sws_ctx_pip)
+    else
     {
-        sws_freeContext(pip_data->sws_ctx_pip);
-        pip_data->sws_ctx_pip = NULL;
+        mydata = strdup(p);
+        for (const char *c = p; *c; c++)
+        {
+            max += (*c == ';' || *c == '\n');
+        }
     }
-
-    /* 安全释放AVFrame */
-    if (pip_data->frame_main)
+    if (max > PIP_BATCH_MAX_ITEMS)
     {
-        av_frame_free(&pip_data->frame_main);
-        pip_data->frame_main = NULL;
+        max = PIP_BATCH_MAX_ITEMS;
     }
-    if (pip_data->frame_pip)
+
+    if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS || (!json && !mydata) ||
+        !(batch = switch_core_alloc(pool, sizeof(*batch))) ||
+        !(batch->items = switch_core_alloc(pool, sizeof(pip_batch_item_t) * (max > 0 ? max : 1))) ||
+        switch_mutex_init(&batch->mutex, SWITCH_MUTEX_UNNESTED, pool) != SWITCH_STATUS_SUCCESS ||
+        switch_thread_cond_create(&batch->cond, pool) != SWITCH_STATUS_SUCCESS)
     {
-        av_frame_free(&pip_data->frame_pip);
-        pip_data->frame_pip = NULL;
+        stream->write_function(stream, "-ERR 内存分配失败\n");
+        goto end;
     }
-    if (pip_data->frame_pip_scaled)
+
+    batch->count = json ? pip_batch_parse_json(ops, batch->items, max, err, sizeof(err))
+                        : pip_batch_parse_text(mydata, batch->items, max, err, sizeof(err));
+    if (batch->count == 0)
     {
-        av_frame_free(&pip_data->frame_pip_scaled);
-        pip_data->frame_pip_scaled = NULL;
+        snprintf(err, sizeof(err), "没有批量操作");
     }
-    if (pip_data->frame_output)
+    if (batch->count <= 0 || pip_batch_validate(batch, err, sizeof(err)) != SWITCH_STATUS_SUCCESS)
     {
-        av_frame_free(&pip_data->frame_output);
-        pip_data->frame_output = NULL;
+        stream->write_function(stream, "-ERR %s\n", err);
+        goto end;
     }
 
-    /* 清理本地图片帧 */
-    if (pip_data->local_image_frame)
+    pip_batch_run(batch);
+
+    for (int i = 0; i < batch->count; i++)
     {
-        av_frame_free(&pip_data->local_image_frame);
-        pip_data->local_image_frame = NULL;
+        succeeded += batch->items[i].status == SWITCH_STATUS_SUCCESS;
     }
+    elapsed_ms = (switch_micro_time_now() - start) / 1000.0;
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "批量命令完成: %d项, 成功%d, 失败%d, 耗时%.3fms\n",
+                      batch->count, succeeded, batch->count - succeeded, elapsed_ms);
 
-    /* 清理远程视频帧 */
-    if (pip_data->last_remote_frame && pip_data->last_remote_frame->img)
+    if (json)
     {
-        switch_img_free(&pip_data->last_remote_frame->img);
-        pip_data->last_remote_frame->img = NULL;
-        pip_data->last_remote_frame = NULL;
+        cJSON *reply = cJSON_CreateObject();
+        cJSON *results = cJSON_CreateArray();
+        char *text;
+
+        cJSON_AddNumberToObject(reply, "succeeded", succeeded);
+        cJSON_AddNumberToObject(reply, "failed", batch->count - succeeded);
+        cJSON_AddNumberToObject(reply, "elapsed_ms", elapsed_ms);
+        for (int i = 0; i < batch->count; i++)
+        {
+            pip_batch_item_t *item = &batch->items[i];
+            cJSON *result = cJSON_CreateObject();
+
+            cJSON_AddStringToObject(result, "op", pip_batch_op_names[item->op]);
+            cJSON_AddStringToObject(result, "uuid", item->uuid);
+            cJSON_AddStringToObject(result, "result", item->status == SWITCH_STATUS_SUCCESS ? "success" : "failure");
+            if (!zstr(item->err))
+            {
+                cJSON_AddStringToObject(result, "reason", item->err);
+            }
+            cJSON_AddItemToArray(results, result);
+        }
+        cJSON_AddItemToObject(reply, "results", results);
+
+        text = cJSON_PrintUnformatted(reply);
+        stream->write_function(stream, "%s\n", text ? text : "{}");
+        switch_safe_free(text);
+        cJSON_Delete(reply);
     }
+    else
+    {
+        stream->write_function(stream, "+OK 成功 %d, 失败 %d, 耗时 %.3fms\n", succeeded, batch->count - succeeded,
+                               elapsed_ms);
+        for (int i = 0; i < batch->count; i++)
+        {
+            pip_batch_item_t *item = &batch->items[i];
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO,
-                      "PIP会话清理完成，处理帧数: %llu, 远程帧: %llu, 本地帧: %llu\n",
-                      (unsigned long long)pip_data->frames_processed, (unsigned long long)pip_data->remote_frames_count,
-                      (unsigned long long)pip_data->local_frames_count);
+            stream->write_function(stream, "%s %s %s%s%s\n", pip_batch_op_names[item->op], item->uuid,
+                                   item->status == SWITCH_STATUS_SUCCESS ? "+OK" : "-ERR", zstr(item->err) ? "" : " ",
+                                   item->err);
+        }
+    }
+
+end:
+    cJSON_Delete(json);
+    switch_safe_free(mydata);
+    if (pool)
+    {
+        switch_core_destroy_memory_pool(&pool);
+    }
+    return SWITCH_STATUS_SUCCESS;
 }
 
 /* API: 启动画中画 */
 SWITCH_STANDARD_API(video_pip_start_function)
 {
-    switch_core_session_t *psession = NULL;
-    pip_session_data_t *pip_data = NULL;
     char *uuid = NULL;
     char *local_video_file = NULL;
     switch_memory_pool_t *pool = NULL;
+    char err[256] = "";
 
     /* 创建临时内存池 */
     switch_core_new_memory_pool(&pool);
@@ -1310,363 +6327,504 @@ SWITCH_STANDARD_API(video_pip_start_function)
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "解析参数完成 - UUID: %s, 视频文件: %s\n",
                       uuid ? uuid : "(auto)", local_video_file ? local_video_file : "(default)");
 
-    /* 如果没有提供本地视频文件，使用默认路径 */
+    /* 如果没有提供本地视频文件，使用配置的默认文件 */
     if (!local_video_file)
     {
-        local_video_file = switch_core_strdup(pool, "/home/white/桌面/freeswitch-video-pip-module/test_pictures/test.jpg");
+        local_video_file = switch_core_strdup(pool, pip_config.local_file);
     }
 
     /* 检查本地视频文件是否存在 */
-    if (access(local_video_file, R_OK) != 0)
+    if (!pip_local_source_accessible(local_video_file))
     {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法访问本地视频文件: %s\n", local_video_file);
         stream->write_function(stream, "-ERR 无法访问本地视频文件: %s\n", local_video_file);
         // 使用默认本地文件
-        local_video_file = switch_core_strdup(pool, "/home/white/桌面/freeswitch-video-pip-module/test_pictures/test.jpg");
+        local_video_file = switch_core_strdup(pool, pip_config.local_file);
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "使用默认本地文件: %s\n", local_video_file);
     }
 
-    /* 如果没有提供UUID，尝试查找当前活跃的会话 */
+    /* 如果没有提供UUID，使用最近应答且仍在进行的视频通话（由CHANNEL_ANSWER/CHANNEL_HANGUP事件维护） */
     if (!uuid)
     {
-        switch_hash_index_t *hi;
-        const void *key;
-        void *val;
-
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "没有提供UUID，查找活跃会话\n");
-
-        // /* 首先尝试从已启动PIP的会话中查找 */
-        // switch_mutex_lock(module_mutex);
-
-        // const char *newest_uuid = NULL;
-        // switch_time_t newest_answered_time = 0;
-
-        // for (hi = switch_core_hash_first(session_pip_map); hi; hi = switch_core_hash_next(&hi))
-        // {
-        //     switch_core_hash_this(hi, &key, NULL, &val);
-        //     const char *session_uuid = (const char *)key;
-
-        //     /* 根据UUID查找会话并检查其状态 */
-        //     switch_core_session_t *session = switch_core_session_locate(session_uuid);
-        //     if (session)
-        //     {
-        //         switch_channel_t *channel = switch_core_session_get_channel(session);
-
-        //         /* 获取会话的应答时间或创建时间 */
-        //         const char *answered_epoch_str = switch_channel_get_variable(channel, "answered_epoch");
-        //         const char *created_epoch_str = switch_channel_get_variable(channel, "created_epoch");
-
-        //         switch_time_t session_time = 0;
-
-        //         if (answered_epoch_str)
-        //         {
-        //             session_time = atoll(answered_epoch_str);
-        //         }
-        //         else if (created_epoch_str)
-        //         {
-        //             session_time = atoll(created_epoch_str);
-        //         }
-        //         else
-        //         {
-        //             /* 如果都没有，使用当前时间作为备选 */
-        //             session_time = switch_time_now() / 1000000; /* 转换为秒 */
-        //         }
-
-        //         /* 选择时间最新（最大）的会话 */
-        //         if (session_time > newest_answered_time || newest_uuid == NULL)
-        //         {
-        //             newest_answered_time = session_time;
-        //             newest_uuid = session_uuid;
-        //         }
-
-        //         switch_core_session_rwunlock(session);
-        //     }
-        // }
-
-        // if (newest_uuid)
-        // {
-        //     uuid = switch_core_strdup(pool, newest_uuid);
-        //     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "找到最新会话: %s (时间: %lld)\n",
-        //                       uuid, (long long)newest_answered_time);
-        // }
-
-        // switch_mutex_unlock(module_mutex);
-
-        /* 如果PIP会话中没有找到，则查找系统中所有活跃会话 */
-        switch_mutex_lock(module_mutex);
+        char recent[SWITCH_UUID_FORMATTED_LENGTH + 1];
+
+        if (pip_recent_video_pick(recent, sizeof(recent)))
+        {
+            uuid = switch_core_strdup(pool, recent);
+        }
+
         if (!uuid)
         {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "PIP会话中未找到，查找系统活跃会话\n");
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "未找到活跃会话\n");
+            stream->write_function(stream, "-ERR 需要会话UUID，没有找到已应答的视频通话\n");
+            stream->write_function(stream, "用法: video_pip_start [uuid] [local_video_file]\n");
+            stream->write_function(stream, "提示: 请先建立视频通话，然后再启动PIP功能\n");
+            switch_core_destroy_memory_pool(&pool);
+            return SWITCH_STATUS_SUCCESS;
+        }
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "没有提供UUID，使用最近应答的视频通话\n");
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "使用会话UUID: %s\n", uuid);
 
-            /* 使用FreeSWITCH API查找活跃会话 */
-            switch_stream_handle_t stream_handle = {0};
-            SWITCH_STANDARD_STREAM(stream_handle);
+    if (pip_session_start(uuid, local_video_file, err, sizeof(err)) != SWITCH_STATUS_SUCCESS)
+    {
+        stream->write_function(stream, "-ERR %s\n", err);
+    }
+    else
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "PIP启动完成\n");
+        stream->write_function(stream, "+OK PIP启动成功 UUID=%s, 本地视频=%s%s%s%s\n", uuid, local_video_file,
+                               zstr(err) ? "" : " (", err, zstr(err) ? "" : ")");
+    }
 
-            /* 执行 "show calls" 命令获取活跃会话列表 */
-            if (switch_api_execute("show", "calls", NULL, &stream_handle) == SWITCH_STATUS_SUCCESS)
-            {
-                char *output = (char *)stream_handle.data;
-                if (output && strlen(output) > 0)
-                {
-                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "show calls输出: %s\n", output);
+    /* 清理临时内存池 */
+    switch_core_destroy_memory_pool(&pool);
+    return SWITCH_STATUS_SUCCESS;
+}
 
-                    /* 解析输出，查找UUID */
-                    char *line = strtok(output, "\n");
-                    while (line)
-                    {
-                        /* 查找包含UUID的行（通常格式为UUID,direction,created,name,state,cid_name,cid_num,ip_addr,dest,application,application_data,dialplan,context） */
-                        if (strlen(line) > 36 && strstr(line, "-") != NULL)
-                        {
-                            /* 提取UUID（前36个字符） */
-                            char temp_uuid[64];
-                            strncpy(temp_uuid, line, 36);
-                            temp_uuid[36] = '\0';
-
-                            /* 验证这是一个有效的UUID格式 */
-                            if (strstr(temp_uuid, "-") != NULL)
-                            {
-                                /* 尝试定位这个会话以验证其有效性 */
-                                switch_core_session_t *test_session = switch_core_session_locate(temp_uuid);
-                                if (test_session)
-                                {
-                                    switch_channel_t *test_channel = switch_core_session_get_channel(test_session);
-                                    switch_channel_state_t state = switch_channel_get_state(test_channel);
-
-                                    /* 检查会话是否处于活跃状态 */
-                                    if (state >= CS_ROUTING && state < CS_HANGUP)
-                                    {
-                                        uuid = switch_core_strdup(pool, temp_uuid);
-                                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO,
-                                                          "从活跃会话中找到有效会话: %s (状态: %d)\n", uuid, state);
-                                        switch_core_session_rwunlock(test_session);
-                                        break;
-                                    }
-                                    else
-                                    {
-                                        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG,
-                                                          "会话 %s 状态不活跃: %d\n", temp_uuid, state);
-                                    }
-                                    switch_core_session_rwunlock(test_session);
-                                }
-                                else
-                                {
-                                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG,
-                                                      "无法定位会话: %s\n", temp_uuid);
-                                }
-                            }
-                        }
-                        line = strtok(NULL, "\n");
-                    }
-                }
-                else
-                {
-                    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "show calls 没有返回数据\n");
-                }
-            }
-            else
-            {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "执行 show calls 命令失败\n");
-            }
+/* API: 异步启动画中画，只提交任务并立即返回任务ID（与bgapi相同的Job-UUID格式） */
+SWITCH_STANDARD_API(video_pip_start_async_function)
+{
+    char *mydata = NULL;
+    char *argv[2] = {0};
+    char job_uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+    int argc = 0;
+
+    if (!zstr(cmd) && (mydata = strdup(cmd)))
+    {
+        argc = switch_separate_string(mydata, ' ', argv, switch_arraylen(argv));
+    }
+
+    if (argc < 1)
+    {
+        stream->write_function(stream, "-ERR 用法: video_pip_start_async <uuid> [local_video_file]\n");
+    }
+    else if (pip_start_job_submit(argv[0], argc >= 2 ? argv[1] : pip_config.local_file, job_uuid, sizeof(job_uuid)) !=
+             SWITCH_STATUS_SUCCESS)
+    {
+        stream->write_function(stream, "-ERR PIP启动队列已满或不可用\n");
+    }
+    else
+    {
+        stream->write_function(stream, "+OK Job-UUID: %s\n", job_uuid);
+    }
+
+    switch_safe_free(mydata);
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* 拨号计划应用: video_pip [local_video_file] 异步启动当前通话的PIP，video_pip stop 停止。
+ * 应用立即返回，任务ID写入通道变量video_pip_job_uuid */
+SWITCH_STANDARD_APP(video_pip_app_function)
+{
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    const char *uuid = switch_core_session_get_uuid(session);
+    const char *local_file = data;
+    char job_uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+
+    if (!zstr(data) && !strcasecmp(data, "stop"))
+    {
+        pip_session_data_t *pip_data = pip_registry_find(uuid);
+
+        if (pip_data)
+        {
+            pip_session_stop(pip_data);
+            pip_session_release(pip_data);
+        }
+        return;
+    }
+
+    if (zstr(local_file))
+    {
+        local_file = switch_channel_get_variable(channel, PIP_VAR_FILE);
+    }
+    if (zstr(local_file))
+    {
+        local_file = pip_config.local_file;
+    }
+
+    if (pip_start_job_submit(uuid, local_file, job_uuid, sizeof(job_uuid)) == SWITCH_STATUS_SUCCESS)
+    {
+        switch_channel_set_variable(channel, PIP_VAR_JOB_UUID, job_uuid);
+    }
+    else
+    {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "PIP启动队列已满或不可用\n");
+    }
+}
+
+/* API: 停止画中画 */
+SWITCH_STANDARD_API(video_pip_stop_function)
+{
+    pip_session_data_t *pip_data = NULL;
+
+    if (zstr(cmd))
+    {
+        /* 如果没有提供UUID，停止所有活跃的PIP会话 */
+        pip_session_data_t **list = NULL;
+        int count = pip_registry_list(&list);
+
+        for (int i = 0; i < count; i++)
+        {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "停止PIP会话: %s\n", list[i]->uuid);
+        }
+        pip_session_stop_many(list, count);
+        pip_registry_list_free(list, count);
 
-            switch_safe_free(stream_handle.data);
+        if (count > 0)
+        {
+            stream->write_function(stream, "+OK 停止了 %d 个PIP会话\n", count);
+        }
+        else
+        {
+            stream->write_function(stream, "+OK 没有活跃的PIP会话需要停止\n");
         }
-        switch_mutex_unlock(module_mutex);
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    /* 停止指定UUID的会话 */
+    pip_data = pip_registry_find(cmd);
+    if (pip_data)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "手动停止PIP会话: %s\n", cmd);
+        pip_session_stop(pip_data);
+        pip_session_release(pip_data);
+        stream->write_function(stream, "+OK PIP停止成功，视频已保存\n");
+    }
+    else
+    {
+        stream->write_function(stream, "-ERR 找不到对应的PIP会话: %s\n", cmd);
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
+/* API: 运行中修改PIP位置、尺寸和透明度，不重建编码器也不中断录像。
+ * 修改在媒体线程处理下一帧之前一次性生效 */
+SWITCH_STANDARD_API(video_pip_update_function)
+{
+    pip_session_data_t *pip_data;
+    pip_layout_t layout = {0};
+    uint32_t mask = 0;
+    char *mydata = NULL;
+    char *argv[14] = {0};
+    int argc = 0;
 
-        if (!uuid)
-        {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "未找到活跃会话\n");
-            stream->write_function(stream, "-ERR 需要会话UUID，没有找到活跃会话\n");
-            stream->write_function(stream, "用法: video_pip_start [uuid] [local_video_file]\n");
-            stream->write_function(stream, "提示: 请先建立视频通话，然后再启动PIP功能\n");
-            switch_core_destroy_memory_pool(&pool);
-            return SWITCH_STATUS_SUCCESS;
-        }
+    if (!zstr(cmd) && (mydata = strdup(cmd)))
+    {
+        argc = switch_separate_string(mydata, ' ', argv, switch_arraylen(argv));
     }
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "使用会话UUID: %s\n", uuid);
 
-    /* 查找会话 */
-    // 使用UUID查找会话,并且会上锁
-    psession = switch_core_session_locate(uuid);
-    if (!psession)
+    if (argc < 2)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "找不到会话: %s\n", uuid);
-        stream->write_function(stream, "-ERR 找不到会话: %s\n", uuid);
-        switch_core_destroy_memory_pool(&pool);
-        return SWITCH_STATUS_SUCCESS;
+        stream->write_function(stream, "-ERR 用法: video_pip_update <uuid> [x=N] [y=N] [width=N] [height=N] [opacity=F] "
+                                       "[position=top_left|top_right|bottom_left|bottom_right|center] "
+                                       "[duration=毫秒] [easing=linear|ease_in|ease_out|ease_in_out] "
+                                       "[border=N] [border_color=RRGGBB] [radius=N] [feather=N] "
+                                       "[brightness=F] [contrast=F] [saturation=F]\n");
+        goto end;
     }
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "成功找到会话，开始分配PIP数据结构\n");
+    for (int i = 1; i < argc; i++)
+    {
+        char *value = strchr(argv[i], '=');
 
-    /* 分配PIP数据结构 */
-    pip_data = switch_core_alloc(switch_core_session_get_pool(psession), sizeof(pip_session_data_t));
-    if (!pip_data)
+        if (value)
+        {
+            *value++ = '\0';
+        }
+        if (pip_layout_parse(argv[i], value, &layout, &mask) != SWITCH_STATUS_SUCCESS)
+        {
+            stream->write_function(stream, "-ERR 参数无效: %s%s%s\n", argv[i], value ? "=" : "", value ? value : "");
+            goto end;
+        }
+    }
+
+    if (!(pip_data = pip_registry_find(argv[0])))
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "分配PIP数据结构失败\n");
-        switch_core_session_rwunlock(psession);
-        stream->write_function(stream, "-ERR 内存分配失败\n");
-        switch_core_destroy_memory_pool(&pool);
-        return SWITCH_STATUS_SUCCESS;
+        stream->write_function(stream, "-ERR 找不到对应的PIP会话: %s\n", argv[0]);
+        goto end;
     }
-    memset(pip_data, 0, sizeof(pip_session_data_t));
+    pip_session_set_layout(pip_data, &layout, mask);
+    pip_session_release(pip_data);
+    stream->write_function(stream, "+OK PIP布局将在下一帧生效\n");
 
-    pip_data->session = psession;
-    pip_data->channel = switch_core_session_get_channel(psession);
+end:
+    switch_safe_free(mydata);
+    return SWITCH_STATUS_SUCCESS;
+}
 
-    /* 设置默认参数 */
-    pip_data->main_width = 640; /* 将由本地视频文件确定 */
-    pip_data->main_height = 480;
-    pip_data->pip_width = DEFAULT_PIP_WIDTH;
-    pip_data->pip_height = DEFAULT_PIP_HEIGHT;
-    pip_data->pip_x = DEFAULT_PIP_X;
-    pip_data->pip_y = DEFAULT_PIP_Y;
-    pip_data->pip_opacity = DEFAULT_PIP_OPACITY;
-    pip_data->active = SWITCH_TRUE;
+/* API: pip_position <uuid> <top_left|top_right|bottom_left|bottom_right|center> */
+SWITCH_STANDARD_API(pip_position_function)
+{
+    pip_session_data_t *pip_data;
+    pip_layout_t layout = {0};
+    uint32_t mask = 0;
+    char *mydata = NULL;
+    char *argv[2] = {0};
+    int argc = 0;
 
-    /* 初始化互斥锁 */
-    if (switch_mutex_init(&pip_data->mutex, SWITCH_MUTEX_UNNESTED, switch_core_session_get_pool(psession)) != SWITCH_STATUS_SUCCESS)
+    if (!zstr(cmd) && (mydata = strdup(cmd)))
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "初始化mutex失败\n");
-        switch_core_session_rwunlock(psession);
-        stream->write_function(stream, "-ERR 初始化互斥锁失败\n");
-        switch_core_destroy_memory_pool(&pool);
-        return SWITCH_STATUS_SUCCESS;
+        argc = switch_separate_string(mydata, ' ', argv, switch_arraylen(argv));
     }
 
-    if (switch_mutex_init(&pip_data->frame_mutex, SWITCH_MUTEX_UNNESTED, switch_core_session_get_pool(psession)) != SWITCH_STATUS_SUCCESS)
+    if (argc < 2 || pip_layout_parse("position", argv[1], &layout, &mask) != SWITCH_STATUS_SUCCESS)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "初始化frame_mutex失败\n");
-        switch_mutex_destroy(pip_data->mutex);
-        switch_core_session_rwunlock(psession);
-        stream->write_function(stream, "-ERR 初始化帧互斥锁失败\n");
-        switch_core_destroy_memory_pool(&pool);
-        return SWITCH_STATUS_SUCCESS;
+        stream->write_function(stream, "-ERR 用法: pip_position <uuid> <top_left|top_right|bottom_left|bottom_right|center>\n");
+    }
+    else if (!(pip_data = pip_registry_find(argv[0])))
+    {
+        stream->write_function(stream, "-ERR 找不到对应的PIP会话: %s\n", argv[0]);
+    }
+    else
+    {
+        pip_session_set_layout(pip_data, &layout, mask);
+        pip_session_release(pip_data);
+        stream->write_function(stream, "+OK PIP位置已更新\n");
     }
 
-    /* 初始化PIP上下文（包含本地视频文件） */
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "开始初始化PIP上下文\n");
+    switch_safe_free(mydata);
+    return SWITCH_STATUS_SUCCESS;
+}
 
-    // 确认本地文件是图片还是视频，并进行相应初始化
-    if (init_pip_context(pip_data, local_video_file) != SWITCH_STATUS_SUCCESS)
+/* API: pip_size <uuid> <比例>，按主画面尺寸的比例（0.1-0.5）设置PIP窗口大小 */
+SWITCH_STANDARD_API(pip_size_function)
+{
+    pip_session_data_t *pip_data;
+    pip_layout_t layout = {0};
+    char *mydata = NULL;
+    char *argv[2] = {0};
+    char *end = NULL;
+    double scale = 0;
+    int argc = 0;
+
+    if (!zstr(cmd) && (mydata = strdup(cmd)))
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "初始化PIP上下文失败\n");
-        cleanup_pip_session(pip_data);
-        switch_core_session_rwunlock(psession);
-        stream->write_function(stream, "-ERR 初始化PIP上下文失败\n");
-        switch_core_destroy_memory_pool(&pool);
-        return SWITCH_STATUS_SUCCESS;
+        argc = switch_separate_string(mydata, ' ', argv, switch_arraylen(argv));
+    }
+    if (argc >= 2)
+    {
+        scale = strtod(argv[1], &end);
     }
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "PIP上下文初始化成功\n");
 
-    /* 创建媒体钩子来捕获远程视频 */
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "开始创建媒体钩子\n");
-    // 第四个参数是一个回调函数指针，指向处理远程视频帧的函数
-    if (switch_core_media_bug_add(psession, "video_pip_read", uuid, pip_read_video_callback, pip_data, 0,
-                                  SMBF_READ_VIDEO_PING, &pip_data->read_bug) != SWITCH_STATUS_SUCCESS)
+    if (argc < 2 || *end || scale < 0.1 || scale > 0.5)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "创建媒体钩子失败\n");
-        cleanup_pip_session(pip_data);
-        switch_core_session_rwunlock(psession);
-        stream->write_function(stream, "-ERR 创建媒体钩子失败\n");
-        switch_core_destroy_memory_pool(&pool);
-        return SWITCH_STATUS_SUCCESS;
+        stream->write_function(stream, "-ERR 用法: pip_size <uuid> <0.1-0.5>\n");
+    }
+    else if (!(pip_data = pip_registry_find(argv[0])))
+    {
+        stream->write_function(stream, "-ERR 找不到对应的PIP会话: %s\n", argv[0]);
+    }
+    else
+    {
+        /* 主画面尺寸在启动后不再变化 */
+        layout.width = (int)(pip_data->main_width * scale);
+        layout.height = (int)(pip_data->main_height * scale);
+        pip_session_set_layout(pip_data, &layout, PIP_LAYOUT_WIDTH | PIP_LAYOUT_HEIGHT);
+        pip_session_release(pip_data);
+        stream->write_function(stream, "+OK PIP大小已更新\n");
     }
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "媒体钩子创建成功\n");
 
-    /* 存储到哈希表 */
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "存储会话到哈希表\n");
-    switch_mutex_lock(module_mutex);
-    switch_core_hash_insert(session_pip_map, uuid, pip_data);
-    switch_mutex_unlock(module_mutex);
+    switch_safe_free(mydata);
+    return SWITCH_STATUS_SUCCESS;
+}
 
-    switch_core_session_rwunlock(psession);
+/* API: video_pip_tap <uuid> start [名称] [槽位数] | stop，开关合成输出的共享内存旁路 */
+SWITCH_STANDARD_API(video_pip_tap_function)
+{
+    pip_session_data_t *pip_data;
+    char *mydata = NULL;
+    char *argv[4] = {0};
+    char err[256] = "";
+    int slots = pip_config.output_tap_slots;
+    int argc = 0;
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "PIP启动完成\n");
-    stream->write_function(stream, "+OK PIP启动成功 UUID=%s, 本地视频=%s\n", uuid, local_video_file);
+    if (!zstr(cmd) && (mydata = strdup(cmd)))
+    {
+        argc = switch_separate_string(mydata, ' ', argv, switch_arraylen(argv));
+    }
+    if (argc >= 4)
+    {
+        slots = atoi(argv[3]);
+    }
 
-    /* 清理临时内存池 */
-    switch_core_destroy_memory_pool(&pool);
+    if (argc < 2 || (strcasecmp(argv[1], "start") && strcasecmp(argv[1], "stop")) || slots < PIP_SHM_MIN_SLOTS ||
+        slots > PIP_SHM_MAX_SLOTS)
+    {
+        stream->write_function(stream, "-ERR 用法: video_pip_tap <uuid> start [名称] [槽位数(%d-%d)] | stop\n",
+                               PIP_SHM_MIN_SLOTS, PIP_SHM_MAX_SLOTS);
+    }
+    else if (!(pip_data = pip_registry_find(argv[0])))
+    {
+        stream->write_function(stream, "-ERR 找不到对应的PIP会话: %s\n", argv[0]);
+    }
+    else
+    {
+        if (!strcasecmp(argv[1], "stop"))
+        {
+            pip_output_tap_stop(pip_data);
+            stream->write_function(stream, "+OK 输出旁路已关闭\n");
+        }
+        else if (pip_output_tap_start(pip_data, argv[2], slots, err, sizeof(err)) == SWITCH_STATUS_SUCCESS)
+        {
+            stream->write_function(stream, "+OK 输出旁路已开启\n");
+        }
+        else
+        {
+            stream->write_function(stream, "-ERR %s\n", err);
+        }
+        pip_session_release(pip_data);
+    }
+
+    switch_safe_free(mydata);
     return SWITCH_STATUS_SUCCESS;
 }
 
-/* API: 停止画中画 */
-SWITCH_STANDARD_API(video_pip_stop_function)
+/* API: 快照。合成路径只在下一次合成前交出上一帧，缩放和编码在快照线程上完成，调用方等待结果 */
+SWITCH_STANDARD_API(video_pip_snapshot_function)
 {
     pip_session_data_t *pip_data = NULL;
+    pip_snapshot_t *snapshot = NULL;
+    switch_memory_pool_t *pool = NULL;
+    char *mydata = NULL;
+    char *argv[3] = {0};
+    const char *target = NULL;
+    int width = DEFAULT_PIP_SNAPSHOT_WIDTH;
+    int argc = 0;
+    switch_bool_t accepted = SWITCH_FALSE;
+
+    if (!zstr(cmd) && (mydata = strdup(cmd)))
+    {
+        argc = switch_separate_string(mydata, ' ', argv, switch_arraylen(argv));
+    }
+    /* 第二个参数为数字时是宽度，其余为文件路径或png/jpeg（以base64返回） */
+    if (argc >= 2 && switch_is_number(argv[1]))
+    {
+        width = atoi(argv[1]);
+        target = argv[2];
+    }
+    else if (argc >= 2)
+    {
+        target = argv[1];
+    }
 
-    if (zstr(cmd))
+    if (argc < 1 || width < 16 || width > PIP_RAW_MAX_DIMENSION)
     {
-        /* 如果没有提供UUID，停止所有活跃的PIP会话 */
-        switch_hash_index_t *hi;
-        const void *key;
-        void *val;
-        int stopped_count = 0;
+        stream->write_function(stream, "-ERR 用法: video_pip_snapshot <uuid> [宽度] [文件路径(.jpg|.png)|png|jpeg]\n");
+        goto end;
+    }
+    if (!(pip_data = pip_registry_find(argv[0])))
+    {
+        stream->write_function(stream, "-ERR 找不到对应的PIP会话: %s\n", argv[0]);
+        goto end;
+    }
 
-        switch_mutex_lock(module_mutex);
+    /* 共享合成组的跟随者不合成，画面与组长相同，向组长请求 */
+    switch_mutex_lock(pip_share_mutex);
+    if (pip_data->share_group && pip_data->share_group->leader && pip_data->share_group->leader != pip_data)
+    {
+        pip_session_data_t *leader = pip_data->share_group->leader;
 
-        /* 简单遍历并标记停止 */
-        for (hi = switch_core_hash_first(session_pip_map); hi; hi = switch_core_hash_next(&hi))
-        {
-            switch_core_hash_this(hi, &key, NULL, &val);
-            pip_data = (pip_session_data_t *)val;
-            if (pip_data && pip_data->active)
-            {
-                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "停止PIP会话: %s\n", (const char *)key);
-                /* 使用异步方式清理，避免阻塞 */
-                pip_data->active = SWITCH_FALSE;
-                stopped_count++;
-            }
-        }
+        pip_session_ref(leader);
+        switch_mutex_unlock(pip_share_mutex);
+        pip_session_release(pip_data);
+        pip_data = leader;
+    }
+    else
+    {
+        switch_mutex_unlock(pip_share_mutex);
+    }
 
-        /* 清空哈希表 */
-        switch_core_hash_delete_multi(session_pip_map, NULL, NULL);
+    /* 全模块限流：超出snapshot-max-pending的请求直接拒绝，不排队 */
+    if (__atomic_add_fetch(&pip_snapshot_pending, 1, __ATOMIC_ACQ_REL) > pip_config.snapshot_max_pending ||
+        !pip_snapshot_queue)
+    {
+        __atomic_sub_fetch(&pip_snapshot_pending, 1, __ATOMIC_ACQ_REL);
+        stream->write_function(stream, "-ERR 快照请求过多，请稍后重试\n");
+        goto end;
+    }
+    accepted = SWITCH_TRUE;
 
-        switch_mutex_unlock(module_mutex);
+    if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS)
+    {
+        stream->write_function(stream, "-ERR 内存不足\n");
+        goto end;
+    }
+    snapshot = switch_core_alloc(pool, sizeof(*snapshot));
+    snapshot->pool = pool;
+    snapshot->refs = 1;
+    snapshot->width = width;
+    switch_mutex_init(&snapshot->mutex, SWITCH_MUTEX_NESTED, pool);
+    switch_thread_cond_create(&snapshot->cond, pool);
+    if (!zstr(target) && (!strcasecmp(target, "png") || !strcasecmp(target, "jpeg") || !strcasecmp(target, "jpg")))
+    {
+        snapshot->png = !strcasecmp(target, "png");
+    }
+    else if (!zstr(target))
+    {
+        const char *ext = strrchr(target, '.');
 
-        /* 异步清理会话 */
-        switch_mutex_lock(module_mutex);
-        for (hi = switch_core_hash_first(session_pip_map); hi; hi = switch_core_hash_next(&hi))
-        {
-            switch_core_hash_this(hi, &key, NULL, &val);
-            pip_data = (pip_session_data_t *)val;
-            if (pip_data)
-            {
-                cleanup_pip_session(pip_data);
-            }
-        }
-        switch_mutex_unlock(module_mutex);
+        snapshot->png = ext && !strcasecmp(ext, ".png");
+        switch_copy_string(snapshot->path, target, sizeof(snapshot->path));
+    }
 
-        if (stopped_count > 0)
-        {
-            stream->write_function(stream, "+OK 停止了 %d 个PIP会话\n", stopped_count);
-        }
-        else
+    if (pip_snapshot_request(pip_data, snapshot) != SWITCH_STATUS_SUCCESS)
+    {
+        stream->write_function(stream, "-ERR 会话已停止\n");
+        goto end;
+    }
+
+    /* 超时后请求仍留在链上或队列中，由合成线程/快照线程结束时释放，快照线程不再为它编码 */
+    switch_mutex_lock(snapshot->mutex);
+    {
+        switch_time_t deadline = switch_micro_time_now() + PIP_SNAPSHOT_TIMEOUT_MS * 1000;
+
+        while (!snapshot->done && switch_micro_time_now() < deadline)
         {
-            stream->write_function(stream, "+OK 没有活跃的PIP会话需要停止\n");
+            switch_thread_cond_timedwait(snapshot->cond, snapshot->mutex, deadline - switch_micro_time_now());
         }
-        return SWITCH_STATUS_SUCCESS;
+        snapshot->abandoned = !snapshot->done;
     }
+    switch_mutex_unlock(snapshot->mutex);
 
-    /* 停止指定UUID的会话 */
-    switch_mutex_lock(module_mutex);
-    pip_data = (pip_session_data_t *)switch_core_hash_find(session_pip_map, cmd);
-    if (pip_data)
+    if (snapshot->abandoned)
     {
-        switch_core_hash_delete(session_pip_map, cmd);
-        pip_data->active = SWITCH_FALSE; /* 立即标记为非活跃 */
+        stream->write_function(stream, "-ERR 快照超时（会话在%dms内没有合成新帧）\n", PIP_SNAPSHOT_TIMEOUT_MS);
     }
-    switch_mutex_unlock(module_mutex);
-
-    if (pip_data)
+    else if (snapshot->status != SWITCH_STATUS_SUCCESS)
     {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "手动停止PIP会话: %s\n", cmd);
-        cleanup_pip_session(pip_data);
-        stream->write_function(stream, "+OK PIP停止成功，视频已保存\n");
+        stream->write_function(stream, "-ERR %s\n", zstr(snapshot->err) ? "快照失败" : snapshot->err);
+    }
+    else if (!zstr(snapshot->path))
+    {
+        stream->write_function(stream, "+OK %s %dx%d %zu\n", snapshot->path, snapshot->out_width,
+                               snapshot->out_height, snapshot->bytes);
     }
     else
     {
-        stream->write_function(stream, "-ERR 找不到对应的PIP会话: %s\n", cmd);
+        stream->write_function(stream, "+OK data:image/%s;base64,%s\n", snapshot->png ? "png" : "jpeg",
+                               snapshot->base64);
     }
 
+end:
+    if (snapshot)
+    {
+        pip_snapshot_release(snapshot);
+    }
+    else if (pool)
+    {
+        switch_core_destroy_memory_pool(&pool);
+    }
+    if (accepted)
+    {
+        __atomic_sub_fetch(&pip_snapshot_pending, 1, __ATOMIC_ACQ_REL);
+    }
+    if (pip_data)
+    {
+        pip_session_release(pip_data);
+    }
+    switch_safe_free(mydata);
     return SWITCH_STATUS_SUCCESS;
 }
 
@@ -1674,50 +6832,181 @@ SWITCH_STANDARD_API(video_pip_stop_function)
 SWITCH_STANDARD_API(video_pip_status_function)
 {
     pip_session_data_t *pip_data = NULL;
+    uint64_t mem_total;
 
     if (zstr(cmd))
     {
-        /* 显示所有活跃会话 */
-        switch_hash_index_t *hi;
-        const void *key;
-        void *val;
-        int count = 0;
+        /* 显示所有活跃会话（持有引用，输出期间不阻塞启动和停止） */
+        pip_session_data_t **list = NULL;
+        int count = pip_registry_list(&list);
 
-        switch_mutex_lock(module_mutex);
-        for (hi = switch_core_hash_first(session_pip_map); hi; hi = switch_core_hash_next(&hi))
+        for (int i = 0; i < count; i++)
         {
-            switch_core_hash_this(hi, &key, NULL, &val);
-            pip_data = (pip_session_data_t *)val;
+            pip_data = list[i];
 
-            stream->write_function(stream, "会话: %s, 帧数: %llu, 状态: %s\n", (char *)key,
-                                   (unsigned long long)pip_data->frames_processed, pip_data->active ? "活跃" : "停止");
-            count++;
+            stream->write_function(stream, "会话: %s, 帧数: %llu, 内存: %.1f MB, 状态: %s\n", pip_data->uuid,
+                                   (unsigned long long)pip_data->frames_processed,
+                                   pip_mem_session_total(pip_data) / (1024.0 * 1024.0),
+                                   pip_data->active ? "活跃" : "停止");
         }
-        switch_mutex_unlock(module_mutex);
+        pip_registry_list_free(list, count);
 
         if (count == 0)
         {
             stream->write_function(stream, "没有活跃的PIP会话\n");
         }
+
+        switch_mutex_lock(metrics_mutex);
+        mem_total = pip_mem_total;
+        switch_mutex_unlock(metrics_mutex);
+        if (pip_config.max_memory_bytes > 0)
+        {
+            stream->write_function(stream, "模块内存: %.1f MB / 上限 %.1f MB (%s)\n", mem_total / (1024.0 * 1024.0),
+                                   pip_config.max_memory_bytes / (1024.0 * 1024.0),
+                                   pip_config.memory_cap_action == PIP_MEM_CAP_DOWNGRADE ? "downgrade" : "reject");
+        }
+        else
+        {
+            stream->write_function(stream, "模块内存: %.1f MB (不限制)\n", mem_total / (1024.0 * 1024.0));
+        }
+
+        if (pip_text_cache.font)
+        {
+            int glyphs;
+            size_t atlas_bytes;
+
+            switch_mutex_lock(pip_text_mutex);
+            pip_font_stats(pip_text_cache.font, &glyphs, &atlas_bytes);
+            stream->write_function(stream, "字幕缓存: %d 段文字, %d 个字形, 字形图集 %.1f KB\n", pip_text_cache.count,
+                                   glyphs, atlas_bytes / 1024.0);
+            switch_mutex_unlock(pip_text_mutex);
+        }
+
+        if (pip_background_image)
+        {
+            int layers = 0;
+            size_t layer_bytes = 0;
+
+            switch_mutex_lock(pip_background_mutex);
+            for (pip_background_t *background = pip_backgrounds; background; background = background->next)
+            {
+                layers++;
+                layer_bytes += background->layer.buffer_size;
+            }
+            stream->write_function(stream, "背景图层: %s %s 透明度=%.2f, %d 种尺寸, 系数 %.1f MB\n",
+                                   pip_config.background_image, pip_blend_mode_name(pip_config.background_blend_mode),
+                                   pip_config.background_opacity, layers, layer_bytes / (1024.0 * 1024.0));
+            switch_mutex_unlock(pip_background_mutex);
+        }
     }
     else
     {
         /* 显示特定会话 */
-        switch_mutex_lock(module_mutex);
-        pip_data = (pip_session_data_t *)switch_core_hash_find(session_pip_map, cmd);
-        switch_mutex_unlock(module_mutex);
+        pip_data = pip_registry_find(cmd);
 
         if (pip_data)
         {
             stream->write_function(stream,
                                    "会话UUID: %s\n"
                                    "主视频: %dx%d\n"
-                                   "PIP: %dx%d@(%d,%d) 透明度=%.2f\n"
+                                   "PIP: %dx%d@(%d,%d) 透明度=%.2f%s\n"
+                                   "样式: 边框=%d 圆角=%d 羽化=%d\n"
                                    "处理帧数: %llu\n"
-                                   "状态: %s\n",
+                                   "状态: %s%s\n"
+                                   "内存: %llu 字节\n"
+                                   "  帧缓冲: %llu\n"
+                                   "  远程图像: %llu\n"
+                                   "  解码器(估算): %llu\n"
+                                   "  编码器(估算): %llu\n"
+                                   "  会话结构: %llu\n",
                                    cmd, pip_data->main_width, pip_data->main_height, pip_data->pip_width,
                                    pip_data->pip_height, pip_data->pip_x, pip_data->pip_y, pip_data->pip_opacity,
-                                   (unsigned long long)pip_data->frames_processed, pip_data->active ? "活跃" : "停止");
+                                   pip_data->animation.active ? " (过渡中)" : "",
+                                   pip_data->style.border_width, pip_data->style.corner_radius, pip_data->style.feather,
+                                   (unsigned long long)pip_data->frames_processed, pip_data->active ? "活跃" : "停止",
+                                   pip_data->mem_downgraded ? " (内存降级: 不录制)" : "",
+                                   (unsigned long long)pip_mem_session_total(pip_data),
+                                   (unsigned long long)pip_data->mem_bytes[PIP_MEM_FRAMES],
+                                   (unsigned long long)pip_data->mem_bytes[PIP_MEM_REMOTE_IMAGE],
+                                   (unsigned long long)pip_data->mem_bytes[PIP_MEM_DECODER],
+                                   (unsigned long long)pip_data->mem_bytes[PIP_MEM_ENCODER],
+                                   (unsigned long long)pip_data->mem_bytes[PIP_MEM_SESSION]);
+            if (pip_data->clock_thread)
+            {
+                stream->write_function(stream, "输出时钟: %s %d fps 重复帧=%llu 覆盖的远程帧=%llu 跳过节拍=%llu\n",
+                                       pip_config.output_clock == PIP_OUTPUT_CLOCK_VFR ? "vfr" : "cfr",
+                                       pip_config.output_fps, (unsigned long long)pip_data->frames_repeated,
+                                       (unsigned long long)pip_data->frames_superseded,
+                                       (unsigned long long)pip_data->clock_overruns);
+            }
+            if (pip_data->shm_name[0])
+            {
+                stream->write_function(stream, "共享内存源: %s 帧号=%llu%s 停滞次数=%llu 撕裂帧=%llu 跳过的撕裂帧=%llu\n",
+                                       pip_data->shm_name, (unsigned long long)pip_data->shm_seq,
+                                       pip_data->shm_stalled ? " (停滞)" : "",
+                                       (unsigned long long)pip_data->shm_stalls,
+                                       (unsigned long long)pip_data->shm_torn,
+                                       (unsigned long long)pip_data->shm_torn_dropped);
+            }
+            switch_mutex_lock(pip_share_mutex);
+            if (pip_data->share_group && pip_data->share_group->leader == pip_data)
+            {
+                uint64_t packets = __atomic_load_n(&pip_data->share_group->packets, __ATOMIC_RELAXED);
+
+                stream->write_function(stream, "共享合成: %s 组长 跟随者=%d 扇出包=%llu\n", pip_data->share_name,
+                                       pip_data->share_group->member_count, (unsigned long long)packets);
+            }
+            else if (pip_data->share_group)
+            {
+                uint64_t packets;
+
+                /* 跟随者的写入计数由组长线程在组锁下更新 */
+                switch_mutex_lock(pip_data->share_group->mutex);
+                packets = pip_data->share_packets;
+                switch_mutex_unlock(pip_data->share_group->mutex);
+                stream->write_function(stream, "共享合成: %s 跟随 %s 已写入包=%llu\n", pip_data->share_name,
+                                       pip_data->share_group->leader ? pip_data->share_group->leader->uuid
+                                                                     : "(组长已离开)",
+                                       (unsigned long long)packets);
+            }
+            switch_mutex_unlock(pip_share_mutex);
+            /* 旁路可能同时被关闭，持锁读取 */
+            switch_mutex_lock(pip_data->frame_mutex);
+            if (pip_data->output_tap)
+            {
+                stream->write_function(stream, "输出旁路: %s 槽位=%u 已发布=%llu\n", pip_data->output_tap->name,
+                                       pip_data->output_tap->ring.header->slot_count,
+                                       (unsigned long long)pip_data->output_tap->published);
+            }
+            for (int i = 0; i < pip_data->rendition_count; i++)
+            {
+                pip_rendition_t *rendition = pip_data->renditions[i];
+
+                stream->write_function(stream, "码流: %dx%d %s 已编码=%llu 跳过=%llu%s\n", rendition->width,
+                                       rendition->height, rendition->filename, (unsigned long long)rendition->frames,
+                                       (unsigned long long)rendition->dropped, rendition->failed ? " (出错停止)" : "");
+            }
+            if (pip_data->subtitle)
+            {
+                stream->write_function(stream, "字幕: \"%s\" %dx%d@(%d,%d) 透明度=%.2f\n", pip_data->subtitle->text,
+                                       pip_data->subtitle->mask.width, pip_data->subtitle->mask.height,
+                                       pip_config.subtitle_x, pip_config.subtitle_y, pip_config.subtitle_opacity);
+            }
+            if (!pip_color_adjust_is_identity(&pip_data->color_adjust))
+            {
+                stream->write_function(stream, "调色: 亮度=%.2f 对比度=%.2f 饱和度=%.2f\n",
+                                       pip_data->color_adjust.brightness, pip_data->color_adjust.contrast,
+                                       pip_data->color_adjust.saturation);
+            }
+            if (pip_data->background)
+            {
+                stream->write_function(stream, "背景图层: %s %dx%d 透明度=%.2f\n",
+                                       pip_blend_mode_name(pip_data->background->layer.mode),
+                                       pip_data->background->layer.width, pip_data->background->layer.height,
+                                       pip_data->background->layer.alpha / 256.0);
+            }
+            switch_mutex_unlock(pip_data->frame_mutex);
+            pip_session_release(pip_data);
         }
         else
         {
@@ -1728,21 +7017,244 @@ SWITCH_STANDARD_API(video_pip_status_function)
     return SWITCH_STATUS_SUCCESS;
 }
 
+/* API: Prometheus格式的模块指标 */
+SWITCH_STANDARD_API(video_pip_metrics_function)
+{
+    static const char *stage_names[PIP_STAGE_COUNT] = {"capture", "decode", "scale", "blend", "encode", "total"};
+    pip_metrics_t metrics;
+    uint64_t started_total, rejected_total, downgraded_total, mem_total;
+    int active_sessions = 0;
+    pip_registry_snapshot_t *snapshot;
+    uint32_t slot;
+
+    /* 持锁期间只做累加，格式化输出在释放锁之后进行；
+     * 汇总和会话遍历在同一把锁内，会话在两者之间结束时不会被重复计数 */
+    switch_mutex_lock(metrics_mutex);
+    metrics = retired_metrics;
+    started_total = sessions_started_total;
+    rejected_total = sessions_rejected_total;
+    downgraded_total = sessions_downgraded_total;
+    mem_total = pip_mem_total;
+
+    snapshot = pip_registry_read_begin(&slot);
+    for (int i = 0; snapshot && i < snapshot->count; i++)
+    {
+        pip_session_data_t *pip_data = snapshot->sessions[i];
+
+        /* 已清理的会话计数器已并入retired_metrics */
+        if (pip_data->active && !pip_data->metrics_retired)
+        {
+            pip_metrics_add_session(&metrics, pip_data);
+            active_sessions++;
+        }
+    }
+    pip_registry_read_end(slot);
+    switch_mutex_unlock(metrics_mutex);
+
+    stream->write_function(stream,
+                           "# HELP video_pip_active_sessions Number of active PIP sessions.\n"
+                           "# TYPE video_pip_active_sessions gauge\n"
+                           "video_pip_active_sessions %d\n",
+                           active_sessions);
+    stream->write_function(stream,
+                           "# HELP video_pip_sessions_started_total PIP sessions started since module load.\n"
+                           "# TYPE video_pip_sessions_started_total counter\n"
+                           "video_pip_sessions_started_total %llu\n",
+                           (unsigned long long)started_total);
+
+#define PIP_METRIC_COUNTER(name, help, value)                                                                            \
+    stream->write_function(stream, "# HELP " name " " help "\n# TYPE " name " counter\n" name " %llu\n",               \
+                           (unsigned long long)(value))
+
+    PIP_METRIC_COUNTER("video_pip_frames_captured_total", "Remote video frames captured.", metrics.frames_captured);
+    PIP_METRIC_COUNTER("video_pip_frames_decoded_total", "Local background frames decoded.", metrics.frames_decoded);
+    PIP_METRIC_COUNTER("video_pip_frames_composited_total", "Frames composited.", metrics.frames_composited);
+    PIP_METRIC_COUNTER("video_pip_frames_encoded_total", "Frames encoded and written.", metrics.frames_encoded);
+    PIP_METRIC_COUNTER("video_pip_frames_dropped_total", "Captured frames that produced no output.",
+                       metrics.frames_dropped);
+    PIP_METRIC_COUNTER("video_pip_encoder_bytes_total", "Encoded bytes written to output files.",
+                       metrics.encoder_bytes);
+    PIP_METRIC_COUNTER("video_pip_decode_errors_total", "Local video decode errors.", metrics.decode_errors);
+    PIP_METRIC_COUNTER("video_pip_scaler_rebuilds_total", "Scaler context rebuilds.", metrics.scaler_rebuilds);
+    PIP_METRIC_COUNTER("video_pip_frames_repeated_total", "Output clock ticks that reused the previous remote frame.",
+                       metrics.frames_repeated);
+    PIP_METRIC_COUNTER("video_pip_frames_superseded_total",
+                       "Remote frames replaced by a newer frame before the output clock used them.",
+                       metrics.frames_superseded);
+    PIP_METRIC_COUNTER("video_pip_clock_overruns_total", "Output clock ticks skipped because compositing ran late.",
+                       metrics.clock_overruns);
+    PIP_METRIC_COUNTER("video_pip_rendition_frames_total", "Frames encoded into low-resolution renditions.",
+                       metrics.rendition_frames);
+    PIP_METRIC_COUNTER("video_pip_rendition_dropped_total",
+                       "Rendition frames skipped because the rendition encoder fell behind.",
+                       metrics.rendition_dropped);
+    PIP_METRIC_COUNTER("video_pip_sessions_rejected_total", "Sessions rejected by the memory cap.", rejected_total);
+    PIP_METRIC_COUNTER("video_pip_sessions_downgraded_total", "Sessions started without recording due to the memory cap.",
+                       downgraded_total);
+
+#undef PIP_METRIC_COUNTER
+
+    stream->write_function(stream,
+                           "# HELP video_pip_memory_bytes Memory accounted to active PIP sessions.\n"
+                           "# TYPE video_pip_memory_bytes gauge\n"
+                           "video_pip_memory_bytes %llu\n"
+                           "# HELP video_pip_memory_limit_bytes Configured module memory cap (0 = unlimited).\n"
+                           "# TYPE video_pip_memory_limit_bytes gauge\n"
+                           "video_pip_memory_limit_bytes %llu\n",
+                           (unsigned long long)mem_total, (unsigned long long)pip_config.max_memory_bytes);
+
+    {
+        int groups = 0, followers = 0;
+
+        switch_mutex_lock(pip_share_mutex);
+        for (pip_share_group_t *group = pip_share_groups; group; group = group->next)
+        {
+            groups += group->leader != NULL;
+            followers += group->member_count;
+        }
+        switch_mutex_unlock(pip_share_mutex);
+
+        stream->write_function(stream,
+                               "# HELP video_pip_share_groups Shared composites with an active leader.\n"
+                               "# TYPE video_pip_share_groups gauge\n"
+                               "video_pip_share_groups %d\n"
+                               "# HELP video_pip_share_followers Sessions recording a shared composite instead of their own.\n"
+                               "# TYPE video_pip_share_followers gauge\n"
+                               "video_pip_share_followers %d\n",
+                               groups, followers);
+    }
+
+    if (pip_encoder_pool.mutex)
+    {
+        uint64_t hits, misses, recycled;
+        int idle = 0;
+
+        switch_mutex_lock(pip_encoder_pool.mutex);
+        hits = pip_encoder_pool.hits;
+        misses = pip_encoder_pool.misses;
+        recycled = pip_encoder_pool.recycled;
+        for (int i = 0; i < pip_encoder_pool.profile_count; i++)
+        {
+            idle += pip_encoder_pool.profiles[i].idle_count;
+        }
+        switch_mutex_unlock(pip_encoder_pool.mutex);
+
+        stream->write_function(stream,
+                               "# HELP video_pip_encoder_pool_idle Pre-opened encoders waiting in the warm pool.\n"
+                               "# TYPE video_pip_encoder_pool_idle gauge\n"
+                               "video_pip_encoder_pool_idle %d\n"
+                               "# HELP video_pip_encoder_pool_hits_total Session starts that borrowed a warm encoder.\n"
+                               "# TYPE video_pip_encoder_pool_hits_total counter\n"
+                               "video_pip_encoder_pool_hits_total %llu\n"
+                               "# HELP video_pip_encoder_pool_misses_total Session starts that opened an encoder inline.\n"
+                               "# TYPE video_pip_encoder_pool_misses_total counter\n"
+                               "video_pip_encoder_pool_misses_total %llu\n"
+                               "# HELP video_pip_encoder_pool_recycled_total Encoders reset and returned at session stop.\n"
+                               "# TYPE video_pip_encoder_pool_recycled_total counter\n"
+                               "video_pip_encoder_pool_recycled_total %llu\n",
+                               idle, (unsigned long long)hits, (unsigned long long)misses, (unsigned long long)recycled);
+    }
+
+    stream->write_function(stream, "# HELP video_pip_stage_latency_seconds Per-frame processing latency by stage.\n"
+                                   "# TYPE video_pip_stage_latency_seconds summary\n");
+    for (int i = 0; i < PIP_STAGE_COUNT; i++)
+    {
+        stream->write_function(stream,
+                               "video_pip_stage_latency_seconds_sum{stage=\"%s\"} %.6f\n"
+                               "video_pip_stage_latency_seconds_count{stage=\"%s\"} %llu\n",
+                               stage_names[i], metrics.stages[i].sum_us / 1000000.0, stage_names[i],
+                               (unsigned long long)metrics.stages[i].count);
+    }
+
+    stream->write_function(stream, "# HELP video_pip_stage_latency_max_seconds Maximum observed latency by stage.\n"
+                                   "# TYPE video_pip_stage_latency_max_seconds gauge\n");
+    for (int i = 0; i < PIP_STAGE_COUNT; i++)
+    {
+        stream->write_function(stream, "video_pip_stage_latency_max_seconds{stage=\"%s\"} %.6f\n", stage_names[i],
+                               metrics.stages[i].max_us / 1000000.0);
+    }
+
+    return SWITCH_STATUS_SUCCESS;
+}
+
 /* 模块加载 */
 SWITCH_MODULE_LOAD_FUNCTION(mod_video_pip_load)
 {
     switch_api_interface_t *api_interface;
+    switch_application_interface_t *app_interface;
 
     *module_interface = switch_loadable_module_create_module_interface(pool, modname);
 
     module_pool = pool;
-    switch_mutex_init(&module_mutex, SWITCH_MUTEX_UNNESTED, module_pool);
-    switch_core_hash_init(&session_pip_map);
+    memset(&pip_registry, 0, sizeof(pip_registry));
+    switch_mutex_init(&pip_registry.write_mutex, SWITCH_MUTEX_UNNESTED, module_pool);
+    switch_mutex_init(&metrics_mutex, SWITCH_MUTEX_UNNESTED, module_pool);
+    switch_mutex_init(&pip_event_mutex, SWITCH_MUTEX_UNNESTED, module_pool);
+    switch_mutex_init(&pip_raw_mutex, SWITCH_MUTEX_UNNESTED, module_pool);
+    switch_mutex_init(&pip_share_mutex, SWITCH_MUTEX_UNNESTED, module_pool);
+    switch_mutex_init(&pip_start_mutex, SWITCH_MUTEX_UNNESTED, module_pool);
+    pip_recent_video_count = 0;
+    pip_shutting_down = 0;
+    memset(&retired_metrics, 0, sizeof(retired_metrics));
+    sessions_started_total = 0;
+    sessions_rejected_total = 0;
+    sessions_downgraded_total = 0;
+    pip_mem_total = 0;
+
+    pip_load_config();
+
+    if (switch_event_reserve_subclass(PIP_EVENT_START_RESULT) != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "无法注册事件子类 %s\n", PIP_EVENT_START_RESULT);
+        return SWITCH_STATUS_TERM;
+    }
+
+    pip_encoder_pool_start();
+    pip_snapshot_start();
+    pip_subtitle_start();
+    pip_background_start();
+
+    /* 启动工作线程先于事件订阅，应答事件提交的任务总有线程处理 */
+    if (pip_start_workers_launch() != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "PIP启动工作线程不可用，异步启动和自动启动将被拒绝\n");
+    }
+
+    /* 订阅应答事件（自动启动、记录最近的视频通话） */
+    if (switch_event_bind_removable(modname, SWITCH_EVENT_CHANNEL_ANSWER, SWITCH_EVENT_SUBCLASS_ANY,
+                                    pip_answer_event_handler, NULL, &pip_answer_node) != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "订阅CHANNEL_ANSWER事件失败，自动启动不可用\n");
+    }
+    if (switch_event_bind_removable(modname, SWITCH_EVENT_CHANNEL_HANGUP, SWITCH_EVENT_SUBCLASS_ANY,
+                                    pip_hangup_event_handler, NULL, &pip_hangup_node) != SWITCH_STATUS_SUCCESS)
+    {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING,
+                          "订阅CHANNEL_HANGUP事件失败，不带UUID的video_pip_start改为逐个确认通话是否存在\n");
+    }
 
     /* 注册API */
     SWITCH_ADD_API(api_interface, "video_pip_start", "启动PIP", video_pip_start_function, "<uuid> [local_video_file]");
+    SWITCH_ADD_API(api_interface, "video_pip_start_async", "异步启动PIP", video_pip_start_async_function,
+                   "<uuid> [local_video_file]");
     SWITCH_ADD_API(api_interface, "video_pip_stop", "停止PIP", video_pip_stop_function, "<uuid>");
+    SWITCH_ADD_API(api_interface, "video_pip_batch", "批量启动/停止/修改PIP", video_pip_batch_function,
+                   "<start|stop|update> <uuid> [file] [x=N y=N width=N height=N opacity=F position=P]; ... | <json>");
+    SWITCH_ADD_API(api_interface, "video_pip_update", "修改PIP布局", video_pip_update_function,
+                   "<uuid> [x=N] [y=N] [width=N] [height=N] [opacity=F] [position=P]");
+    SWITCH_ADD_API(api_interface, "pip_position", "设置PIP位置", pip_position_function,
+                   "<uuid> <top_left|top_right|bottom_left|bottom_right|center>");
+    SWITCH_ADD_API(api_interface, "pip_size", "设置PIP大小", pip_size_function, "<uuid> <0.1-0.5>");
+    SWITCH_ADD_API(api_interface, "video_pip_tap", "开关PIP输出旁路", video_pip_tap_function,
+                   "<uuid> start [name] [slots] | stop");
+    SWITCH_ADD_API(api_interface, "video_pip_snapshot", "PIP画面快照", video_pip_snapshot_function,
+                   "<uuid> [width] [path.jpg|path.png|png|jpeg]");
     SWITCH_ADD_API(api_interface, "video_pip_status", "PIP状态", video_pip_status_function, "[uuid]");
+    SWITCH_ADD_API(api_interface, "video_pip_metrics", "PIP指标(Prometheus格式)", video_pip_metrics_function, "");
+
+    /* 注册拨号计划应用 */
+    SWITCH_ADD_APP(app_interface, "video_pip", "启动/停止PIP", "异步启动当前通话的PIP，完成时发出video_pip::start_result事件",
+                   video_pip_app_function, "[local_video_file|stop]", SAF_NONE);
 
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "视频画中画模块加载成功 - 支持远程视频叠加到本地MP4文件\n");
 
@@ -1752,25 +7264,34 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_video_pip_load)
 /* 模块卸载 */
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_video_pip_shutdown)
 {
-    switch_hash_index_t *hi;
-    const void *key;
-    void *val;
-    pip_session_data_t *pip_data;
-
-    /* 清理所有会话 */
-    switch_mutex_lock(module_mutex);
-    for (hi = switch_core_hash_first(session_pip_map); hi; hi = switch_core_hash_next(&hi))
-    {
-        switch_core_hash_this(hi, &key, NULL, &val);
-        pip_data = (pip_session_data_t *)val;
-        cleanup_pip_session(pip_data);
-    }
-    switch_core_hash_destroy(&session_pip_map);
-    switch_mutex_unlock(module_mutex);
-
-    switch_mutex_destroy(module_mutex);
+    pip_session_data_t **list = NULL;
+    int count;
+
+    /* 先退订事件并等待启动工作线程退出，之后不会再有新会话登记 */
+    __atomic_store_n(&pip_shutting_down, 1, __ATOMIC_SEQ_CST);
+    switch_event_unbind(&pip_answer_node);
+    switch_event_unbind(&pip_hangup_node);
+    pip_start_workers_stop();
+
+    /* 停止所有会话 */
+    count = pip_registry_list(&list);
+    pip_session_stop_many(list, count);
+    pip_registry_list_free(list, count);
+
+    /* 会话归还的编码器在这里一并释放 */
+    pip_encoder_pool_stop();
+    pip_snapshot_stop();
+    pip_subtitle_stop();
+    pip_background_stop();
+
+    switch_mutex_destroy(pip_registry.write_mutex);
+    switch_mutex_destroy(metrics_mutex);
+    switch_mutex_destroy(pip_event_mutex);
+    switch_mutex_destroy(pip_raw_mutex);
+    switch_mutex_destroy(pip_share_mutex);
+    switch_event_free_subclass(PIP_EVENT_START_RESULT);
 
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "视频画中画模块卸载完成\n");
 
     return SWITCH_STATUS_SUCCESS;
-}
\ No newline at end of file
+}
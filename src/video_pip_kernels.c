@@ -0,0 +1,746 @@
+#include "../include/video_pip_kernels.h"
+
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+
+#include <libavutil/mem.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* 简单的YUV420P帧叠加函数 */
+void overlay_yuv420p_frames(AVFrame *main_frame, AVFrame *pip_frame_scaled, AVFrame *output_frame, int x, int y,
+                            float opacity)
+{
+    int pip_width = pip_frame_scaled->width;
+    int pip_height = pip_frame_scaled->height;
+    int main_width = main_frame->width;
+    int main_height = main_frame->height;
+
+    /* 首先复制主视频到输出，窗口完全越界时输出即为主视频 */
+    av_frame_copy(output_frame, main_frame);
+
+    /* 边界检查 */
+    if (x + pip_width > main_width)
+        pip_width = main_width - x;
+    if (y + pip_height > main_height)
+        pip_height = main_height - y;
+    if (x < 0 || y < 0 || pip_width <= 0 || pip_height <= 0)
+        return;
+
+    /* Y分量叠加 */
+    for (int i = 0; i < pip_height; i++)
+    {
+        uint8_t *main_y = output_frame->data[0] + (y + i) * output_frame->linesize[0] + x;
+        uint8_t *pip_y = pip_frame_scaled->data[0] + i * pip_frame_scaled->linesize[0];
+
+        for (int j = 0; j < pip_width; j++)
+        {
+            main_y[j] = (uint8_t)(main_y[j] * (1.0f - opacity) + pip_y[j] * opacity);
+        }
+    }
+
+    /* U/V分量叠加 (色度分量，尺寸减半)：覆盖PIP所在亮度范围对应的全部色度样本，
+     * 奇数坐标时比PIP的色度平面多一列/行，多出的一列/行取PIP色度的最后一列/行 */
+    int x_uv = x / 2;
+    int y_uv = y / 2;
+    int pip_width_uv = (x + pip_width + 1) / 2 - x_uv;
+    int pip_height_uv = (y + pip_height + 1) / 2 - y_uv;
+    int src_width_uv = (pip_frame_scaled->width + 1) / 2;
+    int src_height_uv = (pip_frame_scaled->height + 1) / 2;
+
+    for (int p = 1; p < 3; p++)
+    {
+        for (int i = 0; i < pip_height_uv; i++)
+        {
+            uint8_t *main_uv = output_frame->data[p] + (y_uv + i) * output_frame->linesize[p] + x_uv;
+            uint8_t *pip_uv =
+                pip_frame_scaled->data[p] + FFMIN(i, src_height_uv - 1) * pip_frame_scaled->linesize[p];
+
+            for (int j = 0; j < pip_width_uv; j++)
+            {
+                // Alpha混合算法
+                uint8_t v = pip_uv[FFMIN(j, src_width_uv - 1)];
+                main_uv[j] = (uint8_t)(main_uv[j] * (1.0f - opacity) + v * opacity);
+            }
+        }
+    }
+}
+
+int pip_style_is_plain(const pip_style_t *style)
+{
+    return !style || (style->border_width <= 0 && style->corner_radius <= 0 && style->feather <= 0);
+}
+
+/* 像素中心到圆角矩形边缘的距离，窗口内为正 */
+static float mask_inside_distance(int i, int j, int width, int height, float radius)
+{
+    float px = j + 0.5f;
+    float py = i + 0.5f;
+    float dx = px < width - px ? px : width - px;
+    float dy = py < height - py ? py : height - py;
+
+    if (dx < radius && dy < radius)
+    {
+        return radius - hypotf(radius - dx, radius - dy);
+    }
+    return dx < dy ? dx : dy;
+}
+
+static uint8_t mask_unit_to_byte(float v)
+{
+    if (v <= 0.0f)
+    {
+        return 0;
+    }
+    if (v >= 1.0f)
+    {
+        return 255;
+    }
+    return (uint8_t)lrintf(v * 255.0f);
+}
+
+/* 2x2平均得到色度遮罩，奇数尺寸的最后一行/列复制边缘 */
+static void mask_downsample(const uint8_t *src, int src_linesize, int width, int height, uint8_t *dst,
+                            int dst_linesize)
+{
+    for (int i = 0; i < (height + 1) / 2; i++)
+    {
+        const uint8_t *row0 = src + (2 * i) * src_linesize;
+        const uint8_t *row1 = 2 * i + 1 < height ? row0 + src_linesize : row0;
+
+        for (int j = 0; j < (width + 1) / 2; j++)
+        {
+            int j1 = 2 * j + 1 < width ? 2 * j + 1 : 2 * j;
+            dst[i * dst_linesize + j] = (uint8_t)((row0[2 * j] + row0[j1] + row1[2 * j] + row1[j1] + 2) >> 2);
+        }
+    }
+}
+
+/* 按尺寸划分遮罩缓冲区，只在变大时重新分配 */
+static int mask_alloc(pip_alpha_mask_t *mask, int width, int height)
+{
+    int linesize_y = FFALIGN(width, 32);
+    int linesize_uv = FFALIGN((width + 1) / 2, 32);
+    int height_uv = (height + 1) / 2;
+    size_t size = ((size_t)linesize_y * height + (size_t)linesize_uv * height_uv) * 2;
+
+    if (width <= 0 || height <= 0)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    if (size > mask->buffer_size)
+    {
+        uint8_t *buffer = av_malloc(size);
+        if (!buffer)
+        {
+            return AVERROR(ENOMEM);
+        }
+        av_free(mask->buffer);
+        mask->buffer = buffer;
+        mask->buffer_size = size;
+    }
+
+    mask->width = width;
+    mask->height = height;
+    mask->linesize[0] = linesize_y;
+    mask->linesize[1] = linesize_uv;
+    mask->coverage[0] = mask->buffer;
+    mask->border[0] = mask->coverage[0] + (size_t)linesize_y * height;
+    mask->coverage[1] = mask->border[0] + (size_t)linesize_y * height;
+    mask->border[1] = mask->coverage[1] + (size_t)linesize_uv * height_uv;
+    return 0;
+}
+
+int pip_alpha_mask_build(pip_alpha_mask_t *mask, int width, int height, const pip_style_t *style)
+{
+    int linesize_y = FFALIGN(width, 32);
+    int linesize_uv = FFALIGN((width + 1) / 2, 32);
+    float radius = (float)style->corner_radius;
+    float feather = style->feather > 1 ? (float)style->feather : 1.0f;
+    float border = (float)style->border_width;
+    int ret;
+
+    if ((ret = mask_alloc(mask, width, height)) < 0)
+    {
+        return ret;
+    }
+    memcpy(mask->border_color, style->border_color, sizeof(mask->border_color));
+
+    if (radius * 2 > width)
+    {
+        radius = width / 2.0f;
+    }
+    if (radius * 2 > height)
+    {
+        radius = height / 2.0f;
+    }
+
+    /* 边缘像素中心距边缘0.5像素，覆盖率按半像素偏移后计算，
+     * 无圆角、无羽化时矩形内全部为255，与普通叠加一致 */
+    for (int i = 0; i < height; i++)
+    {
+        uint8_t *coverage = mask->coverage[0] + i * linesize_y;
+        uint8_t *border_row = mask->border[0] + i * linesize_y;
+
+        for (int j = 0; j < width; j++)
+        {
+            float inside = mask_inside_distance(i, j, width, height, radius);
+
+            coverage[j] = mask_unit_to_byte((inside + 0.5f) / feather);
+            border_row[j] = border > 0 ? mask_unit_to_byte(border - inside + 0.5f) : 0;
+        }
+    }
+
+    mask_downsample(mask->coverage[0], linesize_y, width, height, mask->coverage[1], linesize_uv);
+    mask_downsample(mask->border[0], linesize_y, width, height, mask->border[1], linesize_uv);
+
+    return 0;
+}
+
+int pip_alpha_mask_from_coverage(pip_alpha_mask_t *mask, const uint8_t *coverage, int linesize, int width,
+                                 int height, const uint8_t color[3])
+{
+    int ret;
+
+    if ((ret = mask_alloc(mask, width, height)) < 0)
+    {
+        return ret;
+    }
+    memcpy(mask->border_color, color, sizeof(mask->border_color));
+
+    /* 边框比例全部为255，混合时只取border_color，不读取源像素 */
+    for (int i = 0; i < height; i++)
+    {
+        memcpy(mask->coverage[0] + i * mask->linesize[0], coverage + i * linesize, width);
+        memset(mask->border[0] + i * mask->linesize[0], 255, width);
+    }
+    for (int i = 0; i < (height + 1) / 2; i++)
+    {
+        memset(mask->border[1] + i * mask->linesize[1], 255, (width + 1) / 2);
+    }
+    mask_downsample(mask->coverage[0], mask->linesize[0], width, height, mask->coverage[1], mask->linesize[1]);
+
+    return 0;
+}
+
+void pip_alpha_mask_free(pip_alpha_mask_t *mask)
+{
+    av_freep(&mask->buffer);
+    memset(mask, 0, sizeof(*mask));
+}
+
+/* 一行的逐像素混合，dst中已是主视频像素。全部用8位定点运算，
+ * 权重w(0-255)先映射为0-256，SSE2与标量路径结果逐位一致：
+ *   s = (pip*(256-b) + color*b) >> 8
+ *   a = coverage*opacity >> 8
+ *   dst = (dst*(256-a) + s*a) >> 8 */
+static void blend_row_masked(uint8_t *dst, const uint8_t *src, const uint8_t *coverage, const uint8_t *border,
+                             int n, int opacity, uint8_t color)
+{
+    int j = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(256);
+    const __m128i op = _mm_set1_epi16((short)opacity);
+    const __m128i col = _mm_set1_epi16(color);
+
+    for (; j + 16 <= n; j += 16)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + j));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + j));
+        __m128i c = _mm_loadu_si128((const __m128i *)(coverage + j));
+        __m128i b = _mm_loadu_si128((const __m128i *)(border + j));
+        __m128i out[2];
+
+        for (int half = 0; half < 2; half++)
+        {
+            __m128i d16 = half ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+            __m128i s16 = half ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+            __m128i c16 = half ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+            __m128i b16 = half ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+            __m128i a16;
+
+            b16 = _mm_add_epi16(b16, _mm_srli_epi16(b16, 7));
+            s16 = _mm_srli_epi16(
+                _mm_add_epi16(_mm_mullo_epi16(s16, _mm_sub_epi16(full, b16)), _mm_mullo_epi16(col, b16)), 8);
+            a16 = _mm_srli_epi16(_mm_mullo_epi16(c16, op), 8);
+            a16 = _mm_add_epi16(a16, _mm_srli_epi16(a16, 7));
+            out[half] = _mm_srli_epi16(
+                _mm_add_epi16(_mm_mullo_epi16(d16, _mm_sub_epi16(full, a16)), _mm_mullo_epi16(s16, a16)), 8);
+        }
+        _mm_storeu_si128((__m128i *)(dst + j), _mm_packus_epi16(out[0], out[1]));
+    }
+#endif
+
+    for (; j < n; j++)
+    {
+        int b = border[j] + (border[j] >> 7);
+        int s = (src[j] * (256 - b) + color * b) >> 8;
+        int a = (coverage[j] * opacity) >> 8;
+
+        a += a >> 7;
+        dst[j] = (uint8_t)((dst[j] * (256 - a) + s * a) >> 8);
+    }
+}
+
+void overlay_yuv420p_frames_masked(AVFrame *main_frame, AVFrame *pip_frame_scaled, AVFrame *output_frame, int x, int y,
+                                   float opacity, const pip_alpha_mask_t *mask)
+{
+    int pip_width = pip_frame_scaled->width;
+    int pip_height = pip_frame_scaled->height;
+    int op = (int)lrintf(opacity * 256.0f);
+
+    /* 首先复制主视频到输出，不叠加时输出即为主视频 */
+    av_frame_copy(output_frame, main_frame);
+
+    /* 遮罩与PIP尺寸不符时不叠加，由调用方重建遮罩 */
+    if (!mask || !mask->buffer || mask->width != pip_width || mask->height != pip_height)
+        return;
+
+    /* 边界检查 */
+    if (x + pip_width > main_frame->width)
+        pip_width = main_frame->width - x;
+    if (y + pip_height > main_frame->height)
+        pip_height = main_frame->height - y;
+    if (x < 0 || y < 0 || pip_width <= 0 || pip_height <= 0)
+        return;
+
+    op = op < 0 ? 0 : (op > 256 ? 256 : op);
+
+    /* 色度范围与overlay_yuv420p_frames相同：奇数坐标时多出的一列/行取遮罩和PIP的最后一列/行 */
+    for (int p = 0; p < 3; p++)
+    {
+        int m = p ? 1 : 0;
+        int shift = p ? 1 : 0;
+        int px = x >> shift;
+        int py = y >> shift;
+        int pw = ((x + pip_width + shift) >> shift) - px;
+        int ph = ((y + pip_height + shift) >> shift) - py;
+        int sw = (pip_frame_scaled->width + shift) >> shift;
+        int sh = (pip_frame_scaled->height + shift) >> shift;
+        int n = FFMIN(pw, sw);
+
+        for (int i = 0; i < ph; i++)
+        {
+            int si = FFMIN(i, sh - 1);
+            uint8_t *dst = output_frame->data[p] + (py + i) * output_frame->linesize[p] + px;
+            const uint8_t *src = pip_frame_scaled->data[p] + si * pip_frame_scaled->linesize[p];
+            const uint8_t *coverage = mask->coverage[m] + si * mask->linesize[m];
+            const uint8_t *border = mask->border[m] + si * mask->linesize[m];
+
+            blend_row_masked(dst, src, coverage, border, n, op, mask->border_color[p]);
+            if (pw > n)
+            {
+                blend_row_masked(dst + n, src + sw - 1, coverage + sw - 1, border + sw - 1, pw - n, op,
+                                 mask->border_color[p]);
+            }
+        }
+    }
+}
+
+void overlay_yuv420p_mask_color(AVFrame *frame, int x, int y, float opacity, const pip_alpha_mask_t *mask)
+{
+    int width, height, left, top;
+    int op = (int)lrintf(opacity * 256.0f);
+
+    if (!mask || !mask->buffer)
+        return;
+
+    /* 色度遮罩按2x2对齐，位置取偶数；裁剪到画面内，只处理遮罩所在的矩形 */
+    x &= ~1;
+    y &= ~1;
+    left = x < 0 ? -x : 0;
+    top = y < 0 ? -y : 0;
+    width = x + mask->width > frame->width ? frame->width - x : mask->width;
+    height = y + mask->height > frame->height ? frame->height - y : mask->height;
+    if (width <= left || height <= top)
+        return;
+
+    op = op < 0 ? 0 : (op > 256 ? 256 : op);
+
+    for (int p = 0; p < 3; p++)
+    {
+        int m = p ? 1 : 0;
+        int shift = p ? 1 : 0;
+        int j0 = left >> shift;
+        int i0 = top >> shift;
+        int pw = ((width + shift) >> shift) - j0;
+        int ph = (height + shift) >> shift;
+
+        for (int i = i0; i < ph; i++)
+        {
+            uint8_t *dst = frame->data[p] + ((p ? y / 2 : y) + i) * frame->linesize[p] + (p ? x / 2 : x) + j0;
+
+            blend_row_masked(dst, dst, mask->coverage[m] + i * mask->linesize[m] + j0,
+                             mask->border[m] + i * mask->linesize[m] + j0, pw, op, mask->border_color[p]);
+        }
+    }
+}
+
+int pip_color_adjust_is_identity(const pip_color_adjust_t *adjust)
+{
+    return adjust->brightness == 0.0f && adjust->contrast == 1.0f && adjust->saturation == 1.0f;
+}
+
+static uint8_t lut_clip(float v)
+{
+    return v <= 0.0f ? 0 : (v >= 255.0f ? 255 : (uint8_t)lrintf(v));
+}
+
+void pip_color_lut_build(pip_color_lut_t *lut, const pip_color_adjust_t *adjust)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        lut->y[i] = lut_clip(adjust->contrast * (i - 128) + 128.0f + adjust->brightness * 255.0f);
+        lut->uv[i] = lut_clip(adjust->saturation * (i - 128) + 128.0f);
+    }
+}
+
+/* 一行查表，展开4次减少循环开销；查表无法用SSE2向量化，每像素一次访存 */
+static void lut_row(uint8_t *dst, const uint8_t *src, int n, const uint8_t *table)
+{
+    int j = 0;
+
+    for (; j + 4 <= n; j += 4)
+    {
+        uint8_t a = table[src[j]];
+        uint8_t b = table[src[j + 1]];
+        uint8_t c = table[src[j + 2]];
+        uint8_t d = table[src[j + 3]];
+
+        dst[j] = a;
+        dst[j + 1] = b;
+        dst[j + 2] = c;
+        dst[j + 3] = d;
+    }
+    for (; j < n; j++)
+    {
+        dst[j] = table[src[j]];
+    }
+}
+
+void pip_color_lut_apply(AVFrame *dst, const AVFrame *src, const pip_color_lut_t *lut)
+{
+    int width = FFMIN(dst->width, src->width);
+    int height = FFMIN(dst->height, src->height);
+
+    for (int p = 0; p < 3; p++)
+    {
+        int pw = p ? (width + 1) / 2 : width;
+        int ph = p ? (height + 1) / 2 : height;
+        const uint8_t *table = p ? lut->uv : lut->y;
+
+        for (int i = 0; i < ph; i++)
+        {
+            lut_row(dst->data[p] + i * dst->linesize[p], src->data[p] + i * src->linesize[p], pw, table);
+        }
+    }
+}
+
+int pip_blend_mode_parse(const char *name, pip_blend_mode_t *mode)
+{
+    static const pip_blend_mode_t modes[] = {PIP_BLEND_NORMAL, PIP_BLEND_OVERLAY, PIP_BLEND_MULTIPLY,
+                                             PIP_BLEND_SCREEN};
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+    {
+        if (!strcasecmp(name, pip_blend_mode_name(modes[i])))
+        {
+            *mode = modes[i];
+            return 0;
+        }
+    }
+    return AVERROR(EINVAL);
+}
+
+const char *pip_blend_mode_name(pip_blend_mode_t mode)
+{
+    switch (mode)
+    {
+    case PIP_BLEND_OVERLAY:
+        return "overlay";
+    case PIP_BLEND_MULTIPLY:
+        return "multiply";
+    case PIP_BLEND_SCREEN:
+        return "screen";
+    default:
+        return "normal";
+    }
+}
+
+/* 有符号除法，四舍五入（远离0） */
+static int div_round(int num, int den)
+{
+    return num >= 0 ? (num + den / 2) / den : -((-num + den / 2) / den);
+}
+
+/* 一个图层像素b的系数，公式见 video_pip_kernels.h */
+static uint16_t blend_coef(pip_blend_mode_t mode, int alpha, int b, int chroma)
+{
+    if (mode == PIP_BLEND_NORMAL)
+    {
+        return (uint16_t)(b * alpha);
+    }
+    if (chroma)
+    {
+        return (uint16_t)(int16_t)div_round((b - 128) * alpha, 256);
+    }
+    switch (mode)
+    {
+    case PIP_BLEND_MULTIPLY:
+        /* v * (1 - alpha + alpha * b / 255) */
+        return (uint16_t)(256 - div_round(alpha * (255 - b), 255));
+    case PIP_BLEND_SCREEN:
+        /* 255 - (255 - v) * (1 - alpha * b / 255)，亮部系数为 512 - k */
+        return (uint16_t)(256 + div_round(alpha * b, 255));
+    default:
+        /* 暗部 v * (1 + alpha * (2b - 255) / 255)，亮部 255 - (255 - v) * (1 - alpha * (2b - 255) / 255) */
+        return (uint16_t)(256 + div_round(alpha * (2 * b - 255), 255));
+    }
+}
+
+int pip_blend_layer_build(pip_blend_layer_t *layer, const AVFrame *image, pip_blend_mode_t mode, float opacity)
+{
+    int width = image->width;
+    int height = image->height;
+    int linesize_y = FFALIGN(width, 16);
+    int linesize_uv = FFALIGN((width + 1) / 2, 16);
+    int height_uv = (height + 1) / 2;
+    size_t size = ((size_t)linesize_y * height + (size_t)linesize_uv * height_uv * 2) * sizeof(uint16_t);
+
+    if (width <= 0 || height <= 0 || image->format != AV_PIX_FMT_YUV420P || opacity < 0.0f || opacity > 1.0f)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    if (size > layer->buffer_size)
+    {
+        uint8_t *buffer = av_malloc(size);
+        if (!buffer)
+        {
+            return AVERROR(ENOMEM);
+        }
+        av_free(layer->buffer);
+        layer->buffer = buffer;
+        layer->buffer_size = size;
+    }
+
+    layer->width = width;
+    layer->height = height;
+    layer->mode = mode;
+    layer->alpha = (int)lrintf(opacity * 256.0f);
+    layer->linesize[0] = linesize_y;
+    layer->linesize[1] = layer->linesize[2] = linesize_uv;
+    layer->coef[0] = (uint16_t *)layer->buffer;
+    layer->coef[1] = layer->coef[0] + (size_t)linesize_y * height;
+    layer->coef[2] = layer->coef[1] + (size_t)linesize_uv * height_uv;
+
+    for (int p = 0; p < 3; p++)
+    {
+        int pw = p ? (width + 1) / 2 : width;
+        int ph = p ? height_uv : height;
+
+        for (int i = 0; i < ph; i++)
+        {
+            const uint8_t *src = image->data[p] + i * image->linesize[p];
+            uint16_t *coef = layer->coef[p] + (size_t)i * layer->linesize[p];
+
+            for (int j = 0; j < pw; j++)
+            {
+                coef[j] = blend_coef(mode, layer->alpha, src[j], p > 0);
+            }
+        }
+    }
+    return 0;
+}
+
+void pip_blend_layer_free(pip_blend_layer_t *layer)
+{
+    av_freep(&layer->buffer);
+    memset(layer, 0, sizeof(*layer));
+}
+
+/* normal：out = (v * (256 - alpha) + coef + 128) >> 8，两项之和不超过 255 * 256，16位无符号乘法不溢出 */
+static void blend_row_normal(uint8_t *dst, const uint8_t *src, const uint16_t *coef, int n, int alpha)
+{
+    int j = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i inv = _mm_set1_epi16((short)(256 - alpha));
+    const __m128i round = _mm_set1_epi16(128);
+
+    for (; j + 16 <= n; j += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + j));
+        __m128i out[2];
+
+        for (int half = 0; half < 2; half++)
+        {
+            __m128i v16 = half ? _mm_unpackhi_epi8(v, zero) : _mm_unpacklo_epi8(v, zero);
+            __m128i c16 = _mm_loadu_si128((const __m128i *)(coef + j + half * 8));
+
+            out[half] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(v16, inv), c16), round), 8);
+        }
+        _mm_storeu_si128((__m128i *)(dst + j), _mm_packus_epi16(out[0], out[1]));
+    }
+#endif
+
+    for (; j < n; j++)
+    {
+        dst[j] = (uint8_t)((src[j] * (256 - alpha) + coef[j] + 128) >> 8);
+    }
+}
+
+/* overlay、multiply、screen的Y平面：暗部 (v * k + 128) >> 8，亮部 255 - (((255 - v) * (512 - k) + 128) >> 8)。
+ * 暗部v < 128或multiply的k <= 256，亮部同理，乘积不超过16位无符号范围 */
+static void blend_row_light(uint8_t *dst, const uint8_t *src, const uint16_t *coef, int n, pip_blend_mode_t mode)
+{
+    int j = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i full = _mm_set1_epi16(512);
+    const __m128i c128 = _mm_set1_epi16(128); /* 舍入常数，也是暗部和亮部的分界 */
+    const __m128i all = _mm_cmpeq_epi16(zero, zero);
+    /* 暗部选择：multiply恒为暗部，overlay按 v < 128，screen恒为亮部 */
+    const __m128i force_dark = mode == PIP_BLEND_MULTIPLY ? all : zero;
+    const __m128i by_value = mode == PIP_BLEND_OVERLAY ? all : zero;
+
+    for (; j + 16 <= n; j += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + j));
+        __m128i out[2];
+
+        for (int half = 0; half < 2; half++)
+        {
+            __m128i v16 = half ? _mm_unpackhi_epi8(v, zero) : _mm_unpacklo_epi8(v, zero);
+            __m128i k16 = _mm_loadu_si128((const __m128i *)(coef + j + half * 8));
+            __m128i dark = _mm_or_si128(force_dark, _mm_and_si128(by_value, _mm_cmplt_epi16(v16, c128)));
+            /* 暗部取(v, k)，亮部取(255 - v, 512 - k)，同一次乘法 */
+            __m128i d16 = _mm_or_si128(_mm_and_si128(dark, v16), _mm_andnot_si128(dark, _mm_sub_epi16(max, v16)));
+            __m128i m16 = _mm_or_si128(_mm_and_si128(dark, k16), _mm_andnot_si128(dark, _mm_sub_epi16(full, k16)));
+            __m128i r16 = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(d16, m16), c128), 8);
+
+            out[half] = _mm_or_si128(_mm_and_si128(dark, r16), _mm_andnot_si128(dark, _mm_sub_epi16(max, r16)));
+        }
+        _mm_storeu_si128((__m128i *)(dst + j), _mm_packus_epi16(out[0], out[1]));
+    }
+#endif
+
+    for (; j < n; j++)
+    {
+        int v = src[j];
+        int dark = mode == PIP_BLEND_MULTIPLY || (mode == PIP_BLEND_OVERLAY && v < 128);
+
+        dst[j] = (uint8_t)(dark ? (v * coef[j] + 128) >> 8 : 255 - (((255 - v) * (512 - coef[j]) + 128) >> 8));
+    }
+}
+
+/* overlay、multiply、screen的U、V平面：out = clip(v + coef)，coef按有符号解释 */
+static void blend_row_tint(uint8_t *dst, const uint8_t *src, const uint16_t *coef, int n)
+{
+    int j = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; j + 16 <= n; j += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + j));
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(v, zero), _mm_loadu_si128((const __m128i *)(coef + j)));
+        __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(v, zero), _mm_loadu_si128((const __m128i *)(coef + j + 8)));
+
+        _mm_storeu_si128((__m128i *)(dst + j), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for (; j < n; j++)
+    {
+        int v = src[j] + (int16_t)coef[j];
+
+        dst[j] = (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+    }
+}
+
+void pip_blend_layer_apply(AVFrame *dst, const AVFrame *src, const pip_blend_layer_t *layer)
+{
+    int width = FFMIN(FFMIN(dst->width, src->width), layer->width);
+    int height = FFMIN(FFMIN(dst->height, src->height), layer->height);
+
+    for (int p = 0; p < 3; p++)
+    {
+        int pw = p ? (width + 1) / 2 : width;
+        int ph = p ? (height + 1) / 2 : height;
+
+        for (int i = 0; i < ph; i++)
+        {
+            uint8_t *d = dst->data[p] + i * dst->linesize[p];
+            const uint8_t *s = src->data[p] + i * src->linesize[p];
+            const uint16_t *coef = layer->coef[p] + (size_t)i * layer->linesize[p];
+
+            if (layer->mode == PIP_BLEND_NORMAL)
+            {
+                blend_row_normal(d, s, coef, pw, layer->alpha);
+            }
+            else if (p == 0)
+            {
+                blend_row_light(d, s, coef, pw, layer->mode);
+            }
+            else
+            {
+                blend_row_tint(d, s, coef, pw);
+            }
+        }
+    }
+}
+
+void pip_rgb_to_yuv(uint32_t rgb, uint8_t yuv[3])
+{
+    int r = (rgb >> 16) & 0xff;
+    int g = (rgb >> 8) & 0xff;
+    int b = rgb & 0xff;
+
+    yuv[0] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    yuv[1] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+    yuv[2] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+/* 创建远程视频 -> PIP窗口的缩放上下文 */
+struct SwsContext *pip_scaler_create(int src_width, int src_height, int dst_width, int dst_height)
+{
+    return pip_scaler_create_format(AV_PIX_FMT_YUV420P, src_width, src_height, dst_width, dst_height);
+}
+
+struct SwsContext *pip_scaler_create_format(enum AVPixelFormat src_format, int src_width, int src_height,
+                                            int dst_width, int dst_height)
+{
+    return sws_getContext(src_width, src_height, src_format, dst_width, dst_height, AV_PIX_FMT_YUV420P, SWS_BILINEAR,
+                          NULL, NULL, NULL);
+}
+
+/* 设置输出编码器参数（需在avcodec_open2之前调用） */
+void pip_encoder_configure(AVCodecContext *codec_ctx, int width, int height)
+{
+    codec_ctx->width = width;
+    codec_ctx->height = height;
+    codec_ctx->time_base = (AVRational){1, PIP_OUTPUT_FPS};
+    codec_ctx->framerate = (AVRational){PIP_OUTPUT_FPS, 1};
+    codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    codec_ctx->bit_rate = PIP_OUTPUT_BITRATE;
+    codec_ctx->gop_size = PIP_OUTPUT_GOP;
+    codec_ctx->max_b_frames = 1;
+
+    /* H264特定设置 */
+    if (codec_ctx->codec_id == AV_CODEC_ID_H264)
+    {
+        av_opt_set(codec_ctx->priv_data, "preset", "ultrafast", 0);
+        av_opt_set(codec_ctx->priv_data, "tune", "zerolatency", 0);
+    }
+}
@@ -0,0 +1,168 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/video_pip_raw.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PIP_RAW_ALIGN_UP(v, a) (((v) + (a)-1) / (a) * (a))
+
+int pip_raw_header_init(pip_raw_header_t *header, int width, int height, int fps_num, int fps_den)
+{
+    int chroma_width = (width + 1) / 2;
+    int chroma_height = (height + 1) / 2;
+
+    if (width <= 0 || height <= 0 || width > PIP_RAW_MAX_DIMENSION || height > PIP_RAW_MAX_DIMENSION ||
+        fps_num <= 0 || fps_den <= 0)
+    {
+        return -EINVAL;
+    }
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, PIP_RAW_MAGIC, sizeof(header->magic));
+    header->version = PIP_RAW_VERSION;
+    header->header_size = sizeof(*header);
+    header->width = width;
+    header->height = height;
+    header->fps_num = fps_num;
+    header->fps_den = fps_den;
+    header->alignment = PIP_RAW_FRAME_ALIGN;
+    header->linesize[0] = PIP_RAW_ALIGN_UP(width, PIP_RAW_LINE_ALIGN);
+    header->linesize[1] = PIP_RAW_ALIGN_UP(chroma_width, PIP_RAW_LINE_ALIGN);
+    header->linesize[2] = header->linesize[1];
+    header->plane_offset[0] = 0;
+    header->plane_offset[1] = header->linesize[0] * height;
+    header->plane_offset[2] = header->plane_offset[1] + header->linesize[1] * chroma_height;
+    header->frame_size = (uint64_t)header->plane_offset[2] + (uint64_t)header->linesize[2] * chroma_height;
+    return 0;
+}
+
+int pip_raw_probe(const char *path)
+{
+    char magic[8];
+    FILE *fp = fopen(path, "rb");
+    int ok;
+
+    if (!fp)
+    {
+        return 0;
+    }
+    ok = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && !memcmp(magic, PIP_RAW_MAGIC, sizeof(magic));
+    fclose(fp);
+    return ok;
+}
+
+/* 头部字段是否与按尺寸重新计算的布局一致，索引项是否都落在文件内且对齐 */
+static int pip_raw_validate(const pip_raw_file_t *raw)
+{
+    const pip_raw_header_t *h = &raw->header;
+    const uint64_t *index;
+    pip_raw_header_t expect;
+
+    if (memcmp(h->magic, PIP_RAW_MAGIC, sizeof(h->magic)) || h->version != PIP_RAW_VERSION ||
+        h->header_size < sizeof(*h) || h->frame_count == 0 || h->alignment == 0 ||
+        (h->alignment & (h->alignment - 1)))
+    {
+        return -EINVAL;
+    }
+    if (pip_raw_header_init(&expect, h->width, h->height, h->fps_num, h->fps_den) < 0 ||
+        h->frame_size != expect.frame_size || memcmp(h->linesize, expect.linesize, sizeof(h->linesize)) ||
+        memcmp(h->plane_offset, expect.plane_offset, sizeof(h->plane_offset)))
+    {
+        return -EINVAL;
+    }
+    if (h->index_offset < h->header_size || (h->index_offset & (sizeof(uint64_t) - 1)) ||
+        h->index_offset + (uint64_t)h->frame_count * sizeof(uint64_t) > raw->map_size)
+    {
+        return -EINVAL;
+    }
+
+    index = (const uint64_t *)(raw->map + h->index_offset);
+    for (uint32_t i = 0; i < h->frame_count; i++)
+    {
+        uint64_t offset = index[i];
+
+        if ((offset & (h->alignment - 1)) || offset > raw->map_size || raw->map_size - offset < h->frame_size)
+        {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+int pip_raw_open(const char *path, pip_raw_file_t *raw)
+{
+    struct stat st;
+    void *map;
+    int fd;
+    int ret;
+
+    memset(raw, 0, sizeof(*raw));
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        return -errno;
+    }
+    if (fstat(fd, &st) < 0)
+    {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+    if ((uint64_t)st.st_size < sizeof(pip_raw_header_t))
+    {
+        close(fd);
+        return -EINVAL;
+    }
+
+    /* 映射在关闭描述符后仍然有效 */
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ret = map == MAP_FAILED ? -errno : 0;
+    close(fd);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    raw->map = map;
+    raw->map_size = st.st_size;
+    raw->dev = st.st_dev;
+    raw->ino = st.st_ino;
+    raw->mtime = st.st_mtime;
+    memcpy(&raw->header, map, sizeof(raw->header));
+
+    if ((ret = pip_raw_validate(raw)) < 0)
+    {
+        pip_raw_close(raw);
+        return ret;
+    }
+    raw->index = (const uint64_t *)(raw->map + raw->header.index_offset);
+
+    /* 循环播放是顺序读取，让内核提前预读 */
+    posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+    return 0;
+}
+
+void pip_raw_close(pip_raw_file_t *raw)
+{
+    if (raw->map)
+    {
+        munmap((void *)raw->map, raw->map_size);
+    }
+    memset(raw, 0, sizeof(*raw));
+}
+
+void pip_raw_frame(const pip_raw_file_t *raw, uint64_t n, const uint8_t *data[3], int linesize[3])
+{
+    const uint8_t *frame = raw->map + raw->index[n % raw->header.frame_count];
+
+    for (int i = 0; i < 3; i++)
+    {
+        data[i] = frame + raw->header.plane_offset[i];
+        linesize[i] = raw->header.linesize[i];
+    }
+}
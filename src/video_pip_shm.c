@@ -0,0 +1,314 @@
+#define _DEFAULT_SOURCE /* syscall() */
+
+#include "../include/video_pip_shm.h"
+#include "../include/video_pip_raw.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define PIP_SHM_PAGE 4096
+#define PIP_SHM_ALIGN_UP(v, a) (((v) + (a)-1) / (a) * (a))
+
+uint64_t pip_shm_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int pip_shm_ring_create(const char *name, int width, int height, int slot_count, pip_shm_ring_t *ring)
+{
+    pip_raw_header_t layout;
+    pip_shm_header_t *h;
+    uint64_t data_offset, slot_span, size;
+    void *map;
+    int fd;
+    int ret;
+
+    memset(ring, 0, sizeof(*ring));
+    if (slot_count < PIP_SHM_MIN_SLOTS || slot_count > PIP_SHM_MAX_SLOTS ||
+        pip_raw_header_init(&layout, width, height, 1, 1) < 0)
+    {
+        return -EINVAL;
+    }
+
+    data_offset = PIP_SHM_ALIGN_UP(sizeof(pip_shm_header_t) + sizeof(pip_shm_slot_t) * slot_count, PIP_SHM_PAGE);
+    slot_span = PIP_SHM_ALIGN_UP(layout.frame_size, PIP_SHM_PAGE);
+    size = data_offset + slot_span * slot_count;
+
+    /* 旧对象由仍在映射它的读取方继续持有，读取方发现停滞后按名称重新打开 */
+    shm_unlink(name);
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+    {
+        return -errno;
+    }
+    if (ftruncate(fd, (off_t)size) < 0)
+    {
+        ret = -errno;
+        close(fd);
+        shm_unlink(name);
+        return ret;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ret = map == MAP_FAILED ? -errno : 0;
+    close(fd);
+    if (ret < 0)
+    {
+        shm_unlink(name);
+        return ret;
+    }
+
+    h = map;
+    h->version = PIP_SHM_VERSION;
+    h->header_size = sizeof(*h);
+    h->width = width;
+    h->height = height;
+    memcpy(h->linesize, layout.linesize, sizeof(h->linesize));
+    memcpy(h->plane_offset, layout.plane_offset, sizeof(h->plane_offset));
+    h->slot_count = slot_count;
+    h->producer_pid = (uint32_t)getpid();
+    h->frame_size = layout.frame_size;
+    h->slot_span = slot_span;
+    h->data_offset = data_offset;
+    h->heartbeat_us = pip_shm_now_us();
+
+    /* 魔数最后写入，读取方看到魔数时其余字段已经就绪 */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(h->magic, PIP_SHM_MAGIC, sizeof(h->magic));
+
+    ring->header = h;
+    ring->slots = (pip_shm_slot_t *)((uint8_t *)map + sizeof(*h));
+    ring->map = map;
+    ring->map_size = size;
+    ring->writable = 1;
+    return 0;
+}
+
+int pip_shm_ring_open(const char *name, pip_shm_ring_t *ring)
+{
+    pip_raw_header_t layout;
+    pip_shm_header_t h;
+    struct stat st;
+    void *map;
+    int fd;
+    int ret;
+
+    memset(ring, 0, sizeof(*ring));
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+    {
+        return -errno;
+    }
+    if (fstat(fd, &st) < 0)
+    {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+    if ((uint64_t)st.st_size < sizeof(pip_shm_header_t))
+    {
+        close(fd);
+        return -EAGAIN;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ret = map == MAP_FAILED ? -errno : 0;
+    close(fd);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    memcpy(h.magic, map, sizeof(h.magic));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    memcpy((char *)&h + sizeof(h.magic), (const char *)map + sizeof(h.magic), sizeof(h) - sizeof(h.magic));
+
+    if (memcmp(h.magic, PIP_SHM_MAGIC, sizeof(h.magic)))
+    {
+        ret = -EAGAIN;
+    }
+    else if (h.version != PIP_SHM_VERSION || h.header_size < sizeof(h) || h.slot_count < PIP_SHM_MIN_SLOTS ||
+             h.slot_count > PIP_SHM_MAX_SLOTS || pip_raw_header_init(&layout, h.width, h.height, 1, 1) < 0 ||
+             h.frame_size != layout.frame_size || memcmp(h.linesize, layout.linesize, sizeof(h.linesize)) ||
+             memcmp(h.plane_offset, layout.plane_offset, sizeof(h.plane_offset)) || h.slot_span < h.frame_size ||
+             h.data_offset < h.header_size + sizeof(pip_shm_slot_t) * h.slot_count ||
+             h.data_offset + h.slot_span * h.slot_count > (uint64_t)st.st_size)
+    {
+        ret = -EINVAL;
+    }
+    if (ret < 0)
+    {
+        munmap(map, st.st_size);
+        return ret;
+    }
+
+    ring->header = map;
+    ring->slots = (pip_shm_slot_t *)((uint8_t *)map + h.header_size);
+    ring->map = map;
+    ring->map_size = st.st_size;
+    return 0;
+}
+
+void pip_shm_ring_close(pip_shm_ring_t *ring, const char *name)
+{
+    if (ring->map)
+    {
+        munmap(ring->map, ring->map_size);
+        if (ring->writable && name)
+        {
+            shm_unlink(name);
+        }
+    }
+    memset(ring, 0, sizeof(*ring));
+}
+
+static void pip_shm_slot_planes(const pip_shm_ring_t *ring, uint64_t seq, uint8_t *data[3], int linesize[3])
+{
+    const pip_shm_header_t *h = ring->header;
+    uint8_t *slot = ring->map + h->data_offset + ((seq - 1) % h->slot_count) * h->slot_span;
+
+    for (int i = 0; i < 3; i++)
+    {
+        data[i] = slot + h->plane_offset[i];
+        linesize[i] = h->linesize[i];
+    }
+}
+
+uint64_t pip_shm_ring_begin(pip_shm_ring_t *ring, uint8_t *data[3], int linesize[3])
+{
+    uint64_t seq = __atomic_load_n(&ring->header->write_seq, __ATOMIC_RELAXED) + 1;
+    pip_shm_slot_t *slot = &ring->slots[(seq - 1) % ring->header->slot_count];
+
+    /* 先标记写入中再写数据：读取方核对序号时能发现被覆盖的槽位 */
+    __atomic_store_n(&slot->seq, seq * 2 + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    pip_shm_slot_planes(ring, seq, data, linesize);
+    return seq;
+}
+
+/* 共享（非PRIVATE）futex：读取方在其他进程中，且只读映射也可以等待 */
+static void pip_shm_wake_all(pip_shm_header_t *h)
+{
+    __atomic_add_fetch(&h->wake, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+    syscall(SYS_futex, &h->wake, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+void pip_shm_ring_commit(pip_shm_ring_t *ring, uint64_t seq, int64_t pts, uint64_t source_seq)
+{
+    pip_shm_slot_t *slot = &ring->slots[(seq - 1) % ring->header->slot_count];
+    uint64_t now = pip_shm_now_us();
+
+    slot->pts = pts;
+    slot->timestamp_us = now;
+    slot->source_seq = source_seq;
+    __atomic_store_n(&slot->seq, seq * 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->header->write_seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->header->heartbeat_us, now, __ATOMIC_RELAXED);
+    pip_shm_wake_all(ring->header);
+}
+
+void pip_shm_ring_shutdown(pip_shm_ring_t *ring)
+{
+    if (ring->map && ring->writable)
+    {
+        __atomic_store_n(&ring->header->closed, 1, __ATOMIC_RELEASE);
+        pip_shm_wake_all(ring->header);
+    }
+}
+
+uint64_t pip_shm_ring_latest(const pip_shm_ring_t *ring, const uint8_t *data[3], int linesize[3], int64_t *pts)
+{
+    /* 写入方在两次读取之间绕环一整圈才会失败，重试几次即可 */
+    for (int attempt = 0; attempt < 4; attempt++)
+    {
+        uint64_t seq = __atomic_load_n(&ring->header->write_seq, __ATOMIC_ACQUIRE);
+        const pip_shm_slot_t *slot;
+
+        if (seq == 0)
+        {
+            return 0;
+        }
+        slot = &ring->slots[(seq - 1) % ring->header->slot_count];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == seq * 2)
+        {
+            if (pts)
+            {
+                *pts = slot->pts;
+            }
+            pip_shm_slot_planes(ring, seq, (uint8_t **)data, linesize);
+            return seq;
+        }
+    }
+    return 0;
+}
+
+int pip_shm_ring_intact(const pip_shm_ring_t *ring, uint64_t seq)
+{
+    const pip_shm_slot_t *slot = &ring->slots[(seq - 1) % ring->header->slot_count];
+
+    /* 之前对帧数据的读取不能被重排到序号核对之后 */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq * 2;
+}
+
+int64_t pip_shm_ring_wait(const pip_shm_ring_t *ring, uint64_t after, int timeout_ms)
+{
+    pip_shm_header_t *h = ring->header;
+    uint64_t deadline = pip_shm_now_us() + (uint64_t)timeout_ms * 1000;
+
+    for (;;)
+    {
+        /* 先取唤醒计数再检查帧号：检查之后的发布会改变计数，futex不会错过唤醒 */
+        uint32_t wake = __atomic_load_n(&h->wake, __ATOMIC_ACQUIRE);
+        uint64_t seq = __atomic_load_n(&h->write_seq, __ATOMIC_ACQUIRE);
+        uint64_t now;
+
+        if (seq > after)
+        {
+            return (int64_t)seq;
+        }
+        if (__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE))
+        {
+            return -1;
+        }
+        if ((now = pip_shm_now_us()) >= deadline)
+        {
+            return 0;
+        }
+#ifdef __linux__
+        {
+            struct timespec ts = {(time_t)((deadline - now) / 1000000), (long)((deadline - now) % 1000000) * 1000};
+            syscall(SYS_futex, &h->wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+        }
+#else
+        (void)wake;
+        usleep(1000);
+#endif
+    }
+}
+
+int pip_shm_ring_slot_info(const pip_shm_ring_t *ring, uint64_t seq, int64_t *pts, uint64_t *timestamp_us,
+                           uint64_t *source_seq)
+{
+    const pip_shm_slot_t *slot = &ring->slots[(seq - 1) % ring->header->slot_count];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq * 2)
+    {
+        return -1;
+    }
+    *pts = slot->pts;
+    *timestamp_us = slot->timestamp_us;
+    *source_seq = slot->source_seq;
+    return pip_shm_ring_intact(ring, seq) ? 0 : -1;
+}
@@ -0,0 +1,537 @@
+#include "../include/video_pip_text.h"
+
+#include <string.h>
+
+#include <libavutil/mem.h>
+
+#ifdef PIP_HAVE_FREETYPE
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#endif
+
+#define PIP_ATLAS_WIDTH 512
+#define PIP_ATLAS_INITIAL_HEIGHT 64
+#define PIP_GLYPH_INITIAL_SLOTS 256 /* 哈希表槽位数，2的幂 */
+
+/* 图集中的一个字形，位置和尺寸单位为像素 */
+typedef struct pip_glyph
+{
+    uint32_t codepoint;
+    unsigned int index; /* 字体内的字形序号，用于查字距 */
+    int x;              /* 在图集中的位置 */
+    int y;
+    int width;
+    int height;
+    int left;           /* 位图左边相对笔位置的偏移 */
+    int top;            /* 位图上边在基线之上的高度 */
+    long advance;       /* 笔位置前进量，26.6定点 */
+} pip_glyph_t;
+
+struct pip_font
+{
+#ifdef PIP_HAVE_FREETYPE
+    FT_Library library;
+    FT_Face face;
+#endif
+    int ascender;    /* 基线之上的高度（像素） */
+    int line_height; /* 行距（像素） */
+
+    /* 字形图集：宽度固定，按行（shelf）从左到右排放，高度不够时翻倍 */
+    uint8_t *atlas;
+    int atlas_height;
+    int shelf_x;
+    int shelf_y;
+    int shelf_height;
+
+    /* 字形表和以码点为键的开放寻址哈希表，表项为字形序号+1，0为空 */
+    pip_glyph_t *glyphs;
+    int glyph_count;
+    int glyph_capacity;
+    int *slots;
+    int slot_count;
+};
+
+#ifdef PIP_HAVE_FREETYPE
+
+static unsigned int pip_glyph_hash(uint32_t codepoint, int slot_count)
+{
+    return (codepoint * 2654435761u) & (unsigned int)(slot_count - 1);
+}
+
+/* 哈希表超过半满时翻倍重建 */
+static int pip_font_rehash(pip_font_t *font)
+{
+    int slot_count = font->slot_count ? font->slot_count * 2 : PIP_GLYPH_INITIAL_SLOTS;
+    int *slots = av_mallocz(sizeof(*slots) * slot_count);
+
+    if (!slots)
+    {
+        return AVERROR(ENOMEM);
+    }
+    for (int i = 0; i < font->glyph_count; i++)
+    {
+        unsigned int h = pip_glyph_hash(font->glyphs[i].codepoint, slot_count);
+
+        while (slots[h])
+        {
+            h = (h + 1) & (slot_count - 1);
+        }
+        slots[h] = i + 1;
+    }
+    av_free(font->slots);
+    font->slots = slots;
+    font->slot_count = slot_count;
+    return 0;
+}
+
+/* 在图集中为width x height的位图找位置，放不下时增加图集高度 */
+static int pip_atlas_place(pip_font_t *font, int width, int height, int *x, int *y)
+{
+    if (width > PIP_ATLAS_WIDTH)
+    {
+        return AVERROR(ERANGE);
+    }
+    if (font->shelf_x + width > PIP_ATLAS_WIDTH)
+    {
+        font->shelf_y += font->shelf_height;
+        font->shelf_x = 0;
+        font->shelf_height = 0;
+    }
+    if (font->shelf_y + height > font->atlas_height)
+    {
+        int atlas_height = font->atlas_height ? font->atlas_height : PIP_ATLAS_INITIAL_HEIGHT;
+        uint8_t *atlas;
+
+        while (font->shelf_y + height > atlas_height)
+        {
+            atlas_height *= 2;
+        }
+        if (!(atlas = av_realloc(font->atlas, (size_t)PIP_ATLAS_WIDTH * atlas_height)))
+        {
+            return AVERROR(ENOMEM);
+        }
+        memset(atlas + (size_t)PIP_ATLAS_WIDTH * font->atlas_height, 0,
+               (size_t)PIP_ATLAS_WIDTH * (atlas_height - font->atlas_height));
+        font->atlas = atlas;
+        font->atlas_height = atlas_height;
+    }
+
+    *x = font->shelf_x;
+    *y = font->shelf_y;
+    font->shelf_x += width;
+    if (height > font->shelf_height)
+    {
+        font->shelf_height = height;
+    }
+    return 0;
+}
+
+/* 查找字形，第一次遇到的字符在这里光栅化并放入图集 */
+static int pip_font_glyph(pip_font_t *font, uint32_t codepoint, const pip_glyph_t **glyph)
+{
+    FT_GlyphSlot slot = font->face->glyph;
+    pip_glyph_t *g;
+    unsigned int h;
+    int ret;
+
+    if (font->slot_count)
+    {
+        for (h = pip_glyph_hash(codepoint, font->slot_count); font->slots[h]; h = (h + 1) & (font->slot_count - 1))
+        {
+            if (font->glyphs[font->slots[h] - 1].codepoint == codepoint)
+            {
+                *glyph = &font->glyphs[font->slots[h] - 1];
+                return 0;
+            }
+        }
+    }
+
+    if ((font->glyph_count + 1) * 2 > font->slot_count && (ret = pip_font_rehash(font)) < 0)
+    {
+        return ret;
+    }
+    if (font->glyph_count == font->glyph_capacity)
+    {
+        int capacity = font->glyph_capacity ? font->glyph_capacity * 2 : 128;
+        pip_glyph_t *glyphs = av_realloc_array(font->glyphs, capacity, sizeof(*glyphs));
+
+        if (!glyphs)
+        {
+            return AVERROR(ENOMEM);
+        }
+        font->glyphs = glyphs;
+        font->glyph_capacity = capacity;
+    }
+
+    /* 字体中没有的字符按FreeType的约定渲染为.notdef字形 */
+    if (FT_Load_Char(font->face, codepoint, FT_LOAD_RENDER))
+    {
+        return AVERROR_EXTERNAL;
+    }
+
+    g = &font->glyphs[font->glyph_count];
+    memset(g, 0, sizeof(*g));
+    g->codepoint = codepoint;
+    g->index = slot->glyph_index;
+    g->width = (int)slot->bitmap.width;
+    g->height = (int)slot->bitmap.rows;
+    g->left = slot->bitmap_left;
+    g->top = slot->bitmap_top;
+    g->advance = slot->advance.x;
+
+    if (g->width > 0 && g->height > 0)
+    {
+        int pitch = slot->bitmap.pitch;
+        const uint8_t *src = slot->bitmap.buffer;
+
+        if ((ret = pip_atlas_place(font, g->width, g->height, &g->x, &g->y)) < 0)
+        {
+            return ret;
+        }
+        /* 位图行序可能自下而上（pitch为负） */
+        if (pitch < 0)
+        {
+            src += (size_t)-pitch * (g->height - 1);
+        }
+        for (int i = 0; i < g->height; i++)
+        {
+            memcpy(font->atlas + (size_t)(g->y + i) * PIP_ATLAS_WIDTH + g->x, src + (ptrdiff_t)i * pitch, g->width);
+        }
+    }
+
+    for (h = pip_glyph_hash(codepoint, font->slot_count); font->slots[h]; h = (h + 1) & (font->slot_count - 1))
+    {
+    }
+    font->slots[h] = ++font->glyph_count;
+    *glyph = g;
+    return 0;
+}
+
+#endif /* PIP_HAVE_FREETYPE */
+
+int pip_font_open(const char *path, int pixel_size, pip_font_t **font)
+{
+#ifdef PIP_HAVE_FREETYPE
+    pip_font_t *f;
+
+    *font = NULL;
+    if (pixel_size < PIP_FONT_MIN_SIZE || pixel_size > PIP_FONT_MAX_SIZE)
+    {
+        return AVERROR(EINVAL);
+    }
+    if (!(f = av_mallocz(sizeof(*f))))
+    {
+        return AVERROR(ENOMEM);
+    }
+    if (FT_Init_FreeType(&f->library))
+    {
+        av_free(f);
+        return AVERROR_EXTERNAL;
+    }
+    if (FT_New_Face(f->library, path, 0, &f->face) || FT_Set_Pixel_Sizes(f->face, 0, pixel_size))
+    {
+        pip_font_close(&f);
+        return AVERROR_INVALIDDATA;
+    }
+
+    f->ascender = (int)((f->face->size->metrics.ascender + 63) >> 6);
+    f->line_height = (int)((f->face->size->metrics.height + 63) >> 6);
+    if (f->line_height < pixel_size)
+    {
+        f->line_height = pixel_size;
+    }
+    *font = f;
+    return 0;
+#else
+    (void)path;
+    (void)pixel_size;
+    *font = NULL;
+    return AVERROR(ENOSYS);
+#endif
+}
+
+void pip_font_close(pip_font_t **font)
+{
+    pip_font_t *f = *font;
+
+    if (!f)
+    {
+        return;
+    }
+#ifdef PIP_HAVE_FREETYPE
+    if (f->face)
+    {
+        FT_Done_Face(f->face);
+    }
+    if (f->library)
+    {
+        FT_Done_FreeType(f->library);
+    }
+#endif
+    av_free(f->atlas);
+    av_free(f->glyphs);
+    av_free(f->slots);
+    av_freep(font);
+}
+
+void pip_font_stats(const pip_font_t *font, int *glyphs, size_t *atlas_bytes)
+{
+    *glyphs = font ? font->glyph_count : 0;
+    *atlas_bytes = font ? (size_t)PIP_ATLAS_WIDTH * font->atlas_height : 0;
+}
+
+#ifdef PIP_HAVE_FREETYPE
+
+/* 解码一个UTF-8字符，返回消耗的字节数；非法序列按U+FFFD处理并只消耗一个字节 */
+static int pip_utf8_decode(const unsigned char *s, uint32_t *codepoint)
+{
+    int len = s[0] < 0x80 ? 1 : (s[0] & 0xe0) == 0xc0 ? 2 : (s[0] & 0xf0) == 0xe0 ? 3 : (s[0] & 0xf8) == 0xf0 ? 4 : 0;
+    uint32_t cp;
+
+    if (len == 1)
+    {
+        *codepoint = s[0];
+        return 1;
+    }
+    cp = len ? s[0] & (0x7f >> len) : 0;
+    for (int i = 1; i < len; i++)
+    {
+        if ((s[i] & 0xc0) != 0x80)
+        {
+            len = 0;
+            break;
+        }
+        cp = (cp << 6) | (s[i] & 0x3f);
+    }
+    *codepoint = len ? cp : 0xfffd;
+    return len ? len : 1;
+}
+
+/* 排版一段文字。coverage为NULL时只计算外接矩形（宽度、高度和最左侧的偏移）；
+ * 否则按字形图集把覆盖率写入coverage，重叠处取较大值 */
+static int pip_text_layout(pip_font_t *font, const char *text, uint8_t *coverage, int linesize, int *width,
+                           int *height, int *origin)
+{
+    const unsigned char *s = (const unsigned char *)text;
+    unsigned int prev = 0;
+    long pen = 0; /* 26.6定点 */
+    int line = 0;
+    int min_x = 0, max_x = 0;
+    int ret;
+
+    while (*s)
+    {
+        const pip_glyph_t *g;
+        uint32_t codepoint;
+        int x;
+
+        s += pip_utf8_decode(s, &codepoint);
+        if (codepoint == '\n')
+        {
+            line++;
+            pen = 0;
+            prev = 0;
+            continue;
+        }
+        if ((ret = pip_font_glyph(font, codepoint, &g)) < 0)
+        {
+            return ret;
+        }
+        if (prev && FT_HAS_KERNING(font->face))
+        {
+            FT_Vector delta;
+
+            if (!FT_Get_Kerning(font->face, prev, g->index, FT_KERNING_DEFAULT, &delta))
+            {
+                pen += delta.x;
+            }
+        }
+        prev = g->index;
+
+        x = (int)((pen + 32) >> 6) + g->left;
+        if (coverage)
+        {
+            int y = line * font->line_height + font->ascender - g->top;
+
+            for (int i = 0; i < g->height; i++)
+            {
+                const uint8_t *src = font->atlas + (size_t)(g->y + i) * PIP_ATLAS_WIDTH + g->x;
+                uint8_t *dst;
+
+                if (y + i < 0 || y + i >= *height)
+                {
+                    continue;
+                }
+                dst = coverage + (size_t)(y + i) * linesize + x - *origin;
+                for (int j = 0; j < g->width; j++)
+                {
+                    dst[j] = src[j] > dst[j] ? src[j] : dst[j];
+                }
+            }
+        }
+        else
+        {
+            min_x = x < min_x ? x : min_x;
+            max_x = x + g->width > max_x ? x + g->width : max_x;
+        }
+        pen += g->advance;
+        if (!coverage && (int)((pen + 32) >> 6) > max_x)
+        {
+            max_x = (int)((pen + 32) >> 6);
+        }
+    }
+
+    if (!coverage)
+    {
+        *origin = min_x;
+        *width = max_x - min_x;
+        *height = (line + 1) * font->line_height;
+    }
+    return 0;
+}
+
+#endif /* PIP_HAVE_FREETYPE */
+
+static void pip_text_entry_free(pip_text_t *entry)
+{
+    pip_alpha_mask_free(&entry->mask);
+    av_free(entry->text);
+    av_free(entry);
+}
+
+/* 生成新的文字遮罩；宽度向上取偶数，让色度遮罩与亮度对齐 */
+static int pip_text_render(pip_font_t *font, const char *text, const uint8_t color[3], pip_text_t **entry)
+{
+#ifdef PIP_HAVE_FREETYPE
+    pip_text_t *e;
+    uint8_t *coverage;
+    int width, height, origin, linesize;
+    int ret;
+
+    if ((ret = pip_text_layout(font, text, NULL, 0, &width, &height, &origin)) < 0)
+    {
+        return ret;
+    }
+    if (width <= 0)
+    {
+        return AVERROR(EINVAL);
+    }
+    width = (width + 1) & ~1;
+    height = (height + 1) & ~1;
+    linesize = width;
+
+    if (!(coverage = av_mallocz((size_t)linesize * height)))
+    {
+        return AVERROR(ENOMEM);
+    }
+    if (!(e = av_mallocz(sizeof(*e))) || !(e->text = av_strdup(text)))
+    {
+        av_free(e);
+        av_free(coverage);
+        return AVERROR(ENOMEM);
+    }
+    if ((ret = pip_text_layout(font, text, coverage, linesize, &width, &height, &origin)) < 0 ||
+        (ret = pip_alpha_mask_from_coverage(&e->mask, coverage, linesize, width, height, color)) < 0)
+    {
+        av_free(coverage);
+        pip_text_entry_free(e);
+        return ret;
+    }
+    av_free(coverage);
+
+    memcpy(e->color, color, sizeof(e->color));
+    *entry = e;
+    return 0;
+#else
+    (void)font;
+    (void)text;
+    (void)color;
+    (void)entry;
+    return AVERROR(ENOSYS);
+#endif
+}
+
+int pip_text_acquire(pip_text_cache_t *cache, const char *text, const uint8_t color[3], pip_text_t **entry)
+{
+    pip_text_t *e;
+    int ret;
+
+    *entry = NULL;
+    if (!text || !*text)
+    {
+        return AVERROR(EINVAL);
+    }
+    if (!cache->font)
+    {
+        return AVERROR(ENOSYS);
+    }
+
+    for (e = cache->entries; e; e = e->next)
+    {
+        if (!memcmp(e->color, color, sizeof(e->color)) && !strcmp(e->text, text))
+        {
+            if (e->refs++ == 0)
+            {
+                cache->idle--;
+            }
+            *entry = e;
+            return 0;
+        }
+    }
+
+    if ((ret = pip_text_render(cache->font, text, color, &e)) < 0)
+    {
+        return ret;
+    }
+    e->refs = 1;
+    e->next = cache->entries;
+    cache->entries = e;
+    cache->count++;
+    *entry = e;
+    return 0;
+}
+
+void pip_text_release(pip_text_cache_t *cache, pip_text_t *entry)
+{
+    pip_text_t **link, **oldest = NULL;
+
+    if (!entry || --entry->refs > 0)
+    {
+        return;
+    }
+    if (++cache->idle <= PIP_TEXT_CACHE_IDLE)
+    {
+        return;
+    }
+
+    /* 新文字插在表头，最靠后的未使用文字是最早生成的 */
+    for (link = &cache->entries; *link; link = &(*link)->next)
+    {
+        if (!(*link)->refs)
+        {
+            oldest = link;
+        }
+    }
+    if (oldest)
+    {
+        pip_text_t *victim = *oldest;
+
+        *oldest = victim->next;
+        pip_text_entry_free(victim);
+        cache->count--;
+        cache->idle--;
+    }
+}
+
+void pip_text_cache_free(pip_text_cache_t *cache)
+{
+    while (cache->entries)
+    {
+        pip_text_t *next = cache->entries->next;
+
+        pip_text_entry_free(cache->entries);
+        cache->entries = next;
+    }
+    cache->count = 0;
+    cache->idle = 0;
+}
@@ -0,0 +1,284 @@
+/*
+ * FreeSWITCH Video Picture-in-Picture Module
+ * 预解码背景文件生成工具
+ *
+ * 独立可执行程序，只链接FFmpeg。把背景视频解码一次，
+ * 转换为按页对齐的YUV420P帧写入 .pipraw 文件（格式见 include/video_pip_raw.h），
+ * 模块播放时直接mmap，不再需要解码器。
+ *
+ * 先写入 <输出>.tmp，完成后rename到目标路径：正在播放旧文件的会话不受影响，
+ * 新会话启动时会发现文件已被替换并重新映射。
+ *
+ * 文件体积为 帧数 x 对齐后的帧大小，720p约1.4MB/帧，建议只用于几秒到几十秒的循环背景。
+ *
+ * 用法: pip_rawpack [-s 宽x高] [-n 最大帧数] 输入视频 输出.pipraw
+ *   -s  输出尺寸（默认与输入相同），应与通话中使用的背景尺寸一致
+ *   -n  最多写入的帧数（默认不限制）
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mem.h>
+#include <libswscale/swscale.h>
+
+#include "video_pip_raw.h"
+
+typedef struct rawpack_output
+{
+    FILE *fp;
+    pip_raw_header_t header;
+    uint64_t *index;
+    uint32_t index_capacity;
+    uint64_t offset; /* 下一帧的写入位置 */
+    uint8_t *frame;  /* 一帧的对齐缓冲，sws_scale直接写入 */
+    size_t frame_span;
+    struct SwsContext *sws_ctx;
+    uint32_t max_frames;
+} rawpack_output_t;
+
+#define RAWPACK_ALIGN_UP(v, a) (((v) + (a)-1) / (a) * (a))
+
+static int rawpack_write_frame(rawpack_output_t *out, const AVFrame *frame)
+{
+    const pip_raw_header_t *h = &out->header;
+    uint8_t *dst[4] = {out->frame + h->plane_offset[0], out->frame + h->plane_offset[1],
+                       out->frame + h->plane_offset[2], NULL};
+    int dst_linesize[4] = {(int)h->linesize[0], (int)h->linesize[1], (int)h->linesize[2], 0};
+
+    out->sws_ctx = sws_getCachedContext(out->sws_ctx, frame->width, frame->height, frame->format, h->width, h->height,
+                                        AV_PIX_FMT_YUV420P, SWS_BICUBIC, NULL, NULL, NULL);
+    if (!out->sws_ctx)
+    {
+        fprintf(stderr, "创建转换上下文失败: %dx%d -> %ux%u\n", frame->width, frame->height, h->width, h->height);
+        return -1;
+    }
+    if (sws_scale(out->sws_ctx, (const uint8_t *const *)frame->data, frame->linesize, 0, frame->height, dst,
+                  dst_linesize) < 0)
+    {
+        fprintf(stderr, "帧转换失败\n");
+        return -1;
+    }
+
+    if (out->header.frame_count == out->index_capacity)
+    {
+        uint32_t capacity = out->index_capacity ? out->index_capacity * 2 : 256;
+        uint64_t *index = realloc(out->index, capacity * sizeof(uint64_t));
+
+        if (!index)
+        {
+            return -1;
+        }
+        out->index = index;
+        out->index_capacity = capacity;
+    }
+
+    /* 对齐填充和帧数据一起写入，帧起始始终落在页边界上 */
+    if (fseeko(out->fp, (off_t)out->offset, SEEK_SET) < 0 ||
+        fwrite(out->frame, 1, out->frame_span, out->fp) != out->frame_span)
+    {
+        fprintf(stderr, "写入失败: %s\n", strerror(errno));
+        return -1;
+    }
+    out->index[out->header.frame_count++] = out->offset;
+    out->offset += out->frame_span;
+    return 0;
+}
+
+/* 把解码器中已有的帧全部取出写入，达到帧数上限时返回1 */
+static int rawpack_drain(AVCodecContext *codec_ctx, AVFrame *frame, rawpack_output_t *out)
+{
+    int ret;
+
+    while ((ret = avcodec_receive_frame(codec_ctx, frame)) >= 0)
+    {
+        ret = rawpack_write_frame(out, frame);
+        av_frame_unref(frame);
+        if (ret < 0)
+        {
+            return -1;
+        }
+        if (out->max_frames && out->header.frame_count >= out->max_frames)
+        {
+            return 1;
+        }
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : -1;
+}
+
+static int rawpack_finish(rawpack_output_t *out)
+{
+    out->header.index_offset = out->offset;
+    if (fseeko(out->fp, (off_t)out->offset, SEEK_SET) < 0 ||
+        fwrite(out->index, sizeof(uint64_t), out->header.frame_count, out->fp) != out->header.frame_count ||
+        fseeko(out->fp, 0, SEEK_SET) < 0 || fwrite(&out->header, sizeof(out->header), 1, out->fp) != 1 ||
+        fflush(out->fp) != 0 || fsync(fileno(out->fp)) < 0)
+    {
+        fprintf(stderr, "写入索引失败: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "用法: %s [-s 宽x高] [-n 最大帧数] 输入视频 输出.pipraw\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *input, *output;
+    char tmp_path[1024];
+    int width = 0, height = 0;
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *codec_ctx = NULL;
+    const AVCodec *codec = NULL;
+    AVPacket *packet = NULL;
+    AVFrame *frame = NULL;
+    AVStream *stream;
+    AVRational fps;
+    rawpack_output_t out = {0};
+    int stream_index;
+    int ret = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'n':
+            out.max_frames = (uint32_t)atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (argc - optind != 2)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    input = argv[optind];
+    output = argv[optind + 1];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", output);
+
+    if (avformat_open_input(&fmt_ctx, input, NULL, NULL) < 0 || avformat_find_stream_info(fmt_ctx, NULL) < 0)
+    {
+        fprintf(stderr, "无法打开输入文件: %s\n", input);
+        goto end;
+    }
+    if ((stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0)
+    {
+        fprintf(stderr, "输入文件中没有视频流\n");
+        goto end;
+    }
+    stream = fmt_ctx->streams[stream_index];
+    if (!(codec = avcodec_find_decoder(stream->codecpar->codec_id)) || !(codec_ctx = avcodec_alloc_context3(codec)) ||
+        avcodec_parameters_to_context(codec_ctx, stream->codecpar) < 0 || avcodec_open2(codec_ctx, codec, NULL) < 0)
+    {
+        fprintf(stderr, "无法打开解码器\n");
+        goto end;
+    }
+
+    fps = stream->r_frame_rate.num > 0 && stream->r_frame_rate.den > 0 ? stream->r_frame_rate
+          : stream->avg_frame_rate.num > 0 && stream->avg_frame_rate.den > 0 ? stream->avg_frame_rate
+                                                                              : av_make_q(30, 1);
+    if (pip_raw_header_init(&out.header, width ? width : codec_ctx->width, height ? height : codec_ctx->height, fps.num,
+                            fps.den) < 0)
+    {
+        fprintf(stderr, "输出尺寸无效: %dx%d\n", width ? width : codec_ctx->width, height ? height : codec_ctx->height);
+        goto end;
+    }
+
+    out.frame_span = RAWPACK_ALIGN_UP(out.header.frame_size, out.header.alignment);
+    out.offset = RAWPACK_ALIGN_UP(sizeof(out.header), out.header.alignment);
+    if (!(out.frame = av_mallocz(out.frame_span)) || !(packet = av_packet_alloc()) || !(frame = av_frame_alloc()))
+    {
+        fprintf(stderr, "内存不足\n");
+        goto end;
+    }
+    if (!(out.fp = fopen(tmp_path, "wb")))
+    {
+        fprintf(stderr, "无法创建输出文件: %s (%s)\n", tmp_path, strerror(errno));
+        goto end;
+    }
+
+    while (av_read_frame(fmt_ctx, packet) >= 0)
+    {
+        int drained = 0;
+
+        if (packet->stream_index == stream_index && avcodec_send_packet(codec_ctx, packet) >= 0)
+        {
+            drained = rawpack_drain(codec_ctx, frame, &out);
+        }
+        av_packet_unref(packet);
+        if (drained < 0)
+        {
+            goto end;
+        }
+        if (drained > 0)
+        {
+            break;
+        }
+    }
+    if (!out.max_frames || out.header.frame_count < out.max_frames)
+    {
+        avcodec_send_packet(codec_ctx, NULL);
+        if (rawpack_drain(codec_ctx, frame, &out) < 0)
+        {
+            goto end;
+        }
+    }
+
+    if (out.header.frame_count == 0)
+    {
+        fprintf(stderr, "没有解码出任何帧\n");
+        goto end;
+    }
+    if (rawpack_finish(&out) < 0)
+    {
+        goto end;
+    }
+    fclose(out.fp);
+    out.fp = NULL;
+    if (rename(tmp_path, output) < 0)
+    {
+        fprintf(stderr, "重命名失败: %s -> %s (%s)\n", tmp_path, output, strerror(errno));
+        goto end;
+    }
+
+    printf("%s: %ux%u @ %.2f fps, %u 帧, %.1f MB\n", output, out.header.width, out.header.height,
+           (double)out.header.fps_num / out.header.fps_den, out.header.frame_count,
+           (out.offset + out.header.frame_count * sizeof(uint64_t)) / (1024.0 * 1024.0));
+    ret = 0;
+
+end:
+    if (out.fp)
+    {
+        fclose(out.fp);
+        unlink(tmp_path);
+    }
+    sws_freeContext(out.sws_ctx);
+    av_free(out.frame);
+    free(out.index);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&codec_ctx);
+    avformat_close_input(&fmt_ctx);
+    return ret;
+}
@@ -0,0 +1,191 @@
+/*
+ * FreeSWITCH Video Picture-in-Picture Module
+ * 共享内存渲染源的参考写入方
+ *
+ * 独立可执行程序，不依赖FFmpeg和FreeSWITCH。创建帧环（格式见 include/video_pip_shm.h），
+ * 按固定帧率写入合成的测试画面（渐变底色 + 移动色块），用于联调共享内存模式：
+ *   video_pip_start <uuid> shm:/pip_slides
+ * 真实的渲染进程按同样的方式调用 pip_shm_ring_begin / pip_shm_ring_commit 即可。
+ *
+ * 用法: pip_shm_producer [-s 宽x高] [-f 帧率] [-n 槽位数] [-d 秒数] [-p 起始秒:时长秒] [-r] 名称
+ *   -s  画面尺寸（默认1280x720）
+ *   -f  写入帧率（默认30）
+ *   -n  槽位数（默认4，2-64）
+ *   -d  运行时长，秒（默认0，一直运行到Ctrl+C）
+ *   -p  从起始秒开始停止写入指定时长，用于验证读取方的停滞处理
+ *   -r  停顿结束后重新创建帧环（模拟渲染进程重启）
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "video_pip_shm.h"
+
+static volatile sig_atomic_t producer_stop = 0;
+
+static void producer_on_signal(int sig)
+{
+    (void)sig;
+    producer_stop = 1;
+}
+
+/* 渐变底色上叠加一个水平移动的色块，色块颜色随帧号变化，便于肉眼确认画面在更新 */
+static void producer_draw(uint8_t *data[3], const int linesize[3], int width, int height, uint64_t n)
+{
+    int box = height / 4;
+    int box_x = (int)((n * 8) % (uint64_t)(width > box ? width - box : 1));
+    int box_y = (height - box) / 2;
+
+    for (int y = 0; y < height; y++)
+    {
+        uint8_t *row = data[0] + (size_t)y * linesize[0];
+
+        for (int x = 0; x < width; x++)
+        {
+            int inside = x >= box_x && x < box_x + box && y >= box_y && y < box_y + box;
+            row[x] = inside ? 235 : (uint8_t)(16 + (x + y) * 96 / (width + height));
+        }
+    }
+    for (int y = 0; y < (height + 1) / 2; y++)
+    {
+        uint8_t *u = data[1] + (size_t)y * linesize[1];
+        uint8_t *v = data[2] + (size_t)y * linesize[2];
+
+        for (int x = 0; x < (width + 1) / 2; x++)
+        {
+            int inside = x * 2 >= box_x && x * 2 < box_x + box && y * 2 >= box_y && y * 2 < box_y + box;
+            u[x] = inside ? (uint8_t)(64 + (n * 3) % 128) : 128;
+            v[x] = inside ? (uint8_t)(192 - (n * 5) % 128) : 128;
+        }
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "用法: %s [-s 宽x高] [-f 帧率] [-n 槽位数] [-d 秒数] [-p 起始秒:时长秒] [-r] 名称\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *name;
+    int width = 1280, height = 720;
+    double fps = 30.0, duration = 0, pause_at = -1, pause_for = 0;
+    int slots = 4;
+    int recreate = 0;
+    pip_shm_ring_t ring;
+    uint64_t start_us, frames = 0;
+    int paused = 0;
+    int opt;
+    int ret;
+
+    while ((opt = getopt(argc, argv, "s:f:n:d:p:r")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2)
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'f':
+            fps = atof(optarg);
+            break;
+        case 'n':
+            slots = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'p':
+            if (sscanf(optarg, "%lf:%lf", &pause_at, &pause_for) != 2 || pause_at < 0 || pause_for <= 0)
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'r':
+            recreate = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (argc - optind != 1 || fps <= 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    name = argv[optind];
+
+    if ((ret = pip_shm_ring_create(name, width, height, slots, &ring)) < 0)
+    {
+        fprintf(stderr, "创建帧环失败: %s (%s)\n", name, strerror(-ret));
+        return 1;
+    }
+    signal(SIGINT, producer_on_signal);
+    signal(SIGTERM, producer_on_signal);
+    printf("帧环 %s: %dx%d, %d 个槽位, %.2f fps\n", name, width, height, slots, fps);
+
+    start_us = pip_shm_now_us();
+    while (!producer_stop)
+    {
+        double elapsed = (pip_shm_now_us() - start_us) / 1e6;
+        uint64_t due = (uint64_t)(elapsed * fps) + 1;
+        uint8_t *data[3];
+        int linesize[3];
+        uint64_t seq;
+
+        if (duration > 0 && elapsed >= duration)
+        {
+            break;
+        }
+
+        if (pause_at >= 0 && elapsed >= pause_at && elapsed < pause_at + pause_for)
+        {
+            if (!paused)
+            {
+                printf("%.1fs: 暂停写入 %.1f 秒\n", elapsed, pause_for);
+                paused = 1;
+            }
+        }
+        else if (frames < due)
+        {
+            if (paused)
+            {
+                paused = 0;
+                pause_at = -1;
+                if (recreate)
+                {
+                    pip_shm_ring_close(&ring, name);
+                    if ((ret = pip_shm_ring_create(name, width, height, slots, &ring)) < 0)
+                    {
+                        fprintf(stderr, "重新创建帧环失败: %s (%s)\n", name, strerror(-ret));
+                        return 1;
+                    }
+                }
+                printf("%.1fs: 恢复写入%s\n", elapsed, recreate ? "（已重新创建帧环）" : "");
+            }
+            seq = pip_shm_ring_begin(&ring, data, linesize);
+            producer_draw(data, linesize, width, height, frames);
+            pip_shm_ring_commit(&ring, seq, (int64_t)frames, frames);
+            frames = due;
+            continue;
+        }
+
+        nanosleep(&(struct timespec){0, (long)(1e9 / fps / 4)}, NULL);
+    }
+
+    printf("共写入 %llu 帧\n", (unsigned long long)ring.header->write_seq);
+    pip_shm_ring_shutdown(&ring);
+    pip_shm_ring_close(&ring, name);
+    return 0;
+}
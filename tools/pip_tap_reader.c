@@ -0,0 +1,195 @@
+/*
+ * FreeSWITCH Video Picture-in-Picture Module
+ * 输出旁路的参考读取方
+ *
+ * 独立可执行程序，不依赖FFmpeg和FreeSWITCH。挂到会话的输出旁路帧环上
+ * （video_pip_tap <uuid> start，或配置 output-tap=true），在futex上等待新帧，
+ * 直接读取槽位中的数据，统计收到、跳过和撕裂的帧数。
+ * 读取方随时可以挂上或退出，合成线程不会等待读取方：来不及处理的帧只会被跳过。
+ *
+ * 用法: pip_tap_reader [-o 输出.y4m] [-d 秒数] [-w 秒数] 名称
+ *   -o  把收到的帧写成Y4M文件（可用ffplay/ffmpeg直接打开）
+ *   -d  运行时长，秒（默认0，直到帧环关闭或Ctrl+C）
+ *   -w  帧环尚未创建时最多等待的秒数（默认5）
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "video_pip_shm.h"
+
+static volatile sig_atomic_t reader_stop = 0;
+
+static void reader_on_signal(int sig)
+{
+    (void)sig;
+    reader_stop = 1;
+}
+
+/* 帧环可能还在创建中，按间隔重试直到超时 */
+static int reader_open(const char *name, double wait_secs, pip_shm_ring_t *ring)
+{
+    uint64_t deadline = pip_shm_now_us() + (uint64_t)(wait_secs * 1e6);
+    int ret;
+
+    while ((ret = pip_shm_ring_open(name, ring)) == -ENOENT || ret == -EAGAIN)
+    {
+        if (reader_stop || pip_shm_now_us() >= deadline)
+        {
+            break;
+        }
+        nanosleep(&(struct timespec){0, 100 * 1000 * 1000}, NULL);
+    }
+    return ret;
+}
+
+/* 逐行写出三个平面；写完后再核对序号，期间被覆盖的帧不计入 */
+static int reader_write_y4m(FILE *fp, const pip_shm_ring_t *ring, const uint8_t *data[3], const int linesize[3])
+{
+    const pip_shm_header_t *h = ring->header;
+
+    fputs("FRAME\n", fp);
+    for (int i = 0; i < 3; i++)
+    {
+        uint32_t width = i ? (h->width + 1) / 2 : h->width;
+        uint32_t height = i ? (h->height + 1) / 2 : h->height;
+
+        for (uint32_t y = 0; y < height; y++)
+        {
+            if (fwrite(data[i] + (size_t)y * linesize[i], 1, width, fp) != width)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "用法: %s [-o 输出.y4m] [-d 秒数] [-w 秒数] 名称\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *name, *output = NULL;
+    double duration = 0, wait_secs = 5;
+    pip_shm_ring_t ring;
+    FILE *fp = NULL;
+    uint64_t start_us, last = 0, received = 0, skipped = 0, torn = 0, latency_us = 0;
+    int closed = 0;
+    int opt;
+    int ret;
+
+    while ((opt = getopt(argc, argv, "o:d:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            output = optarg;
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'w':
+            wait_secs = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (argc - optind != 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    name = argv[optind];
+
+    signal(SIGINT, reader_on_signal);
+    signal(SIGTERM, reader_on_signal);
+    if ((ret = reader_open(name, wait_secs, &ring)) < 0)
+    {
+        fprintf(stderr, "打开帧环失败: %s (%s)\n", name, strerror(-ret));
+        return 1;
+    }
+    printf("帧环 %s: %ux%u, %u 个槽位, 写入方进程 %u\n", name, ring.header->width, ring.header->height,
+           ring.header->slot_count, ring.header->producer_pid);
+
+    if (output)
+    {
+        if (!(fp = fopen(output, "wb")))
+        {
+            fprintf(stderr, "无法创建输出文件: %s (%s)\n", output, strerror(errno));
+            pip_shm_ring_close(&ring, NULL);
+            return 1;
+        }
+        /* 帧率不在帧环中，按25写入头部，时间以槽位时间戳为准 */
+        fprintf(fp, "YUV4MPEG2 W%u H%u F25:1 Ip A1:1 C420jpeg\n", ring.header->width, ring.header->height);
+    }
+
+    /* 从挂上时的最新帧之后开始，之前的帧不算跳过 */
+    last = __atomic_load_n(&ring.header->write_seq, __ATOMIC_ACQUIRE);
+    start_us = pip_shm_now_us();
+    while (!reader_stop)
+    {
+        const uint8_t *data[3];
+        int linesize[3];
+        int64_t pts;
+        uint64_t timestamp_us, source_seq, seq;
+        int64_t latest;
+
+        if (duration > 0 && (pip_shm_now_us() - start_us) / 1e6 >= duration)
+        {
+            break;
+        }
+        if ((latest = pip_shm_ring_wait(&ring, last, 200)) < 0)
+        {
+            closed = 1;
+            break;
+        }
+        if (latest == 0)
+        {
+            continue;
+        }
+
+        seq = pip_shm_ring_latest(&ring, data, linesize, &pts);
+        if (seq <= last || pip_shm_ring_slot_info(&ring, seq, &pts, &timestamp_us, &source_seq) < 0)
+        {
+            continue;
+        }
+        skipped += last ? seq - last - 1 : 0;
+        last = seq;
+        latency_us += pip_shm_now_us() - timestamp_us;
+
+        if (fp && reader_write_y4m(fp, &ring, data, linesize) < 0)
+        {
+            fprintf(stderr, "写入失败: %s\n", strerror(errno));
+            break;
+        }
+        if (!pip_shm_ring_intact(&ring, seq))
+        {
+            torn++;
+            continue;
+        }
+        received++;
+    }
+
+    printf("%s收到 %llu 帧, 跳过 %llu 帧, 撕裂 %llu 帧, 平均延迟 %.2f ms\n", closed ? "帧环已关闭; " : "",
+           (unsigned long long)received, (unsigned long long)skipped, (unsigned long long)torn,
+           received ? latency_us / 1000.0 / received : 0.0);
+
+    if (fp)
+    {
+        fclose(fp);
+    }
+    pip_shm_ring_close(&ring, NULL);
+    return 0;
+}